@@ -1,3 +1,18 @@
+// Permutation features, -buildshaders compiles every needed combination of them. Without defines this is the full shader,
+// apart from BAKED, which needs the baked light bound.
+#ifndef LIGHTING
+#define LIGHTING 1
+#endif
+#ifndef ATTENUATION
+#define ATTENUATION 1
+#endif
+#ifndef TEXTURED
+#define TEXTURED 1
+#endif
+#ifndef BAKED
+#define BAKED 0
+#endif
+
 struct Light
 {
 	float3 dir;
@@ -22,6 +37,57 @@ cbuffer cbPerObject
 Texture2D ObjTexture;
 SamplerState ObjSamplerState;
 
+cbuffer cbBakedLight : register(b6)
+{
+	// w is 1 / the spacing between probes
+	float4 ProbeOrigin;
+	// Probes along every axis, w is 1 / how far out of the volume the probes fade to the flat ambient
+	float4 ProbeCounts;
+};
+
+Texture2D Lightmap : register(t4);
+// Every SH coefficient of every probe, coefficient after coefficient along z
+Texture3D ProbeVolume : register(t5);
+SamplerState BakedSamplerState : register(s3);
+
+// The baked light a surface facing normal gets at worldPos, in the units the lightmap stores: what the albedo is
+// multiplied by. The probes hold L2 SH of the incoming light already convolved with the cosine lobe.
+float3 ProbeIrradiance(float3 worldPos, float3 normal)
+{
+	float3 n = normalize(normal);
+	float basis[9] =
+	{
+		0.282095f,
+		0.488603f * n.y, 0.488603f * n.z, 0.488603f * n.x,
+		1.092548f * n.x * n.y, 1.092548f * n.y * n.z, 0.315392f * (3.0f * n.z * n.z - 1.0f),
+		1.092548f * n.x * n.z, 0.546274f * (n.x * n.x - n.y * n.y),
+	};
+
+	// Clamped to the probe centers, so the filter never blends one coefficient with the next
+	float3 cell = clamp((worldPos - ProbeOrigin.xyz) * ProbeOrigin.w, 0.0f, ProbeCounts.xyz - 1.0f);
+	float3 uvw = (cell + 0.5f) / float3(ProbeCounts.xy, ProbeCounts.z * 9.0f);
+
+	float3 irradiance = float3(0.0f, 0.0f, 0.0f);
+	[unroll]
+	for (int i = 0; i < 9; ++i)
+		irradiance += ProbeVolume.SampleLevel(BakedSamplerState, uvw + float3(0.0f, 0.0f, i / 9.0f), 0).rgb * basis[i];
+	return max(irradiance, 0.0f);
+}
+
+// The flat ambient term, or what the probes baked for this spot. Outside the volume the edge probes fade out to the
+// flat term, so an object that only partly overlaps it doesn't stretch them over its far side.
+float3 AmbientLight(float3 worldPos, float3 normal)
+{
+#if BAKED
+	float3 cell = (worldPos - ProbeOrigin.xyz) * ProbeOrigin.w;
+	float3 outside = max(max(-cell, cell - (ProbeCounts.xyz - 1.0f)), 0.0f);
+	float fade = saturate(length(outside) / ProbeOrigin.w * ProbeCounts.w);
+	return lerp(ProbeIrradiance(worldPos, normal), light.ambient.rgb, fade);
+#else
+	return light.ambient.rgb;
+#endif
+}
+
 struct VS_OUTPUT
 {
 	float4 Pos : SV_POSITION;
@@ -42,39 +108,293 @@ VS_OUTPUT VS(float4 inPos : POSITION, float4 inTexCoord : TEXCOORD, float3 norma
 	return output;
 }
 
-float4 PS(VS_OUTPUT input) : SV_TARGET
+float4 ComputeLighting(float3 worldPos, float3 normal, float4 diffuse, float3 ambient)
 {
-	input.normal = normalize(input.normal);
+	float3 finalAmbient = diffuse.rgb * ambient;
 
-	float4 diffuse = ObjTexture.Sample(ObjSamplerState, input.TexCoord);
+#if LIGHTING
+	normal = normalize(normal);
 
 	float3 finalColor = float3(0.0f, 0.0f, 0.0f);
 
-	float3 lightToPixelVec = light.pos - input.worldPos;
+	float3 lightToPixelVec = light.pos - worldPos;
 
 	float d = length(lightToPixelVec);
 
-	float3 finalAmbient = diffuse * light.ambient;
-
 	if (d > light.range)
 		return float4(finalAmbient, diffuse.a);
 
 	lightToPixelVec /= d;
 
-	float howMuchLight = dot(lightToPixelVec, input.normal);
+	float howMuchLight = dot(lightToPixelVec, normal);
 	if (howMuchLight > 0.0f)
 	{
 		finalColor += howMuchLight * diffuse * light.diffuse;
+#if ATTENUATION
 		finalColor /= light.att[0] + (light.att[1] * d) + (light.att[2] * (d * d));
+#endif
 	}
 
 	finalColor = saturate(finalColor + finalAmbient);
 
 	return float4(finalColor, diffuse.a);
+#else
+	// Out of the light's range, which is all the full shader would give too
+	return float4(finalAmbient, diffuse.a);
+#endif
+}
+
+float4 PS(VS_OUTPUT input) : SV_TARGET
+{
+#if TEXTURED
+	float4 diffuse = ObjTexture.Sample(ObjSamplerState, input.TexCoord);
+#else
+	float4 diffuse = float4(1.0f, 1.0f, 1.0f, 1.0f);
+#endif
+
+	return ComputeLighting(input.worldPos.xyz, input.normal, diffuse, AmbientLight(input.worldPos.xyz, input.normal));
 }
 
 float4 D2D_PS(VS_OUTPUT input) : SV_TARGET
 {
 	float4 diffuse = ObjTexture.Sample(ObjSamplerState, input.TexCoord);
 	return diffuse;
-}
\ No newline at end of file
+}
+
+cbuffer cbUpscale : register(b1)
+{
+	float2 UVScale;
+	// Centers of the last rendered texels
+	float2 UVMax;
+};
+
+SamplerState UpscaleSamplerState : register(s1);
+
+// Fullscreen triangle, the vertices are generated from SV_VertexID so no vertex buffer is bound
+VS_OUTPUT UPSCALE_VS(uint id : SV_VertexID)
+{
+	VS_OUTPUT output;
+
+	float2 uv = float2((id << 1) & 2, id & 2);
+	output.Pos = float4(uv * float2(2.0f, -2.0f) + float2(-1.0f, 1.0f), 0.0f, 1.0f);
+	output.worldPos = output.Pos;
+	output.TexCoord = float4(uv, 0.0f, 0.0f);
+	output.normal = float3(0.0f, 0.0f, -1.0f);
+
+	return output;
+}
+
+// Stretches the part of the scene target that was rendered at the current resolution scale over the whole Backbuffer.
+// Past the centers of its last texels the filter would blend in whatever the unused part of the target holds.
+float4 UPSCALE_PS(VS_OUTPUT input) : SV_TARGET
+{
+	return ObjTexture.Sample(UpscaleSamplerState, min(input.TexCoord.xy * UVScale, UVMax));
+}
+
+cbuffer cbPerView : register(b2)
+{
+	float4x4 ViewProjection;
+};
+
+// One slice per material, selected by the per instance material index
+Texture2DArray ObjTextureArray : register(t1);
+
+struct INSTANCED_VS_OUTPUT
+{
+	float4 Pos : SV_POSITION;
+	float4 worldPos : POSITION;
+	float2 TexCoord : TEXCOORD;
+	float3 normal : NORMAL;
+	nointerpolation uint Material : MATERIAL;
+};
+
+INSTANCED_VS_OUTPUT INSTANCED_VS(float4 inPos : POSITION, float2 inTexCoord : TEXCOORD, float3 normal : NORMAL,
+	float4 world0 : WORLD0, float4 world1 : WORLD1, float4 world2 : WORLD2, float4 world3 : WORLD3, uint material : MATERIAL)
+{
+	INSTANCED_VS_OUTPUT output;
+
+	float4x4 instanceWorld = float4x4(world0, world1, world2, world3);
+
+	output.worldPos = mul(inPos, instanceWorld);
+	output.Pos = mul(output.worldPos, ViewProjection);
+	output.normal = mul(normal, (float3x3)instanceWorld);
+	output.TexCoord = inTexCoord;
+	output.Material = material;
+
+	return output;
+}
+
+float4 INSTANCED_PS(INSTANCED_VS_OUTPUT input) : SV_TARGET
+{
+#if TEXTURED
+	float4 diffuse = ObjTextureArray.Sample(ObjSamplerState, float3(input.TexCoord, input.Material));
+#else
+	float4 diffuse = float4(1.0f, 1.0f, 1.0f, 1.0f);
+#endif
+
+	return ComputeLighting(input.worldPos.xyz, input.normal, diffuse, AmbientLight(input.worldPos.xyz, input.normal));
+}
+
+cbuffer cbParticle : register(b3)
+{
+	float4x4 ParticleViewProjection;
+	// w is the particle size
+	float4 CameraRight;
+	float4 CameraUp;
+};
+
+struct PARTICLE_VS_OUTPUT
+{
+	float4 Pos : SV_POSITION;
+	float2 Corner : TEXCOORD;
+	float4 Color : COLOR;
+};
+
+// One 4 vertex strip per instance, spread along the camera's right and up axes so it always faces the camera
+PARTICLE_VS_OUTPUT PARTICLE_VS(uint id : SV_VertexID, float3 center : POSITION, float4 color : COLOR)
+{
+	PARTICLE_VS_OUTPUT output;
+
+	float2 corner = float2((id & 1) ? 1.0f : -1.0f, (id & 2) ? -1.0f : 1.0f);
+	float3 worldPos = center + (corner.x * CameraRight.xyz + corner.y * CameraUp.xyz) * CameraRight.w;
+
+	output.Pos = mul(float4(worldPos, 1.0f), ParticleViewProjection);
+	output.Corner = corner;
+	output.Color = color;
+
+	return output;
+}
+
+// Additive, so the alpha fades the color out instead of blending
+float4 PARTICLE_PS(PARTICLE_VS_OUTPUT input) : SV_TARGET
+{
+	float falloff = saturate(1.0f - dot(input.Corner, input.Corner));
+	return float4(input.Color.rgb * input.Color.a * falloff, 0.0f);
+}
+
+cbuffer cbSkinning : register(b4)
+{
+	uint BonesPerCharacter;
+	uint3 SkinningPad;
+};
+
+// Every character's matrices back to back, already multiplied by the inverse bind pose and the character's world
+StructuredBuffer<float4x4> SkinningMatrices : register(t2);
+
+VS_OUTPUT SKINNED_VS(float4 inPos : POSITION, float4 inTexCoord : TEXCOORD, float3 normal : NORMAL,
+	uint4 bones : BLENDINDICES, float4 weights : BLENDWEIGHT, uint instance : SV_InstanceID)
+{
+	VS_OUTPUT output;
+
+	uint first = instance * BonesPerCharacter;
+	float4x4 skin = SkinningMatrices[first + bones.x] * weights.x + SkinningMatrices[first + bones.y] * weights.y +
+		SkinningMatrices[first + bones.z] * weights.z + SkinningMatrices[first + bones.w] * weights.w;
+
+	output.worldPos = mul(inPos, skin);
+	output.Pos = mul(output.worldPos, ViewProjection);
+	output.normal = mul(normal, (float3x3)skin);
+	output.TexCoord = inTexCoord;
+
+	return output;
+}
+
+cbuffer cbTerrain : register(b5)
+{
+	// x start and y 1 / (end - start) of the morph of every level
+	float4 MorphConstants[8];
+	// w is the height scale
+	float4 TerrainCamera;
+	// x base height, y samples per page side, z the page's texel size, w the texels of neighbor samples around the page
+	float4 TerrainParams;
+	float4 SunDirection;
+};
+
+// One slice per resident page of heights
+Texture2DArray<float> TerrainPages : register(t3);
+SamplerState TerrainSamplerState : register(s2);
+
+struct TERRAIN_VS_OUTPUT
+{
+	float4 Pos : SV_POSITION;
+	float3 worldPos : POSITION;
+	float3 normal : NORMAL;
+};
+
+float TerrainHeight(float2 grid, uint slice)
+{
+	// Through the texel centers, so grid points land exactly on their samples. One sample past the edge of the
+	// grid is still in the page, on the border of the neighbor's samples.
+	float2 uv = (grid + TerrainParams.w + 0.5f) * TerrainParams.z;
+	return TerrainParams.x + TerrainPages.SampleLevel(TerrainSamplerState, float3(uv, slice), 0) * TerrainCamera.w;
+}
+
+// grid runs over the samples of the node's page, node is the node's corner, size and level
+TERRAIN_VS_OUTPUT TERRAIN_VS(float2 grid : POSITION, float4 node : NODE, uint slice : SLICE)
+{
+	TERRAIN_VS_OUTPUT output;
+
+	float spacing = node.z / (TerrainParams.y - 1.0f);
+	uint level = (uint)node.w;
+
+	// How far the vertex is from the camera at full detail decides how far it moves towards the coarser grid
+	float3 fullPos = float3(node.x + grid.x * spacing, TerrainHeight(grid, slice), node.y + grid.y * spacing);
+	float morph = saturate((distance(fullPos, TerrainCamera.xyz) - MorphConstants[level].x) * MorphConstants[level].y);
+
+	// Odd vertices slide onto their even neighbor, fully morphed the grid is the next level's
+	float2 morphed = grid - frac(grid * 0.5f) * 2.0f * morph;
+	output.worldPos = float3(node.x + morphed.x * spacing, TerrainHeight(morphed, slice), node.y + morphed.y * spacing);
+	output.Pos = mul(float4(output.worldPos, 1.0f), ViewProjection);
+
+	float left = TerrainHeight(morphed - float2(1.0f, 0.0f), slice);
+	float right = TerrainHeight(morphed + float2(1.0f, 0.0f), slice);
+	float down = TerrainHeight(morphed - float2(0.0f, 1.0f), slice);
+	float up = TerrainHeight(morphed + float2(0.0f, 1.0f), slice);
+	output.normal = float3(left - right, 2.0f * spacing, down - up);
+
+	return output;
+}
+
+// Grass on the flats, rock on the slopes and snow on the peaks, lit by a fixed sun
+float4 TERRAIN_PS(TERRAIN_VS_OUTPUT input) : SV_TARGET
+{
+	float3 normal = normalize(input.normal);
+	float height = saturate((input.worldPos.y - TerrainParams.x) / TerrainCamera.w);
+
+	float3 albedo = lerp(float3(0.28f, 0.42f, 0.18f), float3(0.45f, 0.41f, 0.37f), saturate((0.9f - normal.y) * 5.0f));
+	albedo = lerp(albedo, float3(0.92f, 0.93f, 0.95f), saturate((height - 0.5f) * 5.0f) * saturate(normal.y * 2.0f - 1.0f));
+
+	return float4(albedo * (0.3f + 0.7f * saturate(dot(normal, SunDirection.xyz))), 1.0f);
+}
+
+struct LIGHTMAPPED_VS_OUTPUT
+{
+	float4 Pos : SV_POSITION;
+	float3 worldPos : POSITION;
+	float2 TexCoord : TEXCOORD0;
+	float2 LightmapUV : TEXCOORD1;
+	float3 normal : NORMAL;
+};
+
+// The lightmap UVs come from a second vertex stream, a set per chart
+LIGHTMAPPED_VS_OUTPUT LIGHTMAPPED_VS(float4 inPos : POSITION, float2 inTexCoord : TEXCOORD0, float3 normal : NORMAL,
+	float2 lightmapUV : TEXCOORD1)
+{
+	LIGHTMAPPED_VS_OUTPUT output;
+
+	output.Pos = mul(inPos, WVP);
+	output.worldPos = mul(inPos, World).xyz;
+	output.normal = mul(normal, (float3x3)World);
+	output.TexCoord = inTexCoord;
+	output.LightmapUV = lightmapUV;
+
+	return output;
+}
+
+// The baked sun, sky and bounces take the place of the ambient term, the point light still moves and stays dynamic
+float4 LIGHTMAPPED_PS(LIGHTMAPPED_VS_OUTPUT input) : SV_TARGET
+{
+	float4 diffuse = ObjTexture.Sample(ObjSamplerState, input.TexCoord);
+	float3 baked = Lightmap.Sample(BakedSamplerState, input.LightmapUV).rgb;
+
+	return ComputeLighting(input.worldPos, input.normal, diffuse, baked);
+}
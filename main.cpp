@@ -1,11 +1,27 @@
 #include <windows.h>
 #include <d3d11.h>
 #include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
 #include <DirectXMath.h>
+#include <DirectXPackedVector.h>
 #include <d3dcompiler.h>
 #include <WICTextureLoader.h>
+#include <DDSTextureLoader.h>
+#include <wincodec.h>
 #include <dxgi.h>
-#include <sstream>
+#include <dxgi1_4.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <new>
+#include <crtdbg.h>
+#include <immintrin.h>
 #include <dwrite.h>
 #include <d2d1.h>
 #include <dinput.h>
@@ -30,6 +46,7 @@
 #endif
 
 using namespace DirectX;
+using namespace DirectX::PackedVector;
 
 // Window Information
 //////////////////////////////////////////////////////////////
@@ -41,6 +58,8 @@ const int Height = 600;
 
 bool InitializeWindow(HINSTANCE Instance, int ShowWindow, int Width, int Height, bool Windowed);
 int MessageLoop();
+// One frame of the message loop, input, update and draw between the allocation counters. Returns what it allocated.
+UINT64 RunFrame(double FrameTime);
 LRESULT CALLBACK WindowProcedure(HWND Window, UINT Msg, WPARAM WParam, LPARAM LParam);
 //////////////////////////////////////////////////////////////
 
@@ -129,11 +148,6 @@ ID3D10Blob *PSBuffer;
 // Input (Vertex) Layout
 ID3D11InputLayout *VertexLayout;
 
-// Stores the Depth Stencil View and Buffer
-ID3D11DepthStencilView *DepthStencilView;
-ID3D11Texture2D *DepthStencilBuffer;
-
-
 // Stores the constant buffer variables in our World View Projection Matrix to send to the Effect file
 ID3D11Buffer *cbPerObjectBuffer;
 
@@ -151,9 +165,6 @@ XMVECTOR CameraUp;
 XMMATRIX Cube1World;
 XMMATRIX Cube2World;
 
-XMMATRIX Rotation;
-XMMATRIX Scale;
-XMMATRIX Translation;
 float Rot = 0.01f;
 
 // Holds our texture we load
@@ -181,7 +192,9 @@ ID3D11ShaderResourceView *D2DTexture;
 IDWriteFactory *DWriteFactory;
 IDWriteTextFormat *TextFormat;
 
-std::wstring PrintText;
+// Formatted in place every frame, the overlay only ever shows a short label and a number
+wchar_t PrintText[64];
+int PrintTextLength;
 
 ID3D11Buffer *cbPerFrameBuffer;
 ID3D11PixelShader *D2D_PS;
@@ -212,9 +225,6 @@ int FPS = 0;
 __int64 FrameTimeOld = 0;
 double FrameTime;
 
-// Initializes D3D
-bool InitializeD3D(HINSTANCE Instance);
-
 // Releases objects to prevent memory leaks
 void ReleaseObjects();
 bool InitScene();
@@ -278,10 +288,22 @@ D3D11_INPUT_ELEMENT_DESC Layout[] =
 
 UINT NumLayoutElements = ARRAYSIZE(Layout);
 
+const int CUBE_VERTEX_COUNT = 24;
+const int CUBE_INDEX_COUNT = 36;
+
+void BuildCubeGeometry(Vertex *Vertices, DWORD *Indices, DWORD BaseVertex);
+XMMATRIX ComposeOrbitWorld(float Angle, float AngleX, float AngleZ);
+XMMATRIX ComposeSpinWorld(float Angle, float SizeX, float SizeY);
+XMFLOAT3 TransformLightPosition(const XMMATRIX &ObjectWorld);
+void BuildObjectConstants(const XMMATRIX &ObjectWorld, const XMMATRIX &View, const XMMATRIX &Projection, cbPerObject &Constants);
 
-bool InitD2D_D3D11_DWrite(IDXGIAdapter1 *Adapter);
+
+// The factories and the text format don't need the device, the render target on the shared surface does
+bool InitTextFactories(ID2D1Factory **D2DFactory);
+bool InitD2D_D3D11_DWrite(IDXGIAdapter1 *Adapter, ID2D1Factory *D2DFactory);
 void InitD2DScreenTexture();
-void RenderText(std::wstring text, int inInt);
+void RenderText(const wchar_t *text, int inInt);
+void FormatPrintText(const wchar_t *text, int inInt);
 
 
 IDirectInputDevice8 *DIKeyboard;
@@ -295,294 +317,2552 @@ float RotZ = 0;
 float ScaleX = 1.0f;
 float ScaleY = 1.0f;
 
-XMMATRIX RotationX;
-XMMATRIX RotationZ;
-
 bool InitDirectInput(HINSTANCE Instance);
 void DetectInput(double time);
 
 //////////////////////////////////////////////////////////////
 
 
-int WINAPI WinMain(HINSTANCE Instance, HINSTANCE PrevInstance, LPSTR CommandLine, int ShowCmd)
-{
-	if(!InitializeWindow(Instance, ShowCmd, Width, Height, true))
-	{
-		MessageBox(0, "Error Initializing Window.", "Error", MB_OK | MB_ICONERROR);
-		return 0;
-	}
+// Render Graph Information
+//////////////////////////////////////////////////////////////
 
-	if(!InitializeD3D(Instance))
-	{
-		MessageBox(0, "Error Initializing D3D.", "Error", MB_OK | MB_ICONERROR);
-		return 0;
-	}
+// Each frame is described as a list of passes that declare which resources they read and write.
+// Compiling the graph:
+//	- Culls passes whose writes never reach an output resource (the Backbuffer).
+//	- Works out which pass has to clear each resource (the first one to write it).
+//	- Records the state transitions between passes, so a texture that was just a render target is unbound
+//	  from the OM before it is bound as a shader resource and vice versa.
+//	- Lets transient textures whose lifetimes don't overlap share one allocation.
+// Compiling only looks at the descriptions below and never touches the device, so it can run headlessly.
 
-	if (!InitDirectInput(Instance))
-	{
-		MessageBox(0, "Error Initializing Direct Input.", "Error", MB_OK | MB_ICONERROR);
-		return 0;
-	}
+enum RenderGraphState
+{
+	RG_STATE_UNDEFINED,
+	RG_STATE_RENDER_TARGET,
+	RG_STATE_DEPTH_WRITE,
+	RG_STATE_SHADER_READ,
+};
 
-	if(!InitScene())
-	{
-		MessageBox(0, "Error Initializing Scene.", "Error", MB_OK | MB_ICONERROR);
-		return 0;
-	}
+struct RenderGraphResource
+{
+	const char *Name;
+	UINT Width;
+	UINT Height;
+	DXGI_FORMAT Format;
+	FLOAT ClearColor[4];
+
+	// Imported resources are owned outside of the graph (Swap Chain, D2D shared texture)
+	bool Imported;
+	// Output resources keep the passes that write them alive
+	bool Output;
+	// Some writers clear the resource themselves (D2D clears its own render target)
+	bool ClearedByWriter;
+
+	ID3D11Texture2D *Texture;
+	ID3D11RenderTargetView *RTV;
+	ID3D11DepthStencilView *DSV;
+	ID3D11ShaderResourceView *SRV;
+
+	// Filled in by CompileRenderGraph
+	int FirstPass;
+	int LastPass;
+	int Physical;
+	UINT BindFlags;
+};
 
-	MessageLoop();
+struct RenderGraphBarrier
+{
+	int Resource;
+	RenderGraphState Before;
+	RenderGraphState After;
+};
 
-	ReleaseObjects();
+struct RenderGraphPass
+{
+	const char *Name;
+	void (*Execute)();
+	std::vector<int> Reads;
+	std::vector<int> Writes;
+
+	// Filled in by CompileRenderGraph
+	bool Culled;
+	std::vector<int> Clears;
+	std::vector<RenderGraphBarrier> Barriers;
+};
 
-	return 0;
-}
+// A piece of memory that one or more transient resources live in over the frame
+struct RenderGraphPhysical
+{
+	UINT Width;
+	UINT Height;
+	DXGI_FORMAT Format;
+	UINT BindFlags;
+	UINT64 Bytes;
+	int LastPass;
+
+	ID3D11Texture2D *Texture;
+	ID3D11RenderTargetView *RTV;
+	ID3D11DepthStencilView *DSV;
+	ID3D11ShaderResourceView *SRV;
+};
 
-bool InitializeWindow(HINSTANCE Instance, int CmdShow, int Width, int Height, bool Windowed)
+struct RenderGraph
 {
-	WNDCLASSEX WindowClass = {};
-	WindowClass.cbSize = sizeof(WNDCLASSEX);
-	WindowClass.style = CS_HREDRAW | CS_VREDRAW;
-	WindowClass.lpfnWndProc = WindowProcedure;
-	WindowClass.hInstance = Instance;
-	WindowClass.hIcon = LoadIcon(NULL, IDI_APPLICATION);
-	WindowClass.hCursor = LoadCursor(NULL, IDC_ARROW);
-	WindowClass.hbrBackground = (HBRUSH)(COLOR_WINDOW + 2);
-	WindowClass.lpszClassName = WindowClassName;
-	WindowClass.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
-	if(!RegisterClassEx(&WindowClass))
-	{
-		MessageBox(0, "Error Registering Window Class.", "Error", MB_OK | MB_ICONERROR);
-		return false;
-	}
+	std::vector<RenderGraphResource> Resources;
+	std::vector<RenderGraphPass> Passes;
+	std::vector<RenderGraphPhysical> Physicals;
+
+	// Filled in by CompileRenderGraph
+	int CulledPasses;
+	UINT64 TransientBytes;
+	UINT64 AliasedTransientBytes;
+};
 
-	WindowHandle = CreateWindowEx(0,
-		WindowClassName,
-		"Window Title",
-		WS_OVERLAPPEDWINDOW,
-		CW_USEDEFAULT, CW_USEDEFAULT,
-		Width, Height,
-		0, 0, Instance, 0);
+RenderGraph FrameGraph;
+
+// Resource handles of the frame graph
+int RGBackbuffer;
+int RGDepth;
+int RGTextOverlay;
+
+int AddRenderGraphTexture(RenderGraph &Graph, const char *Name, UINT Width, UINT Height, DXGI_FORMAT Format);
+int ImportRenderGraphTexture(RenderGraph &Graph, const char *Name, ID3D11Texture2D *Texture,
+	ID3D11RenderTargetView *RTV, ID3D11ShaderResourceView *SRV);
+int AddRenderGraphPass(RenderGraph &Graph, const char *Name, void (*Execute)());
+void RenderGraphRead(RenderGraph &Graph, int Pass, int Resource);
+void RenderGraphWrite(RenderGraph &Graph, int Pass, int Resource);
+void CompileRenderGraph(RenderGraph &Graph);
+bool RealizeRenderGraph(RenderGraph &Graph, ID3D11Device *Device);
+void ExecuteRenderGraph(RenderGraph &Graph, ID3D11DeviceContext *Context);
+void ReleaseRenderGraph(RenderGraph &Graph);
+UINT64 RenderGraphTextureBytes(UINT Width, UINT Height, DXGI_FORMAT Format);
+// A depth texture that is also read is created typeless, and its views pick the depth and the color format out of it
+DXGI_FORMAT RenderGraphTextureFormat(DXGI_FORMAT Format, UINT BindFlags);
+DXGI_FORMAT RenderGraphShaderReadFormat(DXGI_FORMAT Format);
+// Compiles a synthetic graph without a device and checks the culling, clears, transitions and aliasing
+int RunRenderGraphTest();
+
+bool SetupFrameGraph();
+void ScenePass();
+void TextPass();
+void TextCompositePass();
 
-	if(!WindowHandle)
-	{
-		MessageBox(0, "Error Creating Window.", "Error", MB_OK | MB_ICONERROR);
-		return false;
-	}
+//////////////////////////////////////////////////////////////
 
-	ShowWindow(WindowHandle, CmdShow);
-	UpdateWindow(WindowHandle);
 
-	return true;
-}
+// Dynamic Resolution Information
+//////////////////////////////////////////////////////////////
 
-int MessageLoop()
+// The scene is rendered into SceneColor, a graph texture sized for the full resolution, but only the top left
+// ScaledWidth x ScaledHeight of it is used. UpscalePass then stretches that region over the Backbuffer.
+// The scale comes from a PI controller that tracks a GPU frame time budget measured with timestamp queries.
+// Cost is roughly proportional to the pixel count, so the scale applies per axis and the controller reacts to
+// the relative error against the budget.
+struct ResolutionController
 {
-	MSG Message = {};
-	while(true)
-	{
-		if(PeekMessage(&Message, 0, 0, 0, PM_REMOVE))
-		{
-			if (Message.message == WM_QUIT) break;
-			TranslateMessage(&Message);
-			DispatchMessage(&Message);
-		}
-		else
-		{
-			FrameCount++;
-			if(GetTime() > 1.0f)
-			{
-				FPS = FrameCount;
-				FrameCount = 0;
-				StartTimer();
-			}
-			FrameTime = GetFrameTime();
+	double TargetMs;
+	double Kp;
+	double Ki;
+	double MinScale;
+	double MaxScale;
+
+	double Integral;
+	double Scale;
+};
 
-			DetectInput(FrameTime);
-			UpdateScene(FrameTime);
-			DrawScene();
-		}
-	}
+// Describes how a controller behaved over a timing trace
+struct ResolutionControllerMetrics
+{
+	// First frame from which the GPU time stays within Tolerance of the budget (or the scale stays pinned to a limit), -1 if never
+	int SettleFrame;
+	// Worst frame time over the budget after settling
+	double MaxOvershootMs;
+	// Mean absolute distance from the budget after settling
+	double MeanAbsErrorMs;
+	// Number of times the scale changed direction
+	int Oscillations;
+	double FinalScale;
+};
 
-	return Message.wParam;
-}
+const int GPU_TIMER_FRAMES = 4;
+ID3D11Query *GpuDisjointQueries[GPU_TIMER_FRAMES];
+ID3D11Query *GpuBeginQueries[GPU_TIMER_FRAMES];
+ID3D11Query *GpuEndQueries[GPU_TIMER_FRAMES];
+int GpuTimerFrame = 0;
+double GpuFrameTime = 0.0;
 
-bool InitDirectInput(HINSTANCE Instance)
+ResolutionController DynamicResolution;
+UINT ScaledWidth = Width;
+UINT ScaledHeight = Height;
+
+int RGSceneColor;
+
+ID3D11VertexShader *UpscaleVS;
+ID3D11PixelShader *UpscalePS;
+ID3D10Blob *UpscaleVSBuffer;
+ID3D10Blob *UpscalePSBuffer;
+ID3D11Buffer *cbUpscaleBuffer;
+ID3D11SamplerState *UpscaleSamplerState;
+
+struct cbUpscale
 {
-	HR(DirectInput8Create(Instance, DIRECTINPUT_VERSION, IID_IDirectInput8, (void **)&DirectInput, NULL));
-	
-	HR(DirectInput->CreateDevice(GUID_SysKeyboard, &DIKeyboard, NULL));
-	HR(DirectInput->CreateDevice(GUID_SysMouse, &DIMouse, NULL));
+	XMFLOAT2 UVScale;
+	// The centers of the last rendered texels, the bilinear filter would blend in stale texels past them
+	XMFLOAT2 UVMax;
+};
 
-	HR(DIKeyboard->SetDataFormat(&c_dfDIKeyboard));
-	HR(DIKeyboard->SetCooperativeLevel(WindowHandle, DISCL_FOREGROUND | DISCL_NONEXCLUSIVE));
+bool InitDynamicResolution();
+void ReleaseDynamicResolution();
+void BeginGpuFrameTimer();
+void EndGpuFrameTimer();
+void UpdateDynamicResolution();
+void UpscalePass();
 
-	HR(DIMouse->SetDataFormat(&c_dfDIMouse));
-	HR(DIMouse->SetCooperativeLevel(WindowHandle, DISCL_EXCLUSIVE | DISCL_NOWINKEY | DISCL_FOREGROUND));
+void ResetResolutionController(ResolutionController &Controller, double TargetMs);
+double UpdateResolutionController(ResolutionController &Controller, double GpuMs);
+ResolutionControllerMetrics EvaluateResolutionController(ResolutionController Controller, const double *FullResolutionMs, int Frames, double Tolerance);
+// Runs step, spike and ramp load traces through the controller and checks how it settles
+int RunResolutionTest();
 
-	return true;
-}
+//////////////////////////////////////////////////////////////
 
-void DetectInput(double time)
+
+// Benchmark Information
+//////////////////////////////////////////////////////////////
+
+// Running with -benchmark [Output.json] skips the window and the device, and times the CPU work the frame
+// does for each object at several object counts. The results are written in the Google Benchmark JSON layout
+// so the usual compare tools can diff two runs.
+struct BenchmarkResult
 {
-	DIMOUSESTATE MouseCurrentState;
-	BYTE KeyboardState[256];
+	const char *Name;
+	int Objects;
+	UINT64 Iterations;
+	int Threads;
+	double RealNs;
+	double CpuNs;
+};
 
-	DIKeyboard->Acquire();
-	DIMouse->Acquire();
+typedef void (*BenchmarkFunction)(int Objects);
 
-	DIMouse->GetDeviceState(sizeof(DIMOUSESTATE), &MouseCurrentState);
-	DIKeyboard->GetDeviceState(sizeof(KeyboardState), (LPVOID)&KeyboardState);
+int RunBenchmarks(const char *OutputPath);
+bool GetCommandLineOption(const char *CommandLine, const char *Option, char *Value, int ValueSize);
+void AttachParentConsole();
+// For -console or -startupreport on a windowed run, so the stats and the startup timeline have somewhere to go. Opens a new
+// console if there's no parent one.
+void OpenStatsConsole();
 
-	if (KeyboardState[DIK_ESCAPE] & 0x80)
-		PostMessage(WindowHandle, WM_DESTROY, 0, 0);
+//////////////////////////////////////////////////////////////
 
-	if (KeyboardState[DIK_LEFT] & 0x80)
-		RotZ -= 1.0f * time;
-	if (KeyboardState[DIK_RIGHT] & 0x80)
-		RotZ += 1.0f * time;
-	if (KeyboardState[DIK_UP] & 0x80)
-		RotX += 1.0f * time;
-	if (KeyboardState[DIK_DOWN] & 0x80)
-		RotX -= 1.0f * time;
 
-	if (MouseCurrentState.lX != MouseLastState.lX)
-		ScaleX -= (MouseCurrentState.lX * 0.001f);
-	if (MouseCurrentState.lY != MouseLastState.lY)
-		ScaleY -= (MouseCurrentState.lY * 0.001f);
+// Scene Streaming Information
+//////////////////////////////////////////////////////////////
 
-	if (RotX > 6.28) RotX -= 6.28;
-	else if (RotX < 0) RotX = 6.28 + RotX;
+// Cooked scene file layout:
+//	SceneFileHeader
+//	SceneFileLight[LightCount]          at LightsOffset
+//	SceneFileCell[GridX * GridZ]        at CellTableOffset, row major in Z
+//	SceneFileEntity[EntityCount]        per cell, at SceneFileCell::Offset
+// The world is cut into square cells on the XZ plane, so only the cells around the camera need to be in memory.
+const char SCENE_FILE_MAGIC[4] = { 'S', 'C', 'N', '1' };
+const UINT SCENE_FILE_VERSION = 1;
 
-	if (RotZ > 6.28) RotZ -= 6.28;
-	else if (RotZ < 0) RotZ = 6.28 + RotZ;
+enum SceneMesh
+{
+	SCENE_MESH_CUBE,
+};
 
-	MouseLastState = MouseCurrentState;
-	return;
-}
+struct SceneFileHeader
+{
+	char Magic[4];
+	UINT Version;
+	int GridX;
+	int GridZ;
+	float CellSize;
+	float OriginX;
+	float OriginZ;
+	UINT LightCount;
+	UINT64 LightsOffset;
+	UINT64 CellTableOffset;
+};
 
-LRESULT CALLBACK WindowProcedure(HWND Window, UINT Msg, WPARAM WParam, LPARAM LParam)
+struct SceneFileLight
 {
-	switch(Msg)
-	{
-		case WM_KEYDOWN:
-		{
-			if (WParam == VK_ESCAPE)
-			{
-				DestroyWindow(Window);
-			}
-		} break;
+	XMFLOAT3 Position;
+	float Range;
+	XMFLOAT3 Attenuation;
+	float Pad;
+	XMFLOAT4 Ambient;
+	XMFLOAT4 Diffuse;
+};
 
-		case WM_DESTROY:
-		{
-			PostQuitMessage(0);
-		} break;
-	}
+struct SceneFileCell
+{
+	UINT EntityCount;
+	UINT Pad;
+	UINT64 Offset;
+};
 
-	return DefWindowProc(Window, Msg, WParam, LParam);
-}
+struct SceneFileEntity
+{
+	XMFLOAT4X4 World;
+	UINT Mesh;
+	UINT Material;
+	float BoundingRadius;
+	float Pad;
+};
 
-bool InitializeD3D(HINSTANCE Instance)
+enum SceneCellState
 {
-	IDXGIFactory1 *DXGIFactory;
-	HR(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **)&DXGIFactory));
-	IDXGIAdapter1 *Adapter;
-	HR(DXGIFactory->EnumAdapters1(0, &Adapter));
-	DXGIFactory->Release();
+	CELL_UNLOADED,
+	CELL_LOADING,
+	CELL_RESIDENT,
+};
 
-	// Describe our Backbuffer.
-	DXGI_MODE_DESC BufferDesc = {};
-	{
-		// Width and Height of Resolution
-		BufferDesc.Width = Width;
-		BufferDesc.Height = Height;
-		// RefreshRate (Rational), 60/1 or 60Hz
-		BufferDesc.RefreshRate.Numerator = 60;
-		BufferDesc.RefreshRate.Denominator = 1;
-		BufferDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-		// DXGI_MODE_SCANLINE_ORDER enum type. Describes the manner in which the rasterizer will render onto the surface.
-		// Since we use Double Buffering, this wont be noticeable, so we can set to unspecified.
-		BufferDesc.ScanlineOrdering = DXGI_MODE_SCANLINE_ORDER_UNSPECIFIED;
-		// DXGI_MODE_SCALING enum type. Explains how an image is stretched to fit monitor resolution.
-		// UNSPECIFIED, CENTERED, STRETCHED
-		BufferDesc.Scaling = DXGI_MODE_SCALING_UNSPECIFIED;
-	}
+struct SceneCell
+{
+	SceneFileCell Info;
+	SceneCellState State;
+	// Written by the loader thread while LOADING, only the main thread touches it otherwise
+	std::vector<SceneFileEntity> Entities;
+};
 
-	// Describe our SwapChain
-	DXGI_SWAP_CHAIN_DESC SwapChainDesc = {};
-	{
-		// Describes our backbuffer above
-		SwapChainDesc.BufferDesc = BufferDesc;
-		// DXGI_SAMPLE_DESC struct to describe Multisampling.
-		// Multisampling smoothes the choppiness in lines or edges created because pixels on monitors are not infinitely small.
-		// Since they are little blocks, you can see choppiness in diagonal lines and edges on a screen.
-		SwapChainDesc.SampleDesc.Count = 1;
-		SwapChainDesc.SampleDesc.Quality = 0;
-		// DXGI_USAGE enum type. Describes the access the CPU has to the Surface of the Backbuffer.
-		// DXGI_USAGE_RENDER_TARGET_OUTPUT so we can render to the Backbuffer.
-		SwapChainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-		// Number of Backbuffers we will use. 1 => Double Buffers, 2 => Triple Buffering, n => x Buffering
-		SwapChainDesc.BufferCount = 1;
-		SwapChainDesc.OutputWindow = WindowHandle;
+struct SceneStreamingStats
+{
+	int CellsResident;
+	int CellsLoading;
+	UINT64 ResidentBytes;
+	UINT64 TotalBytesLoaded;
+	double BytesPerSecond;
+	// Times the cell under the camera was needed but not resident yet
+	int HitchCount;
+};
 
-		SwapChainDesc.Windowed = TRUE;
-		// DXGI_SWAP_EFFECT enum type. Describes what the Display Driver should do with the Front Buffer after swapping it to the back.
-		// We use DISCARD to let the driver decide what is most efficient to do with it.
-		SwapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_DISCARD;
-	}
+struct SceneStreamer
+{
+	HANDLE File;
+	SceneFileHeader Header;
+	std::vector<SceneFileLight> Lights;
+	std::vector<SceneCell> Cells;
+
+	UINT64 MemoryBudget;
+	float LoadRadius;
+	float UnloadRadius;
+
+	UINT64 ResidentBytes;
+	UINT64 PendingBytes;
+	UINT64 BytesThisSecond;
+	double SecondTime;
+	bool CameraCellMissing;
+	SceneStreamingStats Stats;
+
+	// Scratch, kept around so the per frame update doesn't allocate
+	std::vector<int> Finished;
+	std::vector<std::pair<float, int> > Candidates;
+
+	std::thread Loader;
+	std::mutex Lock;
+	std::condition_variable Wake;
+	// Guarded by Lock. Requests is a ring with room for every cell, a cell is requested at most once while it loads.
+	std::vector<int> Requests;
+	int RequestHead;
+	int RequestCount;
+	std::vector<int> Completed;
+	bool Quit;
+};
 
-	// Create the D3D Device, Device Context, and Swap Chain
-	HR(D3D11CreateDeviceAndSwapChain(Adapter,
-		D3D_DRIVER_TYPE_UNKNOWN,
-		0,
-		D3D11_CREATE_DEVICE_DEBUG | D3D11_CREATE_DEVICE_BGRA_SUPPORT,
-		0,
-		0,
-		D3D11_SDK_VERSION,
-		&SwapChainDesc,
-		&SwapChain,
-		&D3D11Device,
-		0,
-		&D3D11DeviceContext));
+// Everything the scene pass draws besides the two cubes
+struct DrawItem
+{
+	XMFLOAT4X4 World;
+	UINT Mesh;
+	UINT Material;
+};
 
-	InitD2D_D3D11_DWrite(Adapter);
+SceneStreamer WorldStreamer;
+bool WorldStreaming = false;
+char ScenePath[MAX_PATH] = "Scene.bin";
+std::vector<DrawItem> DrawList;
 
-	Adapter->Release();
+bool OpenSceneStream(SceneStreamer &Streamer, const char *Path, UINT64 MemoryBudget, float LoadRadius);
+void CloseSceneStream(SceneStreamer &Streamer);
+void UpdateSceneStreaming(SceneStreamer &Streamer, FXMVECTOR Camera, double time);
+void BuildDrawList(SceneStreamer &Streamer);
+bool CookTestScene(const char *Path, int GridSize, int EntitiesPerCell, float CellSize);
 
-	// Create our Backbuffer to create our RenderTargetView
-	HR(SwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void **)&Backbuffer1))
-	HR(D3D11Device->CreateRenderTargetView(Backbuffer1, 0, &RenderTargetView));
+//////////////////////////////////////////////////////////////
 
-	// Create our Depth/Stencil Desc
-	D3D11_TEXTURE2D_DESC DepthStencilDesc = {};
-	{
-		DepthStencilDesc.Width = Width;
-		DepthStencilDesc.Height = Height;
-		DepthStencilDesc.MipLevels = 1;
-		DepthStencilDesc.ArraySize = 1;
-		DepthStencilDesc.Format = DXGI_FORMAT_D24_UNORM_S8_UINT;
-		DepthStencilDesc.SampleDesc.Count = 1;
-		DepthStencilDesc.SampleDesc.Quality = 0;
-		DepthStencilDesc.Usage = D3D11_USAGE_DEFAULT;
-		DepthStencilDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
-	}
 
-	// Create the Depth/Stencil buffer and bind it to the OM stage of the Pipeline.
-	D3D11Device->CreateTexture2D(&DepthStencilDesc, 0, &DepthStencilBuffer);
-	D3D11Device->CreateDepthStencilView(DepthStencilBuffer, 0, &DepthStencilView);
+// Job System Information
+//////////////////////////////////////////////////////////////
 
-	// Bind the RenderTargetView to the Output Merger state of the pipeline. 
-	// NumViews is 1 since we only have 1 RenderTarget to bind
-	D3D11DeviceContext->OMSetRenderTargets(1, &RenderTargetView, DepthStencilView);
+// A fixed set of worker threads that split loops with the calling thread.
+// ParallelFor cuts [0, Count) into chunks of Grain, hands them out through an atomic counter
+// and returns once every chunk ran. It is meant to be called from the main thread only.
+typedef void (*ParallelForFunction)(void *Data, int Begin, int End);
 
-	return true;
-}
+struct JobSystem
+{
+	std::vector<std::thread> Workers;
+	std::mutex Lock;
+	std::condition_variable Wake;
+	std::condition_variable Idle;
+	bool Quit;
+	UINT64 Generation;
+	// Workers currently inside a ParallelFor, guarded by Lock
+	int Active;
+
+	// The ParallelFor in flight, only written while Active is 0
+	ParallelForFunction Function;
+	void *Data;
+	int Count;
+	int Grain;
+	std::atomic<int> NextBegin;
+};
 
-void ReleaseObjects()
+JobSystem Jobs;
+
+void InitJobSystem(int WorkerCount);
+void ShutdownJobSystem();
+int JobThreadCount();
+void ParallelFor(int Count, int Grain, ParallelForFunction Function, void *Data);
+
+//////////////////////////////////////////////////////////////
+
+
+// Command Buffer Information
+//////////////////////////////////////////////////////////////
+
+// Draws of the DrawList are recorded in parallel, one command buffer per chunk, and executed in order afterwards.
+// The D3D11 backend records on deferred contexts and plays the command lists back on the immediate context.
+// The null backend records nothing and only counts, so recording can be exercised headlessly. -benchmark times both
+// backends, the D3D11 one on the WARP adapter.
+struct CommandBuffer
 {
-	SwapChain->Release();
-	D3D11Device->Release();
-	D3D11DeviceContext->Release();
-	RenderTargetView->Release();
+	virtual ~CommandBuffer() {}
+
+	// Deferred contexts start with default state, so everything the scene draws need is bound here
+	virtual void BeginScene() = 0;
+	virtual void DrawObject(const cbPerObject &Constants, UINT IndexCount) = 0;
+	virtual void Finish() = 0;
+	// Called on the main thread, in chunk order
+	virtual void Execute() = 0;
+
+	// Of the last recording
+	UINT Draws;
+	UINT Binds;
+	UINT64 UploadBytes;
+};
+
+struct D3D11CommandBuffer : CommandBuffer
+{
+	D3D11CommandBuffer(ID3D11DeviceContext *InContext, ID3D11Buffer *InObjectConstants, bool InDeferred);
+	~D3D11CommandBuffer();
+
+	void BeginScene();
+	void DrawObject(const cbPerObject &Constants, UINT IndexCount);
+	void Finish();
+	void Execute();
+
+	ID3D11DeviceContext *Context;
+	ID3D11CommandList *List;
+	// A deferred context's own dynamic buffer, mapped with WRITE_DISCARD per draw. UpdateSubresource on a deferred
+	// context copies the constants into the command list and once more on playback. The immediate one uses cbPerObjectBuffer.
+	ID3D11Buffer *ObjectConstants;
+	bool Deferred;
+};
+
+struct NullCommandBuffer : CommandBuffer
+{
+	NullCommandBuffer() : Checksum(0.0f) { Draws = 0; Binds = 0; UploadBytes = 0; }
+
+	void BeginScene() { Draws = 0; }
+	void DrawObject(const cbPerObject &Constants, UINT IndexCount) { Checksum += XMVectorGetX(Constants.WVP.r[0]); Draws++; }
+	void Finish() {}
+	void Execute() {}
+
+	float Checksum;
+};
+
+const int MAX_RECORD_THREADS = 16;
+CommandBuffer *SceneCommandBuffers[MAX_RECORD_THREADS];
+// Number of chunks the DrawList gets recorded in, 1 draws straight on the immediate context. Keys 1-8 change it.
+int RecordThreads = 1;
+int RecordDrawsThisSecond = 0;
+double RecordSecondsThisSecond = 0.0;
+
+bool InitCommandBuffers();
+void ReleaseCommandBuffers();
+void RecordDrawList(CommandBuffer **Buffers, int BufferCount, const DrawItem *Items, int Count);
+
+//////////////////////////////////////////////////////////////
+
+
+// Occlusion Culling Information
+//////////////////////////////////////////////////////////////
+
+// Before the DrawList gets recorded, the biggest objects on screen are rasterized as occluders into a small
+// depth buffer on the CPU, and every item's bounding box is tested against it.
+//	- Each occluder triangle writes its farthest depth, so the buffer never claims more occlusion than there is.
+//	- The buffer is split in horizontal bands that rasterize in parallel, 8 pixels at a time with AVX2.
+//	- Every 8x8 tile keeps the farthest depth it contains; a box is occluded when its nearest point
+//	  is behind that depth in every tile it covers.
+// Depth is z/w like the GPU, 0 at the near plane, cleared to 1.
+const int OCCLUSION_WIDTH = 256;
+const int OCCLUSION_HEIGHT = 128;
+const int OCCLUSION_TILE = 8;
+const int OCCLUSION_TILES_X = OCCLUSION_WIDTH / OCCLUSION_TILE;
+const int OCCLUSION_TILES_Y = OCCLUSION_HEIGHT / OCCLUSION_TILE;
+const int OCCLUSION_BAND_HEIGHT = 16;
+const int MAX_OCCLUDERS = 32;
+
+struct OcclusionTriangle
+{
+	// Edge functions A * x + B * y + C, positive inside
+	float A[3];
+	float B[3];
+	float C[3];
+	float MaxZ;
+	int MinX, MaxX;
+	int MinY, MaxY;
+};
+
+struct OcclusionStats
+{
+	int Occluders;
+	int Triangles;
+	int Tested;
+	int Occluded;
+	double RasterizeMs;
+	double TestMs;
+};
+
+struct OcclusionCuller
+{
+	float *Depth;
+	float TileMaxDepth[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+	XMFLOAT4X4 ViewProjection;
+
+	std::vector<OcclusionTriangle> Triangles;
+	std::vector<std::pair<float, int> > Candidates;
+	std::vector<unsigned char> Visible;
+	OcclusionStats Stats;
+};
+
+OcclusionCuller SceneOcclusion;
+bool OcclusionCulling = true;
+
+void InitOcclusionCuller(OcclusionCuller &Culler);
+void ReleaseOcclusionCuller(OcclusionCuller &Culler);
+void BeginOcclusionFrame(OcclusionCuller &Culler, const XMMATRIX &ViewProjection);
+void AddCubeOccluder(OcclusionCuller &Culler, const XMMATRIX &ObjectWorld);
+void RasterizeOccluders(OcclusionCuller &Culler);
+bool IsCubeOccluded(const OcclusionCuller &Culler, const XMMATRIX &ObjectWorld);
+void CullOccludedDraws(OcclusionCuller &Culler, std::vector<DrawItem> &Items);
+bool DumpOcclusionBuffer(const OcclusionCuller &Culler, const char *Path);
+int RunOcclusionTest(const char *DumpPath);
+
+//////////////////////////////////////////////////////////////
+
+
+// Material Information
+//////////////////////////////////////////////////////////////
+
+// Every material's texture is one slice of a single Texture2DArray, and the draw list is drawn instanced with the
+// material index in the per instance data. Objects with different materials end up in the same draw, one per mesh,
+// and the texture and sampler get bound once a frame.
+// Slices have to share size and format, textures that don't match the first one fall back to slice 0.
+struct MaterialDesc
+{
+	// NULL makes a checker in Color, the same size as the first texture
+	const wchar_t *TexturePath;
+	UINT Color;
+};
+
+const MaterialDesc Materials[] =
+{
+	{ L"test.png", 0 },
+	{ NULL, 0xff3030c0 },
+	{ NULL, 0xff30c030 },
+	{ NULL, 0xffc03030 },
+	{ NULL, 0xff30c0c0 },
+	{ NULL, 0xffc030c0 },
+	{ NULL, 0xffc0c030 },
+	{ NULL, 0xff3080ff },
+	{ NULL, 0xff80ff30 },
+	{ NULL, 0xffff3080 },
+	{ NULL, 0xff30ff80 },
+	{ NULL, 0xff8030ff },
+	{ NULL, 0xffff8030 },
+	{ NULL, 0xff606060 },
+	{ NULL, 0xff205080 },
+	{ NULL, 0xff802050 },
+};
+const UINT MaterialCount = ARRAYSIZE(Materials);
+
+struct InstanceData
+{
+	XMFLOAT4X4 World;
+	UINT Material;
+};
+
+struct cbPerView
+{
+	XMMATRIX ViewProjection;
+};
+
+// Per Vertex data in slot 0, per Instance data in slot 1
+D3D11_INPUT_ELEMENT_DESC InstancedLayout[] =
+{
+	{ "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "NORMAL", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "WORLD", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 0, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+	{ "WORLD", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+	{ "WORLD", 2, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+	{ "WORLD", 3, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+	{ "MATERIAL", 0, DXGI_FORMAT_R32_UINT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+};
+
+const int MAX_INSTANCES_PER_DRAW = 16384;
+
+ID3D11Texture2D *MaterialTextureArray;
+ID3D11ShaderResourceView *MaterialTextureArrayView;
+ID3D11Buffer *InstanceBuffer;
+ID3D11Buffer *cbPerViewBuffer;
+ID3D11VertexShader *InstancedVS;
+ID3D10Blob *InstancedVSBuffer;
+ID3D11InputLayout *InstancedVertexLayout;
+
+// B toggles between instanced batches and one recorded draw per object
+bool MaterialBatching = true;
+int BatchedObjectsThisSecond = 0;
+int BatchedDrawsThisSecond = 0;
+
+bool InitMaterials();
+void ReleaseMaterials();
+typedef bool (*DrawItemPredicate)(const DrawItem &Item);
+
+int DrawDrawListInstanced(const DrawItem *Items, int Count, UINT Features);
+// Copies the items Predicate holds for to the front of Out and the others after them, both in their order. Returns
+// how many it held for.
+int SplitDrawList(const DrawItem *Items, int Count, DrawItemPredicate Predicate, DrawItem *Out);
+bool IsDrawItemLit(const DrawItem &Item);
+int RunBatchingTest();
+
+//////////////////////////////////////////////////////////////
+
+// Offline texture cooking. -cooktextures decodes test.png once, builds its mip chain with a gamma correct filter,
+// block compresses every mip on the job system and writes a DDS the DirectXTK loader uploads as is.
+// InitScene prefers the cooked test.dds over the PNG.
+enum TextureCodec
+{
+	TEXTURE_CODEC_BC1,
+	TEXTURE_CODEC_BC3,
+	TEXTURE_CODEC_BC7,
+	TEXTURE_CODEC_COUNT,
+	// Uncompressed half floats for the baked light, not one the cooker compares
+	TEXTURE_CODEC_RGBA16F = TEXTURE_CODEC_COUNT,
+};
+
+// RGBA8, with the color channels sRGB encoded like the PNG they came from
+struct CookImage
+{
+	UINT Width;
+	UINT Height;
+	std::vector<BYTE> Pixels;
+};
+
+struct CookedTexture
+{
+	TextureCodec Codec;
+	// Goes into the header as is, an _SRGB one for color and a plain one for linear data like the baked light
+	DXGI_FORMAT Format;
+	UINT Width;
+	UINT Height;
+	// Slices of a volume texture, 1 for a 2D one
+	UINT Depth;
+	UINT MipCount;
+	// Every mip's blocks, largest mip first
+	std::vector<BYTE> Data;
+};
+
+struct TextureCookStats
+{
+	double EncodeMs;
+	double MBPerSecond;
+	// Top mip against the source
+	double Psnr;
+	// RGBA8 with the same mips, against what the codec needs
+	UINT64 RawBytes;
+	UINT64 CookedBytes;
+};
+
+// The DDS header with the DX10 extension, so the format is a plain DXGI_FORMAT
+struct DDSPixelFormat
+{
+	UINT Size;
+	UINT Flags;
+	UINT FourCC;
+	UINT RGBBitCount;
+	UINT RBitMask;
+	UINT GBitMask;
+	UINT BBitMask;
+	UINT ABitMask;
+};
+
+struct DDSHeader
+{
+	UINT Size;
+	UINT Flags;
+	UINT Height;
+	UINT Width;
+	UINT PitchOrLinearSize;
+	UINT Depth;
+	UINT MipMapCount;
+	UINT Reserved1[11];
+	DDSPixelFormat PixelFormat;
+	UINT Caps;
+	UINT Caps2;
+	UINT Caps3;
+	UINT Caps4;
+	UINT Reserved2;
+};
+
+struct DDSHeaderDX10
+{
+	DXGI_FORMAT Format;
+	UINT ResourceDimension;
+	UINT MiscFlag;
+	UINT ArraySize;
+	UINT MiscFlags2;
+};
+
+const UINT DDS_HEADER_FLAGS_TEXTURE = 0x00001007;
+const UINT DDS_HEADER_FLAGS_MIPMAP = 0x00020000;
+const UINT DDS_HEADER_FLAGS_LINEARSIZE = 0x00080000;
+const UINT DDS_HEADER_FLAGS_PITCH = 0x00000008;
+const UINT DDS_HEADER_FLAGS_VOLUME = 0x00800000;
+const UINT DDS_PIXEL_FORMAT_FOURCC = 0x00000004;
+const UINT DDS_CAPS_COMPLEX = 0x00000008;
+const UINT DDS_CAPS_TEXTURE = 0x00001000;
+const UINT DDS_CAPS_MIPMAP = 0x00400000;
+const UINT DDS_CAPS2_VOLUME = 0x00200000;
+
+bool DecodeImageFile(const wchar_t *Path, CookImage &Image);
+void BuildMipChain(const CookImage &Base, std::vector<CookImage> &Mips);
+bool CookTexture(const std::vector<CookImage> &Mips, TextureCodec Codec, CookedTexture &Texture, TextureCookStats &Stats);
+bool WriteDDSFile(const char *Path, const CookedTexture &Texture);
+int RunTextureCook(const char *OutputPath);
+
+//////////////////////////////////////////////////////////////
+
+// Pixel shader permutations. Every feature is a #define in Effects.fx, and draws pick the variant with only the features
+// they need. -buildshaders compiles the needed variants ahead of time into Shaders.bin, indexed by permutation key.
+// Variants missing from the archive, or all of them if Effects.fx changed since, compile at startup instead.
+enum ShaderEntry
+{
+	SHADER_ENTRY_PS,
+	SHADER_ENTRY_INSTANCED_PS,
+	SHADER_ENTRY_COUNT,
+};
+
+const char *ShaderEntryNames[SHADER_ENTRY_COUNT] = { "PS", "INSTANCED_PS" };
+
+const UINT SHADER_FEATURE_LIGHTING = 0x1;
+const UINT SHADER_FEATURE_ATTENUATION = 0x2;
+const UINT SHADER_FEATURE_TEXTURED = 0x4;
+// The ambient term comes from the baked probes
+const UINT SHADER_FEATURE_BAKED = 0x8;
+const UINT SHADER_FEATURE_ALL = 0xf;
+const UINT SHADER_FEATURE_COMBINATIONS = 16;
+const UINT SHADER_PERMUTATION_COUNT = SHADER_ENTRY_COUNT * SHADER_FEATURE_COMBINATIONS;
+
+// Shaders without features that go through the archive too, keyed after the permutations. Their bytecode is kept, a
+// vertex shader's input layout needs it.
+enum ArchivedShader
+{
+	ARCHIVED_SHADER_LIGHTMAPPED_VS,
+	ARCHIVED_SHADER_LIGHTMAPPED_PS,
+	ARCHIVED_SHADER_COUNT,
+};
+
+const char *ArchivedShaderNames[ARCHIVED_SHADER_COUNT] = { "LIGHTMAPPED_VS", "LIGHTMAPPED_PS" };
+const char *ArchivedShaderProfiles[ARCHIVED_SHADER_COUNT] = { "vs_5_0", "ps_5_0" };
+const UINT SHADER_ARCHIVE_KEY_COUNT = SHADER_PERMUTATION_COUNT + ARCHIVED_SHADER_COUNT;
+
+struct ShaderArchiveHeader
+{
+	char Magic[4];
+	UINT Version;
+	// Of Effects.fx, so a stale archive is ignored
+	UINT64 SourceHash;
+	UINT EntryCount;
+	UINT Pad;
+};
+
+struct ShaderArchiveEntry
+{
+	UINT Key;
+	UINT Offset;
+	UINT Size;
+	UINT InstructionCount;
+};
+
+const UINT SHADER_ARCHIVE_VERSION = 4;
+
+ID3D11PixelShader *ShaderPermutations[SHADER_PERMUTATION_COUNT];
+ID3D10Blob *ArchivedShaderCode[ARCHIVED_SHADER_COUNT];
+int ArchivedShaderPermutations = 0;
+int CompiledShaderPermutations = 0;
+
+bool InitShaderPermutations(const char *ArchivePath);
+void ReleaseShaderPermutations();
+ID3D11PixelShader *GetPixelShaderPermutation(ShaderEntry Entry, UINT Features);
+// The shader's bytecode from the archive, or compiled now if it isn't there. The caller releases it.
+HRESULT GetArchivedShaderCode(ArchivedShader Shader, ID3D10Blob **Blob);
+UINT AmbientShaderFeatures();
+UINT LitShaderFeatures(const Light &SceneLight);
+UINT SelectShaderFeatures(const Light &SceneLight, CXMMATRIX World);
+int BuildShaderArchive(const char *Path);
+
+//////////////////////////////////////////////////////////////
+
+// Particles live in a structure of arrays pool, one float stream per attribute, so the update runs 8 particles per
+// AVX2 instruction over the job threads. Dead particles are swapped out with the last live one, and every frame the
+// live ones are written into one dynamic instance buffer and drawn as camera facing quads in a single draw.
+const int MAX_PARTICLES = 1 << 20;
+// Particles per update job, the dead lists are kept per chunk
+const int PARTICLE_CHUNK = 16384;
+const int PARTICLE_CHUNKS = MAX_PARTICLES / PARTICLE_CHUNK;
+
+struct ParticlePool
+{
+	float *PositionX;
+	float *PositionY;
+	float *PositionZ;
+	float *VelocityX;
+	float *VelocityY;
+	float *VelocityZ;
+	float *Age;
+	float *Lifetime;
+	int Count;
+	std::vector<int> Dead[PARTICLE_CHUNKS];
+};
+
+struct ParticleEmitter
+{
+	XMFLOAT3 Position;
+	// Particles per second
+	float Rate;
+	float Speed;
+	// 0 emits straight up, 1 in a 45 degree cone
+	float Spread;
+	float Lifetime;
+	float Accumulator;
+	UINT Seed;
+};
+
+// Per Instance data of the particle draw, the color is already faded over the particle's life
+struct ParticleInstance
+{
+	XMFLOAT3 Position;
+	UINT Color;
+};
+
+struct ParticleSystem
+{
+	ParticlePool Pool;
+	std::vector<ParticleEmitter> Emitters;
+	XMFLOAT3 Gravity;
+	float Drag;
+	XMFLOAT4 StartColor;
+	XMFLOAT4 EndColor;
+	float Size;
+
+	// Of the last frame
+	double SimulateMs;
+	double UploadMs;
+	int Spawned;
+	int Died;
+};
+
+struct cbParticle
+{
+	XMMATRIX ViewProjection;
+	// w of CameraRight is the particle size
+	XMFLOAT4 CameraRight;
+	XMFLOAT4 CameraUp;
+};
+
+// Nothing per vertex, the corners come from SV_VertexID
+D3D11_INPUT_ELEMENT_DESC ParticleLayout[] =
+{
+	{ "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+	{ "COLOR", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+};
+
+ParticleSystem Particles;
+ID3D11Buffer *ParticleInstanceBuffer;
+ID3D11Buffer *cbParticleBuffer;
+ID3D11VertexShader *ParticleVS;
+ID3D11PixelShader *ParticlePS;
+ID3D10Blob *ParticleVSBuffer;
+ID3D10Blob *ParticlePSBuffer;
+ID3D11InputLayout *ParticleVertexLayout;
+ID3D11BlendState *AdditiveBlendState;
+ID3D11DepthStencilState *DepthTestNoWriteState;
+
+// P toggles the particles
+bool ParticlesEnabled = true;
+double ParticleSimulateMsThisSecond = 0.0;
+double ParticleUploadMsThisSecond = 0.0;
+int ParticleFramesThisSecond = 0;
+
+void InitParticleSystem(ParticleSystem &System);
+void ReleaseParticleSystem(ParticleSystem &System);
+void AddParticleEmitter(ParticleSystem &System, XMFLOAT3 Position, int Budget, float Lifetime, float Speed, float Spread);
+void SimulateParticles(ParticleSystem &System, float DeltaTime);
+void WriteParticleInstances(const ParticleSystem &System, ParticleInstance *Out);
+bool InitParticles();
+void ReleaseParticles();
+void ParticlePass();
+int RunParticleTest(int Frames);
+
+//////////////////////////////////////////////////////////////
+
+// Skeletal animation. Clips are stored with smallest three quantized rotations and range quantized translations,
+// translation tracks that never move are stored once. Every frame each character samples and blends two clips and
+// walks its hierarchy on the job threads, then the skinning matrices of all characters go up in one structured buffer
+// and the characters are drawn instanced, each instance finding its matrices by SV_InstanceID.
+const int MAX_BONES = 32;
+const int MAX_CHARACTERS = 1024;
+const int SCENE_CHARACTERS = 64;
+const int CHARACTER_BONES = 12;
+const int CHARACTER_CLIPS = 2;
+const float CHARACTER_BONE_LENGTH = 0.5f;
+// sqrt(2), the three smallest components of a unit quaternion are within +-1/sqrt(2)
+const float ROTATION_QUANTIZE_SCALE = 1.41421356f;
+// What -animtest holds the compressed clips to: rotation error in degrees, raw over compressed size, and how far a
+// skinning matrix element may be off the one from the uncompressed clip
+const float ANIMATION_MAX_ROTATION_ERROR = 0.1f;
+const double ANIMATION_MIN_COMPRESSION = 4.0;
+const float ANIMATION_SKINNING_TOLERANCE = 0.01f;
+
+// Bones are ordered so parents come before their children, the root's parent is -1
+struct Skeleton
+{
+	int BoneCount;
+	int Parents[MAX_BONES];
+	XMFLOAT4X4 InverseBind[MAX_BONES];
+};
+
+// Local space keys at a fixed rate, key major: all bones of key 0, then all bones of key 1...
+struct RawAnimationClip
+{
+	int BoneCount;
+	int KeyCount;
+	float SampleRate;
+	std::vector<XMFLOAT4> Rotations;
+	std::vector<XMFLOAT3> Translations;
+};
+
+struct CompressedAnimationClip
+{
+	int BoneCount;
+	int KeyCount;
+	float SampleRate;
+	float Duration;
+	// Used when TranslationTrack is -1
+	XMFLOAT3 ConstantTranslations[MAX_BONES];
+	int TranslationTrack[MAX_BONES];
+	int AnimatedTranslationCount;
+	XMFLOAT3 TranslationMin[MAX_BONES];
+	XMFLOAT3 TranslationExtent[MAX_BONES];
+	// 3 per bone per key, the top bits of the first two say which component was dropped
+	std::vector<UINT16> Rotations;
+	// 3 per animated track per key
+	std::vector<UINT16> Translations;
+};
+
+struct AnimationPose
+{
+	XMVECTOR Rotations[MAX_BONES];
+	XMVECTOR Translations[MAX_BONES];
+};
+
+// Kept apart from Vertex so the cube and instanced layouts don't carry bone data they never use
+struct SkinnedVertex
+{
+	XMFLOAT3 pos;
+	XMFLOAT2 texCoord;
+	XMFLOAT3 normal;
+	BYTE BoneIndices[4];
+	BYTE BoneWeights[4];
+};
+
+D3D11_INPUT_ELEMENT_DESC SkinnedLayout[] =
+{
+	{ "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "NORMAL", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "BLENDINDICES", 0, DXGI_FORMAT_R8G8B8A8_UINT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "BLENDWEIGHT", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+};
+
+struct AnimatedCharacter
+{
+	XMFLOAT4X4 World;
+	float Time;
+	float Speed;
+	// Offsets when the character drifts between the two clips
+	float BlendPhase;
+};
+
+struct cbSkinning
+{
+	UINT BonesPerCharacter;
+	UINT Pad[3];
+};
+
+Skeleton CharacterSkeleton;
+CompressedAnimationClip CharacterClips[CHARACTER_CLIPS];
+std::vector<AnimatedCharacter> Characters;
+// CharacterSkeleton.BoneCount transposed matrices per character, out of the frame arena
+XMFLOAT4X4 *CharacterSkinning;
+ID3D11Buffer *SkinnedVertexBuffer;
+ID3D11Buffer *SkinnedIndexBuffer;
+ID3D11Buffer *SkinningBuffer;
+ID3D11ShaderResourceView *SkinningBufferView;
+ID3D11Buffer *cbSkinningBuffer;
+ID3D11VertexShader *SkinnedVS;
+ID3D10Blob *SkinnedVSBuffer;
+ID3D11InputLayout *SkinnedVertexLayout;
+UINT CharacterIndexCount;
+
+double CharacterUpdateMsThisSecond = 0.0;
+int CharacterFramesThisSecond = 0;
+
+bool CompressAnimationClip(const RawAnimationClip &Raw, CompressedAnimationClip &Clip);
+UINT64 RawAnimationClipBytes(const RawAnimationClip &Raw);
+UINT64 CompressedAnimationClipBytes(const CompressedAnimationClip &Clip);
+void SampleAnimationClip(const CompressedAnimationClip &Clip, float Time, AnimationPose &Pose);
+void BlendAnimationPoses(const AnimationPose &Pose0, const AnimationPose &Pose1, float Weight, int BoneCount, AnimationPose &Out);
+void ComputeSkinningMatrices(const Skeleton &Bones, const AnimationPose &Pose, CXMMATRIX World, XMFLOAT4X4 *Out);
+void BuildCharacterSkeleton(Skeleton &Bones);
+void BuildCharacterClip(int ClipIndex, const Skeleton &Bones, RawAnimationClip &Raw);
+void BuildCharacterMesh(std::vector<SkinnedVertex> &Vertices, std::vector<DWORD> &Indices);
+void UpdateCharacters(AnimatedCharacter *Characters, int Count, float DeltaTime, XMFLOAT4X4 *Skinning);
+bool InitCharacters();
+void ReleaseCharacters();
+void CharacterPass();
+int RunAnimationTest();
+
+//////////////////////////////////////////////////////////////
+
+// Frame memory. Scratch that only lives for a frame comes out of a linear arena that is reset at the start of the
+// frame instead of off the heap. There are two arenas used on alternate frames, so what one frame hands to the next
+// stays valid one frame longer. The arena is only used from the main thread.
+// The global operator new, in all its aligned and nothrow forms, counts allocations made on the main thread and the
+// job workers between BeginFrameAllocations and EndFrameAllocations, after warm-up a frame is expected to make none.
+// Debug builds count through the CRT allocation hook instead, which sees malloc, calloc, realloc and _aligned_malloc too.
+const size_t FRAME_ARENA_SIZE = 4 * 1024 * 1024;
+// Frames before the loop is expected to have reached its steady state
+const int FRAME_ALLOCATION_WARMUP = 300;
+
+struct FrameArena
+{
+	BYTE *Memory[2];
+	size_t Capacity;
+	size_t Used;
+	int Current;
+	// Most used by one frame, and requests that didn't fit
+	size_t HighWater;
+	int Overflows;
+};
+
+FrameArena Frame;
+// Set on the threads whose allocations count against the frame
+thread_local bool TrackFrameAllocations = false;
+std::atomic<bool> FrameAllocationsOpen(false);
+std::atomic<UINT64> FrameAllocationCount(0);
+
+int FramesSinceStart = 0;
+UINT64 AllocationsThisSecond = 0;
+int AllocatingFramesThisSecond = 0;
+
+void InitFrameArena(FrameArena &Arena, size_t Capacity);
+void ReleaseFrameArena(FrameArena &Arena);
+void BeginFrameArena(FrameArena &Arena);
+// NULL when the frame ran out of arena, the caller skips whatever needed it
+void *FrameAlloc(FrameArena &Arena, size_t Bytes, size_t Alignment);
+void BeginFrameAllocations();
+UINT64 EndFrameAllocations();
+int RunAllocationTest(int Frames);
+
+//////////////////////////////////////////////////////////////
+
+// Performance counters. Every frame's counters are published into a ring in a named shared memory section, so a
+// tool in another process can watch the frame without the frame ever waiting on it. Each slot is a seqlock: the
+// writer makes Sequence odd, writes the counters and makes it even again. A reader copies the slot and keeps the copy
+// only if Sequence was the same even number before and after. -counters runs such a reader and prints percentiles.
+// Zones are CPU times, Input, Update and Present and then one per frame graph pass.
+const char *const COUNTER_MAPPING_NAME = "Local\\RenderSandboxCounters";
+const UINT COUNTER_MAGIC = 0x31544E43; // "CNT1"
+const UINT COUNTER_VERSION = 1;
+const int COUNTER_RING_SIZE = 256;
+const int MAX_COUNTER_ZONES = 16;
+const int COUNTER_ZONE_NAME_LENGTH = 24;
+
+enum CounterZone
+{
+	COUNTER_ZONE_INPUT,
+	COUNTER_ZONE_UPDATE,
+	COUNTER_ZONE_PRESENT,
+	// Frame graph pass p is zone COUNTER_ZONE_PASSES + p
+	COUNTER_ZONE_PASSES,
+};
+
+struct FrameCounters
+{
+	UINT64 Frame;
+	float FrameMs;
+	float ZoneMs[MAX_COUNTER_ZONES];
+	UINT DrawCalls;
+	// Calls that set pipeline state
+	UINT StateBinds;
+	// UpdateSubresource and dynamic buffers written through Map
+	UINT64 UploadBytes;
+	// Video memory the process uses, what the frame graph's render targets take of it, and the streamed scene
+	UINT64 VideoMemoryBytes;
+	UINT64 RenderTargetBytes;
+	UINT64 StreamedBytes;
+};
+
+struct CounterSlot
+{
+	volatile LONG64 Sequence;
+	FrameCounters Counters;
+};
+
+// The layout of the shared memory section
+struct CounterRing
+{
+	// Written last, a reader that sees it can trust the rest of the header
+	volatile UINT Magic;
+	UINT Version;
+	UINT SlotCount;
+	UINT ZoneCount;
+	char ZoneNames[MAX_COUNTER_ZONES][COUNTER_ZONE_NAME_LENGTH];
+	// Frames published so far, frame n is in slot n % SlotCount
+	volatile LONG64 Published;
+	CounterSlot Slots[COUNTER_RING_SIZE];
+};
+
+HANDLE CounterMapping;
+CounterRing *SharedCounters;
+// Of the frame being built, on the main thread
+FrameCounters PerfCounters;
+LARGE_INTEGER PerfFrequency;
+IDXGIAdapter3 *CounterAdapter;
+
+bool InitPerfCounters();
+void ReleasePerfCounters();
+void SetCounterZoneName(int Zone, const char *Name);
+// Every pipeline state call goes through Bind, so the binds are counted where they are made. The immediate context
+// counts straight into PerfCounters, other contexts into Binds, which CountContextWork adds once they are executed.
+ID3D11DeviceContext *Bind();
+ID3D11DeviceContext *Bind(ID3D11DeviceContext *Context, UINT &Binds);
+// Draws and uploads are counted where they are made the same way. Unmap counts the Bytes written since MapDiscard.
+ID3D11DeviceContext *DrawCall();
+ID3D11DeviceContext *DrawCall(ID3D11DeviceContext *Context, UINT &Draws);
+void UploadSubresource(ID3D11Resource *Resource, const void *Data, UINT64 Bytes);
+void UploadSubresource(ID3D11DeviceContext *Context, ID3D11Resource *Resource, UINT Subresource, const void *Data, UINT RowPitch,
+	UINT64 Bytes, UINT64 &UploadBytes);
+// NULL if the resource couldn't be mapped
+void *MapDiscard(ID3D11Resource *Resource);
+void *MapDiscard(ID3D11DeviceContext *Context, ID3D11Resource *Resource);
+void Unmap(ID3D11Resource *Resource, UINT64 Bytes);
+void Unmap(ID3D11DeviceContext *Context, ID3D11Resource *Resource, UINT64 Bytes, UINT64 &UploadBytes);
+// Adds what another context counted once its work is executed
+void CountContextWork(UINT Draws, UINT Binds, UINT64 UploadBytes);
+float CounterMs(const LARGE_INTEGER &Start, const LARGE_INTEGER &End);
+void BeginFrameCounters();
+void PublishFrameCounters(const LARGE_INTEGER &FrameStart);
+int RunCounterReader(int Seconds);
+
+//////////////////////////////////////////////////////////////
+
+// Frame capture. A captured frame is copied into one of a ring of staging textures and only mapped, without ever
+// waiting, once the GPU is done with the copy a few frames later. The pixels go into one of a fixed set of CPU
+// buffers that a worker thread encodes, to numbered PNGs or appended to one raw file. When the ring or the buffers
+// are full the frame is dropped instead of stalling.
+// The backend hides where frames come from, so the scheduling also runs headlessly with -capturetest.
+const int CAPTURE_RING_SIZE = 3;
+const int CAPTURE_BUFFERS = 4;
+
+enum CaptureFormat
+{
+	CAPTURE_FORMAT_PNG,
+	CAPTURE_FORMAT_RAW,
+};
+
+// At the start of a raw capture file, every frame after it is a UINT64 frame number and Width * Height BGRA pixels
+struct RawCaptureHeader
+{
+	char Magic[4];
+	UINT Width;
+	UINT Height;
+	UINT Format;
+};
+
+struct CaptureBackend
+{
+	virtual ~CaptureBackend() {}
+
+	// Starts copying the current frame into staging slot Slot
+	virtual void Copy(int Slot, UINT64 Frame) = 0;
+	// Maps the slot if its copy has finished, never waits for it
+	virtual bool TryMap(int Slot, UINT64 Frame, const BYTE **Pixels, UINT *RowPitch) = 0;
+	virtual void Unmap(int Slot) = 0;
+
+	UINT Width;
+	UINT Height;
+};
+
+struct D3D11CaptureBackend : CaptureBackend
+{
+	D3D11CaptureBackend(ID3D11Device *Device, ID3D11DeviceContext *InContext, ID3D11Texture2D *InSource);
+	~D3D11CaptureBackend();
+
+	void Copy(int Slot, UINT64 Frame);
+	bool TryMap(int Slot, UINT64 Frame, const BYTE **Pixels, UINT *RowPitch);
+	void Unmap(int Slot);
+
+	ID3D11DeviceContext *Context;
+	ID3D11Texture2D *Source;
+	ID3D11Texture2D *Staging[CAPTURE_RING_SIZE];
+};
+
+// Copies become readable Latency frames after they were made, like on a GPU running that far behind
+struct NullCaptureBackend : CaptureBackend
+{
+	NullCaptureBackend(UINT InWidth, UINT InHeight, int InLatency);
+
+	void Copy(int Slot, UINT64 Frame);
+	bool TryMap(int Slot, UINT64 Frame, const BYTE **Pixels, UINT *RowPitch);
+	void Unmap(int Slot) {}
+
+	int Latency;
+	UINT64 CopiedFrame[CAPTURE_RING_SIZE];
+	std::vector<BYTE> Pixels[CAPTURE_RING_SIZE];
+};
+
+struct CaptureSlot
+{
+	bool Pending;
+	UINT64 Frame;
+};
+
+struct CaptureJob
+{
+	int Buffer;
+	UINT64 Frame;
+};
+
+struct CaptureStats
+{
+	int Requested;
+	int Captured;
+	int Dropped;
+	int Encoded;
+	// Spent on the main thread issuing copies and moving mapped pixels, and on the worker encoding
+	double MainThreadMs;
+	double EncodeMs;
+};
+
+struct FrameCapture
+{
+	CaptureBackend *Backend;
+	CaptureFormat Format;
+	char Prefix[MAX_PATH];
+	CaptureSlot Slots[CAPTURE_RING_SIZE];
+	int NextSlot;
+	BYTE *Buffers[CAPTURE_BUFFERS];
+	HANDLE RawFile;
+
+	std::thread Encoder;
+	std::mutex Lock;
+	std::condition_variable Wake;
+	std::condition_variable Done;
+	// Guarded by Lock. Jobs is a ring, a buffer is free when it isn't in it and isn't being encoded.
+	bool BufferFree[CAPTURE_BUFFERS];
+	CaptureJob Jobs[CAPTURE_BUFFERS];
+	int JobHead;
+	int JobCount;
+	bool Quit;
+
+	// Since the last ResetCaptureStats, EncodeMs and Encoded are guarded by Lock
+	CaptureStats Stats;
+};
+
+FrameCapture SceneCapture;
+// The ring, its staging textures and the encoder thread are only set up by the first capture asked for
+bool CaptureActive = false;
+// Set up failed, later requests are ignored
+bool CaptureFailed = false;
+// Capture every CaptureInterval-th frame, 0 captures only on F12
+int CaptureInterval = 0;
+CaptureFormat CaptureOutputFormat = CAPTURE_FORMAT_PNG;
+bool ScreenshotRequested = false;
+
+bool InitFrameCapture(FrameCapture &Capture, CaptureBackend *Backend, CaptureFormat Format, const char *Prefix);
+// Waits for the encoder to finish what it was given, frames still on the GPU are dropped
+void ReleaseFrameCapture(FrameCapture &Capture);
+// Once a frame, after the frame was rendered: picks up finished copies and starts a new one when Requested
+void UpdateFrameCapture(FrameCapture &Capture, UINT64 Frame, bool Requested);
+CaptureStats ResetCaptureStats(FrameCapture &Capture);
+// SceneCapture over the Backbuffer, called on the first request
+bool StartSceneCapture();
+int RunCaptureTest(int Frames, CaptureFormat Format);
+
+//////////////////////////////////////////////////////////////
+
+// Terrain. A CDLOD quadtree over a heightmap: every node is one TERRAIN_PAGE_QUADS grid drawn from a single page of
+// heights, and every level down halves the node size and the range it is used within. Vertices morph towards the
+// next coarser grid as they approach the end of their level's range, so there are no seams and no popping. Pages of
+// every level are cooked into one file that is mapped and read on a loader thread, only the pages the selection asked
+// for are resident in a Texture2DArray, and a node whose children aren't resident yet is drawn coarser meanwhile.
+//
+// Cooked terrain file layout:
+//	TerrainFileHeader
+//	TerrainFilePage[PageCount]          at PageTableOffset, finest level first, row major in Z within a level
+//	UINT16[TERRAIN_PAGE_TEXELS^2]       per page at TerrainFilePage::Offset, 0-65535 spans HeightScale
+const char TERRAIN_FILE_MAGIC[4] = { 'T', 'R', 'N', '1' };
+const UINT TERRAIN_FILE_VERSION = 2;
+const int TERRAIN_PAGE_QUADS = 64;
+// Neighboring pages share their edge samples
+const int TERRAIN_PAGE_SAMPLES = TERRAIN_PAGE_QUADS + 1;
+// Every page also holds a ring of its neighbors' samples, so the normals at its edges see across them. Clamped at the
+// edge of the terrain.
+const int TERRAIN_PAGE_BORDER = 1;
+const int TERRAIN_PAGE_TEXELS = TERRAIN_PAGE_SAMPLES + 2 * TERRAIN_PAGE_BORDER;
+const int TERRAIN_MAX_LODS = 8;
+const int TERRAIN_PAGE_SLOTS = 256;
+const int MAX_TERRAIN_NODES = 2048;
+// Pages copied into the array per frame, the rest wait for the next frame
+const int TERRAIN_UPLOADS_PER_FRAME = 16;
+// Of the finest level, doubled with every level up
+const float TERRAIN_DETAIL_RANGE = 60.0f;
+// Where in its range a level starts morphing into the next
+const float TERRAIN_MORPH_START = 0.7f;
+// Whole node and one index range per quadrant of the grid
+const int TERRAIN_DRAW_BUCKETS = 5;
+const int TERRAIN_WHOLE_NODE = 4;
+
+struct TerrainFileHeader
+{
+	char Magic[4];
+	UINT Version;
+	// Pages per side of the coarsest level, every finer level has twice as many
+	int RootPages;
+	int Levels;
+	float SampleSpacing;
+	float HeightScale;
+	float BaseHeight;
+	float OriginX;
+	float OriginZ;
+	UINT PageCount;
+	UINT64 PageTableOffset;
+};
+
+// The height range is in world units and bounds the node of the page in the selection
+struct TerrainFilePage
+{
+	UINT64 Offset;
+	float MinHeight;
+	float MaxHeight;
+};
+
+enum TerrainPageState
+{
+	PAGE_UNLOADED,
+	PAGE_LOADING,
+	PAGE_RESIDENT,
+};
+
+struct TerrainPage
+{
+	TerrainFilePage Info;
+	TerrainPageState State;
+	// Slice of the page array, assigned when the page is requested
+	int Slot;
+};
+
+struct TerrainSlot
+{
+	int Page;
+	UINT64 LastUsed;
+	// The coarsest level is always resident, so there is always something to draw
+	bool Pinned;
+};
+
+// Per instance data of the terrain draw
+struct TerrainInstance
+{
+	// x and y are the node's corner on the XZ plane, z its size, w its level
+	XMFLOAT4 Node;
+	UINT Slice;
+};
+
+struct TerrainStats
+{
+	int NodesDrawn;
+	int NodesCulled;
+	// Nodes drawn at their parent's detail because their pages weren't resident yet
+	int NodesCoarser;
+	UINT64 Triangles;
+	double SelectMs;
+	int PagesResident;
+	int PagesLoading;
+	int PagesUploaded;
+	UINT64 BytesStreamed;
+};
+
+struct TerrainStreamer
+{
+	HANDLE File;
+	HANDLE Mapping;
+	const BYTE *View;
+	UINT64 FileSize;
+	TerrainFileHeader Header;
+	int LevelFirstPage[TERRAIN_MAX_LODS];
+	int LevelPagesPerSide[TERRAIN_MAX_LODS];
+	float LodRanges[TERRAIN_MAX_LODS];
+	std::vector<TerrainPage> Pages;
+
+	TerrainSlot Slots[TERRAIN_PAGE_SLOTS];
+	// TERRAIN_PAGE_TEXELS^2 per slot, written by the loader thread while the slot's page is LOADING
+	UINT16 *SlotSamples;
+	// NULL when there is no device, pages then become resident without an upload
+	ID3D11DeviceContext *Context;
+	ID3D11Texture2D *PageArray;
+	UINT64 Frame;
+
+	// Selection of the last frame, the quadrant of every instance says which index range draws it
+	TerrainInstance Selected[MAX_TERRAIN_NODES];
+	BYTE SelectedBucket[MAX_TERRAIN_NODES];
+	int SelectedCount;
+	XMVECTOR FrustumPlanes[6];
+	XMFLOAT3 Camera;
+	bool FrustumCulling;
+	TerrainStats Stats;
+
+	// Scratch, kept around so the per frame update doesn't allocate
+	std::vector<std::pair<float, int> > Candidates;
+	std::vector<int> Finished;
+	std::vector<int> Uploads;
+
+	std::thread Loader;
+	std::mutex Lock;
+	std::condition_variable Wake;
+	// Guarded by Lock. Requests is a ring with room for every page, a page is requested at most once while it loads.
+	std::vector<int> Requests;
+	int RequestHead;
+	int RequestCount;
+	std::vector<int> Completed;
+	bool Quit;
+};
+
+struct cbTerrain
+{
+	// x start and y 1 / (end - start) of the morph of every level
+	XMFLOAT4 MorphConstants[TERRAIN_MAX_LODS];
+	// w is the height scale
+	XMFLOAT4 CameraPositionScale;
+	// x base height, y samples per page side, z the page's texel size
+	XMFLOAT4 TerrainParams;
+	XMFLOAT4 SunDirection;
+};
+
+D3D11_INPUT_ELEMENT_DESC TerrainLayout[] =
+{
+	{ "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "NODE", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 0, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+	{ "SLICE", 0, DXGI_FORMAT_R32_UINT, 1, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+};
+
+TerrainStreamer Terrain;
+bool TerrainLoaded = false;
+// T toggles the terrain
+bool TerrainEnabled = true;
+char TerrainPath[MAX_PATH] = "Terrain.bin";
+ID3D11Buffer *TerrainGridVertexBuffer;
+ID3D11Buffer *TerrainGridIndexBuffer;
+ID3D11Buffer *TerrainInstanceBuffer;
+ID3D11Buffer *cbTerrainBuffer;
+ID3D11Texture2D *TerrainPageArray;
+ID3D11ShaderResourceView *TerrainPageArrayView;
+ID3D11SamplerState *TerrainSamplerState;
+ID3D11VertexShader *TerrainVS;
+ID3D11PixelShader *TerrainPS;
+ID3D10Blob *TerrainVSBuffer;
+ID3D10Blob *TerrainPSBuffer;
+ID3D11InputLayout *TerrainVertexLayout;
+
+double TerrainSelectMsThisSecond = 0.0;
+UINT64 TerrainTrianglesThisSecond = 0;
+int TerrainNodesThisSecond = 0;
+int TerrainFramesThisSecond = 0;
+
+bool OpenTerrainStream(TerrainStreamer &Streamer, const char *Path, ID3D11DeviceContext *Context, ID3D11Texture2D *PageArray);
+void CloseTerrainStream(TerrainStreamer &Streamer);
+// Picks the nodes to draw around the camera, then uploads finished pages and requests the ones the selection missed
+void UpdateTerrain(TerrainStreamer &Streamer, FXMVECTOR Camera, CXMMATRIX ViewProjection);
+bool CookTestTerrain(const char *Path, int RootPages, int Levels, float SampleSpacing, float HeightScale);
+bool InitTerrain();
+void ReleaseTerrain();
+void TerrainPass();
+int RunTerrainTest(int Frames);
+
+//////////////////////////////////////////////////////////////
+
+// Meshlets. Big meshes are cut at cook time into clusters of at most MESHLET_MAX_VERTICES vertices and
+// MESHLET_MAX_TRIANGLES triangles, grown over shared vertices so each one stays compact, and every cluster gets a
+// bounding sphere and a cone around its triangles' normals. Every frame UpdateScene culls the clusters against the
+// frustum and their cone on the job threads, 8 per AVX2 instruction, and only the triangles of the survivors are
+// written into one compacted index stream that MeshletPass later draws. A mesh that is mostly off screen or facing
+// away then only costs what can be seen.
+//
+// Cooked mesh file layout:
+//	MeshletFileHeader
+//	Vertex[VertexCount]
+//	Meshlet[MeshletCount]
+//	MeshletBounds[MeshletCount]
+//	UINT[MeshletVertexCount]            mesh vertex of every meshlet vertex, each meshlet's run at its VertexOffset
+//	BYTE[MeshletTriangleCount * 3]      meshlet vertex of every corner, each meshlet's run at its TriangleOffset * 3
+//	XMFLOAT2[MeshletVertexCount]        lightmap UV of every meshlet vertex, only once -bakelight unwrapped the mesh
+const char MESHLET_FILE_MAGIC[4] = { 'M', 'S', 'H', '1' };
+const UINT MESHLET_FILE_VERSION = 2;
+const int MESHLET_MAX_VERTICES = 64;
+const int MESHLET_MAX_TRIANGLES = 124;
+// Meshlets per culling job, a multiple of 8 so the vector loads stay aligned
+const int MESHLET_CULL_CHUNK = 256;
+
+struct MeshletFileHeader
+{
+	char Magic[4];
+	UINT Version;
+	UINT VertexCount;
+	UINT MeshletCount;
+	UINT MeshletVertexCount;
+	UINT MeshletTriangleCount;
+	// Texels along a side of the lightmap the UVs were laid out for, 0 when there are none
+	UINT LightmapSize;
+	UINT Pad;
+};
+
+struct Meshlet
+{
+	UINT VertexOffset;
+	UINT TriangleOffset;
+	UINT VertexCount;
+	UINT TriangleCount;
+};
+
+// Every triangle of the meshlet faces away from a camera that sees the sphere's center within the cone around
+// -ConeAxis, ConeCutoff is the sine of the widest angle between the axis and a triangle's normal. A cone wider than
+// 90 degrees has a cutoff of 1 and is never culled.
+struct MeshletBounds
+{
+	XMFLOAT3 Center;
+	float Radius;
+	XMFLOAT3 ConeAxis;
+	float ConeCutoff;
+};
+
+// What one culling job found in its chunk of meshlets
+struct MeshletCullChunk
+{
+	int VisibleCount;
+	UINT IndexCount;
+	UINT IndexOffset;
+	UINT FrustumCulledTriangles;
+	UINT BackfaceCulledTriangles;
+};
+
+struct MeshletCullStats
+{
+	int Meshlets;
+	int VisibleMeshlets;
+	UINT64 Triangles;
+	UINT64 FrustumCulledTriangles;
+	UINT64 BackfaceCulledTriangles;
+	double CullMs;
+};
+
+struct ClusterMesh
+{
+	std::vector<Vertex> Vertices;
+	std::vector<Meshlet> Meshlets;
+	std::vector<MeshletBounds> Bounds;
+	std::vector<UINT> MeshletVertices;
+	std::vector<BYTE> MeshletTriangles;
+	UINT TriangleCount;
+	// Once unwrapped every meshlet is a chart of the lightmap, so a vertex gets a UV per meshlet it is in. The mesh is
+	// then drawn from the meshlet vertices, and the culling writes indices into them instead of the mesh's vertices.
+	std::vector<XMFLOAT2> LightmapUVs;
+	UINT LightmapSize;
+
+	// The bounds again, one 32 byte aligned stream per component for the culling
+	float *CenterX;
+	float *CenterY;
+	float *CenterZ;
+	float *Radius;
+	float *ConeX;
+	float *ConeY;
+	float *ConeZ;
+	float *ConeCutoff;
+	// Written by the culling, the visible meshlets of every chunk start at the chunk's first meshlet
+	std::vector<int> Visible;
+	std::vector<MeshletCullChunk> Chunks;
+};
+
+ClusterMesh BigMesh;
+bool MeshletsLoaded = false;
+// C toggles the cluster culling, without it every triangle of the mesh is drawn
+bool ClusterCulling = true;
+char MeshPath[MAX_PATH] = "Mesh.bin";
+XMMATRIX BigMeshWorld;
+ID3D11Buffer *BigMeshVertexBuffer;
+ID3D11Buffer *BigMeshLightmapUVBuffer;
+// Rewritten every frame with the triangles of the visible meshlets
+ID3D11Buffer *BigMeshIndexBuffer;
+// Of the frame's culling, what MeshletPass draws
+UINT BigMeshIndexCount = 0;
+
+int MeshletFramesThisSecond = 0;
+double MeshletCullMsThisSecond = 0.0;
+UINT64 MeshletTrianglesThisSecond = 0;
+UINT64 MeshletFrustumCulledThisSecond = 0;
+UINT64 MeshletBackfaceCulledThisSecond = 0;
+
+void BuildMeshlets(const std::vector<Vertex> &Vertices, const std::vector<DWORD> &Indices, ClusterMesh &Mesh);
+bool WriteClusterMesh(const char *Path, const ClusterMesh &Mesh);
+bool LoadClusterMesh(const char *Path, ClusterMesh &Mesh);
+// Builds the culling streams out of Bounds, once after the meshlets are built or loaded
+void PrepareMeshletCulling(ClusterMesh &Mesh);
+void ReleaseClusterMesh(ClusterMesh &Mesh);
+// Culls in the mesh's own space and writes the visible triangles to Indices, returns how many indices were written
+UINT CullMeshlets(ClusterMesh &Mesh, CXMMATRIX WorldViewProjection, FXMVECTOR MeshCamera, bool Cull, DWORD *Indices, MeshletCullStats &Stats);
+void BuildMeshletTestMesh(std::vector<Vertex> &Vertices, std::vector<DWORD> &Indices);
+bool CookMeshletMesh(const char *Path);
+// Where the mesh stands, the baker lights it there
+XMMATRIX ClusterMeshWorld();
+bool InitMeshlets();
+void ReleaseMeshlets();
+// Called by UpdateScene once the camera moved, culls BigMesh on the job threads into BigMeshIndexBuffer
+void CullBigMesh();
+void MeshletPass();
+int RunMeshletTest();
+
+//////////////////////////////////////////////////////////////
+
+// Light baking. -bakelight path traces the light that never moves into Lightmap.dds for the cluster mesh and into SH
+// probes in Probes.dds for everything else, on every job thread. That is the sun the terrain is lit by and a sky as
+// bright as the flat ambient term, bounced off the mesh and the cooked scene's cubes around it. The mesh's own UVs
+// tile, so it is unwrapped into planar charts, one per meshlet, packed in rows. Rays run through a 4 wide BVH, 4 boxes
+// or 4 triangles per SSE instruction. At runtime the mesh samples its lightmap in place of the ambient term and every
+// other lit shader reads its ambient from the probes (SHADER_FEATURE_BAKED). The point light moves and stays dynamic.
+const int LIGHTMAP_SIZE = 1024;
+// Texels around every chart, so the filter never reaches into the next one
+const int LIGHTMAP_CHART_PADDING = 2;
+// Paths per lightmap texel and rays per probe
+const int BAKE_SAMPLES = 64;
+const int PROBE_SAMPLES = 1024;
+// Surfaces a path bounces off before it stops
+const int BAKE_BOUNCES = 3;
+// Nothing has a baked albedo yet, so every surface reflects this much
+const float BAKE_ALBEDO = 0.5f;
+// Rays leave surfaces this far out so they don't hit where they started
+const float BAKE_RAY_OFFSET = 0.002f;
+const float PROBE_SPACING = 2.0f;
+const float PROBE_MARGIN = 4.0f;
+// How far out of the probe volume the probes fade to the flat ambient, and past which nothing samples them
+const float PROBE_FADE_DISTANCE = 4.0f;
+// Cubes further than this out of the probe volume are left out of the bake
+const float BAKE_SCENE_MARGIN = 16.0f;
+// A probe seeing more back faces than this is buried in geometry and takes its neighbors' light instead
+const float PROBE_BURIED_FRACTION = 0.1f;
+const int SH_COEFFICIENTS = 9;
+const int BVH_LEAF_TRIANGLES = 4;
+// A level of the BVH pushes at most three more children than it pops, so a BVH of depth levels needs 3 * depth + 1.
+// BuildBakeScene refuses a deeper one.
+const int BVH_STACK_SIZE = 128;
+const XMFLOAT3 SUN_DIRECTION(0.4f, 0.8f, 0.3f);
+const XMFLOAT3 SUN_COLOR(0.75f, 0.7f, 0.6f);
+const XMFLOAT3 SKY_COLOR(0.3f, 0.3f, 0.3f);
+
+// Four children's boxes, a row per bound: MinX, MinY, MinZ, MaxX, MaxY, MaxZ. A child is a node's index, or the
+// complement of a packet's for a leaf. Unused children have inverted boxes no ray gets through.
+struct BvhNode
+{
+	float Bounds[6][4];
+	int Children[4];
+};
+
+// Up to BVH_LEAF_TRIANGLES triangles as a corner and two edges, a row per component. Unused lanes have zero edges and
+// are never hit.
+struct BvhPacket
+{
+	float Corner[3][4];
+	float Edge1[3][4];
+	float Edge2[3][4];
+	int Triangles[4];
+};
+
+struct BakeScene
+{
+	// World space, three per triangle
+	std::vector<XMFLOAT3> Positions;
+	// Geometric, per triangle
+	std::vector<XMFLOAT3> Normals;
+	std::vector<BvhNode> Nodes;
+	std::vector<BvhPacket> Packets;
+	// Levels of nodes above the leaves
+	int BvhDepth;
+	XMFLOAT3 SunDirection;
+	int MeshTriangles;
+	int CubeCount;
+};
+
+struct BakeHit
+{
+	int Triangle;
+	float Distance;
+};
+
+// A lightmap texel the unwrap covers and the point of the mesh at its center
+struct LightmapTexel
+{
+	int X;
+	int Y;
+	XMFLOAT3 Position;
+	XMFLOAT3 Normal;
+	XMFLOAT3 FaceNormal;
+};
+
+// A grid of probes around the mesh, derived from it so the bake and the runtime agree without storing it
+struct ProbeVolume
+{
+	XMFLOAT3 Origin;
+	float Spacing;
+	int CountX;
+	int CountY;
+	int CountZ;
+};
+
+struct BakeStats
+{
+	UINT64 Rays;
+	double Seconds;
+	int BuriedProbes;
+};
+
+struct cbBakedLight
+{
+	// w is 1 / the spacing between probes
+	XMFLOAT4 ProbeOrigin;
+	// w is 1 / PROBE_FADE_DISTANCE
+	XMFLOAT4 ProbeCounts;
+};
+
+D3D11_INPUT_ELEMENT_DESC LightmappedLayout[] =
+{
+	{ "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "NORMAL", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+	{ "TEXCOORD", 1, DXGI_FORMAT_R32G32_FLOAT, 1, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+};
+
+bool LightmapLoaded = false;
+bool ProbesLoaded = false;
+ProbeVolume BakedProbeVolume;
+ID3D11ShaderResourceView *LightmapView;
+ID3D11ShaderResourceView *ProbeVolumeView;
+ID3D11SamplerState *BakedSamplerState;
+ID3D11Buffer *cbBakedLightBuffer;
+ID3D11VertexShader *LightmappedVS;
+ID3D11PixelShader *LightmappedPS;
+ID3D10Blob *LightmappedVSBuffer;
+ID3D10Blob *LightmappedPSBuffer;
+ID3D11InputLayout *LightmappedVertexLayout;
+
+// Lays every meshlet out as a chart of a Size x Size lightmap and fills in the mesh's LightmapUVs
+bool UnwrapLightmap(ClusterMesh &Mesh, int Size);
+void ComputeProbeVolume(const ClusterMesh &Mesh, CXMMATRIX World, ProbeVolume &Volume);
+// The mesh, and the cubes of the cooked scene at ScenePath around the probe volume when there is one. False if the
+// BVH came out too deep for TraceBakeRay's stack.
+bool BuildBakeScene(const ClusterMesh &Mesh, CXMMATRIX World, const ProbeVolume &Volume, const char *ScenePath, BakeScene &Scene);
+bool TraceBakeRay(const BakeScene &Scene, const XMFLOAT3 &Origin, const XMFLOAT3 &Direction, float MaxDistance, bool AnyHit, BakeHit &Hit);
+void RasterizeLightmap(const ClusterMesh &Mesh, CXMMATRIX World, std::vector<LightmapTexel> &Texels);
+// Threads caps how many threads take part, for the scaling report. Every texel and probe seeds its own random numbers,
+// so the result doesn't depend on it.
+BakeStats BakeLightmap(const BakeScene &Scene, const std::vector<LightmapTexel> &Texels, int Size, int Samples, int Threads,
+	std::vector<XMFLOAT4> &Lightmap);
+// SH_COEFFICIENTS colors per probe, x fastest then y then z, already convolved with the cosine lobe
+BakeStats BakeProbes(const BakeScene &Scene, const ProbeVolume &Volume, int Samples, int Threads, std::vector<XMFLOAT3> &Coefficients);
+void DilateLightmap(std::vector<XMFLOAT4> &Lightmap, int Size);
+bool WriteLightmap(const char *Path, const std::vector<XMFLOAT4> &Lightmap, int Size);
+bool WriteProbeVolume(const char *Path, const ProbeVolume &Volume, const std::vector<XMFLOAT3> &Coefficients);
+int RunLightBake(int Samples);
+int RunBakeTest();
+bool InitBakedLight();
+void ReleaseBakedLight();
+// Whether a sphere comes within PROBE_FADE_DISTANCE of the loaded probes
+bool OverlapsProbeVolume(FXMVECTOR Center, float Radius);
+// Binds the probes and the lightmap for the frame, every lit shader may read them
+void BindBakedLight();
+
+//////////////////////////////////////////////////////////////
+
+// Startup. Everything up to the scene systems runs as a graph of tasks on the job threads, a task starts once the ones
+// it depends on are done. The shader compiles, reading and decoding the cube's texture and the text factories overlap
+// each other and the device creation, and whatever needs the device waits on that alone. The window's thread stays
+// blocked meanwhile, so what may send the window messages runs on it around the graph: the window before, the swap
+// chain and DirectInput's cooperative levels after. The scene systems come last, on the main thread too, they bind
+// state on the immediate context and split their own work with ParallelFor, which doesn't nest.
+const int STARTUP_MAX_TASKS = 32;
+const int STARTUP_MAX_DEPENDENCIES = 4;
+// Columns of the timeline's bars
+const int STARTUP_TIMELINE_WIDTH = 48;
+// Where a windowed run leaves the timeline, it has no console unless -console or -startupreport opens one
+const char *STARTUP_LOG_PATH = "Startup.log";
+
+typedef bool (*StartupFunction)(void *Data);
+
+struct StartupTask
+{
+	const char *Name;
+	StartupFunction Function;
+	void *Data;
+	int Dependencies[STARTUP_MAX_DEPENDENCIES];
+	int DependencyCount;
+
+	// Guarded by the graph's Lock
+	bool Started;
+	bool Done;
+	// The loop that ran it, -1 for the steps on the main thread outside of the graph
+	int Thread;
+	LARGE_INTEGER Start;
+	LARGE_INTEGER End;
+};
+
+struct StartupGraph
+{
+	StartupTask Tasks[STARTUP_MAX_TASKS];
+	int TaskCount;
+	std::mutex Lock;
+	std::condition_variable Ready;
+	// The first task that failed, -1 while none did
+	int FailedTask;
+	int Threads;
+	LARGE_INTEGER Begin;
+	LARGE_INTEGER End;
+};
+
+// What the tasks hand over to the ones depending on them
+struct SceneStartup
+{
+	IDXGIFactory1 *Factory;
+	IDXGIAdapter1 *Adapter;
+	ID2D1Factory *D2DFactory;
+	// test.dds as it is on disk, or test.png decoded when there is no test.dds
+	std::vector<BYTE> CubeTextureDDS;
+	CookImage CubeTextureImage;
+};
+
+struct StartupShaderCompile
+{
+	const char *Name;
+	const char *Entry;
+	const char *Target;
+	ID3D10Blob **Blob;
+};
+
+// From the top of WinMain, the timeline and the time to the first frame are measured against it
+LARGE_INTEGER StartupBegin;
+StartupGraph Startup;
+SceneStartup SceneStartupData;
+// Set by the headless modes that draw, CreateD3DDevice then takes the WARP adapter instead of the first one
+bool UseWarpAdapter = false;
+
+void ResetStartupGraph(StartupGraph &Graph);
+// Returns the task's index for AddStartupDependency
+int AddStartupTask(StartupGraph &Graph, const char *Name, StartupFunction Function, void *Data);
+// Only on a task added before, so the graph can't have a cycle
+void AddStartupDependency(StartupGraph &Graph, int Task, int DependsOn);
+// A step that ran on the main thread outside the graph, so it shows up in the timeline
+void RecordStartupStep(StartupGraph &Graph, const char *Name, LARGE_INTEGER Start, LARGE_INTEGER End);
+// Threads caps how many job threads take part. After a task fails no other one starts and it returns false.
+bool RunStartupGraph(StartupGraph &Graph, int Threads);
+// Every task as a bar between Origin and End, in milliseconds since Origin. Title says what End is.
+void PrintStartupTimeline(FILE *Stream, const StartupGraph &Graph, LARGE_INTEGER Origin, LARGE_INTEGER End, const char *Title);
+// The timeline of Startup from StartupBegin to End, on stdout and into STARTUP_LOG_PATH
+void ReportStartup(LARGE_INTEGER End, const char *Title);
+// The device, the text, the shaders, buffers and texture of the cube, the upscale pass and the shader permutations
+void BuildSceneStartup(StartupGraph &Graph, SceneStartup &State);
+// Creates the device on the first adapter, and leaves the factory and the adapter in State for the swap chain and D2D
+bool CreateD3DDevice(SceneStartup &State);
+// Creates the swap chain and the back buffer's view once the device is there
+bool InitializeD3D(SceneStartup &State);
+// The scene as WinMain starts it, on the WARP adapter in a hidden window, so the headless modes can drive the real passes
+bool InitHeadlessScene();
+// Runs the tasks that don't need the device once on the calling thread and once on every job thread, then the whole
+// scene graph on the WARP adapter
+int RunStartupTest();
+
+//////////////////////////////////////////////////////////////
+
+
+int WINAPI WinMain(HINSTANCE Instance, HINSTANCE PrevInstance, LPSTR CommandLine, int ShowCmd)
+{
+	QueryPerformanceCounter(&StartupBegin);
+
+	// Leave the main thread its own core
+	InitJobSystem((int)std::thread::hardware_concurrency() - 1);
+
+	char OptionValue[MAX_PATH];
+	if (GetCommandLineOption(CommandLine, "-benchmark", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunBenchmarks(OptionValue[0] ? OptionValue : "benchmark.json");
+	}
+
+	if (GetCommandLineOption(CommandLine, "-cookscene", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return CookTestScene(OptionValue[0] ? OptionValue : ScenePath, 64, 32, 16.0f) ? 0 : 1;
+	}
+
+	if (GetCommandLineOption(CommandLine, "-drstest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunResolutionTest();
+	}
+
+	if (GetCommandLineOption(CommandLine, "-rendergraphtest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunRenderGraphTest();
+	}
+
+	if (GetCommandLineOption(CommandLine, "-occlusiontest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunOcclusionTest(OptionValue[0] ? OptionValue : "occlusion.pgm");
+	}
+
+	if (GetCommandLineOption(CommandLine, "-batchtest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunBatchingTest();
+	}
+
+	if (GetCommandLineOption(CommandLine, "-cooktextures", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunTextureCook(OptionValue[0] ? OptionValue : "test.dds");
+	}
+
+	if (GetCommandLineOption(CommandLine, "-buildshaders", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return BuildShaderArchive(OptionValue[0] ? OptionValue : "Shaders.bin");
+	}
+
+	if (GetCommandLineOption(CommandLine, "-particletest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunParticleTest(OptionValue[0] ? atoi(OptionValue) : 300);
+	}
+
+	if (GetCommandLineOption(CommandLine, "-animtest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunAnimationTest();
+	}
+
+	if (GetCommandLineOption(CommandLine, "-counters", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunCounterReader(OptionValue[0] ? atoi(OptionValue) : 0);
+	}
+
+	if (GetCommandLineOption(CommandLine, "-captureformat", OptionValue, MAX_PATH) && !strcmp(OptionValue, "raw"))
+		CaptureOutputFormat = CAPTURE_FORMAT_RAW;
+
+	if (GetCommandLineOption(CommandLine, "-capturetest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunCaptureTest(OptionValue[0] ? atoi(OptionValue) : 120, CaptureOutputFormat);
+	}
+
+	if (GetCommandLineOption(CommandLine, "-capture", OptionValue, MAX_PATH))
+		CaptureInterval = OptionValue[0] ? max(atoi(OptionValue), 1) : 1;
+
+	if (GetCommandLineOption(CommandLine, "-alloctest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunAllocationTest(OptionValue[0] ? atoi(OptionValue) : 600);
+	}
+
+	if (GetCommandLineOption(CommandLine, "-scene", OptionValue, MAX_PATH) && OptionValue[0])
+		strcpy_s(ScenePath, OptionValue);
+
+	if (GetCommandLineOption(CommandLine, "-terrain", OptionValue, MAX_PATH) && OptionValue[0])
+		strcpy_s(TerrainPath, OptionValue);
+
+	if (GetCommandLineOption(CommandLine, "-cookterrain", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return CookTestTerrain(OptionValue[0] ? OptionValue : TerrainPath, 2, 5, 0.5f, 120.0f) ? 0 : 1;
+	}
+
+	if (GetCommandLineOption(CommandLine, "-terraintest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunTerrainTest(OptionValue[0] ? atoi(OptionValue) : 600);
+	}
+
+	if (GetCommandLineOption(CommandLine, "-mesh", OptionValue, MAX_PATH) && OptionValue[0])
+		strcpy_s(MeshPath, OptionValue);
+
+	if (GetCommandLineOption(CommandLine, "-cookmesh", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return CookMeshletMesh(OptionValue[0] ? OptionValue : MeshPath) ? 0 : 1;
+	}
+
+	if (GetCommandLineOption(CommandLine, "-meshlettest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunMeshletTest();
+	}
+
+	if (GetCommandLineOption(CommandLine, "-bakelight", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunLightBake(OptionValue[0] ? max(atoi(OptionValue), 1) : BAKE_SAMPLES);
+	}
+
+	if (GetCommandLineOption(CommandLine, "-baketest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunBakeTest();
+	}
+
+	if (GetCommandLineOption(CommandLine, "-startuptest", OptionValue, MAX_PATH))
+	{
+		AttachParentConsole();
+		return RunStartupTest();
+	}
+
+	if (GetCommandLineOption(CommandLine, "-console", OptionValue, MAX_PATH) ||
+		GetCommandLineOption(CommandLine, "-startupreport", OptionValue, MAX_PATH))
+		OpenStatsConsole();
+
+	ResetStartupGraph(Startup);
+	LARGE_INTEGER StepStart, StepEnd;
+
+	QueryPerformanceCounter(&StepStart);
+	if(!InitializeWindow(Instance, ShowCmd, Width, Height, true))
+	{
+		MessageBox(0, "Error Initializing Window.", "Error", MB_OK | MB_ICONERROR);
+		return 0;
+	}
+	QueryPerformanceCounter(&StepEnd);
+	RecordStartupStep(Startup, "Window", StepStart, StepEnd);
+
+	BuildSceneStartup(Startup, SceneStartupData);
+	if (!RunStartupGraph(Startup, JobThreadCount()))
+	{
+		ReportStartup(Startup.End, "until a task failed");
+		char Message[128];
+		sprintf_s(Message, "Error Initializing %s.", Startup.Tasks[Startup.FailedTask].Name);
+		MessageBox(0, Message, "Error", MB_OK | MB_ICONERROR);
+		return 0;
+	}
+
+	QueryPerformanceCounter(&StepStart);
+	if(!InitializeD3D(SceneStartupData))
+	{
+		MessageBox(0, "Error Initializing D3D.", "Error", MB_OK | MB_ICONERROR);
+		return 0;
+	}
+	QueryPerformanceCounter(&StepEnd);
+	RecordStartupStep(Startup, "Swap chain", StepStart, StepEnd);
+
+	QueryPerformanceCounter(&StepStart);
+	if (!InitDirectInput(Instance))
+	{
+		MessageBox(0, "Error Initializing Direct Input.", "Error", MB_OK | MB_ICONERROR);
+		return 0;
+	}
+	QueryPerformanceCounter(&StepEnd);
+	RecordStartupStep(Startup, "Direct Input", StepStart, StepEnd);
+
+	QueryPerformanceCounter(&StepStart);
+	if(!InitScene())
+	{
+		MessageBox(0, "Error Initializing Scene.", "Error", MB_OK | MB_ICONERROR);
+		return 0;
+	}
+	QueryPerformanceCounter(&StepEnd);
+	RecordStartupStep(Startup, "Scene systems", StepStart, StepEnd);
+
+	MessageLoop();
+
+	CloseSceneStream(WorldStreamer);
+	ReleaseObjects();
+	ShutdownJobSystem();
+
+	return 0;
+}
+
+bool InitializeWindow(HINSTANCE Instance, int CmdShow, int Width, int Height, bool Windowed)
+{
+	WNDCLASSEX WindowClass = {};
+	WindowClass.cbSize = sizeof(WNDCLASSEX);
+	WindowClass.style = CS_HREDRAW | CS_VREDRAW;
+	WindowClass.lpfnWndProc = WindowProcedure;
+	WindowClass.hInstance = Instance;
+	WindowClass.hIcon = LoadIcon(NULL, IDI_APPLICATION);
+	WindowClass.hCursor = LoadCursor(NULL, IDC_ARROW);
+	WindowClass.hbrBackground = (HBRUSH)(COLOR_WINDOW + 2);
+	WindowClass.lpszClassName = WindowClassName;
+	WindowClass.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
+	if(!RegisterClassEx(&WindowClass))
+	{
+		MessageBox(0, "Error Registering Window Class.", "Error", MB_OK | MB_ICONERROR);
+		return false;
+	}
+
+	WindowHandle = CreateWindowEx(0,
+		WindowClassName,
+		"Window Title",
+		WS_OVERLAPPEDWINDOW,
+		CW_USEDEFAULT, CW_USEDEFAULT,
+		Width, Height,
+		0, 0, Instance, 0);
+
+	if(!WindowHandle)
+	{
+		MessageBox(0, "Error Creating Window.", "Error", MB_OK | MB_ICONERROR);
+		return false;
+	}
+
+	ShowWindow(WindowHandle, CmdShow);
+	UpdateWindow(WindowHandle);
+
+	return true;
+}
+
+int MessageLoop()
+{
+	MSG Message = {};
+	while(true)
+	{
+		if(PeekMessage(&Message, 0, 0, 0, PM_REMOVE))
+		{
+			if (Message.message == WM_QUIT) break;
+			TranslateMessage(&Message);
+			DispatchMessage(&Message);
+		}
+		else
+		{
+			FrameCount++;
+			if(GetTime() > 1.0f)
+			{
+				FPS = FrameCount;
+				FrameCount = 0;
+
+				if (RecordDrawsThisSecond > 0)
+				{
+					printf("Recording: %d draws/sec on %d thread(s), %.0f draws/sec of recording time\n",
+						RecordDrawsThisSecond, RecordThreads, RecordDrawsThisSecond / RecordSecondsThisSecond);
+					RecordDrawsThisSecond = 0;
+					RecordSecondsThisSecond = 0.0;
+				}
+
+				if (BatchedObjectsThisSecond > 0)
+				{
+					printf("Batching: %d objects in %d instanced draws this second, %.1fx fewer draw calls\n",
+						BatchedObjectsThisSecond, BatchedDrawsThisSecond, (double)BatchedObjectsThisSecond / BatchedDrawsThisSecond);
+					BatchedObjectsThisSecond = 0;
+					BatchedDrawsThisSecond = 0;
+				}
+
+				if (ParticleFramesThisSecond > 0)
+				{
+					printf("Particles: %d alive, %.2f ms simulate, %.2f ms upload\n", Particles.Pool.Count,
+						ParticleSimulateMsThisSecond / ParticleFramesThisSecond, ParticleUploadMsThisSecond / ParticleFramesThisSecond);
+					ParticleSimulateMsThisSecond = 0.0;
+					ParticleUploadMsThisSecond = 0.0;
+					ParticleFramesThisSecond = 0;
+				}
+
+				if (CharacterFramesThisSecond > 0)
+				{
+					double UpdateMs = CharacterUpdateMsThisSecond / CharacterFramesThisSecond;
+					printf("Animation: %d characters, %.3f ms update, %.1f characters/ms\n", (int)Characters.size(), UpdateMs,
+						Characters.size() / max(UpdateMs, 1e-6));
+					CharacterUpdateMsThisSecond = 0.0;
+					CharacterFramesThisSecond = 0;
+				}
+
+				if (TerrainFramesThisSecond > 0)
+				{
+					const TerrainStats &Stats = Terrain.Stats;
+					printf("Terrain: %.1f nodes, %.2f M triangles, %.3f ms selection per frame, %d pages resident, %d loading, "
+						"%d nodes drawn coarser\n", (double)TerrainNodesThisSecond / TerrainFramesThisSecond,
+						TerrainTrianglesThisSecond / 1e6 / TerrainFramesThisSecond, TerrainSelectMsThisSecond / TerrainFramesThisSecond,
+						Stats.PagesResident, Stats.PagesLoading, Stats.NodesCoarser);
+					TerrainSelectMsThisSecond = 0.0;
+					TerrainTrianglesThisSecond = 0;
+					TerrainNodesThisSecond = 0;
+					TerrainFramesThisSecond = 0;
+				}
+
+				if (MeshletFramesThisSecond > 0)
+				{
+					double Triangles = (double)max(MeshletTrianglesThisSecond, (UINT64)1);
+					printf("Clusters: %.1f%% of the triangles rejected, %.1f%% outside the frustum, %.1f%% facing away, %.3f ms culling per frame%s\n",
+						100.0 * (MeshletFrustumCulledThisSecond + MeshletBackfaceCulledThisSecond) / Triangles,
+						100.0 * MeshletFrustumCulledThisSecond / Triangles, 100.0 * MeshletBackfaceCulledThisSecond / Triangles,
+						MeshletCullMsThisSecond / MeshletFramesThisSecond, ClusterCulling ? "" : " (off)");
+					MeshletCullMsThisSecond = 0.0;
+					MeshletTrianglesThisSecond = 0;
+					MeshletFrustumCulledThisSecond = 0;
+					MeshletBackfaceCulledThisSecond = 0;
+					MeshletFramesThisSecond = 0;
+				}
+
+				if (CaptureActive)
+				{
+					CaptureStats Stats = ResetCaptureStats(SceneCapture);
+					if (Stats.Requested > 0 || Stats.Encoded > 0)
+					{
+						printf("Capture: %d requested, %d captured, %d dropped, %d written, %.3f ms per frame on the main thread, "
+							"%.1f ms per frame encoding\n", Stats.Requested, Stats.Captured, Stats.Dropped, Stats.Encoded,
+							Stats.MainThreadMs / max(FPS, 1), Stats.EncodeMs / max(Stats.Encoded, 1));
+					}
+				}
+
+				if (AllocatingFramesThisSecond > 0)
+				{
+					printf("Allocations: %llu heap allocations in %d frames this second, %.1f KB of frame arena at most\n",
+						AllocationsThisSecond, AllocatingFramesThisSecond, Frame.HighWater / 1024.0);
+					AllocationsThisSecond = 0;
+					AllocatingFramesThisSecond = 0;
+				}
+
+				if (WorldStreaming && OcclusionCulling)
+				{
+					const OcclusionStats &Stats = SceneOcclusion.Stats;
+					printf("Occlusion: %d of %d objects occluded by %d occluders, %.3f ms rasterize + %.3f ms test\n",
+						Stats.Occluded, Stats.Tested, Stats.Occluders, Stats.RasterizeMs, Stats.TestMs);
+				}
+				StartTimer();
+			}
+			FrameTime = GetFrameTime();
+			UINT64 Allocations = RunFrame(FrameTime);
+
+			// DrawScene presented the first frame, startup is over
+			if (FramesSinceStart == 0)
+			{
+				LARGE_INTEGER FirstFrame;
+				QueryPerformanceCounter(&FirstFrame);
+				ReportStartup(FirstFrame, "until the first frame");
+			}
+			if (++FramesSinceStart > FRAME_ALLOCATION_WARMUP && Allocations > 0)
+			{
+				AllocationsThisSecond += Allocations;
+				AllocatingFramesThisSecond++;
+			}
+		}
+	}
+
+	return Message.wParam;
+}
+
+UINT64 RunFrame(double FrameTime)
+{
+	LARGE_INTEGER FrameStart, ZoneStart, ZoneEnd;
+	QueryPerformanceCounter(&FrameStart);
+	BeginFrameAllocations();
+	BeginFrameArena(Frame);
+	BeginFrameCounters();
+
+	DetectInput(FrameTime);
+	QueryPerformanceCounter(&ZoneStart);
+	PerfCounters.ZoneMs[COUNTER_ZONE_INPUT] = CounterMs(FrameStart, ZoneStart);
+	UpdateScene(FrameTime);
+	QueryPerformanceCounter(&ZoneEnd);
+	PerfCounters.ZoneMs[COUNTER_ZONE_UPDATE] = CounterMs(ZoneStart, ZoneEnd);
+	DrawScene();
+
+	UINT64 Allocations = EndFrameAllocations();
+	PublishFrameCounters(FrameStart);
+	return Allocations;
+}
+
+bool InitDirectInput(HINSTANCE Instance)
+{
+	HR(DirectInput8Create(Instance, DIRECTINPUT_VERSION, IID_IDirectInput8, (void **)&DirectInput, NULL));
+	
+	HR(DirectInput->CreateDevice(GUID_SysKeyboard, &DIKeyboard, NULL));
+	HR(DirectInput->CreateDevice(GUID_SysMouse, &DIMouse, NULL));
+
+	HR(DIKeyboard->SetDataFormat(&c_dfDIKeyboard));
+	HR(DIKeyboard->SetCooperativeLevel(WindowHandle, DISCL_FOREGROUND | DISCL_NONEXCLUSIVE));
+
+	HR(DIMouse->SetDataFormat(&c_dfDIMouse));
+	HR(DIMouse->SetCooperativeLevel(WindowHandle, DISCL_EXCLUSIVE | DISCL_NOWINKEY | DISCL_FOREGROUND));
+
+	return true;
+}
+
+void DetectInput(double time)
+{
+	DIMOUSESTATE MouseCurrentState = {};
+	BYTE KeyboardState[256] = {};
+
+	// The headless modes have no DirectInput, the rest runs as if nothing was pressed
+	if (DIKeyboard)
+	{
+		DIKeyboard->Acquire();
+		DIMouse->Acquire();
+
+		DIMouse->GetDeviceState(sizeof(DIMOUSESTATE), &MouseCurrentState);
+		DIKeyboard->GetDeviceState(sizeof(KeyboardState), (LPVOID)&KeyboardState);
+	}
+
+	if (KeyboardState[DIK_ESCAPE] & 0x80)
+		PostMessage(WindowHandle, WM_DESTROY, 0, 0);
+
+	if (KeyboardState[DIK_LEFT] & 0x80)
+		RotZ -= 1.0f * time;
+	if (KeyboardState[DIK_RIGHT] & 0x80)
+		RotZ += 1.0f * time;
+	if (KeyboardState[DIK_UP] & 0x80)
+		RotX += 1.0f * time;
+	if (KeyboardState[DIK_DOWN] & 0x80)
+		RotX -= 1.0f * time;
+
+	if (MouseCurrentState.lX != MouseLastState.lX)
+		ScaleX -= (MouseCurrentState.lX * 0.001f);
+	if (MouseCurrentState.lY != MouseLastState.lY)
+		ScaleY -= (MouseCurrentState.lY * 0.001f);
+
+	if (RotX > 6.28) RotX -= 6.28;
+	else if (RotX < 0) RotX = 6.28 + RotX;
+
+	if (RotZ > 6.28) RotZ -= 6.28;
+	else if (RotZ < 0) RotZ = 6.28 + RotZ;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		if (KeyboardState[DIK_1 + i] & 0x80)
+			RecordThreads = min(i + 1, MAX_RECORD_THREADS);
+	}
+
+	// O toggles occlusion culling, B material batching, P particles, T the terrain, C the cluster culling, F5 dumps the occlusion buffer, F12 captures a frame
+	static BYTE LastKeyboardState[256];
+	if ((KeyboardState[DIK_O] & 0x80) && !(LastKeyboardState[DIK_O] & 0x80))
+		OcclusionCulling = !OcclusionCulling;
+	if ((KeyboardState[DIK_B] & 0x80) && !(LastKeyboardState[DIK_B] & 0x80))
+		MaterialBatching = !MaterialBatching;
+	if ((KeyboardState[DIK_P] & 0x80) && !(LastKeyboardState[DIK_P] & 0x80))
+		ParticlesEnabled = !ParticlesEnabled;
+	if ((KeyboardState[DIK_T] & 0x80) && !(LastKeyboardState[DIK_T] & 0x80))
+		TerrainEnabled = !TerrainEnabled;
+	if ((KeyboardState[DIK_C] & 0x80) && !(LastKeyboardState[DIK_C] & 0x80))
+		ClusterCulling = !ClusterCulling;
+	if ((KeyboardState[DIK_F5] & 0x80) && !(LastKeyboardState[DIK_F5] & 0x80))
+		DumpOcclusionBuffer(SceneOcclusion, "occlusion.pgm");
+	if ((KeyboardState[DIK_F12] & 0x80) && !(LastKeyboardState[DIK_F12] & 0x80))
+		ScreenshotRequested = true;
+	memcpy(LastKeyboardState, KeyboardState, sizeof(KeyboardState));
+
+	// WASD flies the camera over the ground plane
+	float CameraMove = 0.0f;
+	float CameraStrafe = 0.0f;
+	if (KeyboardState[DIK_W] & 0x80)
+		CameraMove += 20.0f * time;
+	if (KeyboardState[DIK_S] & 0x80)
+		CameraMove -= 20.0f * time;
+	if (KeyboardState[DIK_D] & 0x80)
+		CameraStrafe += 20.0f * time;
+	if (KeyboardState[DIK_A] & 0x80)
+		CameraStrafe -= 20.0f * time;
+
+	if (CameraMove != 0.0f || CameraStrafe != 0.0f)
+	{
+		XMVECTOR Forward = XMVector3Normalize(XMVectorSetY(CameraTarget - CameraPosition, 0.0f));
+		XMVECTOR Right = XMVector3Cross(CameraUp, Forward);
+		XMVECTOR CameraOffset = Forward * CameraMove + Right * CameraStrafe;
+
+		CameraPosition += CameraOffset;
+		CameraTarget += CameraOffset;
+		CameraView = XMMatrixLookAtLH(CameraPosition, CameraTarget, CameraUp);
+	}
+
+	MouseLastState = MouseCurrentState;
+	return;
+}
+
+LRESULT CALLBACK WindowProcedure(HWND Window, UINT Msg, WPARAM WParam, LPARAM LParam)
+{
+	switch(Msg)
+	{
+		case WM_KEYDOWN:
+		{
+			if (WParam == VK_ESCAPE)
+			{
+				DestroyWindow(Window);
+			}
+		} break;
+
+		case WM_DESTROY:
+		{
+			PostQuitMessage(0);
+		} break;
+	}
+
+	return DefWindowProc(Window, Msg, WParam, LParam);
+}
+
+bool CreateD3DDevice(SceneStartup &State)
+{
+	HR(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void **)&State.Factory));
+	if (UseWarpAdapter)
+	{
+		IDXGIFactory4 *Factory4;
+		if (FAILED(State.Factory->QueryInterface(__uuidof(IDXGIFactory4), (void **)&Factory4)))
+			return false;
+		HRESULT Result = Factory4->EnumWarpAdapter(__uuidof(IDXGIAdapter1), (void **)&State.Adapter);
+		Factory4->Release();
+		if (FAILED(Result))
+			return false;
+	}
+	else
+		HR(State.Factory->EnumAdapters1(0, &State.Adapter));
+
+	// Create the D3D Device and Device Context, the swap chain comes later on the window's thread
+	HR(D3D11CreateDevice(State.Adapter,
+		D3D_DRIVER_TYPE_UNKNOWN,
+		0,
+		D3D11_CREATE_DEVICE_DEBUG | D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+		0,
+		0,
+		D3D11_SDK_VERSION,
+		&D3D11Device,
+		0,
+		&D3D11DeviceContext));
+
+	// Only there from Windows 10 on, the video memory counter stays 0 without it
+	if (FAILED(State.Adapter->QueryInterface(__uuidof(IDXGIAdapter3), (void **)&CounterAdapter)))
+		CounterAdapter = NULL;
+
+	return D3D11Device != NULL;
+}
+
+bool InitializeD3D(SceneStartup &State)
+{
+	// Describe our Backbuffer.
+	DXGI_MODE_DESC BufferDesc = {};
+	{
+		// Width and Height of Resolution
+		BufferDesc.Width = Width;
+		BufferDesc.Height = Height;
+		// RefreshRate (Rational), 60/1 or 60Hz
+		BufferDesc.RefreshRate.Numerator = 60;
+		BufferDesc.RefreshRate.Denominator = 1;
+		BufferDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+		// DXGI_MODE_SCANLINE_ORDER enum type. Describes the manner in which the rasterizer will render onto the surface.
+		// Since we use Double Buffering, this wont be noticeable, so we can set to unspecified.
+		BufferDesc.ScanlineOrdering = DXGI_MODE_SCANLINE_ORDER_UNSPECIFIED;
+		// DXGI_MODE_SCALING enum type. Explains how an image is stretched to fit monitor resolution.
+		// UNSPECIFIED, CENTERED, STRETCHED
+		BufferDesc.Scaling = DXGI_MODE_SCALING_UNSPECIFIED;
+	}
+
+	// Describe our SwapChain
+	DXGI_SWAP_CHAIN_DESC SwapChainDesc = {};
+	{
+		// Describes our backbuffer above
+		SwapChainDesc.BufferDesc = BufferDesc;
+		// DXGI_SAMPLE_DESC struct to describe Multisampling.
+		// Multisampling smoothes the choppiness in lines or edges created because pixels on monitors are not infinitely small.
+		// Since they are little blocks, you can see choppiness in diagonal lines and edges on a screen.
+		SwapChainDesc.SampleDesc.Count = 1;
+		SwapChainDesc.SampleDesc.Quality = 0;
+		// DXGI_USAGE enum type. Describes the access the CPU has to the Surface of the Backbuffer.
+		// DXGI_USAGE_RENDER_TARGET_OUTPUT so we can render to the Backbuffer.
+		SwapChainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+		// Number of Backbuffers we will use. 1 => Double Buffers, 2 => Triple Buffering, n => x Buffering
+		SwapChainDesc.BufferCount = 1;
+		SwapChainDesc.OutputWindow = WindowHandle;
+
+		SwapChainDesc.Windowed = TRUE;
+		// DXGI_SWAP_EFFECT enum type. Describes what the Display Driver should do with the Front Buffer after swapping it to the back.
+		// We use DISCARD to let the driver decide what is most efficient to do with it.
+		SwapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_DISCARD;
+	}
+
+	// Create the Swap Chain on the device the startup graph made
+	HR(State.Factory->CreateSwapChain(D3D11Device, &SwapChainDesc, &SwapChain));
+	State.Factory->Release();
+	State.Factory = NULL;
+
+	// Create our Backbuffer to create our RenderTargetView
+	HR(SwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void **)&Backbuffer1))
+	HR(D3D11Device->CreateRenderTargetView(Backbuffer1, 0, &RenderTargetView));
+
+	// The Depth/Stencil buffer is a transient resource of the frame graph, it gets created in SetupFrameGraph.
+
+	// Bind the RenderTargetView to the Output Merger state of the pipeline. 
+	// NumViews is 1 since we only have 1 RenderTarget to bind
+	Bind()->OMSetRenderTargets(1, &RenderTargetView, NULL);
+
+	return true;
+}
+
+// DirectInput is left out, nothing polls the input without the message loop
+bool InitHeadlessScene()
+{
+	UseWarpAdapter = true;
+	if (!InitializeWindow(GetModuleHandle(NULL), SW_HIDE, Width, Height, true))
+		return false;
+
+	ResetStartupGraph(Startup);
+	BuildSceneStartup(Startup, SceneStartupData);
+	if (!RunStartupGraph(Startup, JobThreadCount()))
+	{
+		printf("%s failed on the WARP adapter\n", Startup.Tasks[Startup.FailedTask].Name);
+		return false;
+	}
+
+	return InitializeD3D(SceneStartupData) && InitScene();
+}
+
+void ReleaseObjects()
+{
+	SwapChain->Release();
+	D3D11Device->Release();
+	D3D11DeviceContext->Release();
+	RenderTargetView->Release();
 	SquareVertexBuffer->Release();
 	SquareIndexBuffer->Release();
 	VertexShader->Release();
@@ -590,127 +2870,9618 @@ void ReleaseObjects()
 	VSBuffer->Release();
 	PSBuffer->Release();
 	VertexLayout->Release();
-	DepthStencilView->Release();
-	DepthStencilBuffer->Release();
+	ReleaseRenderGraph(FrameGraph);
+	ReleaseDynamicResolution();
+	ReleaseCommandBuffers();
+	ReleaseOcclusionCuller(SceneOcclusion);
+	ReleaseMaterials();
+	ReleaseShaderPermutations();
+	ReleaseParticles();
+	ReleaseCharacters();
+	ReleaseTerrain();
+	ReleaseMeshlets();
+	ReleaseBakedLight();
+	ReleaseFrameArena(Frame);
+	ReleasePerfCounters();
+	if (CaptureActive)
+	{
+		ReleaseFrameCapture(SceneCapture);
+		delete SceneCapture.Backend;
+	}
 	cbPerObjectBuffer->Release();
 	TransparentBlendState->Release();
 	CCCullMode->Release();
 	CWCullMode->Release();
 	NoCullMode->Release();
 
-	D3D101Device->Release();
-	KeyedMutex1->Release();
-	KeyedMutex0->Release();
-	D2DRenderTarget->Release();
-	Brush->Release();
-	Backbuffer1->Release();
-	SharedTexture1->Release();
-	DWriteFactory->Release();
-	TextFormat->Release();
-	D2DTexture->Release();
+	D3D101Device->Release();
+	KeyedMutex1->Release();
+	KeyedMutex0->Release();
+	D2DRenderTarget->Release();
+	Brush->Release();
+	Backbuffer1->Release();
+	SharedTexture1->Release();
+	DWriteFactory->Release();
+	TextFormat->Release();
+	D2DTexture->Release();
+
+	cbPerFrameBuffer->Release();
+
+	DIKeyboard->Unacquire();
+	DIMouse->Unacquire();
+	DirectInput->Release();
+}
+
+bool InitScene()
+{
+	// The startup graph created the shaders and the cube's buffers, set them as our Pipelines current ones
+	Bind()->VSSetShader(VertexShader, 0, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+
+	// Bind the Index Buffer in the IA (first stage)
+	Bind()->IASetIndexBuffer(SquareIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+
+	// Now we need to bind our Vertex Buffer to the IA (first stage)
+	UINT Stride = sizeof(Vertex);
+	UINT Offset = 0;
+	Bind()->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
+
+	// Bind the Layout to the IA as the Active Layout.
+	Bind()->IASetInputLayout(VertexLayout);
+
+	// Set the Primitive Topology of the IA
+	// Create a triangle; Every 3 vertices will make a triangle. 
+	Bind()->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+	// Create and set our viewport.
+	// Tells the RS stage what to draw.
+	// Creates a square in pixels which the rasterizer uses to find where to display our geometry on the client area of our window.
+	D3D11_VIEWPORT Viewport = {};
+	Viewport.TopLeftX = 0;
+	Viewport.TopLeftY = 0;
+	Viewport.Width = Width;
+	Viewport.Height = Height;
+	Viewport.MinDepth = 0.0f; // Closest value in Depth
+	Viewport.MaxDepth = 1.0f; // Furthest value in Depth
+
+	Bind()->RSSetViewports(1, &Viewport);
+
+	light.pos = XMFLOAT3(0.0f, 0.0f, 0.0f);
+	light.range = 100.0f;
+	light.att = XMFLOAT3(0.0f, 0.2, 0.0f);
+	light.ambient = XMFLOAT4(0.3f, 0.3f, 0.3f, 1.0f);
+	light.diffuse = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
+
+	// Setup Camera
+	CameraPosition = XMVectorSet(0.0f, 3.0f, -8.0f, 0.0f);
+	CameraTarget = XMVectorSet(0.0f, 0.0f, 0.0f, 0.0f);
+	CameraUp = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+
+	// Create the Viewspace
+	CameraView = XMMatrixLookAtLH(CameraPosition, CameraTarget, CameraUp);
+	
+	// Create projection space
+	CameraProjection = XMMatrixPerspectiveFovLH((0.4f * 3.14f), (float)Width / Height, 1.0f, 1000.0f);
+
+	if (!InitCommandBuffers())
+		return false;
+
+	InitOcclusionCuller(SceneOcclusion);
+
+	if (!InitMaterials())
+		return false;
+
+	if (!InitParticles())
+		return false;
+
+	InitFrameArena(Frame, FRAME_ARENA_SIZE);
+
+	if (!InitCharacters())
+		return false;
+
+	if (!InitTerrain())
+		return false;
+
+	if (!InitMeshlets())
+		return false;
+
+	if (!InitBakedLight())
+		return false;
+
+	// Stream the cooked scene around the camera if there is one, keeping at most 64MB of it in memory
+	WorldStreaming = OpenSceneStream(WorldStreamer, ScenePath, 64 * 1024 * 1024, 96.0f);
+	if (WorldStreaming && !WorldStreamer.Lights.empty())
+	{
+		const SceneFileLight &SceneLight = WorldStreamer.Lights[0];
+		light.range = SceneLight.Range;
+		light.att = SceneLight.Attenuation;
+		light.ambient = SceneLight.Ambient;
+		light.diffuse = SceneLight.Diffuse;
+	}
+
+	if (!SetupFrameGraph())
+		return false;
+
+	// Nothing depends on them, the sandbox runs the same without
+	if (!InitPerfCounters())
+		printf("Performance counters are not published\n");
+
+	return true;
+}
+
+// Writes the 24 vertices and 36 indices of a unit cube, indices start at BaseVertex
+void BuildCubeGeometry(Vertex *Vertices, DWORD *Indices, DWORD BaseVertex)
+{
+	// Where the points meet
+	const Vertex CubeVertices[CUBE_VERTEX_COUNT] =
+	{
+		// Front Face
+		Vertex(-1.0f, -1.0f, -1.0f, 0.0f, 1.0f,-1.0f, -1.0f, -1.0f),
+		Vertex(-1.0f,  1.0f, -1.0f, 0.0f, 0.0f,-1.0f,  1.0f, -1.0f),
+		Vertex(1.0f,  1.0f, -1.0f, 1.0f, 0.0f, 1.0f,  1.0f, -1.0f),
+		Vertex(1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f, -1.0f, -1.0f),
+
+		// Back Face
+		Vertex(-1.0f, -1.0f, 1.0f, 1.0f, 1.0f,-1.0f, -1.0f, 1.0f),
+		Vertex(1.0f, -1.0f, 1.0f, 0.0f, 1.0f, 1.0f, -1.0f, 1.0f),
+		Vertex(1.0f,  1.0f, 1.0f, 0.0f, 0.0f, 1.0f,  1.0f, 1.0f),
+		Vertex(-1.0f,  1.0f, 1.0f, 1.0f, 0.0f,-1.0f,  1.0f, 1.0f),
+
+		// Top Face
+		Vertex(-1.0f, 1.0f, -1.0f, 0.0f, 1.0f,-1.0f, 1.0f, -1.0f),
+		Vertex(-1.0f, 1.0f,  1.0f, 0.0f, 0.0f,-1.0f, 1.0f,  1.0f),
+		Vertex(1.0f, 1.0f,  1.0f, 1.0f, 0.0f, 1.0f, 1.0f,  1.0f),
+		Vertex(1.0f, 1.0f, -1.0f, 1.0f, 1.0f, 1.0f, 1.0f, -1.0f),
+
+		// Bottom Face
+		Vertex(-1.0f, -1.0f, -1.0f, 1.0f, 1.0f,-1.0f, -1.0f, -1.0f),
+		Vertex(1.0f, -1.0f, -1.0f, 0.0f, 1.0f, 1.0f, -1.0f, -1.0f),
+		Vertex(1.0f, -1.0f,  1.0f, 0.0f, 0.0f, 1.0f, -1.0f,  1.0f),
+		Vertex(-1.0f, -1.0f,  1.0f, 1.0f, 0.0f,-1.0f, -1.0f,  1.0f),
+
+		// Left Face
+		Vertex(-1.0f, -1.0f,  1.0f, 0.0f, 1.0f,-1.0f, -1.0f,  1.0f),
+		Vertex(-1.0f,  1.0f,  1.0f, 0.0f, 0.0f,-1.0f,  1.0f,  1.0f),
+		Vertex(-1.0f,  1.0f, -1.0f, 1.0f, 0.0f,-1.0f,  1.0f, -1.0f),
+		Vertex(-1.0f, -1.0f, -1.0f, 1.0f, 1.0f,-1.0f, -1.0f, -1.0f),
+
+		// Right Face
+		Vertex(1.0f, -1.0f, -1.0f, 0.0f, 1.0f, 1.0f, -1.0f, -1.0f),
+		Vertex(1.0f,  1.0f, -1.0f, 0.0f, 0.0f, 1.0f,  1.0f, -1.0f),
+		Vertex(1.0f,  1.0f,  1.0f, 1.0f, 0.0f, 1.0f,  1.0f,  1.0f),
+		Vertex(1.0f, -1.0f,  1.0f, 1.0f, 1.0f, 1.0f, -1.0f,  1.0f),
+	};
+
+	// Allows to use part of another triangle to use on another
+	const DWORD CubeIndices[CUBE_INDEX_COUNT] =
+	{
+		// Front Face
+		0,  1,  2,
+		0,  2,  3,
+
+		// Back Face
+		4,  5,  6,
+		4,  6,  7,
+
+		// Top Face
+		8,  9, 10,
+		8, 10, 11,
+
+		// Bottom Face
+		12, 13, 14,
+		12, 14, 15,
+
+		// Left Face
+		16, 17, 18,
+		16, 18, 19,
+
+		// Right Face
+		20, 21, 22,
+		20, 22, 23
+	};
+
+	for (int i = 0; i < CUBE_VERTEX_COUNT; ++i)
+		Vertices[i] = CubeVertices[i];
+	for (int i = 0; i < CUBE_INDEX_COUNT; ++i)
+		Indices[i] = BaseVertex + CubeIndices[i];
+}
+
+void UpdateScene(double time)
+{
+	Rot += 1.0f * time;
+	if (Rot > 6.28f) // 2pi
+		Rot = 0.0f;
+
+	Cube1World = ComposeOrbitWorld(Rot, RotX, RotZ);
+	light.pos = TransformLightPosition(Cube1World);
+	Cube2World = ComposeSpinWorld(-Rot, ScaleX, ScaleY);
+
+	// A long hitch shouldn't throw the particles across the scene
+	if (ParticlesEnabled)
+		SimulateParticles(Particles, (float)min(time, 0.1));
+
+	// Written here and uploaded by the character pass of the same frame
+	CharacterSkinning = (XMFLOAT4X4 *)FrameAlloc(Frame, sizeof(XMFLOAT4X4) * Characters.size() * CharacterSkeleton.BoneCount, 16);
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+	if (CharacterSkinning)
+		UpdateCharacters(Characters.data(), (int)Characters.size(), (float)time, CharacterSkinning);
+	QueryPerformanceCounter(&End);
+	CharacterUpdateMsThisSecond += double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+	CharacterFramesThisSecond++;
+
+	if (TerrainLoaded && TerrainEnabled)
+	{
+		UpdateTerrain(Terrain, CameraPosition, CameraView * CameraProjection);
+		TerrainSelectMsThisSecond += Terrain.Stats.SelectMs;
+		TerrainTrianglesThisSecond += Terrain.Stats.Triangles;
+		TerrainNodesThisSecond += Terrain.Stats.NodesDrawn;
+		TerrainFramesThisSecond++;
+	}
+
+	if (MeshletsLoaded)
+		CullBigMesh();
+
+	if (WorldStreaming)
+	{
+		UpdateSceneStreaming(WorldStreamer, CameraPosition, time);
+		BuildDrawList(WorldStreamer);
+		if (OcclusionCulling)
+			CullOccludedDraws(SceneOcclusion, DrawList);
+	}
+}
+
+// Cube1 orbits the origin 4 units out, tilted by the arrow keys
+XMMATRIX ComposeOrbitWorld(float Angle, float AngleX, float AngleZ)
+{
+	XMVECTOR RotYAxis = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+	XMVECTOR RotZAxis = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f);
+	XMVECTOR RotXAxis = XMVectorSet(1.0f, 0.0f, 0.0f, 0.0f);
+
+	XMMATRIX Rotation = XMMatrixRotationAxis(RotYAxis, Angle);
+	XMMATRIX RotationX = XMMatrixRotationAxis(RotXAxis, AngleX);
+	XMMATRIX RotationZ = XMMatrixRotationAxis(RotZAxis, AngleZ);
+	XMMATRIX Translation = XMMatrixTranslation(0.0f, 0.0f, 4.0f);
+
+	return Translation * Rotation * RotationX * RotationZ;
+}
+
+// Cube2 spins in place, scaled by the mouse
+XMMATRIX ComposeSpinWorld(float Angle, float SizeX, float SizeY)
+{
+	XMVECTOR RotYAxis = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+
+	XMMATRIX Rotation = XMMatrixRotationAxis(RotYAxis, Angle);
+	XMMATRIX Scale = XMMatrixScaling(SizeX, SizeY, 1.3f);
+
+	return Rotation * Scale;
+}
+
+// The light sits at the center of the object it is attached to
+XMFLOAT3 TransformLightPosition(const XMMATRIX &ObjectWorld)
+{
+	XMVECTOR LightVector = XMVectorZero();
+	LightVector = XMVector3TransformCoord(LightVector, ObjectWorld);
+
+	XMFLOAT3 Position;
+	XMStoreFloat3(&Position, LightVector);
+	return Position;
+}
+
+// The effect file expects column major matrices, so both get transposed
+void BuildObjectConstants(const XMMATRIX &ObjectWorld, const XMMATRIX &View, const XMMATRIX &Projection, cbPerObject &Constants)
+{
+	XMMATRIX ObjectWVP = ObjectWorld * View * Projection;
+	Constants.World = XMMatrixTranspose(ObjectWorld);
+	Constants.WVP = XMMatrixTranspose(ObjectWVP);
+}
+
+void DrawScene()
+{
+	UpdateDynamicResolution();
+
+	// The frame graph clears the scene target and Depth/Stencil before the first pass that writes them
+	BeginGpuFrameTimer();
+	ExecuteRenderGraph(FrameGraph, D3D11DeviceContext);
+	EndGpuFrameTimer();
+
+	// The Backbuffer is complete here, text overlay included
+	bool Requested = ScreenshotRequested || (CaptureInterval > 0 && PerfCounters.Frame % CaptureInterval == 0);
+	ScreenshotRequested = false;
+	if (Requested && !CaptureActive && !CaptureFailed)
+		CaptureActive = StartSceneCapture();
+	if (CaptureActive)
+		UpdateFrameCapture(SceneCapture, PerfCounters.Frame, Requested);
+
+	// Swap the front buffer with the backbuffer
+	LARGE_INTEGER Start, End;
+	QueryPerformanceCounter(&Start);
+	SwapChain->Present(0, 0);
+	QueryPerformanceCounter(&End);
+	PerfCounters.ZoneMs[COUNTER_ZONE_PRESENT] = CounterMs(Start, End);
+}
+
+bool StartSceneCapture()
+{
+	D3D11CaptureBackend *CaptureSource = new D3D11CaptureBackend(D3D11Device, D3D11DeviceContext, Backbuffer1);
+	if (!InitFrameCapture(SceneCapture, CaptureSource, CaptureOutputFormat, "capture"))
+	{
+		printf("Frame capture is off, the capture file can't be created\n");
+		delete CaptureSource;
+		CaptureFailed = true;
+		return false;
+	}
+	return true;
+}
+
+void ScenePass()
+{
+	ID3D11RenderTargetView *SceneTargetView = FrameGraph.Resources[RGSceneColor].RTV;
+	ID3D11DepthStencilView *DepthStencilView = FrameGraph.Resources[RGDepth].DSV;
+
+	// Only render into the scaled part of the scene target
+	D3D11_VIEWPORT Viewport = {};
+	Viewport.Width = (FLOAT)ScaledWidth;
+	Viewport.Height = (FLOAT)ScaledHeight;
+	Viewport.MinDepth = 0.0f;
+	Viewport.MaxDepth = 1.0f;
+	Bind()->RSSetViewports(1, &Viewport);
+	Bind()->IASetInputLayout(VertexLayout);
+
+	constBufferPerFrame.light = light;
+	UploadSubresource(cbPerFrameBuffer, &constBufferPerFrame, sizeof(cbPerFrame));
+	Bind()->PSSetConstantBuffers(0, 1, &cbPerFrameBuffer);
+	BindBakedLight();
+
+	Bind()->VSSetShader(VertexShader, 0, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+
+	Bind()->OMSetRenderTargets(1, &SceneTargetView, DepthStencilView);
+	Bind()->OMSetBlendState(0, 0, 0xffffffff);
+
+	Bind()->IASetIndexBuffer(SquareIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	UINT Stride = sizeof(Vertex);
+	UINT Offset = 0;
+	Bind()->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
+
+
+	BuildObjectConstants(Cube1World, CameraView, CameraProjection, cbPerObj);
+	UploadSubresource(cbPerObjectBuffer, &cbPerObj, sizeof(cbPerObject));
+	Bind()->VSSetConstantBuffers(0, 1, &cbPerObjectBuffer);
+	Bind()->PSSetShaderResources(0, 1, &CubeTexture);
+	Bind()->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+	Bind()->PSSetShader(GetPixelShaderPermutation(SHADER_ENTRY_PS, SelectShaderFeatures(light, Cube1World)), 0, 0);
+
+	Bind()->RSSetState(CWCullMode);
+	DrawCall()->DrawIndexed(36, 0, 0);
+
+	BuildObjectConstants(Cube2World, CameraView, CameraProjection, cbPerObj);
+	UploadSubresource(cbPerObjectBuffer, &cbPerObj, sizeof(cbPerObject));
+	Bind()->VSSetConstantBuffers(0, 1, &cbPerObjectBuffer);
+	Bind()->PSSetShaderResources(0, 1, &CubeTexture);
+	Bind()->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+	Bind()->PSSetShader(GetPixelShaderPermutation(SHADER_ENTRY_PS, SelectShaderFeatures(light, Cube2World)), 0, 0);
+
+	Bind()->RSSetState(CWCullMode);
+	DrawCall()->DrawIndexed(36, 0, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+
+	// Streamed scene entities, all of them are cubes for now
+	if (!DrawList.empty())
+	{
+		LARGE_INTEGER Frequency, Start, End;
+		QueryPerformanceFrequency(&Frequency);
+		QueryPerformanceCounter(&Start);
+
+		if (MaterialBatching)
+		{
+			// Objects wholly outside the light's range get the unlit variant, so the list splits into two batches.
+			// The split goes into the frame arena, DrawList keeps its order. Without room everything draws lit.
+			int Count = (int)DrawList.size();
+			DrawItem *Split = (DrawItem *)FrameAlloc(Frame, sizeof(DrawItem) * Count, 16);
+			int LitCount = Split ? SplitDrawList(DrawList.data(), Count, IsDrawItemLit, Split) : Count;
+
+			BatchedDrawsThisSecond += DrawDrawListInstanced(Split ? Split : DrawList.data(), LitCount, LitShaderFeatures(light));
+			if (LitCount < Count)
+				BatchedDrawsThisSecond += DrawDrawListInstanced(Split + LitCount, Count - LitCount, SHADER_FEATURE_TEXTURED | AmbientShaderFeatures());
+			BatchedObjectsThisSecond += Count;
+		}
+		else
+			RecordDrawList(SceneCommandBuffers, RecordThreads, DrawList.data(), (int)DrawList.size());
+
+		QueryPerformanceCounter(&End);
+		RecordDrawsThisSecond += (int)DrawList.size();
+		RecordSecondsThisSecond += double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+	}
+}
+
+void TextPass()
+{
+	RenderText(L"FPS: ", FPS);
+}
+
+bool InitTextFactories(ID2D1Factory **D2DFactory)
+{
+	HR(D2D1CreateFactory(D2D1_FACTORY_TYPE_SINGLE_THREADED, __uuidof(ID2D1Factory), (void **)D2DFactory));
+	HR(DWriteCreateFactory(DWRITE_FACTORY_TYPE_SHARED, __uuidof(IDWriteFactory), reinterpret_cast<IUnknown **>(&DWriteFactory)));
+
+	HR(DWriteFactory->CreateTextFormat(L"Script",
+		NULL,
+		DWRITE_FONT_WEIGHT_REGULAR,
+		DWRITE_FONT_STYLE_NORMAL,
+		DWRITE_FONT_STRETCH_NORMAL,
+		24.0f,
+		L"en-us",
+		&TextFormat));
+
+	HR(TextFormat->SetTextAlignment(DWRITE_TEXT_ALIGNMENT_LEADING));
+	HR(TextFormat->SetParagraphAlignment(DWRITE_PARAGRAPH_ALIGNMENT_NEAR));
+
+	return *D2DFactory != NULL;
+}
+
+bool InitD2D_D3D11_DWrite(IDXGIAdapter1 *Adapter, ID2D1Factory *D2DFactory)
+{
+	D3D10CreateDevice1(Adapter, D3D10_DRIVER_TYPE_HARDWARE, NULL, D3D10_CREATE_DEVICE_DEBUG | D3D10_CREATE_DEVICE_BGRA_SUPPORT,
+		D3D10_FEATURE_LEVEL_10_1, D3D10_1_SDK_VERSION, &D3D101Device);
+
+	D3D11_TEXTURE2D_DESC SharedTextureDesc = {};
+	SharedTextureDesc.Width = Width;
+	SharedTextureDesc.Height = Height;
+	SharedTextureDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+	SharedTextureDesc.MipLevels = 1;
+	SharedTextureDesc.ArraySize = 1;
+	SharedTextureDesc.SampleDesc.Count = 1;
+	SharedTextureDesc.Usage = D3D11_USAGE_DEFAULT;
+	SharedTextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+	SharedTextureDesc.MiscFlags = D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX;
+	HR(D3D11Device->CreateTexture2D(&SharedTextureDesc, NULL, &SharedTexture1));
+	HR(SharedTexture1->QueryInterface(__uuidof(IDXGIKeyedMutex), (void **)&KeyedMutex1));
+
+	IDXGIResource *SharedResource10;
+	HANDLE SharedHandle10;
+
+	HR(SharedTexture1->QueryInterface(__uuidof(IDXGIResource), (void **)&SharedResource10));
+	HR(SharedResource10->GetSharedHandle(&SharedHandle10));
+	SharedResource10->Release();
+
+	IDXGISurface1 *SharedSurface10;
+	HR(D3D101Device->OpenSharedResource(SharedHandle10, __uuidof(IDXGISurface1), (void **)(&SharedSurface10)));
+	HR(SharedSurface10->QueryInterface(__uuidof(IDXGIKeyedMutex), (void **)&KeyedMutex0));
+
+	D2D1_RENDER_TARGET_PROPERTIES RenderTargetProperties = {};
+	RenderTargetProperties.type = D2D1_RENDER_TARGET_TYPE_HARDWARE;
+	RenderTargetProperties.pixelFormat = D2D1::PixelFormat(DXGI_FORMAT_UNKNOWN, D2D1_ALPHA_MODE_PREMULTIPLIED);
+
+	HR(D2DFactory->CreateDxgiSurfaceRenderTarget(SharedSurface10, &RenderTargetProperties, &D2DRenderTarget));
+	SharedSurface10->Release();
+
+	HR(D2DRenderTarget->CreateSolidColorBrush(D2D1::ColorF(1.0f, 1.0f, 0.0f, 1.0f), &Brush));
+
+	D3D101Device->IASetPrimitiveTopology(D3D10_PRIMITIVE_TOPOLOGY_POINTLIST);
+
+	return true;
+}
+
+void InitD2DScreenTexture()
+{
+	//Create the vertex buffer
+	Vertex v[] =
+	{
+		// Front Face
+		Vertex(-1.0f, -1.0f, -1.0f, 0.0f, 1.0f,-1.0f, -1.0f, -1.0f),
+		Vertex(-1.0f,  1.0f, -1.0f, 0.0f, 0.0f,-1.0f,  1.0f, -1.0f),
+		Vertex(1.0f,  1.0f, -1.0f, 1.0f, 0.0f, 1.0f,  1.0f, -1.0f),
+		Vertex(1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f, -1.0f, -1.0f),
+	};
+
+	DWORD indices[] = {
+		// Front Face
+		0,  1,  2,
+		0,  2,  3,
+	};
+
+	D3D11_BUFFER_DESC IndexBufferDesc = {};
+	IndexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
+	IndexBufferDesc.ByteWidth = sizeof(DWORD) * 2 * 3;
+	IndexBufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+
+	D3D11_SUBRESOURCE_DATA IndexInitData;
+	IndexInitData.pSysMem = indices;
+	D3D11Device->CreateBuffer(&IndexBufferDesc, &IndexInitData, &D2DIndexBuffer);
+
+	D3D11_BUFFER_DESC VertexBufferDesc = {};
+	VertexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
+	VertexBufferDesc.ByteWidth = sizeof(Vertex) * 4;
+	VertexBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+
+	D3D11_SUBRESOURCE_DATA VertexInitData;
+	VertexInitData.pSysMem = v;
+	D3D11Device->CreateBuffer(&VertexBufferDesc, &VertexInitData, &D2DVertBuffer);
+
+	D3D11Device->CreateShaderResourceView(SharedTexture1, NULL, &D2DTexture);
+}
+
+void RenderText(const wchar_t *text, int inInt)
+{
+	KeyedMutex1->ReleaseSync(0);
+	KeyedMutex0->AcquireSync(0, 5);
+	D2DRenderTarget->BeginDraw();
+
+	D2DRenderTarget->Clear(D2D1::ColorF(0.0f, 0.0f, 0.0f, 0.0f));
+
+	FormatPrintText(text, inInt);
+
+	D2D1_COLOR_F FontColor = D2D1::ColorF(1.0f, 1.0f, 1.0f, 1.0f);
+	Brush->SetColor(FontColor);
+
+	D2D1_RECT_F LayoutRect = D2D1::RectF(0, 0, Width, Height);
+
+	D2DRenderTarget->DrawText(PrintText, PrintTextLength, TextFormat, LayoutRect, Brush);
+
+	D2DRenderTarget->EndDraw();
+
+	KeyedMutex0->ReleaseSync(1);
+	KeyedMutex1->AcquireSync(1, 5);
+}
+
+// Blends the D2D text overlay over the Backbuffer
+void TextCompositePass()
+{
+	Bind()->OMSetRenderTargets(1, &RenderTargetView, NULL);
+	Bind()->VSSetShader(VertexShader, 0, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+	Bind()->OMSetBlendState(TransparentBlendState, NULL, 0xffffffff);
+
+	Bind()->IASetIndexBuffer(D2DIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	UINT Stride = sizeof(Vertex);
+	UINT Offset = 0;
+	Bind()->IASetVertexBuffers(0, 1, &D2DVertBuffer, &Stride, &Offset);
+
+	WVP = XMMatrixIdentity();
+	cbPerObj.World = XMMatrixTranspose(WVP);
+	cbPerObj.WVP = XMMatrixTranspose(WVP);
+	UploadSubresource(cbPerObjectBuffer, &cbPerObj, sizeof(cbPerObject));
+	Bind()->VSSetConstantBuffers(0, 1, &cbPerObjectBuffer);
+
+	Bind()->PSSetShaderResources(0, 1, &D2DTexture);
+	Bind()->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+
+	Bind()->RSSetState(CWCullMode);
+	DrawCall()->DrawIndexed(6, 0, 0);
+}
+
+void FormatPrintText(const wchar_t *text, int inInt)
+{
+	PrintTextLength = max(swprintf_s(PrintText, L"%s%d", text, inInt), 0);
+}
+
+void StartTimer()
+{
+	LARGE_INTEGER FrequencyCount;
+	QueryPerformanceFrequency(&FrequencyCount);
+
+	CountsPerSecond = double(FrequencyCount.QuadPart);
+
+	QueryPerformanceFrequency(&FrequencyCount);
+	CounterStart = FrequencyCount.QuadPart;
+}
+
+double GetTime()
+{
+	LARGE_INTEGER _CurrentTime;
+	QueryPerformanceCounter(&_CurrentTime);
+	return double(_CurrentTime.QuadPart - CounterStart) / CountsPerSecond;
+}
+
+double GetFrameTime()
+{
+	LARGE_INTEGER _CurrentTime;
+	__int64 _TickCount;
+	QueryPerformanceCounter(&_CurrentTime);
+
+	_TickCount = _CurrentTime.QuadPart - FrameTimeOld;
+	FrameTimeOld = _CurrentTime.QuadPart;
+
+	if (_TickCount < 0.0f)
+		_TickCount = 0.0f;
+
+	return float(_TickCount) / CountsPerSecond;
+}
+bool SetupFrameGraph()
+{
+	RenderGraph &Graph = FrameGraph;
+
+	RGBackbuffer = ImportRenderGraphTexture(Graph, "Backbuffer", Backbuffer1, RenderTargetView, NULL);
+	Graph.Resources[RGBackbuffer].Output = true;
+	// The upscale covers every pixel of the Backbuffer
+	Graph.Resources[RGBackbuffer].ClearedByWriter = true;
+
+	RGTextOverlay = ImportRenderGraphTexture(Graph, "TextOverlay", SharedTexture1, NULL, D2DTexture);
+	Graph.Resources[RGTextOverlay].ClearedByWriter = true;
+
+	// Sized for the full resolution so scaling never has to recreate them
+	// The scene shades in linear and the target encodes, so sRGB textures sample through their _SRGB views
+	RGSceneColor = AddRenderGraphTexture(Graph, "SceneColor", Width, Height, DXGI_FORMAT_B8G8R8A8_UNORM_SRGB);
+	Graph.Resources[RGSceneColor].ClearColor[0] = Red;
+	Graph.Resources[RGSceneColor].ClearColor[1] = Green;
+	Graph.Resources[RGSceneColor].ClearColor[2] = Blue;
+	RGDepth = AddRenderGraphTexture(Graph, "Depth", Width, Height, DXGI_FORMAT_D24_UNORM_S8_UINT);
+
+	int Scene = AddRenderGraphPass(Graph, "Scene", ScenePass);
+	RenderGraphWrite(Graph, Scene, RGSceneColor);
+	RenderGraphWrite(Graph, Scene, RGDepth);
+
+	int TerrainNodes = AddRenderGraphPass(Graph, "Terrain", TerrainPass);
+	RenderGraphWrite(Graph, TerrainNodes, RGSceneColor);
+	RenderGraphWrite(Graph, TerrainNodes, RGDepth);
+
+	int Clusters = AddRenderGraphPass(Graph, "Clusters", MeshletPass);
+	RenderGraphWrite(Graph, Clusters, RGSceneColor);
+	RenderGraphWrite(Graph, Clusters, RGDepth);
+
+	int CharactersPass = AddRenderGraphPass(Graph, "Characters", CharacterPass);
+	RenderGraphWrite(Graph, CharactersPass, RGSceneColor);
+	RenderGraphWrite(Graph, CharactersPass, RGDepth);
+
+	// Depth tested against the scene but not written
+	int ParticlesPass = AddRenderGraphPass(Graph, "Particles", ParticlePass);
+	RenderGraphWrite(Graph, ParticlesPass, RGSceneColor);
+	RenderGraphWrite(Graph, ParticlesPass, RGDepth);
+
+	int Upscale = AddRenderGraphPass(Graph, "Upscale", UpscalePass);
+	RenderGraphRead(Graph, Upscale, RGSceneColor);
+	RenderGraphWrite(Graph, Upscale, RGBackbuffer);
+
+	int Text = AddRenderGraphPass(Graph, "Text", TextPass);
+	RenderGraphWrite(Graph, Text, RGTextOverlay);
+
+	int TextComposite = AddRenderGraphPass(Graph, "TextComposite", TextCompositePass);
+	RenderGraphRead(Graph, TextComposite, RGTextOverlay);
+	RenderGraphWrite(Graph, TextComposite, RGBackbuffer);
+
+	CompileRenderGraph(Graph);
+
+	printf("Render Graph: %d of %d passes culled, transient memory %.2f MB aliased (%.2f MB without aliasing)\n",
+		Graph.CulledPasses, (int)Graph.Passes.size(),
+		Graph.AliasedTransientBytes / (1024.0 * 1024.0), Graph.TransientBytes / (1024.0 * 1024.0));
+
+	return RealizeRenderGraph(Graph, D3D11Device);
+}
+
+UINT64 RenderGraphTextureBytes(UINT Width, UINT Height, DXGI_FORMAT Format)
+{
+	UINT BytesPerPixel = 4;
+	switch (Format)
+	{
+		case DXGI_FORMAT_R16G16B16A16_FLOAT:
+		case DXGI_FORMAT_R32G32_FLOAT:
+		case DXGI_FORMAT_D32_FLOAT_S8X24_UINT:
+			BytesPerPixel = 8; break;
+		case DXGI_FORMAT_R32G32B32A32_FLOAT:
+			BytesPerPixel = 16; break;
+		case DXGI_FORMAT_R8_UNORM:
+			BytesPerPixel = 1; break;
+		case DXGI_FORMAT_R16_UNORM:
+		case DXGI_FORMAT_R16_FLOAT:
+		case DXGI_FORMAT_D16_UNORM:
+			BytesPerPixel = 2; break;
+	}
+
+	return (UINT64)Width * Height * BytesPerPixel;
+}
+
+static bool IsDepthFormat(DXGI_FORMAT Format)
+{
+	return Format == DXGI_FORMAT_D24_UNORM_S8_UINT || Format == DXGI_FORMAT_D32_FLOAT ||
+		Format == DXGI_FORMAT_D16_UNORM || Format == DXGI_FORMAT_D32_FLOAT_S8X24_UINT;
+}
+
+DXGI_FORMAT RenderGraphTextureFormat(DXGI_FORMAT Format, UINT BindFlags)
+{
+	if (!(BindFlags & D3D11_BIND_SHADER_RESOURCE))
+		return Format;
+
+	switch (Format)
+	{
+		case DXGI_FORMAT_D24_UNORM_S8_UINT: return DXGI_FORMAT_R24G8_TYPELESS;
+		case DXGI_FORMAT_D32_FLOAT: return DXGI_FORMAT_R32_TYPELESS;
+		case DXGI_FORMAT_D16_UNORM: return DXGI_FORMAT_R16_TYPELESS;
+		case DXGI_FORMAT_D32_FLOAT_S8X24_UINT: return DXGI_FORMAT_R32G8X24_TYPELESS;
+		case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB: return DXGI_FORMAT_B8G8R8A8_TYPELESS;
+		case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB: return DXGI_FORMAT_R8G8B8A8_TYPELESS;
+	}
+	return Format;
+}
+
+DXGI_FORMAT RenderGraphShaderReadFormat(DXGI_FORMAT Format)
+{
+	// An sRGB target is read back encoded, the passes after it work in display encoding like the backbuffer
+	switch (Format)
+	{
+		case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB: return DXGI_FORMAT_B8G8R8A8_UNORM;
+		case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB: return DXGI_FORMAT_R8G8B8A8_UNORM;
+		case DXGI_FORMAT_D24_UNORM_S8_UINT: return DXGI_FORMAT_R24_UNORM_X8_TYPELESS;
+		case DXGI_FORMAT_D32_FLOAT: return DXGI_FORMAT_R32_FLOAT;
+		case DXGI_FORMAT_D16_UNORM: return DXGI_FORMAT_R16_UNORM;
+		case DXGI_FORMAT_D32_FLOAT_S8X24_UINT: return DXGI_FORMAT_R32_FLOAT_X8X24_TYPELESS;
+	}
+	return Format;
+}
+
+int AddRenderGraphTexture(RenderGraph &Graph, const char *Name, UINT Width, UINT Height, DXGI_FORMAT Format)
+{
+	RenderGraphResource Resource = {};
+	Resource.Name = Name;
+	Resource.Width = Width;
+	Resource.Height = Height;
+	Resource.Format = Format;
+	Resource.Physical = -1;
+	Resource.FirstPass = -1;
+	Resource.LastPass = -1;
+
+	Graph.Resources.push_back(Resource);
+	return (int)Graph.Resources.size() - 1;
+}
+
+int ImportRenderGraphTexture(RenderGraph &Graph, const char *Name, ID3D11Texture2D *Texture,
+	ID3D11RenderTargetView *RTV, ID3D11ShaderResourceView *SRV)
+{
+	D3D11_TEXTURE2D_DESC Desc = {};
+	if (Texture)
+		Texture->GetDesc(&Desc);
+
+	int Index = AddRenderGraphTexture(Graph, Name, Desc.Width, Desc.Height, Desc.Format);
+	RenderGraphResource &Resource = Graph.Resources[Index];
+	Resource.Imported = true;
+	Resource.Texture = Texture;
+	Resource.RTV = RTV;
+	Resource.SRV = SRV;
+	return Index;
+}
+
+int AddRenderGraphPass(RenderGraph &Graph, const char *Name, void (*Execute)())
+{
+	RenderGraphPass Pass;
+	Pass.Name = Name;
+	Pass.Execute = Execute;
+	Pass.Culled = false;
+
+	Graph.Passes.push_back(Pass);
+	return (int)Graph.Passes.size() - 1;
+}
+
+void RenderGraphRead(RenderGraph &Graph, int Pass, int Resource)
+{
+	Graph.Passes[Pass].Reads.push_back(Resource);
+}
+
+void RenderGraphWrite(RenderGraph &Graph, int Pass, int Resource)
+{
+	Graph.Passes[Pass].Writes.push_back(Resource);
+}
+
+void CompileRenderGraph(RenderGraph &Graph)
+{
+	int NumPasses = (int)Graph.Passes.size();
+	int NumResources = (int)Graph.Resources.size();
+
+	// Cull: walk the passes backwards. A pass survives if it writes an output,
+	// or something that a surviving later pass reads.
+	std::vector<bool> Needed(NumResources, false);
+	for (int i = 0; i < NumResources; ++i)
+		Needed[i] = Graph.Resources[i].Output;
+
+	Graph.CulledPasses = 0;
+	for (int p = NumPasses - 1; p >= 0; --p)
+	{
+		RenderGraphPass &Pass = Graph.Passes[p];
+		Pass.Culled = true;
+		for (size_t w = 0; w < Pass.Writes.size(); ++w)
+		{
+			if (Needed[Pass.Writes[w]])
+				Pass.Culled = false;
+		}
+
+		if (Pass.Culled)
+		{
+			Graph.CulledPasses++;
+			continue;
+		}
+
+		for (size_t r = 0; r < Pass.Reads.size(); ++r)
+			Needed[Pass.Reads[r]] = true;
+	}
+
+	// Lifetimes, clears, bind flags and transitions over the surviving passes
+	std::vector<RenderGraphState> State(NumResources, RG_STATE_UNDEFINED);
+	for (int i = 0; i < NumResources; ++i)
+	{
+		RenderGraphResource &Resource = Graph.Resources[i];
+		Resource.FirstPass = -1;
+		Resource.LastPass = -1;
+		Resource.Physical = -1;
+		Resource.BindFlags = 0;
+	}
+
+	for (int p = 0; p < NumPasses; ++p)
+	{
+		RenderGraphPass &Pass = Graph.Passes[p];
+		Pass.Clears.clear();
+		Pass.Barriers.clear();
+		if (Pass.Culled)
+			continue;
+
+		for (size_t r = 0; r < Pass.Reads.size(); ++r)
+		{
+			int Index = Pass.Reads[r];
+			RenderGraphResource &Resource = Graph.Resources[Index];
+			if (Resource.FirstPass < 0)
+				Resource.FirstPass = p;
+			Resource.LastPass = p;
+			Resource.BindFlags |= D3D11_BIND_SHADER_RESOURCE;
+
+			if (State[Index] != RG_STATE_SHADER_READ)
+			{
+				RenderGraphBarrier Barrier = { Index, State[Index], RG_STATE_SHADER_READ };
+				Pass.Barriers.push_back(Barrier);
+				State[Index] = RG_STATE_SHADER_READ;
+			}
+		}
+
+		for (size_t w = 0; w < Pass.Writes.size(); ++w)
+		{
+			int Index = Pass.Writes[w];
+			RenderGraphResource &Resource = Graph.Resources[Index];
+			bool Depth = IsDepthFormat(Resource.Format);
+
+			// Whoever writes a resource first in the frame clears it
+			if (Resource.FirstPass < 0 && !Resource.ClearedByWriter)
+				Pass.Clears.push_back(Index);
+
+			if (Resource.FirstPass < 0)
+				Resource.FirstPass = p;
+			Resource.LastPass = p;
+			Resource.BindFlags |= Depth ? D3D11_BIND_DEPTH_STENCIL : D3D11_BIND_RENDER_TARGET;
+
+			RenderGraphState After = Depth ? RG_STATE_DEPTH_WRITE : RG_STATE_RENDER_TARGET;
+			if (State[Index] != After)
+			{
+				RenderGraphBarrier Barrier = { Index, State[Index], After };
+				Pass.Barriers.push_back(Barrier);
+				State[Index] = After;
+			}
+		}
+	}
+
+	// Alias transients. D3D11 has no placed resources, so two transients can only share memory
+	// when they have the same description. Transients are visited in order of first use and take over the
+	// first allocation that is compatible and free again by the time they start.
+	Graph.Physicals.clear();
+	Graph.TransientBytes = 0;
+	Graph.AliasedTransientBytes = 0;
+	for (int p = 0; p < NumPasses; ++p)
+	{
+		for (int i = 0; i < NumResources; ++i)
+		{
+			RenderGraphResource &Resource = Graph.Resources[i];
+			if (Resource.Imported || Resource.FirstPass != p)
+				continue;
+
+			UINT64 Bytes = RenderGraphTextureBytes(Resource.Width, Resource.Height, Resource.Format);
+			Graph.TransientBytes += Bytes;
+
+			for (size_t k = 0; k < Graph.Physicals.size(); ++k)
+			{
+				RenderGraphPhysical &Physical = Graph.Physicals[k];
+				if (Physical.LastPass < Resource.FirstPass && Physical.Width == Resource.Width &&
+					Physical.Height == Resource.Height && Physical.Format == Resource.Format)
+				{
+					Resource.Physical = (int)k;
+					Physical.LastPass = Resource.LastPass;
+					Physical.BindFlags |= Resource.BindFlags;
+					break;
+				}
+			}
+
+			if (Resource.Physical < 0)
+			{
+				RenderGraphPhysical Physical = {};
+				Physical.Width = Resource.Width;
+				Physical.Height = Resource.Height;
+				Physical.Format = Resource.Format;
+				Physical.BindFlags = Resource.BindFlags;
+				Physical.Bytes = Bytes;
+				Physical.LastPass = Resource.LastPass;
+
+				Graph.Physicals.push_back(Physical);
+				Graph.AliasedTransientBytes += Bytes;
+				Resource.Physical = (int)Graph.Physicals.size() - 1;
+			}
+		}
+	}
+}
+
+bool RealizeRenderGraph(RenderGraph &Graph, ID3D11Device *Device)
+{
+	for (size_t k = 0; k < Graph.Physicals.size(); ++k)
+	{
+		RenderGraphPhysical &Physical = Graph.Physicals[k];
+
+		D3D11_TEXTURE2D_DESC Desc = {};
+		Desc.Width = Physical.Width;
+		Desc.Height = Physical.Height;
+		Desc.MipLevels = 1;
+		Desc.ArraySize = 1;
+		Desc.Format = RenderGraphTextureFormat(Physical.Format, Physical.BindFlags);
+		Desc.SampleDesc.Count = 1;
+		Desc.Usage = D3D11_USAGE_DEFAULT;
+		Desc.BindFlags = Physical.BindFlags;
+
+		if (FAILED(Device->CreateTexture2D(&Desc, NULL, &Physical.Texture)))
+			return false;
+
+		if (Physical.BindFlags & D3D11_BIND_RENDER_TARGET)
+		{
+			D3D11_RENDER_TARGET_VIEW_DESC RTVDesc = {};
+			RTVDesc.Format = Physical.Format;
+			RTVDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+			HR(Device->CreateRenderTargetView(Physical.Texture, &RTVDesc, &Physical.RTV));
+		}
+		if (Physical.BindFlags & D3D11_BIND_DEPTH_STENCIL)
+		{
+			D3D11_DEPTH_STENCIL_VIEW_DESC DSVDesc = {};
+			DSVDesc.Format = Physical.Format;
+			DSVDesc.ViewDimension = D3D11_DSV_DIMENSION_TEXTURE2D;
+			HR(Device->CreateDepthStencilView(Physical.Texture, &DSVDesc, &Physical.DSV));
+		}
+		if (Physical.BindFlags & D3D11_BIND_SHADER_RESOURCE)
+		{
+			D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc = {};
+			SRVDesc.Format = RenderGraphShaderReadFormat(Physical.Format);
+			SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+			SRVDesc.Texture2D.MipLevels = 1;
+			HR(Device->CreateShaderResourceView(Physical.Texture, &SRVDesc, &Physical.SRV));
+		}
+	}
+
+	for (size_t i = 0; i < Graph.Resources.size(); ++i)
+	{
+		RenderGraphResource &Resource = Graph.Resources[i];
+		if (Resource.Imported || Resource.Physical < 0)
+			continue;
+
+		RenderGraphPhysical &Physical = Graph.Physicals[Resource.Physical];
+		Resource.Texture = Physical.Texture;
+		Resource.RTV = Physical.RTV;
+		Resource.DSV = Physical.DSV;
+		Resource.SRV = Physical.SRV;
+	}
+
+	return true;
+}
+
+void ExecuteRenderGraph(RenderGraph &Graph, ID3D11DeviceContext *Context)
+{
+	for (size_t p = 0; p < Graph.Passes.size(); ++p)
+	{
+		RenderGraphPass &Pass = Graph.Passes[p];
+		if (Pass.Culled)
+			continue;
+
+		// D3D11 tracks hazards itself, but a resource still bound to the OM gets silently
+		// unbound (with a debug layer warning) when we bind it as a texture, and the other way around.
+		bool UnbindTargets = false;
+		bool UnbindTextures = false;
+		for (size_t b = 0; b < Pass.Barriers.size(); ++b)
+		{
+			const RenderGraphBarrier &Barrier = Pass.Barriers[b];
+			if (Barrier.After == RG_STATE_SHADER_READ && Barrier.Before != RG_STATE_UNDEFINED)
+				UnbindTargets = true;
+			if (Barrier.Before == RG_STATE_SHADER_READ)
+				UnbindTextures = true;
+		}
+
+		UINT Binds = 0;
+		if (UnbindTargets)
+			Bind(Context, Binds)->OMSetRenderTargets(0, NULL, NULL);
+		if (UnbindTextures)
+		{
+			ID3D11ShaderResourceView *NullSRV[1] = { NULL };
+			Bind(Context, Binds)->PSSetShaderResources(0, 1, NullSRV);
+		}
+		CountContextWork(0, Binds, 0);
+
+		for (size_t c = 0; c < Pass.Clears.size(); ++c)
+		{
+			RenderGraphResource &Resource = Graph.Resources[Pass.Clears[c]];
+			if (Resource.DSV)
+				Context->ClearDepthStencilView(Resource.DSV, D3D11_CLEAR_DEPTH | D3D11_CLEAR_STENCIL, 1.0f, 0);
+			else if (Resource.RTV)
+				Context->ClearRenderTargetView(Resource.RTV, Resource.ClearColor);
+		}
+
+		LARGE_INTEGER Start, End;
+		QueryPerformanceCounter(&Start);
+		Pass.Execute();
+		QueryPerformanceCounter(&End);
+		if (COUNTER_ZONE_PASSES + p < MAX_COUNTER_ZONES)
+			PerfCounters.ZoneMs[COUNTER_ZONE_PASSES + p] = CounterMs(Start, End);
+	}
+}
+
+void ReleaseRenderGraph(RenderGraph &Graph)
+{
+	for (size_t k = 0; k < Graph.Physicals.size(); ++k)
+	{
+		RenderGraphPhysical &Physical = Graph.Physicals[k];
+		if (Physical.RTV) Physical.RTV->Release();
+		if (Physical.DSV) Physical.DSV->Release();
+		if (Physical.SRV) Physical.SRV->Release();
+		if (Physical.Texture) Physical.Texture->Release();
+	}
+
+	Graph.Physicals.clear();
+	Graph.Passes.clear();
+	Graph.Resources.clear();
+}
+
+static bool HasRenderGraphBarrier(const RenderGraphPass &Pass, int Resource, RenderGraphState Before, RenderGraphState After)
+{
+	for (size_t b = 0; b < Pass.Barriers.size(); ++b)
+	{
+		const RenderGraphBarrier &Barrier = Pass.Barriers[b];
+		if (Barrier.Resource == Resource && Barrier.Before == Before && Barrier.After == After)
+			return true;
+	}
+	return false;
+}
+
+static bool HasRenderGraphClear(const RenderGraphPass &Pass, int Resource)
+{
+	return std::find(Pass.Clears.begin(), Pass.Clears.end(), Resource) != Pass.Clears.end();
+}
+
+// A deferred frame: the GBuffer's depth is read by the lighting, a bloom target shaped like the albedo starts after the
+// albedo's last read and takes its memory over, and a debug view nothing reads is culled.
+int RunRenderGraphTest()
+{
+	RenderGraph Graph;
+	int Backbuffer = AddRenderGraphTexture(Graph, "Backbuffer", Width, Height, DXGI_FORMAT_B8G8R8A8_UNORM);
+	Graph.Resources[Backbuffer].Imported = true;
+	Graph.Resources[Backbuffer].Output = true;
+	int Albedo = AddRenderGraphTexture(Graph, "Albedo", Width, Height, DXGI_FORMAT_B8G8R8A8_UNORM);
+	int Depth = AddRenderGraphTexture(Graph, "Depth", Width, Height, DXGI_FORMAT_D24_UNORM_S8_UINT);
+	int Lit = AddRenderGraphTexture(Graph, "Lit", Width, Height, DXGI_FORMAT_R16G16B16A16_FLOAT);
+	int Bloom = AddRenderGraphTexture(Graph, "Bloom", Width, Height, DXGI_FORMAT_B8G8R8A8_UNORM);
+	int Debug = AddRenderGraphTexture(Graph, "Debug", Width, Height, DXGI_FORMAT_B8G8R8A8_UNORM);
+
+	int GBuffer = AddRenderGraphPass(Graph, "GBuffer", NULL);
+	RenderGraphWrite(Graph, GBuffer, Albedo);
+	RenderGraphWrite(Graph, GBuffer, Depth);
+
+	int Lighting = AddRenderGraphPass(Graph, "Lighting", NULL);
+	RenderGraphRead(Graph, Lighting, Albedo);
+	RenderGraphRead(Graph, Lighting, Depth);
+	RenderGraphWrite(Graph, Lighting, Lit);
+
+	int DebugView = AddRenderGraphPass(Graph, "DebugView", NULL);
+	RenderGraphRead(Graph, DebugView, Depth);
+	RenderGraphWrite(Graph, DebugView, Debug);
+
+	int BloomPass = AddRenderGraphPass(Graph, "Bloom", NULL);
+	RenderGraphRead(Graph, BloomPass, Lit);
+	RenderGraphWrite(Graph, BloomPass, Bloom);
+
+	int Tonemap = AddRenderGraphPass(Graph, "Tonemap", NULL);
+	RenderGraphRead(Graph, Tonemap, Lit);
+	RenderGraphRead(Graph, Tonemap, Bloom);
+	RenderGraphWrite(Graph, Tonemap, Backbuffer);
+
+	CompileRenderGraph(Graph);
+
+	int Failures = 0;
+	const std::vector<RenderGraphPass> &Passes = Graph.Passes;
+	const std::vector<RenderGraphResource> &Resources = Graph.Resources;
+
+	// Culling
+	Failures += Graph.CulledPasses != 1 || !Passes[DebugView].Culled;
+	Failures += Passes[GBuffer].Culled || Passes[Lighting].Culled || Passes[BloomPass].Culled || Passes[Tonemap].Culled;
+	Failures += Resources[Debug].FirstPass != -1 || Resources[Debug].Physical != -1;
+
+	// Clears by the first writer only
+	Failures += !HasRenderGraphClear(Passes[GBuffer], Albedo) || !HasRenderGraphClear(Passes[GBuffer], Depth);
+	Failures += !HasRenderGraphClear(Passes[Lighting], Lit) || !HasRenderGraphClear(Passes[BloomPass], Bloom);
+	Failures += !HasRenderGraphClear(Passes[Tonemap], Backbuffer) || Passes[Lighting].Clears.size() != 1;
+
+	// Transitions
+	Failures += !HasRenderGraphBarrier(Passes[GBuffer], Albedo, RG_STATE_UNDEFINED, RG_STATE_RENDER_TARGET);
+	Failures += !HasRenderGraphBarrier(Passes[GBuffer], Depth, RG_STATE_UNDEFINED, RG_STATE_DEPTH_WRITE);
+	Failures += !HasRenderGraphBarrier(Passes[Lighting], Albedo, RG_STATE_RENDER_TARGET, RG_STATE_SHADER_READ);
+	Failures += !HasRenderGraphBarrier(Passes[Lighting], Depth, RG_STATE_DEPTH_WRITE, RG_STATE_SHADER_READ);
+	Failures += !HasRenderGraphBarrier(Passes[BloomPass], Lit, RG_STATE_RENDER_TARGET, RG_STATE_SHADER_READ);
+	// Lit stays readable from the bloom to the tonemap, so that needs no second transition
+	Failures += Passes[Tonemap].Barriers.size() != 2 || !HasRenderGraphBarrier(Passes[Tonemap], Bloom, RG_STATE_RENDER_TARGET, RG_STATE_SHADER_READ);
+
+	// Aliasing: the bloom takes the albedo's memory, nothing else matches or is free in time
+	Failures += Resources[Bloom].Physical != Resources[Albedo].Physical;
+	Failures += Resources[Depth].Physical == Resources[Albedo].Physical || Resources[Lit].Physical == Resources[Albedo].Physical;
+	Failures += Graph.Physicals.size() != 3;
+	UINT64 ColorBytes = RenderGraphTextureBytes(Width, Height, DXGI_FORMAT_B8G8R8A8_UNORM);
+	Failures += Graph.TransientBytes - Graph.AliasedTransientBytes != ColorBytes;
+
+	// The depth is read, so it has to be typeless with a depth and a color view
+	const RenderGraphPhysical &DepthMemory = Graph.Physicals[Resources[Depth].Physical];
+	Failures += DepthMemory.BindFlags != (D3D11_BIND_DEPTH_STENCIL | D3D11_BIND_SHADER_RESOURCE);
+	Failures += RenderGraphTextureFormat(DepthMemory.Format, DepthMemory.BindFlags) != DXGI_FORMAT_R24G8_TYPELESS;
+	Failures += RenderGraphShaderReadFormat(DepthMemory.Format) != DXGI_FORMAT_R24_UNORM_X8_TYPELESS;
+	Failures += RenderGraphTextureFormat(DXGI_FORMAT_D24_UNORM_S8_UINT, D3D11_BIND_DEPTH_STENCIL) != DXGI_FORMAT_D24_UNORM_S8_UINT;
+	// A read sRGB target renders through its _SRGB view and is read back through the plain one
+	Failures += RenderGraphTextureFormat(DXGI_FORMAT_B8G8R8A8_UNORM_SRGB, D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE) !=
+		DXGI_FORMAT_B8G8R8A8_TYPELESS;
+	Failures += RenderGraphShaderReadFormat(DXGI_FORMAT_B8G8R8A8_UNORM_SRGB) != DXGI_FORMAT_B8G8R8A8_UNORM;
+
+	int Transients = 0;
+	for (size_t i = 0; i < Resources.size(); ++i)
+		Transients += !Resources[i].Imported && Resources[i].Physical >= 0;
+	printf("Render graph test: %d of %d passes culled, %d allocations for %d transients, %.2f MB aliased (%.2f MB without aliasing)\n",
+		Graph.CulledPasses, (int)Passes.size(), (int)Graph.Physicals.size(), Transients,
+		Graph.AliasedTransientBytes / (1024.0 * 1024.0), Graph.TransientBytes / (1024.0 * 1024.0));
+	printf("  %d of the checks failed\n", Failures);
+	return Failures == 0 ? 0 : 1;
+}
+
+bool InitDynamicResolution()
+{
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "UPSCALE_VS", "vs_5_0", 0, 0, &UpscaleVSBuffer, 0));
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "UPSCALE_PS", "ps_5_0", 0, 0, &UpscalePSBuffer, 0));
+	HR(D3D11Device->CreateVertexShader(UpscaleVSBuffer->GetBufferPointer(), UpscaleVSBuffer->GetBufferSize(), 0, &UpscaleVS));
+	HR(D3D11Device->CreatePixelShader(UpscalePSBuffer->GetBufferPointer(), UpscalePSBuffer->GetBufferSize(), 0, &UpscalePS));
+
+	D3D11_BUFFER_DESC ConstantBufferDesc = {};
+	ConstantBufferDesc.ByteWidth = sizeof(cbUpscale);
+	ConstantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	HR(D3D11Device->CreateBuffer(&ConstantBufferDesc, 0, &cbUpscaleBuffer));
+
+	// Clamped at the texture's edges, UPSCALE_PS keeps the filter out of the unused part of the scene target
+	D3D11_SAMPLER_DESC SamplerDesc = {};
+	SamplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+	SamplerDesc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+	SamplerDesc.MaxLOD = D3D11_FLOAT32_MAX;
+	HR(D3D11Device->CreateSamplerState(&SamplerDesc, &UpscaleSamplerState));
+
+	// A ring of timestamp queries, each frame reads back the one written GPU_TIMER_FRAMES frames ago
+	// so we never wait on the GPU.
+	D3D11_QUERY_DESC QueryDesc = {};
+	for (int i = 0; i < GPU_TIMER_FRAMES; ++i)
+	{
+		QueryDesc.Query = D3D11_QUERY_TIMESTAMP_DISJOINT;
+		HR(D3D11Device->CreateQuery(&QueryDesc, &GpuDisjointQueries[i]));
+		QueryDesc.Query = D3D11_QUERY_TIMESTAMP;
+		HR(D3D11Device->CreateQuery(&QueryDesc, &GpuBeginQueries[i]));
+		HR(D3D11Device->CreateQuery(&QueryDesc, &GpuEndQueries[i]));
+	}
+
+	// 60Hz budget
+	ResetResolutionController(DynamicResolution, 1000.0 / 60.0);
+
+	return true;
+}
+
+void ReleaseDynamicResolution()
+{
+	for (int i = 0; i < GPU_TIMER_FRAMES; ++i)
+	{
+		GpuDisjointQueries[i]->Release();
+		GpuBeginQueries[i]->Release();
+		GpuEndQueries[i]->Release();
+	}
+
+	UpscaleVS->Release();
+	UpscalePS->Release();
+	UpscaleVSBuffer->Release();
+	UpscalePSBuffer->Release();
+	cbUpscaleBuffer->Release();
+	UpscaleSamplerState->Release();
+}
+
+void BeginGpuFrameTimer()
+{
+	int Slot = GpuTimerFrame % GPU_TIMER_FRAMES;
+	D3D11DeviceContext->Begin(GpuDisjointQueries[Slot]);
+	D3D11DeviceContext->End(GpuBeginQueries[Slot]);
+}
+
+void EndGpuFrameTimer()
+{
+	int Slot = GpuTimerFrame % GPU_TIMER_FRAMES;
+	D3D11DeviceContext->End(GpuEndQueries[Slot]);
+	D3D11DeviceContext->End(GpuDisjointQueries[Slot]);
+	GpuTimerFrame++;
+}
+
+void UpdateDynamicResolution()
+{
+	if (GpuTimerFrame < GPU_TIMER_FRAMES)
+		return;
+
+	// The slot we are about to reuse holds the oldest frame
+	int Slot = GpuTimerFrame % GPU_TIMER_FRAMES;
+
+	D3D11_QUERY_DATA_TIMESTAMP_DISJOINT Disjoint;
+	UINT64 Begin, End;
+	if (D3D11DeviceContext->GetData(GpuDisjointQueries[Slot], &Disjoint, sizeof(Disjoint), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK ||
+		D3D11DeviceContext->GetData(GpuBeginQueries[Slot], &Begin, sizeof(Begin), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK ||
+		D3D11DeviceContext->GetData(GpuEndQueries[Slot], &End, sizeof(End), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+		return;
+
+	// The GPU clock changed frequency during the frame, the timestamps are meaningless
+	if (Disjoint.Disjoint)
+		return;
+
+	GpuFrameTime = double(End - Begin) * 1000.0 / double(Disjoint.Frequency);
+	double Scale = UpdateResolutionController(DynamicResolution, GpuFrameTime);
+
+	ScaledWidth = max(1, (UINT)(Width * Scale + 0.5));
+	ScaledHeight = max(1, (UINT)(Height * Scale + 0.5));
+}
+
+void UpscalePass()
+{
+	D3D11_VIEWPORT Viewport = {};
+	Viewport.Width = Width;
+	Viewport.Height = Height;
+	Viewport.MinDepth = 0.0f;
+	Viewport.MaxDepth = 1.0f;
+	Bind()->RSSetViewports(1, &Viewport);
+
+	Bind()->OMSetRenderTargets(1, &RenderTargetView, NULL);
+	Bind()->OMSetBlendState(0, 0, 0xffffffff);
+	Bind()->RSSetState(NoCullMode);
+
+	cbUpscale Constants = {};
+	Constants.UVScale = XMFLOAT2((float)ScaledWidth / Width, (float)ScaledHeight / Height);
+	Constants.UVMax = XMFLOAT2((ScaledWidth - 0.5f) / Width, (ScaledHeight - 0.5f) / Height);
+	UploadSubresource(cbUpscaleBuffer, &Constants, sizeof(cbUpscale));
+	Bind()->PSSetConstantBuffers(1, 1, &cbUpscaleBuffer);
+
+	ID3D11ShaderResourceView *SceneColor = FrameGraph.Resources[RGSceneColor].SRV;
+	Bind()->PSSetShaderResources(0, 1, &SceneColor);
+	Bind()->PSSetSamplers(1, 1, &UpscaleSamplerState);
+
+	// The triangle is generated in the VS, so no Input Layout or Vertex Buffer is needed
+	Bind()->IASetInputLayout(NULL);
+	Bind()->VSSetShader(UpscaleVS, 0, 0);
+	Bind()->PSSetShader(UpscalePS, 0, 0);
+	DrawCall()->Draw(3, 0);
+
+	Bind()->IASetInputLayout(VertexLayout);
+}
+
+void ResetResolutionController(ResolutionController &Controller, double TargetMs)
+{
+	Controller.TargetMs = TargetMs;
+	Controller.Kp = 0.1;
+	Controller.Ki = 0.05;
+	Controller.MinScale = 0.5;
+	Controller.MaxScale = 1.0;
+
+	// Start out at full resolution
+	Controller.Scale = Controller.MaxScale;
+	Controller.Integral = Controller.MaxScale / Controller.Ki;
+}
+
+double UpdateResolutionController(ResolutionController &Controller, double GpuMs)
+{
+	// Positive when we have headroom
+	double Error = (Controller.TargetMs - GpuMs) / Controller.TargetMs;
+
+	double Integral = Controller.Integral + Error;
+	double Scale = Controller.Kp * Error + Controller.Ki * Integral;
+
+	// Anti-windup: stop integrating while the output is pinned to a limit
+	if (Scale > Controller.MaxScale)
+		Scale = Controller.MaxScale;
+	else if (Scale < Controller.MinScale)
+		Scale = Controller.MinScale;
+	else
+		Controller.Integral = Integral;
+
+	Controller.Scale = Scale;
+	return Scale;
+}
+
+ResolutionControllerMetrics EvaluateResolutionController(ResolutionController Controller, const double *FullResolutionMs, int Frames, double Tolerance)
+{
+	ResolutionControllerMetrics Metrics = {};
+	Metrics.SettleFrame = -1;
+
+	std::vector<double> GpuMs(Frames);
+	std::vector<bool> Settled(Frames);
+
+	double LastDelta = 0.0;
+	for (int i = 0; i < Frames; ++i)
+	{
+		// Synthetic GPU cost, proportional to the pixel count at the scale picked last frame
+		double PreviousScale = Controller.Scale;
+		GpuMs[i] = FullResolutionMs[i] * Controller.Scale * Controller.Scale;
+		double Scale = UpdateResolutionController(Controller, GpuMs[i]);
+
+		bool Pinned = Scale <= Controller.MinScale || Scale >= Controller.MaxScale;
+		Settled[i] = Pinned || fabs(GpuMs[i] - Controller.TargetMs) <= Tolerance * Controller.TargetMs;
+
+		double Delta = Scale - PreviousScale;
+		if (Delta * LastDelta < 0.0)
+			Metrics.Oscillations++;
+		if (Delta != 0.0)
+			LastDelta = Delta;
+	}
+
+	for (int i = Frames - 1; i >= 0 && Settled[i]; --i)
+		Metrics.SettleFrame = i;
+
+	if (Metrics.SettleFrame >= 0)
+	{
+		for (int i = Metrics.SettleFrame; i < Frames; ++i)
+		{
+			Metrics.MaxOvershootMs = max(Metrics.MaxOvershootMs, GpuMs[i] - Controller.TargetMs);
+			Metrics.MeanAbsErrorMs += fabs(GpuMs[i] - Controller.TargetMs);
+		}
+		Metrics.MeanAbsErrorMs /= (Frames - Metrics.SettleFrame);
+	}
+
+	Metrics.FinalScale = Controller.Scale;
+	return Metrics;
+}
+
+// The GPU cost at full resolution jumps from under the budget to 30ms, spikes to 60ms for three frames, or climbs
+// from 10ms to 40ms over five seconds. The scale has to follow within half a second and then hold without hunting.
+int RunResolutionTest()
+{
+	const int Frames = 600;
+	const double TargetMs = 1000.0 / 60.0;
+	const double Tolerance = 0.1;
+	const int StepFrame = 120;
+	const int SpikeFrame = 300;
+	const int SpikeFrames = 3;
+	const int RampStart = 100;
+	const int RampEnd = 400;
+
+	std::vector<double> Step(Frames), Spike(Frames), Ramp(Frames);
+	for (int i = 0; i < Frames; ++i)
+	{
+		Step[i] = i < StepFrame ? 12.0 : 30.0;
+		Spike[i] = i >= SpikeFrame && i < SpikeFrame + SpikeFrames ? 60.0 : 25.0;
+		Ramp[i] = 10.0 + 30.0 * min(max(i - RampStart, 0), RampEnd - RampStart) / (RampEnd - RampStart);
+	}
+
+	ResolutionController Controller;
+	ResetResolutionController(Controller, TargetMs);
+
+	int Failures = 0;
+	const char *Names[3] = { "step", "spike", "ramp" };
+	const std::vector<double> *Traces[3] = { &Step, &Spike, &Ramp };
+	// Frame the load last changed, and the bounds on the settling and the hunting after it
+	const int Disturbances[3] = { StepFrame, SpikeFrame + SpikeFrames, 0 };
+	const int MaxSettleFrames = 30;
+	const int MaxOscillations[3] = { 10, 10, 2 };
+	const double MaxMeanErrorMs[3] = { 0.05 * TargetMs, 0.05 * TargetMs, 0.15 * TargetMs };
+	for (int t = 0; t < 3; ++t)
+	{
+		const std::vector<double> &Trace = *Traces[t];
+		ResolutionControllerMetrics Metrics = EvaluateResolutionController(Controller, Trace.data(), Frames, Tolerance);
+
+		// Where the cost at the scale matches the budget for the final load
+		double ExpectedScale = min(max(sqrt(TargetMs / Trace[Frames - 1]), Controller.MinScale), Controller.MaxScale);
+		bool Passed = Metrics.SettleFrame >= 0 && Metrics.SettleFrame - Disturbances[t] <= MaxSettleFrames &&
+			Metrics.MaxOvershootMs <= Tolerance * TargetMs && Metrics.MeanAbsErrorMs <= MaxMeanErrorMs[t] &&
+			Metrics.Oscillations <= MaxOscillations[t] && fabs(Metrics.FinalScale - ExpectedScale) <= 0.02;
+		Failures += !Passed;
+
+		printf("Resolution test, %s: settled on frame %d, %.2f ms worst overshoot, %.2f ms mean error, %d reversals, scale %.3f (%.3f expected)%s\n",
+			Names[t], Metrics.SettleFrame, Metrics.MaxOvershootMs, Metrics.MeanAbsErrorMs, Metrics.Oscillations,
+			Metrics.FinalScale, ExpectedScale, Passed ? "" : " FAILED");
+	}
+
+	printf("  %d of the checks failed\n", Failures);
+	return Failures == 0 ? 0 : 1;
+}
+
+// Finds Option in the command line. Value receives the word following it, or an empty string.
+bool GetCommandLineOption(const char *CommandLine, const char *Option, char *Value, int ValueSize)
+{
+	Value[0] = 0;
+
+	// Whole words only, -capture mustn't match -capturetest
+	size_t OptionLength = strlen(Option);
+	const char *Found = strstr(CommandLine, Option);
+	while (Found && ((Found != CommandLine && Found[-1] != ' ') || (Found[OptionLength] && Found[OptionLength] != ' ')))
+		Found = strstr(Found + OptionLength, Option);
+	if (!Found)
+		return false;
+
+	const char *Next = Found + OptionLength;
+	while (*Next == ' ')
+		Next++;
+
+	// The next word is a value unless it is another option
+	if (*Next == '-')
+		return true;
+
+	int Length = 0;
+	while (Next[Length] && Next[Length] != ' ' && Length < ValueSize - 1)
+	{
+		Value[Length] = Next[Length];
+		Length++;
+	}
+	Value[Length] = 0;
+
+	return true;
+}
+
+// We are a Windows subsystem application, so printf goes nowhere unless we borrow the console we were started from
+void AttachParentConsole()
+{
+	if (AttachConsole(ATTACH_PARENT_PROCESS))
+	{
+		FILE *Stream;
+		freopen_s(&Stream, "CONOUT$", "w", stdout);
+		freopen_s(&Stream, "CONOUT$", "w", stderr);
+	}
+}
+
+void OpenStatsConsole()
+{
+	if (AttachConsole(ATTACH_PARENT_PROCESS) || AllocConsole())
+	{
+		FILE *Stream;
+		freopen_s(&Stream, "CONOUT$", "w", stdout);
+		freopen_s(&Stream, "CONOUT$", "w", stderr);
+		// Unbuffered, a windowed run would hold the stats back until the buffer fills
+		setvbuf(stdout, NULL, _IONBF, 0);
+	}
+}
+
+// Scratch the benchmarks work on, sized for the largest object count
+const int BENCHMARK_MAX_OBJECTS = 16384;
+XMMATRIX *BenchmarkWorlds;
+cbPerObject *BenchmarkConstants;
+XMFLOAT3 *BenchmarkLightPositions;
+Vertex *BenchmarkVertices;
+DWORD *BenchmarkIndices;
+DrawItem *BenchmarkDrawItems;
+int BenchmarkRecordThreads;
+volatile float BenchmarkSink;
+
+void BenchmarkUpdateScene(int Objects)
+{
+	for (int i = 0; i < Objects; ++i)
+		BenchmarkWorlds[i] = ComposeOrbitWorld(Rot + i * 0.001f, RotX, RotZ);
+	BenchmarkSink = XMVectorGetX(BenchmarkWorlds[Objects - 1].r[3]);
+}
+
+void BenchmarkObjectConstants(int Objects)
+{
+	for (int i = 0; i < Objects; ++i)
+		BuildObjectConstants(BenchmarkWorlds[i], CameraView, CameraProjection, BenchmarkConstants[i]);
+	BenchmarkSink = XMVectorGetX(BenchmarkConstants[Objects - 1].WVP.r[0]);
+}
+
+void BenchmarkLightTransform(int Objects)
+{
+	for (int i = 0; i < Objects; ++i)
+		BenchmarkLightPositions[i] = TransformLightPosition(BenchmarkWorlds[i]);
+	BenchmarkSink = BenchmarkLightPositions[Objects - 1].x;
+}
+
+void BenchmarkFormatText(int Objects)
+{
+	for (int i = 0; i < Objects; ++i)
+		FormatPrintText(L"FPS: ", i);
+	BenchmarkSink = (float)PrintTextLength;
+}
+
+void BenchmarkGeometry(int Objects)
+{
+	for (int i = 0; i < Objects; ++i)
+		BuildCubeGeometry(&BenchmarkVertices[i * CUBE_VERTEX_COUNT], &BenchmarkIndices[i * CUBE_INDEX_COUNT], i * CUBE_VERTEX_COUNT);
+	BenchmarkSink = BenchmarkVertices[(Objects - 1) * CUBE_VERTEX_COUNT].pos.x;
+}
+
+void BenchmarkRecordDraws(int Objects)
+{
+	static NullCommandBuffer Buffers[MAX_RECORD_THREADS];
+	CommandBuffer *BufferPointers[MAX_RECORD_THREADS];
+	for (int i = 0; i < MAX_RECORD_THREADS; ++i)
+		BufferPointers[i] = &Buffers[i];
+
+	RecordDrawList(BufferPointers, BenchmarkRecordThreads, BenchmarkDrawItems, Objects);
+	BenchmarkSink = Buffers[0].Checksum;
+}
+
+// The real thing: the first chunk on the immediate context, the others on deferred contexts played back with
+// ExecuteCommandList, on the WARP device
+void BenchmarkRecordDrawsD3D11(int Objects)
+{
+	RecordDrawList(SceneCommandBuffers, BenchmarkRecordThreads, BenchmarkDrawItems, Objects);
+	BenchmarkSink = (float)SceneCommandBuffers[0]->Draws;
+}
+
+// Rate of the time stamp counter QueryThreadCycleTime counts in, measured against the performance counter
+static double CyclesPerSecond = 0.0;
+
+static void CalibrateThreadCycles()
+{
+	LARGE_INTEGER Frequency, Start, Now;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+	UINT64 StartCycles = __rdtsc();
+	do
+	{
+		QueryPerformanceCounter(&Now);
+	} while (double(Now.QuadPart - Start.QuadPart) / Frequency.QuadPart < 0.05);
+	UINT64 EndCycles = __rdtsc();
+
+	CyclesPerSecond = double(EndCycles - StartCycles) * Frequency.QuadPart / double(Now.QuadPart - Start.QuadPart);
+}
+
+// GetThreadTimes only moves on the scheduler tick, about 15.6ms, while the cycle count is exact
+static double ThreadCpuSeconds()
+{
+	ULONG64 Cycles;
+	QueryThreadCycleTime(GetCurrentThread(), &Cycles);
+	return double(Cycles) / CyclesPerSecond;
+}
+
+// Doubles the iteration count until a batch runs for at least 50ms, then keeps the fastest of 5 batches
+static BenchmarkResult RunBenchmark(const char *Name, BenchmarkFunction Function, int Objects)
+{
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+
+	BenchmarkResult Result = {};
+	Result.Name = Name;
+	Result.Objects = Objects;
+
+	Function(Objects);
+
+	UINT64 Iterations = 1;
+	for (;;)
+	{
+		QueryPerformanceCounter(&Start);
+		for (UINT64 i = 0; i < Iterations; ++i)
+			Function(Objects);
+		QueryPerformanceCounter(&End);
+
+		if (double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart >= 0.05)
+			break;
+		Iterations *= 2;
+	}
+
+	Result.Iterations = Iterations;
+	Result.RealNs = 1e30;
+	Result.CpuNs = 1e30;
+	for (int Batch = 0; Batch < 5; ++Batch)
+	{
+		double CpuStart = ThreadCpuSeconds();
+		QueryPerformanceCounter(&Start);
+		for (UINT64 i = 0; i < Iterations; ++i)
+			Function(Objects);
+		QueryPerformanceCounter(&End);
+		double CpuEnd = ThreadCpuSeconds();
+
+		double RealNs = double(End.QuadPart - Start.QuadPart) * 1e9 / Frequency.QuadPart / Iterations;
+		double CpuNs = (CpuEnd - CpuStart) * 1e9 / Iterations;
+		Result.RealNs = min(Result.RealNs, RealNs);
+		Result.CpuNs = min(Result.CpuNs, CpuNs);
+	}
+
+	printf("%-20s %6d objects %12.1f ns %10.2f ns/object\n", Name, Objects, Result.RealNs, Result.RealNs / Objects);
+	return Result;
+}
+
+int RunBenchmarks(const char *OutputPath)
+{
+	CalibrateThreadCycles();
+
+	BenchmarkWorlds = (XMMATRIX *)_aligned_malloc(sizeof(XMMATRIX) * BENCHMARK_MAX_OBJECTS, 16);
+	BenchmarkConstants = (cbPerObject *)_aligned_malloc(sizeof(cbPerObject) * BENCHMARK_MAX_OBJECTS, 16);
+	BenchmarkLightPositions = new XMFLOAT3[BENCHMARK_MAX_OBJECTS];
+	BenchmarkVertices = new Vertex[BENCHMARK_MAX_OBJECTS * CUBE_VERTEX_COUNT];
+	BenchmarkIndices = new DWORD[BENCHMARK_MAX_OBJECTS * CUBE_INDEX_COUNT];
+	BenchmarkDrawItems = new DrawItem[BENCHMARK_MAX_OBJECTS];
+
+	// Same camera InitScene sets up
+	CameraPosition = XMVectorSet(0.0f, 3.0f, -8.0f, 0.0f);
+	CameraTarget = XMVectorSet(0.0f, 0.0f, 0.0f, 0.0f);
+	CameraUp = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+	CameraView = XMMatrixLookAtLH(CameraPosition, CameraTarget, CameraUp);
+	CameraProjection = XMMatrixPerspectiveFovLH((0.4f * 3.14f), (float)Width / Height, 1.0f, 1000.0f);
+	for (int i = 0; i < BENCHMARK_MAX_OBJECTS; ++i)
+	{
+		BenchmarkWorlds[i] = ComposeOrbitWorld(i * 0.001f, RotX, RotZ);
+		XMStoreFloat4x4(&BenchmarkDrawItems[i].World, BenchmarkWorlds[i]);
+		BenchmarkDrawItems[i].Mesh = SCENE_MESH_CUBE;
+		BenchmarkDrawItems[i].Material = 0;
+	}
+
+	struct
+	{
+		const char *Name;
+		BenchmarkFunction Function;
+	} Benchmarks[] =
+	{
+		{ "UpdateScene", BenchmarkUpdateScene },
+		{ "ObjectConstants", BenchmarkObjectConstants },
+		{ "LightTransform", BenchmarkLightTransform },
+		{ "FormatText", BenchmarkFormatText },
+		{ "CubeGeometry", BenchmarkGeometry },
+	};
+	const int ObjectCounts[] = { 1, 16, 256, 4096, BENCHMARK_MAX_OBJECTS };
+
+	std::vector<BenchmarkResult> Results;
+	for (int b = 0; b < ARRAYSIZE(Benchmarks); ++b)
+	{
+		for (int c = 0; c < ARRAYSIZE(ObjectCounts); ++c)
+			Results.push_back(RunBenchmark(Benchmarks[b].Name, Benchmarks[b].Function, ObjectCounts[c]));
+	}
+
+	// Draw recording on the null command buffers, the draw count stays fixed and the thread count changes
+	for (int Threads = 1; Threads <= min(JobThreadCount(), MAX_RECORD_THREADS); Threads *= 2)
+	{
+		BenchmarkRecordThreads = Threads;
+		BenchmarkResult Result = RunBenchmark("RecordDraws", BenchmarkRecordDraws, BENCHMARK_MAX_OBJECTS);
+		Result.Threads = Threads;
+		Results.push_back(Result);
+		printf("%-20s %6d threads %12.0f draws/sec\n", "RecordDraws", Threads, BENCHMARK_MAX_OBJECTS * 1e9 / Result.RealNs);
+	}
+
+	// Then on the D3D11 command buffers, where the command lists get built and executed too
+	if (InitHeadlessScene())
+	{
+		for (int Threads = 1; Threads <= min(JobThreadCount(), MAX_RECORD_THREADS); Threads *= 2)
+		{
+			BenchmarkRecordThreads = Threads;
+			BenchmarkResult Result = RunBenchmark("RecordDrawsD3D11", BenchmarkRecordDrawsD3D11, BENCHMARK_MAX_OBJECTS);
+			Result.Threads = Threads;
+			Results.push_back(Result);
+			printf("%-20s %6d threads %12.0f draws/sec\n", "RecordDrawsD3D11", Threads, BENCHMARK_MAX_OBJECTS * 1e9 / Result.RealNs);
+		}
+	}
+	else
+		printf("No WARP device, the D3D11 recording isn't measured\n");
+
+	_aligned_free(BenchmarkWorlds);
+	_aligned_free(BenchmarkConstants);
+	delete[] BenchmarkLightPositions;
+	delete[] BenchmarkVertices;
+	delete[] BenchmarkIndices;
+	delete[] BenchmarkDrawItems;
+
+	FILE *File;
+	if (fopen_s(&File, OutputPath, "w") != 0)
+	{
+		printf("Could not open %s\n", OutputPath);
+		return 1;
+	}
+
+	SYSTEM_INFO SystemInfo;
+	GetSystemInfo(&SystemInfo);
+	SYSTEMTIME Time;
+	GetLocalTime(&Time);
+
+	fprintf(File, "{\n  \"context\": {\n");
+	fprintf(File, "    \"date\": \"%04d-%02d-%02dT%02d:%02d:%02d\",\n", Time.wYear, Time.wMonth, Time.wDay, Time.wHour, Time.wMinute, Time.wSecond);
+	fprintf(File, "    \"num_cpus\": %u,\n", SystemInfo.dwNumberOfProcessors);
+#if defined(DEBUG) | defined(_DEBUG)
+	fprintf(File, "    \"library_build_type\": \"debug\"\n");
+#else
+	fprintf(File, "    \"library_build_type\": \"release\"\n");
+#endif
+	fprintf(File, "  },\n  \"benchmarks\": [\n");
+	for (size_t i = 0; i < Results.size(); ++i)
+	{
+		const BenchmarkResult &Result = Results[i];
+		char Name[128];
+		if (Result.Threads > 0)
+			sprintf_s(Name, "%s/%d/threads:%d", Result.Name, Result.Objects, Result.Threads);
+		else
+			sprintf_s(Name, "%s/%d", Result.Name, Result.Objects);
+
+		fprintf(File, "    {\n");
+		fprintf(File, "      \"name\": \"%s\",\n", Name);
+		fprintf(File, "      \"run_name\": \"%s\",\n", Name);
+		fprintf(File, "      \"run_type\": \"iteration\",\n");
+		fprintf(File, "      \"iterations\": %llu,\n", Result.Iterations);
+		fprintf(File, "      \"real_time\": %.3f,\n", Result.RealNs);
+		fprintf(File, "      \"cpu_time\": %.3f,\n", Result.CpuNs);
+		fprintf(File, "      \"time_unit\": \"ns\",\n");
+		fprintf(File, "      \"objects\": %d,\n", Result.Objects);
+		fprintf(File, "      \"ns_per_object\": %.3f\n", Result.RealNs / Result.Objects);
+		fprintf(File, "    }%s\n", i + 1 < Results.size() ? "," : "");
+	}
+	fprintf(File, "  ]\n}\n");
+	fclose(File);
+
+	printf("Wrote %d results to %s\n", (int)Results.size(), OutputPath);
+	return 0;
+}
+
+static void SceneLoaderThread(SceneStreamer *Streamer)
+{
+	for (;;)
+	{
+		int CellIndex;
+		{
+			std::unique_lock<std::mutex> Guard(Streamer->Lock);
+			Streamer->Wake.wait(Guard, [Streamer] { return Streamer->Quit || Streamer->RequestCount > 0; });
+			if (Streamer->Quit)
+				return;
+
+			CellIndex = Streamer->Requests[Streamer->RequestHead];
+			Streamer->RequestHead = (Streamer->RequestHead + 1) % (int)Streamer->Requests.size();
+			Streamer->RequestCount--;
+		}
+
+		// Only this thread touches the file and the entities of a LOADING cell
+		SceneCell &Cell = Streamer->Cells[CellIndex];
+		Cell.Entities.resize(Cell.Info.EntityCount);
+
+		LARGE_INTEGER Offset;
+		Offset.QuadPart = Cell.Info.Offset;
+		DWORD BytesRead = 0;
+		DWORD Bytes = Cell.Info.EntityCount * sizeof(SceneFileEntity);
+		if (!SetFilePointerEx(Streamer->File, Offset, NULL, FILE_BEGIN) ||
+			!ReadFile(Streamer->File, Cell.Entities.data(), Bytes, &BytesRead, NULL) || BytesRead != Bytes)
+		{
+			printf("Failed to read scene cell %d\n", CellIndex);
+			Cell.Entities.clear();
+		}
+
+		std::lock_guard<std::mutex> Guard(Streamer->Lock);
+		Streamer->Completed.push_back(CellIndex);
+	}
+}
+
+bool OpenSceneStream(SceneStreamer &Streamer, const char *Path, UINT64 MemoryBudget, float LoadRadius)
+{
+	Streamer.File = CreateFile(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (Streamer.File == INVALID_HANDLE_VALUE)
+		return false;
+
+	DWORD BytesRead = 0;
+	if (!ReadFile(Streamer.File, &Streamer.Header, sizeof(SceneFileHeader), &BytesRead, NULL) || BytesRead != sizeof(SceneFileHeader) ||
+		memcmp(Streamer.Header.Magic, SCENE_FILE_MAGIC, 4) != 0 || Streamer.Header.Version != SCENE_FILE_VERSION)
+	{
+		printf("%s is not a version %u scene file\n", Path, SCENE_FILE_VERSION);
+		CloseHandle(Streamer.File);
+		return false;
+	}
+
+	// Lights and the cell table are small and stay resident, only the entities stream
+	LARGE_INTEGER Offset;
+	Streamer.Lights.resize(Streamer.Header.LightCount);
+	Offset.QuadPart = Streamer.Header.LightsOffset;
+	SetFilePointerEx(Streamer.File, Offset, NULL, FILE_BEGIN);
+	if (!ReadFile(Streamer.File, Streamer.Lights.data(), Streamer.Header.LightCount * sizeof(SceneFileLight), &BytesRead, NULL) ||
+		BytesRead != Streamer.Header.LightCount * sizeof(SceneFileLight))
+	{
+		printf("%s has a truncated light table\n", Path);
+		CloseHandle(Streamer.File);
+		return false;
+	}
+
+	int CellCount = Streamer.Header.GridX * Streamer.Header.GridZ;
+	std::vector<SceneFileCell> CellTable(CellCount);
+	Offset.QuadPart = Streamer.Header.CellTableOffset;
+	SetFilePointerEx(Streamer.File, Offset, NULL, FILE_BEGIN);
+	if (!ReadFile(Streamer.File, CellTable.data(), CellCount * sizeof(SceneFileCell), &BytesRead, NULL) ||
+		BytesRead != CellCount * sizeof(SceneFileCell))
+	{
+		printf("%s has a truncated cell table\n", Path);
+		CloseHandle(Streamer.File);
+		return false;
+	}
+
+	Streamer.Cells.resize(CellCount);
+	for (int i = 0; i < CellCount; ++i)
+	{
+		Streamer.Cells[i].Info = CellTable[i];
+		Streamer.Cells[i].State = CELL_UNLOADED;
+	}
+
+	Streamer.MemoryBudget = MemoryBudget;
+	Streamer.LoadRadius = LoadRadius;
+	// Some slack so cells on the edge don't load and unload every other frame
+	Streamer.UnloadRadius = LoadRadius + Streamer.Header.CellSize;
+	Streamer.ResidentBytes = 0;
+	Streamer.PendingBytes = 0;
+	Streamer.BytesThisSecond = 0;
+	Streamer.SecondTime = 0.0;
+	Streamer.CameraCellMissing = false;
+	Streamer.Stats = SceneStreamingStats();
+	Streamer.Quit = false;
+
+	Streamer.Finished.reserve(CellCount);
+	Streamer.Completed.reserve(CellCount);
+	Streamer.Requests.resize(CellCount);
+	Streamer.RequestHead = 0;
+	Streamer.RequestCount = 0;
+	Streamer.Candidates.reserve(CellCount);
+	DrawList.reserve(4096);
+
+	Streamer.Loader = std::thread(SceneLoaderThread, &Streamer);
+
+	printf("Streaming %s: %d x %d cells of %.1f units\n", Path, Streamer.Header.GridX, Streamer.Header.GridZ, Streamer.Header.CellSize);
+	return true;
+}
+
+void CloseSceneStream(SceneStreamer &Streamer)
+{
+	if (!Streamer.Loader.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> Guard(Streamer.Lock);
+		Streamer.Quit = true;
+	}
+	Streamer.Wake.notify_one();
+	Streamer.Loader.join();
+
+	CloseHandle(Streamer.File);
+	Streamer.Cells.clear();
+	Streamer.Lights.clear();
+}
+
+static float SceneCellDistance(const SceneStreamer &Streamer, int CellIndex, float CameraX, float CameraZ)
+{
+	const SceneFileHeader &Header = Streamer.Header;
+	float CenterX = Header.OriginX + ((CellIndex % Header.GridX) + 0.5f) * Header.CellSize;
+	float CenterZ = Header.OriginZ + ((CellIndex / Header.GridX) + 0.5f) * Header.CellSize;
+	float DX = CenterX - CameraX;
+	float DZ = CenterZ - CameraZ;
+	return sqrtf(DX * DX + DZ * DZ);
+}
+
+static void UnloadSceneCell(SceneStreamer &Streamer, SceneCell &Cell)
+{
+	Streamer.ResidentBytes -= Cell.Info.EntityCount * sizeof(SceneFileEntity);
+	Cell.State = CELL_UNLOADED;
+	// Give the memory back, clear() would keep the capacity
+	std::vector<SceneFileEntity>().swap(Cell.Entities);
+}
+
+void UpdateSceneStreaming(SceneStreamer &Streamer, FXMVECTOR Camera, double time)
+{
+	const SceneFileHeader &Header = Streamer.Header;
+	float CameraX = XMVectorGetX(Camera);
+	float CameraZ = XMVectorGetZ(Camera);
+
+	// Pick up whatever the loader finished since last frame
+	Streamer.Finished.clear();
+	{
+		std::lock_guard<std::mutex> Guard(Streamer.Lock);
+		Streamer.Finished.swap(Streamer.Completed);
+	}
+
+	for (size_t i = 0; i < Streamer.Finished.size(); ++i)
+	{
+		SceneCell &Cell = Streamer.Cells[Streamer.Finished[i]];
+		UINT64 Bytes = Cell.Info.EntityCount * sizeof(SceneFileEntity);
+		Cell.State = CELL_RESIDENT;
+		Streamer.PendingBytes -= Bytes;
+		Streamer.ResidentBytes += Bytes;
+		Streamer.BytesThisSecond += Bytes;
+		Streamer.Stats.TotalBytesLoaded += Bytes;
+	}
+
+	// Drop cells the camera moved away from
+	for (size_t i = 0; i < Streamer.Cells.size(); ++i)
+	{
+		SceneCell &Cell = Streamer.Cells[i];
+		if (Cell.State == CELL_RESIDENT && SceneCellDistance(Streamer, (int)i, CameraX, CameraZ) > Streamer.UnloadRadius)
+			UnloadSceneCell(Streamer, Cell);
+	}
+
+	// Only visit the cells that can be inside the load radius, closest first
+	int Reach = (int)ceilf(Streamer.LoadRadius / Header.CellSize);
+	int CameraCellX = (int)floorf((CameraX - Header.OriginX) / Header.CellSize);
+	int CameraCellZ = (int)floorf((CameraZ - Header.OriginZ) / Header.CellSize);
+
+	Streamer.Candidates.clear();
+	for (int z = max(0, CameraCellZ - Reach); z <= min(Header.GridZ - 1, CameraCellZ + Reach); ++z)
+	{
+		for (int x = max(0, CameraCellX - Reach); x <= min(Header.GridX - 1, CameraCellX + Reach); ++x)
+		{
+			int CellIndex = z * Header.GridX + x;
+			float Distance = SceneCellDistance(Streamer, CellIndex, CameraX, CameraZ);
+			if (Distance <= Streamer.LoadRadius && Streamer.Cells[CellIndex].State == CELL_UNLOADED &&
+				Streamer.Cells[CellIndex].Info.EntityCount > 0)
+				Streamer.Candidates.push_back(std::make_pair(Distance, CellIndex));
+		}
+	}
+	std::sort(Streamer.Candidates.begin(), Streamer.Candidates.end());
+
+	bool Requested = false;
+	for (size_t c = 0; c < Streamer.Candidates.size(); ++c)
+	{
+		int CellIndex = Streamer.Candidates[c].second;
+		SceneCell &Cell = Streamer.Cells[CellIndex];
+		UINT64 Bytes = Cell.Info.EntityCount * sizeof(SceneFileEntity);
+
+		// Over budget: make room by evicting resident cells that are further away than this one
+		while (Streamer.ResidentBytes + Streamer.PendingBytes + Bytes > Streamer.MemoryBudget)
+		{
+			int Farthest = -1;
+			float FarthestDistance = Streamer.Candidates[c].first;
+			for (size_t i = 0; i < Streamer.Cells.size(); ++i)
+			{
+				if (Streamer.Cells[i].State != CELL_RESIDENT)
+					continue;
+				float Distance = SceneCellDistance(Streamer, (int)i, CameraX, CameraZ);
+				if (Distance > FarthestDistance)
+				{
+					Farthest = (int)i;
+					FarthestDistance = Distance;
+				}
+			}
+
+			if (Farthest < 0)
+				break;
+			UnloadSceneCell(Streamer, Streamer.Cells[Farthest]);
+		}
+
+		if (Streamer.ResidentBytes + Streamer.PendingBytes + Bytes > Streamer.MemoryBudget)
+			break;
+
+		Cell.State = CELL_LOADING;
+		Streamer.PendingBytes += Bytes;
+
+		std::lock_guard<std::mutex> Guard(Streamer.Lock);
+		Streamer.Requests[(Streamer.RequestHead + Streamer.RequestCount) % Streamer.Requests.size()] = CellIndex;
+		Streamer.RequestCount++;
+		Requested = true;
+	}
+
+	if (Requested)
+		Streamer.Wake.notify_one();
+
+	// A hitch is the camera standing in a cell whose content isn't there yet
+	bool CameraCellMissing = false;
+	if (CameraCellX >= 0 && CameraCellX < Header.GridX && CameraCellZ >= 0 && CameraCellZ < Header.GridZ)
+	{
+		const SceneCell &Cell = Streamer.Cells[CameraCellZ * Header.GridX + CameraCellX];
+		CameraCellMissing = Cell.Info.EntityCount > 0 && Cell.State != CELL_RESIDENT;
+	}
+	if (CameraCellMissing && !Streamer.CameraCellMissing)
+		Streamer.Stats.HitchCount++;
+	Streamer.CameraCellMissing = CameraCellMissing;
+
+	Streamer.Stats.CellsResident = 0;
+	Streamer.Stats.CellsLoading = 0;
+	for (size_t i = 0; i < Streamer.Cells.size(); ++i)
+	{
+		if (Streamer.Cells[i].State == CELL_RESIDENT)
+			Streamer.Stats.CellsResident++;
+		else if (Streamer.Cells[i].State == CELL_LOADING)
+			Streamer.Stats.CellsLoading++;
+	}
+	Streamer.Stats.ResidentBytes = Streamer.ResidentBytes;
+
+	Streamer.SecondTime += time;
+	if (Streamer.SecondTime >= 1.0)
+	{
+		Streamer.Stats.BytesPerSecond = Streamer.BytesThisSecond / Streamer.SecondTime;
+		Streamer.BytesThisSecond = 0;
+		Streamer.SecondTime = 0.0;
+
+		printf("Streaming: %d cells resident, %d loading, %.2f MB resident, %.2f MB/s, %d hitches\n",
+			Streamer.Stats.CellsResident, Streamer.Stats.CellsLoading, Streamer.Stats.ResidentBytes / (1024.0 * 1024.0),
+			Streamer.Stats.BytesPerSecond / (1024.0 * 1024.0), Streamer.Stats.HitchCount);
+	}
+}
+
+void BuildDrawList(SceneStreamer &Streamer)
+{
+	DrawList.clear();
+	for (size_t i = 0; i < Streamer.Cells.size(); ++i)
+	{
+		const SceneCell &Cell = Streamer.Cells[i];
+		if (Cell.State != CELL_RESIDENT)
+			continue;
+
+		for (size_t e = 0; e < Cell.Entities.size(); ++e)
+		{
+			DrawItem Item;
+			Item.World = Cell.Entities[e].World;
+			Item.Mesh = Cell.Entities[e].Mesh;
+			Item.Material = Cell.Entities[e].Material;
+			DrawList.push_back(Item);
+		}
+	}
+}
+
+// Writes a GridSize x GridSize world of randomly placed cubes centered on the origin
+bool CookTestScene(const char *Path, int GridSize, int EntitiesPerCell, float CellSize)
+{
+	FILE *File;
+	if (fopen_s(&File, Path, "wb") != 0)
+	{
+		printf("Could not open %s\n", Path);
+		return false;
+	}
+
+	SceneFileHeader Header = {};
+	memcpy(Header.Magic, SCENE_FILE_MAGIC, 4);
+	Header.Version = SCENE_FILE_VERSION;
+	Header.GridX = GridSize;
+	Header.GridZ = GridSize;
+	Header.CellSize = CellSize;
+	Header.OriginX = -GridSize * CellSize * 0.5f;
+	Header.OriginZ = -GridSize * CellSize * 0.5f;
+	Header.LightCount = 1;
+	Header.LightsOffset = sizeof(SceneFileHeader);
+	Header.CellTableOffset = Header.LightsOffset + sizeof(SceneFileLight);
+
+	SceneFileLight SceneLight = {};
+	SceneLight.Range = 100.0f;
+	SceneLight.Attenuation = XMFLOAT3(0.0f, 0.2f, 0.0f);
+	SceneLight.Ambient = XMFLOAT4(0.3f, 0.3f, 0.3f, 1.0f);
+	SceneLight.Diffuse = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
+
+	int CellCount = GridSize * GridSize;
+	std::vector<SceneFileCell> CellTable(CellCount);
+	UINT64 Offset = Header.CellTableOffset + CellCount * sizeof(SceneFileCell);
+	for (int i = 0; i < CellCount; ++i)
+	{
+		CellTable[i].EntityCount = EntitiesPerCell;
+		CellTable[i].Offset = Offset;
+		Offset += EntitiesPerCell * sizeof(SceneFileEntity);
+	}
+
+	fwrite(&Header, sizeof(Header), 1, File);
+	fwrite(&SceneLight, sizeof(SceneLight), 1, File);
+	fwrite(CellTable.data(), sizeof(SceneFileCell), CellCount, File);
+
+	UINT Seed = 1234;
+	std::vector<SceneFileEntity> Entities(EntitiesPerCell);
+	for (int i = 0; i < CellCount; ++i)
+	{
+		float CellX = Header.OriginX + (i % GridSize) * CellSize;
+		float CellZ = Header.OriginZ + (i / GridSize) * CellSize;
+
+		for (int e = 0; e < EntitiesPerCell; ++e)
+		{
+			float Random[4];
+			for (int r = 0; r < 4; ++r)
+			{
+				Seed = Seed * 1664525u + 1013904223u;
+				Random[r] = (Seed >> 8) / 16777216.0f;
+			}
+
+			float Size = 0.5f + Random[2];
+			XMMATRIX EntityWorld = XMMatrixScaling(Size, Size, Size) * XMMatrixRotationY(Random[3] * XM_2PI) *
+				XMMatrixTranslation(CellX + Random[0] * CellSize, Size, CellZ + Random[1] * CellSize);
+
+			SceneFileEntity &Entity = Entities[e];
+			XMStoreFloat4x4(&Entity.World, EntityWorld);
+			Entity.Mesh = SCENE_MESH_CUBE;
+			Entity.Material = (e + i) % MaterialCount;
+			// The cube's corner is sqrt(3) out
+			Entity.BoundingRadius = Size * 1.7320508f;
+			Entity.Pad = 0.0f;
+		}
+
+		fwrite(Entities.data(), sizeof(SceneFileEntity), EntitiesPerCell, File);
+	}
+
+	fclose(File);
+	printf("Cooked %s: %d cells, %d entities, %.2f MB\n", Path, CellCount, CellCount * EntitiesPerCell, Offset / (1024.0 * 1024.0));
+	return true;
+}
+
+static void RunParallelForChunks(JobSystem &System)
+{
+	for (;;)
+	{
+		int Begin = System.NextBegin.fetch_add(System.Grain);
+		if (Begin >= System.Count)
+			return;
+		System.Function(System.Data, Begin, min(Begin + System.Grain, System.Count));
+	}
+}
+
+static void JobWorkerThread(JobSystem *System)
+{
+	TrackFrameAllocations = true;
+
+	UINT64 Seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> Guard(System->Lock);
+			System->Wake.wait(Guard, [System, Seen] { return System->Quit || System->Generation != Seen; });
+			if (System->Quit)
+				return;
+
+			Seen = System->Generation;
+			System->Active++;
+		}
+
+		RunParallelForChunks(*System);
+
+		std::lock_guard<std::mutex> Guard(System->Lock);
+		if (--System->Active == 0)
+			System->Idle.notify_all();
+	}
+}
+
+void InitJobSystem(int WorkerCount)
+{
+	Jobs.Quit = false;
+	Jobs.Generation = 0;
+	Jobs.Active = 0;
+	Jobs.Count = 0;
+	Jobs.NextBegin = 0;
+
+	for (int i = 0; i < WorkerCount; ++i)
+		Jobs.Workers.push_back(std::thread(JobWorkerThread, &Jobs));
+}
+
+void ShutdownJobSystem()
+{
+	{
+		std::lock_guard<std::mutex> Guard(Jobs.Lock);
+		Jobs.Quit = true;
+	}
+	Jobs.Wake.notify_all();
+
+	for (size_t i = 0; i < Jobs.Workers.size(); ++i)
+		Jobs.Workers[i].join();
+	Jobs.Workers.clear();
+}
+
+// Including the calling thread
+int JobThreadCount()
+{
+	return (int)Jobs.Workers.size() + 1;
+}
+
+void ParallelFor(int Count, int Grain, ParallelForFunction Function, void *Data)
+{
+	if (Count <= 0)
+		return;
+
+	if (Jobs.Workers.empty() || Count <= Grain)
+	{
+		Function(Data, 0, Count);
+		return;
+	}
+
+	{
+		// A worker that woke up late for the previous loop may still be looking at its parameters
+		std::unique_lock<std::mutex> Guard(Jobs.Lock);
+		Jobs.Idle.wait(Guard, [] { return Jobs.Active == 0; });
+
+		Jobs.Function = Function;
+		Jobs.Data = Data;
+		Jobs.Count = Count;
+		Jobs.Grain = Grain;
+		Jobs.NextBegin = 0;
+		Jobs.Generation++;
+	}
+	Jobs.Wake.notify_all();
+
+	RunParallelForChunks(Jobs);
+
+	// Every chunk is handed out, wait for the ones still running on workers
+	std::unique_lock<std::mutex> Guard(Jobs.Lock);
+	Jobs.Idle.wait(Guard, [] { return Jobs.Active == 0; });
+}
+
+D3D11CommandBuffer::D3D11CommandBuffer(ID3D11DeviceContext *InContext, ID3D11Buffer *InObjectConstants, bool InDeferred)
+	: Context(InContext), List(NULL), ObjectConstants(InObjectConstants), Deferred(InDeferred)
+{
+	Draws = 0;
+	Binds = 0;
+	UploadBytes = 0;
+}
+
+D3D11CommandBuffer::~D3D11CommandBuffer()
+{
+	if (Deferred)
+	{
+		ObjectConstants->Release();
+		Context->Release();
+	}
+}
+
+void D3D11CommandBuffer::BeginScene()
+{
+	Draws = 0;
+	Binds = 0;
+	UploadBytes = 0;
+
+	// The immediate context already has the scene state bound by ScenePass
+	if (!Deferred)
+		return;
+
+	ID3D11RenderTargetView *SceneTargetView = FrameGraph.Resources[RGSceneColor].RTV;
+	ID3D11DepthStencilView *DepthStencilView = FrameGraph.Resources[RGDepth].DSV;
+
+	D3D11_VIEWPORT Viewport = {};
+	Viewport.Width = (FLOAT)ScaledWidth;
+	Viewport.Height = (FLOAT)ScaledHeight;
+	Viewport.MinDepth = 0.0f;
+	Viewport.MaxDepth = 1.0f;
+
+	UINT Stride = sizeof(Vertex);
+	UINT Offset = 0;
+
+	Bind(Context, Binds)->RSSetViewports(1, &Viewport);
+	Bind(Context, Binds)->RSSetState(CWCullMode);
+	Bind(Context, Binds)->OMSetRenderTargets(1, &SceneTargetView, DepthStencilView);
+	Bind(Context, Binds)->OMSetBlendState(0, 0, 0xffffffff);
+	Bind(Context, Binds)->IASetInputLayout(VertexLayout);
+	Bind(Context, Binds)->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	Bind(Context, Binds)->IASetIndexBuffer(SquareIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	Bind(Context, Binds)->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
+	Bind(Context, Binds)->VSSetShader(VertexShader, 0, 0);
+	Bind(Context, Binds)->PSSetShader(PixelShader, 0, 0);
+	Bind(Context, Binds)->VSSetConstantBuffers(0, 1, &ObjectConstants);
+	Bind(Context, Binds)->PSSetConstantBuffers(0, 1, &cbPerFrameBuffer);
+	Bind(Context, Binds)->PSSetShaderResources(0, 1, &CubeTexture);
+	Bind(Context, Binds)->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+}
+
+void D3D11CommandBuffer::DrawObject(const cbPerObject &Constants, UINT IndexCount)
+{
+	if (Deferred)
+	{
+		void *Mapped = MapDiscard(Context, ObjectConstants);
+		if (!Mapped)
+			return;
+		memcpy(Mapped, &Constants, sizeof(cbPerObject));
+		Unmap(Context, ObjectConstants, sizeof(cbPerObject), UploadBytes);
+	}
+	else
+		UploadSubresource(Context, cbPerObjectBuffer, 0, &Constants, 0, sizeof(cbPerObject), UploadBytes);
+	DrawCall(Context, Draws)->DrawIndexed(IndexCount, 0, 0);
+}
+
+void D3D11CommandBuffer::Finish()
+{
+	if (Deferred)
+		HR(Context->FinishCommandList(FALSE, &List));
+}
+
+void D3D11CommandBuffer::Execute()
+{
+	if (!List)
+		return;
+
+	// Restore the immediate context state afterwards, later passes rely on it
+	D3D11DeviceContext->ExecuteCommandList(List, TRUE);
+	List->Release();
+	List = NULL;
+}
+
+bool InitCommandBuffers()
+{
+	// The first chunk always records on the immediate context, it is free and saves a command list
+	SceneCommandBuffers[0] = new D3D11CommandBuffer(D3D11DeviceContext, cbPerObjectBuffer, false);
+
+	D3D11_BUFFER_DESC ConstantBufferDesc = {};
+	ConstantBufferDesc.ByteWidth = sizeof(cbPerObject);
+	ConstantBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
+	ConstantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	ConstantBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	for (int i = 1; i < MAX_RECORD_THREADS; ++i)
+	{
+		ID3D11DeviceContext *DeferredContext;
+		if (FAILED(D3D11Device->CreateDeferredContext(0, &DeferredContext)))
+			return false;
+		ID3D11Buffer *ObjectConstants;
+		if (FAILED(D3D11Device->CreateBuffer(&ConstantBufferDesc, NULL, &ObjectConstants)))
+		{
+			DeferredContext->Release();
+			return false;
+		}
+		SceneCommandBuffers[i] = new D3D11CommandBuffer(DeferredContext, ObjectConstants, true);
+	}
+
+	return true;
+}
+
+void ReleaseCommandBuffers()
+{
+	for (int i = 0; i < MAX_RECORD_THREADS; ++i)
+	{
+		delete SceneCommandBuffers[i];
+		SceneCommandBuffers[i] = NULL;
+	}
+}
+
+struct RecordDrawListJob
+{
+	CommandBuffer **Buffers;
+	const DrawItem *Items;
+	int Grain;
+};
+
+static void RecordDrawChunk(void *Data, int Begin, int End)
+{
+	RecordDrawListJob *Job = (RecordDrawListJob *)Data;
+	CommandBuffer *Buffer = Job->Buffers[Begin / Job->Grain];
+
+	Buffer->BeginScene();
+
+	cbPerObject Constants;
+	for (int i = Begin; i < End; ++i)
+	{
+		BuildObjectConstants(XMLoadFloat4x4(&Job->Items[i].World), CameraView, CameraProjection, Constants);
+		Buffer->DrawObject(Constants, CUBE_INDEX_COUNT);
+	}
+
+	Buffer->Finish();
+}
+
+void RecordDrawList(CommandBuffer **Buffers, int BufferCount, const DrawItem *Items, int Count)
+{
+	BufferCount = max(1, min(BufferCount, MAX_RECORD_THREADS));
+
+	RecordDrawListJob Job;
+	Job.Buffers = Buffers;
+	Job.Items = Items;
+	Job.Grain = (Count + BufferCount - 1) / BufferCount;
+
+	// Chunk 0 may record on the immediate context from a worker. That is fine, nothing else
+	// touches the immediate context until ParallelFor returns.
+	int Chunks = (Count + Job.Grain - 1) / Job.Grain;
+	ParallelFor(Count, Job.Grain, RecordDrawChunk, &Job);
+
+	// Play back in chunk order so the draws land exactly as if they were recorded on one thread
+	for (int i = 0; i < Chunks; ++i)
+	{
+		Buffers[i]->Execute();
+		CountContextWork(Buffers[i]->Draws, Buffers[i]->Binds, Buffers[i]->UploadBytes);
+	}
+}
+
+// Corners of the unit cube and its 12 triangles over them, every mesh in the scene is a cube for now
+static const float OccluderCorners[8][3] =
+{
+	{ -1.0f, -1.0f, -1.0f }, { -1.0f,  1.0f, -1.0f }, {  1.0f,  1.0f, -1.0f }, {  1.0f, -1.0f, -1.0f },
+	{ -1.0f, -1.0f,  1.0f }, { -1.0f,  1.0f,  1.0f }, {  1.0f,  1.0f,  1.0f }, {  1.0f, -1.0f,  1.0f },
+};
+
+static const int OccluderTriangles[12][3] =
+{
+	{ 0, 1, 2 }, { 0, 2, 3 }, // Front
+	{ 4, 7, 6 }, { 4, 6, 5 }, // Back
+	{ 1, 5, 6 }, { 1, 6, 2 }, // Top
+	{ 0, 3, 7 }, { 0, 7, 4 }, // Bottom
+	{ 4, 5, 1 }, { 4, 1, 0 }, // Left
+	{ 3, 2, 6 }, { 3, 6, 7 }, // Right
+};
+
+void InitOcclusionCuller(OcclusionCuller &Culler)
+{
+	Culler.Depth = (float *)_aligned_malloc(sizeof(float) * OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 32);
+	for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; ++i)
+		Culler.Depth[i] = 1.0f;
+	for (int i = 0; i < OCCLUSION_TILES_X * OCCLUSION_TILES_Y; ++i)
+		Culler.TileMaxDepth[i] = 1.0f;
+
+	Culler.Triangles.reserve(MAX_OCCLUDERS * 12 + 24);
+	Culler.Candidates.reserve(4096);
+	Culler.Visible.reserve(4096);
+	Culler.Stats = OcclusionStats();
+}
+
+void ReleaseOcclusionCuller(OcclusionCuller &Culler)
+{
+	_aligned_free(Culler.Depth);
+	Culler.Depth = NULL;
+}
+
+void BeginOcclusionFrame(OcclusionCuller &Culler, const XMMATRIX &ViewProjection)
+{
+	XMStoreFloat4x4(&Culler.ViewProjection, ViewProjection);
+	Culler.Triangles.clear();
+	Culler.Stats.Occluders = 0;
+}
+
+void AddCubeOccluder(OcclusionCuller &Culler, const XMMATRIX &ObjectWorld)
+{
+	XMMATRIX ObjectToClip = ObjectWorld * XMLoadFloat4x4(&Culler.ViewProjection);
+
+	float ScreenX[8], ScreenY[8], Z[8];
+	bool Clipped[8];
+	for (int i = 0; i < 8; ++i)
+	{
+		XMVECTOR Clip = XMVector4Transform(XMVectorSet(OccluderCorners[i][0], OccluderCorners[i][1], OccluderCorners[i][2], 1.0f), ObjectToClip);
+		float W = XMVectorGetW(Clip);
+
+		// Behind or on the near plane, triangles using it are dropped. Dropping occluders is always safe.
+		Clipped[i] = W <= 1e-4f || XMVectorGetZ(Clip) < 0.0f;
+		if (Clipped[i])
+			continue;
+
+		ScreenX[i] = (XMVectorGetX(Clip) / W * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+		ScreenY[i] = (0.5f - XMVectorGetY(Clip) / W * 0.5f) * OCCLUSION_HEIGHT;
+		Z[i] = XMVectorGetZ(Clip) / W;
+	}
+
+	Culler.Stats.Occluders++;
+
+	for (int t = 0; t < 12; ++t)
+	{
+		int I0 = OccluderTriangles[t][0];
+		int I1 = OccluderTriangles[t][1];
+		int I2 = OccluderTriangles[t][2];
+		if (Clipped[I0] || Clipped[I1] || Clipped[I2])
+			continue;
+
+		float X0 = ScreenX[I0], Y0 = ScreenY[I0];
+		float X1 = ScreenX[I1], Y1 = ScreenY[I1];
+		float X2 = ScreenX[I2], Y2 = ScreenY[I2];
+
+		// Both windings get rasterized, so flip back facing triangles to keep the edge functions positive inside
+		float Area = (X2 - X0) * (Y1 - Y0) - (Y2 - Y0) * (X1 - X0);
+		if (fabsf(Area) < 1e-6f)
+			continue;
+		if (Area < 0.0f)
+		{
+			float SwapX = X1, SwapY = Y1;
+			X1 = X2; Y1 = Y2;
+			X2 = SwapX; Y2 = SwapY;
+		}
+
+		OcclusionTriangle Triangle;
+		float X[3] = { X0, X1, X2 };
+		float Y[3] = { Y0, Y1, Y2 };
+		for (int e = 0; e < 3; ++e)
+		{
+			int Next = (e + 1) % 3;
+			Triangle.A[e] = Y[Next] - Y[e];
+			Triangle.B[e] = -(X[Next] - X[e]);
+			Triangle.C[e] = -X[e] * Triangle.A[e] - Y[e] * Triangle.B[e];
+		}
+
+		Triangle.MaxZ = max(Z[I0], max(Z[I1], Z[I2]));
+		Triangle.MinX = max(0, (int)floorf(min(X0, min(X1, X2))));
+		Triangle.MaxX = min(OCCLUSION_WIDTH - 1, (int)ceilf(max(X0, max(X1, X2))));
+		Triangle.MinY = max(0, (int)floorf(min(Y0, min(Y1, Y2))));
+		Triangle.MaxY = min(OCCLUSION_HEIGHT - 1, (int)ceilf(max(Y0, max(Y1, Y2))));
+		if (Triangle.MinX > Triangle.MaxX || Triangle.MinY > Triangle.MaxY)
+			continue;
+
+		Culler.Triangles.push_back(Triangle);
+	}
+}
+
+static void RasterizeOcclusionBand(void *Data, int BeginBand, int EndBand)
+{
+	OcclusionCuller &Culler = *(OcclusionCuller *)Data;
+
+	for (int Band = BeginBand; Band < EndBand; ++Band)
+	{
+		int BandY0 = Band * OCCLUSION_BAND_HEIGHT;
+		int BandY1 = BandY0 + OCCLUSION_BAND_HEIGHT;
+
+		for (int i = BandY0 * OCCLUSION_WIDTH; i < BandY1 * OCCLUSION_WIDTH; ++i)
+			Culler.Depth[i] = 1.0f;
+
+		for (size_t t = 0; t < Culler.Triangles.size(); ++t)
+		{
+			const OcclusionTriangle &Triangle = Culler.Triangles[t];
+			if (Triangle.MaxY < BandY0 || Triangle.MinY >= BandY1)
+				continue;
+
+			int RowBegin = max(Triangle.MinY, BandY0);
+			int RowEnd = min(Triangle.MaxY + 1, BandY1);
+			int StartX = Triangle.MinX & ~7;
+
+#if defined(__AVX2__)
+			const __m256 LaneOffsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+			const __m256 Zero = _mm256_setzero_ps();
+			const __m256 TriangleZ = _mm256_set1_ps(Triangle.MaxZ);
+			const __m256 A0 = _mm256_set1_ps(Triangle.A[0]);
+			const __m256 A1 = _mm256_set1_ps(Triangle.A[1]);
+			const __m256 A2 = _mm256_set1_ps(Triangle.A[2]);
+
+			for (int y = RowBegin; y < RowEnd; ++y)
+			{
+				float PixelY = y + 0.5f;
+				__m256 Row0 = _mm256_set1_ps(Triangle.B[0] * PixelY + Triangle.C[0]);
+				__m256 Row1 = _mm256_set1_ps(Triangle.B[1] * PixelY + Triangle.C[1]);
+				__m256 Row2 = _mm256_set1_ps(Triangle.B[2] * PixelY + Triangle.C[2]);
+				float *DepthRow = Culler.Depth + y * OCCLUSION_WIDTH;
+
+				for (int x = StartX; x <= Triangle.MaxX; x += 8)
+				{
+					__m256 PixelX = _mm256_add_ps(_mm256_set1_ps((float)x), LaneOffsets);
+					__m256 E0 = _mm256_add_ps(_mm256_mul_ps(A0, PixelX), Row0);
+					__m256 E1 = _mm256_add_ps(_mm256_mul_ps(A1, PixelX), Row1);
+					__m256 E2 = _mm256_add_ps(_mm256_mul_ps(A2, PixelX), Row2);
+					__m256 Inside = _mm256_and_ps(_mm256_cmp_ps(E0, Zero, _CMP_GE_OQ),
+						_mm256_and_ps(_mm256_cmp_ps(E1, Zero, _CMP_GE_OQ), _mm256_cmp_ps(E2, Zero, _CMP_GE_OQ)));
+
+					__m256 Old = _mm256_load_ps(DepthRow + x);
+					_mm256_store_ps(DepthRow + x, _mm256_blendv_ps(Old, _mm256_min_ps(Old, TriangleZ), Inside));
+				}
+			}
+#else
+			for (int y = RowBegin; y < RowEnd; ++y)
+			{
+				float PixelY = y + 0.5f;
+				float *DepthRow = Culler.Depth + y * OCCLUSION_WIDTH;
+
+				for (int x = StartX; x <= Triangle.MaxX; ++x)
+				{
+					float PixelX = x + 0.5f;
+					if (Triangle.A[0] * PixelX + Triangle.B[0] * PixelY + Triangle.C[0] >= 0.0f &&
+						Triangle.A[1] * PixelX + Triangle.B[1] * PixelY + Triangle.C[1] >= 0.0f &&
+						Triangle.A[2] * PixelX + Triangle.B[2] * PixelY + Triangle.C[2] >= 0.0f)
+						DepthRow[x] = min(DepthRow[x], Triangle.MaxZ);
+				}
+			}
+#endif
+		}
+
+		// Farthest depth of each tile in the band
+		for (int TileY = BandY0 / OCCLUSION_TILE; TileY < BandY1 / OCCLUSION_TILE; ++TileY)
+		{
+			for (int TileX = 0; TileX < OCCLUSION_TILES_X; ++TileX)
+			{
+				float MaxDepth = 0.0f;
+				for (int y = 0; y < OCCLUSION_TILE; ++y)
+				{
+					const float *DepthRow = Culler.Depth + (TileY * OCCLUSION_TILE + y) * OCCLUSION_WIDTH + TileX * OCCLUSION_TILE;
+					for (int x = 0; x < OCCLUSION_TILE; ++x)
+						MaxDepth = max(MaxDepth, DepthRow[x]);
+				}
+				Culler.TileMaxDepth[TileY * OCCLUSION_TILES_X + TileX] = MaxDepth;
+			}
+		}
+	}
+}
+
+void RasterizeOccluders(OcclusionCuller &Culler)
+{
+	Culler.Stats.Triangles = (int)Culler.Triangles.size();
+	ParallelFor(OCCLUSION_HEIGHT / OCCLUSION_BAND_HEIGHT, 1, RasterizeOcclusionBand, &Culler);
+}
+
+bool IsCubeOccluded(const OcclusionCuller &Culler, const XMMATRIX &ObjectWorld)
+{
+	XMMATRIX ObjectToClip = ObjectWorld * XMLoadFloat4x4(&Culler.ViewProjection);
+
+	float MinX = FLT_MAX, MinY = FLT_MAX, MinZ = FLT_MAX;
+	float MaxX = -FLT_MAX, MaxY = -FLT_MAX;
+	for (int i = 0; i < 8; ++i)
+	{
+		XMVECTOR Clip = XMVector4Transform(XMVectorSet(OccluderCorners[i][0], OccluderCorners[i][1], OccluderCorners[i][2], 1.0f), ObjectToClip);
+		float W = XMVectorGetW(Clip);
+
+		// Crosses the near plane, call it visible
+		if (W <= 1e-4f || XMVectorGetZ(Clip) < 0.0f)
+			return false;
+
+		float X = (XMVectorGetX(Clip) / W * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+		float Y = (0.5f - XMVectorGetY(Clip) / W * 0.5f) * OCCLUSION_HEIGHT;
+		MinX = min(MinX, X);
+		MaxX = max(MaxX, X);
+		MinY = min(MinY, Y);
+		MaxY = max(MaxY, Y);
+		MinZ = min(MinZ, XMVectorGetZ(Clip) / W);
+	}
+
+	// Off screen is the frustum's business, not ours
+	if (MaxX < 0.0f || MaxY < 0.0f || MinX >= OCCLUSION_WIDTH || MinY >= OCCLUSION_HEIGHT)
+		return false;
+
+	int TileX0 = max(0, (int)MinX) / OCCLUSION_TILE;
+	int TileX1 = min(OCCLUSION_WIDTH - 1, (int)MaxX) / OCCLUSION_TILE;
+	int TileY0 = max(0, (int)MinY) / OCCLUSION_TILE;
+	int TileY1 = min(OCCLUSION_HEIGHT - 1, (int)MaxY) / OCCLUSION_TILE;
+
+	for (int TileY = TileY0; TileY <= TileY1; ++TileY)
+	{
+		for (int TileX = TileX0; TileX <= TileX1; ++TileX)
+		{
+			if (MinZ <= Culler.TileMaxDepth[TileY * OCCLUSION_TILES_X + TileX])
+				return false;
+		}
+	}
+
+	return true;
+}
+
+struct OcclusionTestJob
+{
+	OcclusionCuller *Culler;
+	const DrawItem *Items;
+};
+
+static void TestOcclusionChunk(void *Data, int Begin, int End)
+{
+	OcclusionTestJob *Job = (OcclusionTestJob *)Data;
+	for (int i = Begin; i < End; ++i)
+		Job->Culler->Visible[i] = !IsCubeOccluded(*Job->Culler, XMLoadFloat4x4(&Job->Items[i].World));
+}
+
+void CullOccludedDraws(OcclusionCuller &Culler, std::vector<DrawItem> &Items)
+{
+	LARGE_INTEGER Frequency, Start, Rasterized, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	BeginOcclusionFrame(Culler, CameraView * CameraProjection);
+
+	// The two cubes are always drawn, so they always occlude
+	AddCubeOccluder(Culler, Cube1World);
+	AddCubeOccluder(Culler, Cube2World);
+
+	// Pick the items that look biggest from the camera
+	Culler.Candidates.clear();
+	for (size_t i = 0; i < Items.size(); ++i)
+	{
+		XMMATRIX ItemWorld = XMLoadFloat4x4(&Items[i].World);
+		float Size = XMVectorGetX(XMVector3Length(ItemWorld.r[0]));
+		float Distance = XMVectorGetX(XMVector3Length(ItemWorld.r[3] - CameraPosition));
+		Culler.Candidates.push_back(std::make_pair(-Size / max(Distance, 0.001f), (int)i));
+	}
+
+	size_t OccluderCount = min(Culler.Candidates.size(), (size_t)MAX_OCCLUDERS);
+	std::partial_sort(Culler.Candidates.begin(), Culler.Candidates.begin() + OccluderCount, Culler.Candidates.end());
+	for (size_t i = 0; i < OccluderCount; ++i)
+		AddCubeOccluder(Culler, XMLoadFloat4x4(&Items[Culler.Candidates[i].second].World));
+
+	RasterizeOccluders(Culler);
+	QueryPerformanceCounter(&Rasterized);
+
+	Culler.Visible.resize(Items.size());
+	OcclusionTestJob Job = { &Culler, Items.data() };
+	ParallelFor((int)Items.size(), 256, TestOcclusionChunk, &Job);
+
+	// Compact in place, keeping the order
+	size_t Kept = 0;
+	for (size_t i = 0; i < Items.size(); ++i)
+	{
+		if (Culler.Visible[i])
+			Items[Kept++] = Items[i];
+	}
+
+	Culler.Stats.Tested = (int)Items.size();
+	Culler.Stats.Occluded = (int)(Items.size() - Kept);
+	Items.resize(Kept);
+
+	QueryPerformanceCounter(&End);
+	Culler.Stats.RasterizeMs = double(Rasterized.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+	Culler.Stats.TestMs = double(End.QuadPart - Rasterized.QuadPart) * 1000.0 / Frequency.QuadPart;
+}
+
+// Writes the depth buffer as a PGM, linearized between the near plane (white) and 100 units (black)
+bool DumpOcclusionBuffer(const OcclusionCuller &Culler, const char *Path)
+{
+	FILE *File;
+	if (fopen_s(&File, Path, "wb") != 0)
+		return false;
+
+	const float Near = 1.0f;
+	const float Far = 1000.0f;
+	const float VisibleRange = 100.0f;
+
+	fprintf(File, "P5\n%d %d\n255\n", OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+	for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; ++i)
+	{
+		float ViewZ = Near * Far / (Far - Culler.Depth[i] * (Far - Near));
+		float Brightness = 1.0f - min(1.0f, (ViewZ - Near) / VisibleRange);
+		unsigned char Pixel = (unsigned char)(Brightness * 255.0f);
+		fwrite(&Pixel, 1, 1, File);
+	}
+
+	fclose(File);
+	printf("Wrote the occlusion buffer to %s\n", Path);
+	return true;
+}
+
+// How many of the cube's corners the camera sees through the front face of a wall at z = WallZ, shrunk by Margin on
+// every side. 8 is fully behind it; with a negative Margin, 0 is clear of it with room to spare.
+static int CountCornersBehindWall(const XMMATRIX &ObjectWorld, float WallZ, float HalfWidth, float MinY, float MaxY, float Margin)
+{
+	XMFLOAT3 Camera;
+	XMStoreFloat3(&Camera, CameraPosition);
+
+	int Behind = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		XMFLOAT3 Corner;
+		XMStoreFloat3(&Corner, XMVector3TransformCoord(XMVectorSet(OccluderCorners[i][0], OccluderCorners[i][1], OccluderCorners[i][2], 1.0f), ObjectWorld));
+		if (Corner.z <= WallZ)
+			continue;
+
+		float T = (WallZ - Camera.z) / (Corner.z - Camera.z);
+		float X = Camera.x + (Corner.x - Camera.x) * T;
+		float Y = Camera.y + (Corner.y - Camera.y) * T;
+		Behind += fabsf(X) <= HalfWidth - Margin && Y >= MinY + Margin && Y <= MaxY - Margin;
+	}
+	return Behind;
+}
+
+// A wall in front of the camera with a few cubes in front of it and a grid of cubes behind and beside it.
+// Fails when a cube in front of the wall or in the grid's first row beside it is culled, or one well behind it is not.
+int RunOcclusionTest(const char *DumpPath)
+{
+	CameraPosition = XMVectorSet(0.0f, 3.0f, -8.0f, 0.0f);
+	CameraTarget = XMVectorSet(0.0f, 0.0f, 0.0f, 0.0f);
+	CameraUp = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+	CameraView = XMMatrixLookAtLH(CameraPosition, CameraTarget, CameraUp);
+	CameraProjection = XMMatrixPerspectiveFovLH((0.4f * 3.14f), (float)Width / Height, 1.0f, 1000.0f);
+
+	// Stand-ins for the two sandbox cubes, the first one is the wall
+	Cube1World = XMMatrixScaling(8.0f, 4.0f, 0.5f) * XMMatrixTranslation(0.0f, 2.0f, 0.0f);
+	Cube2World = XMMatrixScaling(0.5f, 0.5f, 0.5f) * XMMatrixTranslation(-20.0f, 0.5f, 0.0f);
+
+	std::vector<DrawItem> Items;
+	for (int z = 0; z < 64; ++z)
+	{
+		for (int x = 0; x < 64; ++x)
+		{
+			DrawItem Item;
+			XMStoreFloat4x4(&Item.World, XMMatrixScaling(0.4f, 0.4f, 0.4f) * XMMatrixTranslation(-32.0f + x, 0.4f, 2.0f + z));
+			Item.Mesh = SCENE_MESH_CUBE;
+			Item.Material = 0;
+			Items.push_back(Item);
+		}
+	}
+	for (int x = -1; x <= 1; ++x)
+	{
+		DrawItem Item;
+		XMStoreFloat4x4(&Item.World, XMMatrixScaling(0.4f, 0.4f, 0.4f) * XMMatrixTranslation(3.0f * x, 0.4f, -3.0f));
+		Item.Mesh = SCENE_MESH_CUBE;
+		Item.Material = 0;
+		Items.push_back(Item);
+	}
+
+	OcclusionCuller Culler;
+	InitOcclusionCuller(Culler);
+
+	// Warm up once, then report the second run
+	std::vector<DrawItem> Cull = Items;
+	CullOccludedDraws(Culler, Cull);
+	Cull = Items;
+	CullOccludedDraws(Culler, Cull);
+
+	const OcclusionStats &Stats = Culler.Stats;
+	printf("Occlusion test (%s): %d of %d objects occluded by %d occluders (%d triangles), %.3f ms rasterize + %.3f ms test\n",
+#if defined(__AVX2__)
+		"AVX2",
+#else
+		"scalar",
+#endif
+		Stats.Occluded, Stats.Tested, Stats.Occluders, Stats.Triangles, Stats.RasterizeMs, Stats.TestMs);
+
+	// Visible is still indexed like Items. Farther rows may hide behind nearer cubes, so only the first row is
+	// expected to stay visible beside the wall. A tile is about 0.7 units across on the wall, hence the margin.
+	int Failures = 0;
+	int Behind = 0, Beside = 0;
+	for (size_t i = 0; i < Items.size(); ++i)
+	{
+		XMMATRIX ItemWorld = XMLoadFloat4x4(&Items[i].World);
+		float Z = Items[i].World._43;
+		bool Culled = !Culler.Visible[i];
+		if (CountCornersBehindWall(ItemWorld, -0.5f, 8.0f, -2.0f, 6.0f, 1.0f) == 8)
+		{
+			Behind++;
+			Failures += !Culled;
+		}
+		else if ((Z < 0.0f || Z == 2.0f) && CountCornersBehindWall(ItemWorld, -0.5f, 8.0f, -2.0f, 6.0f, -0.5f) == 0)
+		{
+			Beside++;
+			Failures += Culled;
+		}
+	}
+
+	printf("  %d cubes well behind the wall, %d in front of or beside it\n", Behind, Beside);
+	Failures += Behind == 0 || Beside == 0;
+	Failures += !DumpOcclusionBuffer(Culler, DumpPath);
+	ReleaseOcclusionCuller(Culler);
+
+	printf("  %d of the checks failed\n", Failures);
+	return Failures == 0 ? 0 : 1;
+}
+
+bool InitMaterials()
+{
+	// Load the file backed textures, the first one decides the size and format of the array
+	ID3D11Resource *Loaded[MaterialCount] = {};
+	D3D11_TEXTURE2D_DESC BaseDesc = {};
+	bool HaveBase = false;
+	for (UINT i = 0; i < MaterialCount; ++i)
+	{
+		if (!Materials[i].TexturePath || FAILED(CreateWICTextureFromFile(D3D11Device, Materials[i].TexturePath, &Loaded[i], NULL)))
+			continue;
+
+		ID3D11Texture2D *Texture;
+		D3D11_TEXTURE2D_DESC Desc = {};
+		HR(Loaded[i]->QueryInterface(__uuidof(ID3D11Texture2D), (void **)&Texture));
+		Texture->GetDesc(&Desc);
+		Texture->Release();
+
+		if (!HaveBase)
+		{
+			BaseDesc = Desc;
+			HaveBase = true;
+		}
+		else if (Desc.Width != BaseDesc.Width || Desc.Height != BaseDesc.Height || Desc.Format != BaseDesc.Format)
+		{
+			wprintf(L"%s doesn't match the size or format of the material array, using slice 0\n", Materials[i].TexturePath);
+			Loaded[i]->Release();
+			Loaded[i] = NULL;
+		}
+	}
+
+	if (!HaveBase)
+	{
+		BaseDesc.Width = 256;
+		BaseDesc.Height = 256;
+		BaseDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+	}
+
+	// The textures are sRGB encoded like test.png, so the array samples through the _SRGB format. Copies from the
+	// loaded UNORM textures are fine, the formats are of the same family.
+	if (BaseDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM)
+		BaseDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+	else if (BaseDesc.Format == DXGI_FORMAT_B8G8R8A8_UNORM)
+		BaseDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+
+	// Full mip chain, generated on the GPU once every slice is in
+	D3D11_TEXTURE2D_DESC ArrayDesc = {};
+	ArrayDesc.Width = BaseDesc.Width;
+	ArrayDesc.Height = BaseDesc.Height;
+	ArrayDesc.MipLevels = 0;
+	ArrayDesc.ArraySize = MaterialCount;
+	ArrayDesc.Format = BaseDesc.Format;
+	ArrayDesc.SampleDesc.Count = 1;
+	ArrayDesc.Usage = D3D11_USAGE_DEFAULT;
+	ArrayDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+	ArrayDesc.MiscFlags = D3D11_RESOURCE_MISC_GENERATE_MIPS;
+	if (FAILED(D3D11Device->CreateTexture2D(&ArrayDesc, NULL, &MaterialTextureArray)))
+		return false;
+	MaterialTextureArray->GetDesc(&ArrayDesc);
+
+	bool CanMakeChecker = ArrayDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM || ArrayDesc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB ||
+		ArrayDesc.Format == DXGI_FORMAT_B8G8R8A8_UNORM || ArrayDesc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+	std::vector<UINT> Checker;
+
+	for (UINT i = 0; i < MaterialCount; ++i)
+	{
+		UINT Slice = D3D11CalcSubresource(0, i, ArrayDesc.MipLevels);
+		if (Loaded[i])
+		{
+			D3D11DeviceContext->CopySubresourceRegion(MaterialTextureArray, Slice, 0, 0, 0, Loaded[i], 0, NULL);
+		}
+		else if (!Materials[i].TexturePath && CanMakeChecker)
+		{
+			// 32 pixel squares of the material color and white. In BGRA formats red and blue swap, which is fine for a test pattern.
+			Checker.resize(ArrayDesc.Width * ArrayDesc.Height);
+			for (UINT y = 0; y < ArrayDesc.Height; ++y)
+			{
+				for (UINT x = 0; x < ArrayDesc.Width; ++x)
+					Checker[y * ArrayDesc.Width + x] = ((x / 32) + (y / 32)) & 1 ? Materials[i].Color : 0xffffffff;
+			}
+			D3D11DeviceContext->UpdateSubresource(MaterialTextureArray, Slice, NULL, Checker.data(), ArrayDesc.Width * 4, 0);
+		}
+		else if (i > 0)
+		{
+			D3D11DeviceContext->CopySubresourceRegion(MaterialTextureArray, Slice, 0, 0, 0, MaterialTextureArray, 0, NULL);
+		}
+
+		if (Loaded[i])
+			Loaded[i]->Release();
+	}
+
+	HR(D3D11Device->CreateShaderResourceView(MaterialTextureArray, NULL, &MaterialTextureArrayView));
+	D3D11DeviceContext->GenerateMips(MaterialTextureArrayView);
+
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "INSTANCED_VS", "vs_5_0", 0, 0, &InstancedVSBuffer, 0));
+	HR(D3D11Device->CreateVertexShader(InstancedVSBuffer->GetBufferPointer(), InstancedVSBuffer->GetBufferSize(), 0, &InstancedVS));
+	HR(D3D11Device->CreateInputLayout(InstancedLayout, ARRAYSIZE(InstancedLayout), InstancedVSBuffer->GetBufferPointer(),
+		InstancedVSBuffer->GetBufferSize(), &InstancedVertexLayout));
+
+	// Rewritten every batch, so the CPU writes it and the GPU reads it
+	D3D11_BUFFER_DESC InstanceBufferDesc = {};
+	InstanceBufferDesc.ByteWidth = sizeof(InstanceData) * MAX_INSTANCES_PER_DRAW;
+	InstanceBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
+	InstanceBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	InstanceBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	HR(D3D11Device->CreateBuffer(&InstanceBufferDesc, NULL, &InstanceBuffer));
+
+	D3D11_BUFFER_DESC ConstantBufferDesc = {};
+	ConstantBufferDesc.ByteWidth = sizeof(cbPerView);
+	ConstantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	HR(D3D11Device->CreateBuffer(&ConstantBufferDesc, 0, &cbPerViewBuffer));
+
+	return true;
+}
+
+void ReleaseMaterials()
+{
+	MaterialTextureArrayView->Release();
+	MaterialTextureArray->Release();
+	InstanceBuffer->Release();
+	cbPerViewBuffer->Release();
+	InstancedVS->Release();
+	InstancedVSBuffer->Release();
+	InstancedVertexLayout->Release();
+}
+
+struct InstanceFillJob
+{
+	const DrawItem *Items;
+	InstanceData *Instances;
+};
+
+static void FillInstanceChunk(void *Data, int Begin, int End)
+{
+	InstanceFillJob *Job = (InstanceFillJob *)Data;
+	for (int i = Begin; i < End; ++i)
+	{
+		Job->Instances[i].World = Job->Items[i].World;
+		Job->Instances[i].Material = min(Job->Items[i].Material, MaterialCount - 1);
+	}
+}
+
+// Returns the number of draw calls it took
+int DrawDrawListInstanced(const DrawItem *Items, int Count, UINT Features)
+{
+	cbPerView View;
+	View.ViewProjection = XMMatrixTranspose(CameraView * CameraProjection);
+	UploadSubresource(cbPerViewBuffer, &View, sizeof(cbPerView));
+	Bind()->VSSetConstantBuffers(2, 1, &cbPerViewBuffer);
+
+	// Bound once for every material
+	Bind()->PSSetShaderResources(1, 1, &MaterialTextureArrayView);
+	Bind()->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+
+	Bind()->IASetInputLayout(InstancedVertexLayout);
+	Bind()->VSSetShader(InstancedVS, 0, 0);
+	Bind()->PSSetShader(GetPixelShaderPermutation(SHADER_ENTRY_INSTANCED_PS, Features), 0, 0);
+
+	ID3D11Buffer *Buffers[2] = { SquareVertexBuffer, InstanceBuffer };
+	UINT Strides[2] = { sizeof(Vertex), sizeof(InstanceData) };
+	UINT Offsets[2] = { 0, 0 };
+	Bind()->IASetVertexBuffers(0, 2, Buffers, Strides, Offsets);
+
+	// Every item is a cube, so the only reason to split is the size of the instance buffer
+	int Draws = 0;
+	for (int Begin = 0; Begin < Count; Begin += MAX_INSTANCES_PER_DRAW)
+	{
+		int Instances = min(Count - Begin, MAX_INSTANCES_PER_DRAW);
+
+		InstanceData *Mapped = (InstanceData *)MapDiscard(InstanceBuffer);
+		if (!Mapped)
+			break;
+
+		InstanceFillJob Job = { Items + Begin, Mapped };
+		ParallelFor(Instances, 1024, FillInstanceChunk, &Job);
+
+		Unmap(InstanceBuffer, Instances * sizeof(InstanceData));
+		DrawCall()->DrawIndexedInstanced(CUBE_INDEX_COUNT, Instances, 0, 0, 0);
+		Draws++;
+	}
+
+	UINT Stride = sizeof(Vertex);
+	UINT Offset = 0;
+	Bind()->IASetInputLayout(VertexLayout);
+	Bind()->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
+	Bind()->VSSetShader(VertexShader, 0, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+
+	return Draws;
+}
+
+int SplitDrawList(const DrawItem *Items, int Count, DrawItemPredicate Predicate, DrawItem *Out)
+{
+	int Front = 0;
+	for (int i = 0; i < Count; ++i)
+	{
+		if (Predicate(Items[i]))
+			Out[Front++] = Items[i];
+	}
+
+	int Back = Front;
+	for (int i = 0; i < Count; ++i)
+	{
+		if (!Predicate(Items[i]))
+			Out[Back++] = Items[i];
+	}
+	return Front;
+}
+
+// Within the light's range, see SelectShaderFeatures
+bool IsDrawItemLit(const DrawItem &Item)
+{
+	return (SelectShaderFeatures(light, XMLoadFloat4x4(&Item.World)) & SHADER_FEATURE_LIGHTING) != 0;
+}
+
+// 10000 cubes over every material slice, drawn on the WARP device instanced with the texture array and with one
+// recorded draw per object. Fails unless the instanced path takes a single draw and every instance keeps its material.
+int RunBatchingTest()
+{
+	const int ObjectCount = 10000;
+	const int Frames = 20;
+
+	if (!InitHeadlessScene())
+		return 1;
+
+	std::vector<DrawItem> Items(ObjectCount);
+	UINT Seed = 1234;
+	for (int i = 0; i < ObjectCount; ++i)
+	{
+		Seed = Seed * 1664525u + 1013904223u;
+		XMStoreFloat4x4(&Items[i].World, XMMatrixTranslation((float)(i % 100), 0.0f, (float)(i / 100)));
+		Items[i].Mesh = SCENE_MESH_CUBE;
+		Items[i].Material = (Seed >> 8) % MaterialCount;
+	}
+
+	// What ScenePass binds ahead of the draw list
+	ID3D11RenderTargetView *SceneTargetView = FrameGraph.Resources[RGSceneColor].RTV;
+	Bind()->OMSetRenderTargets(1, &SceneTargetView, FrameGraph.Resources[RGDepth].DSV);
+	Bind()->VSSetConstantBuffers(0, 1, &cbPerObjectBuffer);
+	Bind()->PSSetShaderResources(0, 1, &CubeTexture);
+	Bind()->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+
+	LARGE_INTEGER Start, End;
+	int InstancedDraws = 0;
+	QueryPerformanceCounter(&Start);
+	for (int i = 0; i < Frames; ++i)
+		InstancedDraws = DrawDrawListInstanced(Items.data(), ObjectCount, LitShaderFeatures(light));
+	QueryPerformanceCounter(&End);
+	float InstancedMs = CounterMs(Start, End) / Frames;
+
+	// The instance buffer still holds the last batch, which is all of them
+	int Failures = 0;
+	int Mismatched = 0;
+	D3D11_BUFFER_DESC StagingDesc = {};
+	StagingDesc.ByteWidth = sizeof(InstanceData) * MAX_INSTANCES_PER_DRAW;
+	StagingDesc.Usage = D3D11_USAGE_STAGING;
+	StagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+	ID3D11Buffer *Staging = NULL;
+	D3D11_MAPPED_SUBRESOURCE Mapped;
+	if (SUCCEEDED(D3D11Device->CreateBuffer(&StagingDesc, NULL, &Staging)))
+	{
+		D3D11DeviceContext->CopyResource(Staging, InstanceBuffer);
+		if (SUCCEEDED(D3D11DeviceContext->Map(Staging, 0, D3D11_MAP_READ, 0, &Mapped)))
+		{
+			const InstanceData *Instances = (const InstanceData *)Mapped.pData;
+			for (int i = 0; i < ObjectCount; ++i)
+				Mismatched += Instances[i].Material != Items[i].Material;
+			D3D11DeviceContext->Unmap(Staging, 0);
+		}
+		else
+			Failures++;
+		Staging->Release();
+	}
+	else
+		Failures++;
+
+	QueryPerformanceCounter(&Start);
+	for (int i = 0; i < Frames; ++i)
+		RecordDrawList(SceneCommandBuffers, 1, Items.data(), ObjectCount);
+	QueryPerformanceCounter(&End);
+	float PerObjectMs = CounterMs(Start, End) / Frames;
+	int PerObjectDraws = SceneCommandBuffers[0]->Draws;
+
+	printf("Batching test: %d objects, %d materials\n", ObjectCount, MaterialCount);
+	printf("  One draw per object:           %6d draws %8.3f ms\n", PerObjectDraws, PerObjectMs);
+	printf("  Instanced with texture arrays: %6d draws %8.3f ms (%.1fx faster)\n", InstancedDraws, InstancedMs,
+		PerObjectMs / max(InstancedMs, 0.001f));
+	printf("  %d instances with the wrong material\n", Mismatched);
+
+	Failures += MaterialCount < 16;
+	Failures += InstancedDraws != (ObjectCount + MAX_INSTANCES_PER_DRAW - 1) / MAX_INSTANCES_PER_DRAW;
+	Failures += PerObjectDraws != ObjectCount;
+	Failures += Mismatched != 0;
+	printf("  %d of the checks failed\n", Failures);
+	return Failures == 0 ? 0 : 1;
+}
+
+static float SrgbToLinearTable[256];
+static BYTE LinearToSrgbTable[4096];
+
+static void InitSrgbTables()
+{
+	static bool Initialized = false;
+	if (Initialized)
+		return;
+
+	for (int i = 0; i < 256; ++i)
+	{
+		float Value = i / 255.0f;
+		SrgbToLinearTable[i] = Value <= 0.04045f ? Value / 12.92f : powf((Value + 0.055f) / 1.055f, 2.4f);
+	}
+	for (int i = 0; i < 4096; ++i)
+	{
+		float Value = i / 4095.0f;
+		float Srgb = Value <= 0.0031308f ? Value * 12.92f : 1.055f * powf(Value, 1.0f / 2.4f) - 0.055f;
+		LinearToSrgbTable[i] = (BYTE)(Srgb * 255.0f + 0.5f);
+	}
+	Initialized = true;
+}
+
+// RGB through the sRGB curve, alpha is already linear
+static inline __m128 LoadLinearPixel(const BYTE *Pixel)
+{
+	return _mm_set_ps(Pixel[3] * (1.0f / 255.0f), SrgbToLinearTable[Pixel[2]], SrgbToLinearTable[Pixel[1]], SrgbToLinearTable[Pixel[0]]);
+}
+
+struct MipDownsampleJob
+{
+	const CookImage *Source;
+	CookImage *Dest;
+};
+
+// 2x2 box filter in linear space, odd edges repeat their last row or column
+static void DownsampleMipRows(void *Data, int Begin, int End)
+{
+	MipDownsampleJob *Job = (MipDownsampleJob *)Data;
+	const CookImage &Source = *Job->Source;
+	CookImage &Dest = *Job->Dest;
+
+	const __m128 Quarter = _mm_set1_ps(0.25f);
+	const __m128 Zero = _mm_setzero_ps();
+	const __m128 One = _mm_set1_ps(1.0f);
+	const __m128 TableScale = _mm_set1_ps(4095.0f);
+
+	for (int y = Begin; y < End; ++y)
+	{
+		const BYTE *Row0 = &Source.Pixels[min(2 * (UINT)y, Source.Height - 1) * Source.Width * 4];
+		const BYTE *Row1 = &Source.Pixels[min(2 * (UINT)y + 1, Source.Height - 1) * Source.Width * 4];
+		BYTE *Out = &Dest.Pixels[y * Dest.Width * 4];
+
+		for (UINT x = 0; x < Dest.Width; ++x, Out += 4)
+		{
+			UINT x0 = min(2 * x, Source.Width - 1) * 4;
+			UINT x1 = min(2 * x + 1, Source.Width - 1) * 4;
+
+			__m128 Sum = _mm_add_ps(_mm_add_ps(LoadLinearPixel(Row0 + x0), LoadLinearPixel(Row0 + x1)),
+				_mm_add_ps(LoadLinearPixel(Row1 + x0), LoadLinearPixel(Row1 + x1)));
+			Sum = _mm_min_ps(_mm_max_ps(_mm_mul_ps(Sum, Quarter), Zero), One);
+
+			alignas(16) int Index[4];
+			_mm_store_si128((__m128i *)Index, _mm_cvtps_epi32(_mm_mul_ps(Sum, TableScale)));
+			Out[0] = LinearToSrgbTable[Index[0]];
+			Out[1] = LinearToSrgbTable[Index[1]];
+			Out[2] = LinearToSrgbTable[Index[2]];
+			Out[3] = (BYTE)((Index[3] * 255 + 2047) / 4095);
+		}
+	}
+}
+
+void BuildMipChain(const CookImage &Base, std::vector<CookImage> &Mips)
+{
+	InitSrgbTables();
+
+	Mips.clear();
+	Mips.push_back(Base);
+	while (Mips.back().Width > 1 || Mips.back().Height > 1)
+	{
+		CookImage Mip;
+		Mip.Width = max(Mips.back().Width / 2, 1u);
+		Mip.Height = max(Mips.back().Height / 2, 1u);
+		Mip.Pixels.resize(Mip.Width * Mip.Height * 4);
+
+		MipDownsampleJob Job = { &Mips.back(), &Mip };
+		ParallelFor((int)Mip.Height, 8, DownsampleMipRows, &Job);
+		Mips.push_back(Mip);
+	}
+}
+
+// 4x4 RGBA block at block coordinates x, y. Mips smaller than a block repeat their edge pixels.
+static void FetchBlock(const CookImage &Image, UINT BlockX, UINT BlockY, BYTE Block[64])
+{
+	for (UINT y = 0; y < 4; ++y)
+	{
+		UINT SourceY = min(BlockY * 4 + y, Image.Height - 1);
+		for (UINT x = 0; x < 4; ++x)
+		{
+			UINT SourceX = min(BlockX * 4 + x, Image.Width - 1);
+			memcpy(&Block[(y * 4 + x) * 4], &Image.Pixels[(SourceY * Image.Width + SourceX) * 4], 4);
+		}
+	}
+}
+
+// Endpoints at the two ends of the block's principal axis, pulled in by Inset of the range on each side
+static void PrincipalEndpoints(const BYTE Block[64], int Channels, float Inset, float Low[4], float High[4])
+{
+	float Mean[4] = {};
+	for (int i = 0; i < 16; ++i)
+	{
+		for (int c = 0; c < Channels; ++c)
+			Mean[c] += Block[i * 4 + c];
+	}
+	for (int c = 0; c < Channels; ++c)
+		Mean[c] /= 16.0f;
+
+	float Covariance[4][4] = {};
+	for (int i = 0; i < 16; ++i)
+	{
+		for (int a = 0; a < Channels; ++a)
+		{
+			for (int b = 0; b < Channels; ++b)
+				Covariance[a][b] += (Block[i * 4 + a] - Mean[a]) * (Block[i * 4 + b] - Mean[b]);
+		}
+	}
+
+	// A few rounds of power iteration find the dominant eigenvector well enough for 16 points
+	float Axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	for (int Iteration = 0; Iteration < 8; ++Iteration)
+	{
+		float Next[4] = {};
+		float Largest = 0.0f;
+		for (int a = 0; a < Channels; ++a)
+		{
+			for (int b = 0; b < Channels; ++b)
+				Next[a] += Covariance[a][b] * Axis[b];
+			Largest = max(Largest, fabsf(Next[a]));
+		}
+		if (Largest == 0.0f)
+			break;
+		for (int a = 0; a < Channels; ++a)
+			Axis[a] = Next[a] / Largest;
+	}
+
+	float Length = 0.0f;
+	for (int c = 0; c < Channels; ++c)
+		Length += Axis[c] * Axis[c];
+	Length = sqrtf(Length);
+
+	float MinT = 0.0f, MaxT = 0.0f;
+	if (Length > 0.0f)
+	{
+		for (int c = 0; c < Channels; ++c)
+			Axis[c] /= Length;
+
+		MinT = FLT_MAX;
+		MaxT = -FLT_MAX;
+		for (int i = 0; i < 16; ++i)
+		{
+			float T = 0.0f;
+			for (int c = 0; c < Channels; ++c)
+				T += (Block[i * 4 + c] - Mean[c]) * Axis[c];
+			MinT = min(MinT, T);
+			MaxT = max(MaxT, T);
+		}
+
+		float Pull = (MaxT - MinT) * Inset;
+		MinT += Pull;
+		MaxT -= Pull;
+	}
+
+	for (int c = 0; c < Channels; ++c)
+	{
+		Low[c] = min(max(Mean[c] + MinT * Axis[c], 0.0f), 255.0f);
+		High[c] = min(max(Mean[c] + MaxT * Axis[c], 0.0f), 255.0f);
+	}
+}
+
+// Least squares endpoints for the pixels' current palette weights, returns false when every weight is the same
+static bool FitEndpoints(const BYTE Block[64], int Channels, const float Weights[16], float Low[4], float High[4])
+{
+	float LowLow = 0.0f, HighHigh = 0.0f, LowHigh = 0.0f;
+	float LowPixel[4] = {}, HighPixel[4] = {};
+	for (int i = 0; i < 16; ++i)
+	{
+		float W = Weights[i];
+		LowLow += (1.0f - W) * (1.0f - W);
+		HighHigh += W * W;
+		LowHigh += (1.0f - W) * W;
+		for (int c = 0; c < Channels; ++c)
+		{
+			LowPixel[c] += (1.0f - W) * Block[i * 4 + c];
+			HighPixel[c] += W * Block[i * 4 + c];
+		}
+	}
+
+	float Determinant = LowLow * HighHigh - LowHigh * LowHigh;
+	if (fabsf(Determinant) < 1e-6f)
+		return false;
+
+	for (int c = 0; c < Channels; ++c)
+	{
+		Low[c] = min(max((LowPixel[c] * HighHigh - HighPixel[c] * LowHigh) / Determinant, 0.0f), 255.0f);
+		High[c] = min(max((HighPixel[c] * LowLow - LowPixel[c] * LowHigh) / Determinant, 0.0f), 255.0f);
+	}
+	return true;
+}
+
+static inline UINT16 PackColor565(const float Color[3])
+{
+	UINT R = (UINT)(Color[0] * 31.0f / 255.0f + 0.5f);
+	UINT G = (UINT)(Color[1] * 63.0f / 255.0f + 0.5f);
+	UINT B = (UINT)(Color[2] * 31.0f / 255.0f + 0.5f);
+	return (UINT16)((R << 11) | (G << 5) | B);
+}
+
+static inline void UnpackColor565(UINT16 Packed, int Color[3])
+{
+	int R = (Packed >> 11) & 31, G = (Packed >> 5) & 63, B = Packed & 31;
+	Color[0] = (R << 3) | (R >> 2);
+	Color[1] = (G << 2) | (G >> 4);
+	Color[2] = (B << 3) | (B >> 2);
+}
+
+// Four color palette of c0 > c1, picks each pixel's nearest entry and returns the total squared error
+static int PickBC1Indices(const BYTE Block[64], UINT16 Color0, UINT16 Color1, UINT &Indices)
+{
+	int Palette[4][3];
+	UnpackColor565(Color0, Palette[0]);
+	UnpackColor565(Color1, Palette[1]);
+	for (int c = 0; c < 3; ++c)
+	{
+		Palette[2][c] = (2 * Palette[0][c] + Palette[1][c]) / 3;
+		Palette[3][c] = (Palette[0][c] + 2 * Palette[1][c]) / 3;
+	}
+
+	int Error = 0;
+	Indices = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		int Best = 0, BestError = INT_MAX;
+		for (int p = 0; p < 4; ++p)
+		{
+			int dR = Block[i * 4] - Palette[p][0], dG = Block[i * 4 + 1] - Palette[p][1], dB = Block[i * 4 + 2] - Palette[p][2];
+			int PixelError = dR * dR + dG * dG + dB * dB;
+			if (PixelError < BestError)
+			{
+				Best = p;
+				BestError = PixelError;
+			}
+		}
+		Indices |= Best << (i * 2);
+		Error += BestError;
+	}
+	return Error;
+}
+
+static int EncodeBC1Colors(const BYTE Block[64], const float Low[3], const float High[3], UINT16 &Color0, UINT16 &Color1, UINT &Indices)
+{
+	Color0 = PackColor565(High);
+	Color1 = PackColor565(Low);
+	if (Color0 < Color1)
+		std::swap(Color0, Color1);
+
+	// Equal endpoints would select the three color mode, every pixel uses c0 either way
+	if (Color0 == Color1)
+	{
+		UINT Unused;
+		int Error = PickBC1Indices(Block, Color0, Color1, Unused);
+		Indices = 0;
+		return Error;
+	}
+	return PickBC1Indices(Block, Color0, Color1, Indices);
+}
+
+static void EncodeBC1Block(const BYTE Block[64], BYTE Out[8])
+{
+	float Low[4], High[4];
+	PrincipalEndpoints(Block, 3, 1.0f / 16.0f, Low, High);
+
+	UINT16 Color0, Color1;
+	UINT Indices;
+	int Error = EncodeBC1Colors(Block, Low, High, Color0, Color1, Indices);
+
+	// One least squares pass over the chosen indices, kept if it helps
+	static const float PaletteWeights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+	float Weights[16];
+	for (int i = 0; i < 16; ++i)
+		Weights[i] = PaletteWeights[(Indices >> (i * 2)) & 3];
+
+	if (FitEndpoints(Block, 3, Weights, High, Low))
+	{
+		UINT16 FitColor0, FitColor1;
+		UINT FitIndices;
+		if (EncodeBC1Colors(Block, Low, High, FitColor0, FitColor1, FitIndices) < Error)
+		{
+			Color0 = FitColor0;
+			Color1 = FitColor1;
+			Indices = FitIndices;
+		}
+	}
+
+	memcpy(Out, &Color0, 2);
+	memcpy(Out + 2, &Color1, 2);
+	memcpy(Out + 4, &Indices, 4);
+}
+
+// BC3's alpha half, the eight value mode with a0 > a1
+static void EncodeAlphaBlock(const BYTE Block[64], BYTE Out[8])
+{
+	int Low = 255, High = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		Low = min(Low, (int)Block[i * 4 + 3]);
+		High = max(High, (int)Block[i * 4 + 3]);
+	}
+
+	Out[0] = (BYTE)High;
+	Out[1] = (BYTE)Low;
+
+	UINT64 Indices = 0;
+	if (High > Low)
+	{
+		for (int i = 0; i < 16; ++i)
+		{
+			// Steps from a0 towards a1, index 0 is a0, 1 is a1 and 2..7 are the six in between
+			int Step = ((High - Block[i * 4 + 3]) * 7 + (High - Low) / 2) / (High - Low);
+			UINT64 Index = Step == 0 ? 0 : Step == 7 ? 1 : Step + 1;
+			Indices |= Index << (i * 3);
+		}
+	}
+
+	for (int i = 0; i < 6; ++i)
+		Out[2 + i] = (BYTE)(Indices >> (i * 8));
+}
+
+static void EncodeBC3Block(const BYTE Block[64], BYTE Out[16])
+{
+	EncodeAlphaBlock(Block, Out);
+	EncodeBC1Block(Block, Out + 8);
+}
+
+static const int BC7Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// Mode 6 endpoints are 7 bits per channel plus a p-bit shared by the channels, try both p-bits
+static void QuantizeBC7Endpoint(const float Value[4], int Endpoint[4], int &PBit)
+{
+	float BestError = FLT_MAX;
+	for (int P = 0; P < 2; ++P)
+	{
+		int Candidate[4];
+		float Error = 0.0f;
+		for (int c = 0; c < 4; ++c)
+		{
+			int Quantized = min(max((int)floorf((Value[c] - P) * 0.5f + 0.5f), 0), 127);
+			Candidate[c] = (Quantized << 1) | P;
+			Error += (Candidate[c] - Value[c]) * (Candidate[c] - Value[c]);
+		}
+		if (Error < BestError)
+		{
+			BestError = Error;
+			PBit = P;
+			memcpy(Endpoint, Candidate, sizeof(Candidate));
+		}
+	}
+}
+
+static int PickBC7Indices(const BYTE Block[64], const int Endpoint0[4], const int Endpoint1[4], BYTE Indices[16])
+{
+	int Palette[16][4];
+	for (int p = 0; p < 16; ++p)
+	{
+		for (int c = 0; c < 4; ++c)
+			Palette[p][c] = ((64 - BC7Weights4[p]) * Endpoint0[c] + BC7Weights4[p] * Endpoint1[c] + 32) >> 6;
+	}
+
+	int Error = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		int Best = 0, BestError = INT_MAX;
+		for (int p = 0; p < 16; ++p)
+		{
+			int PixelError = 0;
+			for (int c = 0; c < 4; ++c)
+			{
+				int Delta = Block[i * 4 + c] - Palette[p][c];
+				PixelError += Delta * Delta;
+			}
+			if (PixelError < BestError)
+			{
+				Best = p;
+				BestError = PixelError;
+			}
+		}
+		Indices[i] = (BYTE)Best;
+		Error += BestError;
+	}
+	return Error;
+}
+
+static void WriteBits(BYTE *Out, int &Offset, UINT Value, int Count)
+{
+	for (int i = 0; i < Count; ++i, ++Offset)
+	{
+		if ((Value >> i) & 1)
+			Out[Offset >> 3] |= (BYTE)(1 << (Offset & 7));
+	}
+}
+
+static UINT ReadBits(const BYTE *In, int &Offset, int Count)
+{
+	UINT Value = 0;
+	for (int i = 0; i < Count; ++i, ++Offset)
+		Value |= ((In[Offset >> 3] >> (Offset & 7)) & 1) << i;
+	return Value;
+}
+
+// Mode 6 only: one subset, RGBA endpoints and 4 bit indices. Plenty for a single texture and simple to get right.
+static void EncodeBC7Block(const BYTE Block[64], BYTE Out[16])
+{
+	float Low[4], High[4];
+	PrincipalEndpoints(Block, 4, 1.0f / 32.0f, Low, High);
+
+	int Endpoint0[4], Endpoint1[4], PBit0, PBit1;
+	BYTE Indices[16];
+	QuantizeBC7Endpoint(Low, Endpoint0, PBit0);
+	QuantizeBC7Endpoint(High, Endpoint1, PBit1);
+	int Error = PickBC7Indices(Block, Endpoint0, Endpoint1, Indices);
+
+	float Weights[16];
+	for (int i = 0; i < 16; ++i)
+		Weights[i] = BC7Weights4[Indices[i]] / 64.0f;
+
+	if (FitEndpoints(Block, 4, Weights, Low, High))
+	{
+		int FitEndpoint0[4], FitEndpoint1[4], FitPBit0, FitPBit1;
+		BYTE FitIndices[16];
+		QuantizeBC7Endpoint(Low, FitEndpoint0, FitPBit0);
+		QuantizeBC7Endpoint(High, FitEndpoint1, FitPBit1);
+		if (PickBC7Indices(Block, FitEndpoint0, FitEndpoint1, FitIndices) < Error)
+		{
+			memcpy(Endpoint0, FitEndpoint0, sizeof(Endpoint0));
+			memcpy(Endpoint1, FitEndpoint1, sizeof(Endpoint1));
+			memcpy(Indices, FitIndices, sizeof(Indices));
+			PBit0 = FitPBit0;
+			PBit1 = FitPBit1;
+		}
+	}
+
+	// The first index is stored without its top bit, so it has to be below 8
+	if (Indices[0] & 8)
+	{
+		for (int c = 0; c < 4; ++c)
+			std::swap(Endpoint0[c], Endpoint1[c]);
+		std::swap(PBit0, PBit1);
+		for (int i = 0; i < 16; ++i)
+			Indices[i] = 15 - Indices[i];
+	}
+
+	memset(Out, 0, 16);
+	int Offset = 0;
+	WriteBits(Out, Offset, 1 << 6, 7);
+	for (int c = 0; c < 4; ++c)
+	{
+		WriteBits(Out, Offset, Endpoint0[c] >> 1, 7);
+		WriteBits(Out, Offset, Endpoint1[c] >> 1, 7);
+	}
+	WriteBits(Out, Offset, PBit0, 1);
+	WriteBits(Out, Offset, PBit1, 1);
+	WriteBits(Out, Offset, Indices[0], 3);
+	for (int i = 1; i < 16; ++i)
+		WriteBits(Out, Offset, Indices[i], 4);
+}
+
+static void DecodeBC1Block(const BYTE In[8], BYTE Block[64])
+{
+	UINT16 Color0, Color1;
+	UINT Indices;
+	memcpy(&Color0, In, 2);
+	memcpy(&Color1, In + 2, 2);
+	memcpy(&Indices, In + 4, 4);
+
+	int Palette[4][4];
+	UnpackColor565(Color0, Palette[0]);
+	UnpackColor565(Color1, Palette[1]);
+	for (int c = 0; c < 3; ++c)
+	{
+		if (Color0 > Color1)
+		{
+			Palette[2][c] = (2 * Palette[0][c] + Palette[1][c]) / 3;
+			Palette[3][c] = (Palette[0][c] + 2 * Palette[1][c]) / 3;
+		}
+		else
+		{
+			Palette[2][c] = (Palette[0][c] + Palette[1][c]) / 2;
+			Palette[3][c] = 0;
+		}
+	}
+	Palette[0][3] = Palette[1][3] = Palette[2][3] = 255;
+	Palette[3][3] = Color0 > Color1 ? 255 : 0;
+
+	for (int i = 0; i < 16; ++i)
+	{
+		for (int c = 0; c < 4; ++c)
+			Block[i * 4 + c] = (BYTE)Palette[(Indices >> (i * 2)) & 3][c];
+	}
+}
+
+static void DecodeAlphaBlock(const BYTE In[8], BYTE Block[64])
+{
+	int Palette[8];
+	Palette[0] = In[0];
+	Palette[1] = In[1];
+	if (Palette[0] > Palette[1])
+	{
+		for (int i = 1; i < 7; ++i)
+			Palette[i + 1] = ((7 - i) * Palette[0] + i * Palette[1]) / 7;
+	}
+	else
+	{
+		for (int i = 1; i < 5; ++i)
+			Palette[i + 1] = ((5 - i) * Palette[0] + i * Palette[1]) / 5;
+		Palette[6] = 0;
+		Palette[7] = 255;
+	}
+
+	UINT64 Indices = 0;
+	for (int i = 0; i < 6; ++i)
+		Indices |= (UINT64)In[2 + i] << (i * 8);
+	for (int i = 0; i < 16; ++i)
+		Block[i * 4 + 3] = (BYTE)Palette[(Indices >> (i * 3)) & 7];
+}
+
+// Only mode 6, which is all EncodeBC7Block writes. Other modes decode to magenta.
+static void DecodeBC7Block(const BYTE In[16], BYTE Block[64])
+{
+	int Offset = 0;
+	if (ReadBits(In, Offset, 7) != (1 << 6))
+	{
+		for (int i = 0; i < 16; ++i)
+		{
+			Block[i * 4] = 255;
+			Block[i * 4 + 1] = 0;
+			Block[i * 4 + 2] = 255;
+			Block[i * 4 + 3] = 255;
+		}
+		return;
+	}
+
+	int Endpoint0[4], Endpoint1[4];
+	for (int c = 0; c < 4; ++c)
+	{
+		Endpoint0[c] = ReadBits(In, Offset, 7) << 1;
+		Endpoint1[c] = ReadBits(In, Offset, 7) << 1;
+	}
+	int PBit0 = ReadBits(In, Offset, 1);
+	int PBit1 = ReadBits(In, Offset, 1);
+	for (int c = 0; c < 4; ++c)
+	{
+		Endpoint0[c] |= PBit0;
+		Endpoint1[c] |= PBit1;
+	}
+
+	for (int i = 0; i < 16; ++i)
+	{
+		int Index = ReadBits(In, Offset, i == 0 ? 3 : 4);
+		for (int c = 0; c < 4; ++c)
+			Block[i * 4 + c] = (BYTE)(((64 - BC7Weights4[Index]) * Endpoint0[c] + BC7Weights4[Index] * Endpoint1[c] + 32) >> 6);
+	}
+}
+
+static UINT TextureCodecBlockBytes(TextureCodec Codec)
+{
+	return Codec == TEXTURE_CODEC_BC1 ? 8 : 16;
+}
+
+static UINT64 CookedMipBytes(UINT Width, UINT Height, TextureCodec Codec)
+{
+	if (Codec == TEXTURE_CODEC_RGBA16F)
+		return (UINT64)Width * Height * 8;
+	return (UINT64)max((Width + 3) / 4, 1u) * max((Height + 3) / 4, 1u) * TextureCodecBlockBytes(Codec);
+}
+
+struct BlockEncodeJob
+{
+	const CookImage *Image;
+	TextureCodec Codec;
+	UINT BlocksX;
+	BYTE *Out;
+};
+
+static void EncodeBlockChunk(void *Data, int Begin, int End)
+{
+	BlockEncodeJob *Job = (BlockEncodeJob *)Data;
+	UINT BlockBytes = TextureCodecBlockBytes(Job->Codec);
+
+	BYTE Block[64];
+	for (int i = Begin; i < End; ++i)
+	{
+		FetchBlock(*Job->Image, i % Job->BlocksX, i / Job->BlocksX, Block);
+		BYTE *Out = Job->Out + (size_t)i * BlockBytes;
+		switch (Job->Codec)
+		{
+		case TEXTURE_CODEC_BC1: EncodeBC1Block(Block, Out); break;
+		case TEXTURE_CODEC_BC3: EncodeBC3Block(Block, Out); break;
+		case TEXTURE_CODEC_BC7: EncodeBC7Block(Block, Out); break;
+		}
+	}
+}
+
+// PSNR of a cooked mip against the pixels it came from, over the channels the codec keeps
+static double CookedMipPsnr(const CookImage &Image, TextureCodec Codec, const BYTE *Blocks)
+{
+	int Channels = Codec == TEXTURE_CODEC_BC1 ? 3 : 4;
+	UINT BlocksX = max((Image.Width + 3) / 4, 1u);
+	UINT BlocksY = max((Image.Height + 3) / 4, 1u);
+	UINT BlockBytes = TextureCodecBlockBytes(Codec);
+
+	double SquaredError = 0.0;
+	BYTE Decoded[64];
+	for (UINT by = 0; by < BlocksY; ++by)
+	{
+		for (UINT bx = 0; bx < BlocksX; ++bx)
+		{
+			const BYTE *In = Blocks + (by * BlocksX + bx) * BlockBytes;
+			switch (Codec)
+			{
+			case TEXTURE_CODEC_BC1: DecodeBC1Block(In, Decoded); break;
+			case TEXTURE_CODEC_BC3: DecodeBC1Block(In + 8, Decoded); DecodeAlphaBlock(In, Decoded); break;
+			case TEXTURE_CODEC_BC7: DecodeBC7Block(In, Decoded); break;
+			}
+
+			for (UINT y = 0; y < 4 && by * 4 + y < Image.Height; ++y)
+			{
+				for (UINT x = 0; x < 4 && bx * 4 + x < Image.Width; ++x)
+				{
+					const BYTE *Source = &Image.Pixels[((by * 4 + y) * Image.Width + bx * 4 + x) * 4];
+					for (int c = 0; c < Channels; ++c)
+					{
+						double Delta = (double)Source[c] - Decoded[(y * 4 + x) * 4 + c];
+						SquaredError += Delta * Delta;
+					}
+				}
+			}
+		}
+	}
+
+	double MeanSquaredError = SquaredError / ((double)Image.Width * Image.Height * Channels);
+	return MeanSquaredError > 0.0 ? 10.0 * log10(255.0 * 255.0 / MeanSquaredError) : 99.0;
+}
+
+bool CookTexture(const std::vector<CookImage> &Mips, TextureCodec Codec, CookedTexture &Texture, TextureCookStats &Stats)
+{
+	if (Mips.empty())
+		return false;
+
+	// The mips are sRGB encoded like the PNG, the _SRGB format in the header has the sampler decode them
+	static const DXGI_FORMAT Formats[TEXTURE_CODEC_COUNT] = { DXGI_FORMAT_BC1_UNORM_SRGB, DXGI_FORMAT_BC3_UNORM_SRGB, DXGI_FORMAT_BC7_UNORM_SRGB };
+	Texture.Codec = Codec;
+	Texture.Format = Formats[Codec];
+	Texture.Width = Mips[0].Width;
+	Texture.Height = Mips[0].Height;
+	Texture.Depth = 1;
+	Texture.MipCount = (UINT)Mips.size();
+
+	Stats.RawBytes = 0;
+	Stats.CookedBytes = 0;
+	for (size_t i = 0; i < Mips.size(); ++i)
+	{
+		Stats.RawBytes += (UINT64)Mips[i].Width * Mips[i].Height * 4;
+		Stats.CookedBytes += CookedMipBytes(Mips[i].Width, Mips[i].Height, Codec);
+	}
+	Texture.Data.assign((size_t)Stats.CookedBytes, 0);
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	// Every mip is one parallel loop over its blocks, the small ones just run on the calling thread
+	BYTE *Out = Texture.Data.data();
+	for (size_t i = 0; i < Mips.size(); ++i)
+	{
+		BlockEncodeJob Job = { &Mips[i], Codec, max((Mips[i].Width + 3) / 4, 1u), Out };
+		int BlockCount = (int)(CookedMipBytes(Mips[i].Width, Mips[i].Height, Codec) / TextureCodecBlockBytes(Codec));
+		ParallelFor(BlockCount, 64, EncodeBlockChunk, &Job);
+		Out += CookedMipBytes(Mips[i].Width, Mips[i].Height, Codec);
+	}
+
+	QueryPerformanceCounter(&End);
+	Stats.EncodeMs = double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+	Stats.MBPerSecond = Stats.RawBytes / (1024.0 * 1024.0) / max(Stats.EncodeMs / 1000.0, 1e-9);
+	Stats.Psnr = CookedMipPsnr(Mips[0], Codec, Texture.Data.data());
+	return true;
+}
+
+bool DecodeImageFile(const wchar_t *Path, CookImage &Image)
+{
+	IWICImagingFactory *Factory = NULL;
+	if (FAILED(CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&Factory))))
+		return false;
+
+	IWICBitmapDecoder *Decoder = NULL;
+	IWICBitmapFrameDecode *Frame = NULL;
+	IWICFormatConverter *Converter = NULL;
+	bool Decoded = false;
+	if (SUCCEEDED(Factory->CreateDecoderFromFilename(Path, NULL, GENERIC_READ, WICDecodeMetadataCacheOnDemand, &Decoder)) &&
+		SUCCEEDED(Decoder->GetFrame(0, &Frame)) &&
+		SUCCEEDED(Factory->CreateFormatConverter(&Converter)) &&
+		SUCCEEDED(Converter->Initialize(Frame, GUID_WICPixelFormat32bppRGBA, WICBitmapDitherTypeNone, NULL, 0.0, WICBitmapPaletteTypeCustom)) &&
+		SUCCEEDED(Converter->GetSize(&Image.Width, &Image.Height)))
+	{
+		Image.Pixels.resize(Image.Width * Image.Height * 4);
+		Decoded = SUCCEEDED(Converter->CopyPixels(NULL, Image.Width * 4, (UINT)Image.Pixels.size(), Image.Pixels.data()));
+	}
+
+	if (Converter)
+		Converter->Release();
+	if (Frame)
+		Frame->Release();
+	if (Decoder)
+		Decoder->Release();
+	Factory->Release();
+	return Decoded;
+}
+
+bool WriteDDSFile(const char *Path, const CookedTexture &Texture)
+{
+	FILE *File;
+	if (fopen_s(&File, Path, "wb") != 0)
+	{
+		printf("Couldn't open %s for writing\n", Path);
+		return false;
+	}
+
+	DDSHeader Header = {};
+	Header.Size = sizeof(DDSHeader);
+	Header.Flags = DDS_HEADER_FLAGS_TEXTURE | DDS_HEADER_FLAGS_MIPMAP | DDS_HEADER_FLAGS_LINEARSIZE;
+	Header.Height = Texture.Height;
+	Header.Width = Texture.Width;
+	Header.PitchOrLinearSize = (UINT)CookedMipBytes(Texture.Width, Texture.Height, Texture.Codec);
+	Header.MipMapCount = Texture.MipCount;
+	// Uncompressed data gives the pitch of a row instead of the size of the top mip
+	if (Texture.Codec == TEXTURE_CODEC_RGBA16F)
+	{
+		Header.Flags = (Header.Flags & ~DDS_HEADER_FLAGS_LINEARSIZE) | DDS_HEADER_FLAGS_PITCH;
+		Header.PitchOrLinearSize = Texture.Width * 8;
+	}
+	if (Texture.Depth > 1)
+	{
+		Header.Flags |= DDS_HEADER_FLAGS_VOLUME;
+		Header.Depth = Texture.Depth;
+		Header.Caps2 = DDS_CAPS2_VOLUME;
+	}
+	Header.PixelFormat.Size = sizeof(DDSPixelFormat);
+	Header.PixelFormat.Flags = DDS_PIXEL_FORMAT_FOURCC;
+	Header.PixelFormat.FourCC = MAKEFOURCC('D', 'X', '1', '0');
+	Header.Caps = DDS_CAPS_TEXTURE | DDS_CAPS_COMPLEX | DDS_CAPS_MIPMAP;
+
+	DDSHeaderDX10 HeaderDX10 = {};
+	HeaderDX10.Format = Texture.Format;
+	HeaderDX10.ResourceDimension = Texture.Depth > 1 ? D3D11_RESOURCE_DIMENSION_TEXTURE3D : D3D11_RESOURCE_DIMENSION_TEXTURE2D;
+	HeaderDX10.ArraySize = 1;
+
+	UINT Magic = MAKEFOURCC('D', 'D', 'S', ' ');
+	fwrite(&Magic, sizeof(Magic), 1, File);
+	fwrite(&Header, sizeof(Header), 1, File);
+	fwrite(&HeaderDX10, sizeof(HeaderDX10), 1, File);
+	fwrite(Texture.Data.data(), 1, Texture.Data.size(), File);
+	fclose(File);
+
+	printf("Wrote %s: %ux%u, %u mips, %.1f KB\n", Path, Texture.Width, Texture.Height, Texture.MipCount, Texture.Data.size() / 1024.0);
+	return true;
+}
+
+// Cooks test.png with every codec for the report, and writes the BC7 one
+int RunTextureCook(const char *OutputPath)
+{
+	CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+	CookImage Source;
+	if (!DecodeImageFile(L"test.png", Source))
+	{
+		printf("Couldn't decode test.png\n");
+		CoUninitialize();
+		return 1;
+	}
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	std::vector<CookImage> Mips;
+	BuildMipChain(Source, Mips);
+
+	QueryPerformanceCounter(&End);
+	printf("test.png: %ux%u, %d mips built in %.2f ms on %d threads\n", Source.Width, Source.Height, (int)Mips.size(),
+		double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart, JobThreadCount());
+
+	static const char *CodecNames[TEXTURE_CODEC_COUNT] = { "BC1", "BC3", "BC7" };
+	CookedTexture Cooked[TEXTURE_CODEC_COUNT];
+	TextureCookStats Stats[TEXTURE_CODEC_COUNT];
+	for (int Codec = 0; Codec < TEXTURE_CODEC_COUNT; ++Codec)
+	{
+		CookTexture(Mips, (TextureCodec)Codec, Cooked[Codec], Stats[Codec]);
+		printf("  %s: %8.2f ms %8.1f MB/s %6.2f dB PSNR %8.1f KB in VRAM\n", CodecNames[Codec], Stats[Codec].EncodeMs,
+			Stats[Codec].MBPerSecond, Stats[Codec].Psnr, Stats[Codec].CookedBytes / 1024.0);
+	}
+
+	// What CreateWICTextureFromFile uploads today is the top mip as RGBA8
+	UINT64 RuntimeBytes = (UINT64)Source.Width * Source.Height * 4;
+	printf("  RGBA8: %.1f KB without mips, %.1f KB with them. BC7 saves %.1f KB (%.0f%%) over the full chain.\n",
+		RuntimeBytes / 1024.0, Stats[TEXTURE_CODEC_BC7].RawBytes / 1024.0,
+		(Stats[TEXTURE_CODEC_BC7].RawBytes - Stats[TEXTURE_CODEC_BC7].CookedBytes) / 1024.0,
+		100.0 * (1.0 - (double)Stats[TEXTURE_CODEC_BC7].CookedBytes / Stats[TEXTURE_CODEC_BC7].RawBytes));
+
+	bool Written = WriteDDSFile(OutputPath, Cooked[TEXTURE_CODEC_BC7]);
+	CoUninitialize();
+	return Written ? 0 : 1;
+}
+
+// FNV-1a of Effects.fx, 0 if it can't be read
+static UINT64 HashShaderSource()
+{
+	FILE *File;
+	if (fopen_s(&File, "Effects.fx", "rb") != 0)
+		return 0;
+
+	UINT64 Hash = 14695981039346656037ull;
+	BYTE Buffer[4096];
+	size_t Read;
+	while ((Read = fread(Buffer, 1, sizeof(Buffer), File)) > 0)
+	{
+		for (size_t i = 0; i < Read; ++i)
+			Hash = (Hash ^ Buffer[i]) * 1099511628211ull;
+	}
+	fclose(File);
+	return Hash;
+}
+
+// Attenuation only matters when there is lighting to attenuate. Every material has a texture, so nothing draws untextured.
+static bool IsShaderPermutationNeeded(UINT Key)
+{
+	if (Key >= SHADER_PERMUTATION_COUNT)
+		return true;
+	UINT Features = Key % SHADER_FEATURE_COMBINATIONS;
+	if (!(Features & SHADER_FEATURE_TEXTURED))
+		return false;
+	return (Features & SHADER_FEATURE_LIGHTING) || !(Features & SHADER_FEATURE_ATTENUATION);
+}
+
+static HRESULT CompileShaderPermutation(UINT Key, ID3D10Blob **Blob)
+{
+	UINT Features = Key % SHADER_FEATURE_COMBINATIONS;
+	D3D_SHADER_MACRO Defines[] =
+	{
+		{ "LIGHTING", Features & SHADER_FEATURE_LIGHTING ? "1" : "0" },
+		{ "ATTENUATION", Features & SHADER_FEATURE_ATTENUATION ? "1" : "0" },
+		{ "TEXTURED", Features & SHADER_FEATURE_TEXTURED ? "1" : "0" },
+		{ "BAKED", Features & SHADER_FEATURE_BAKED ? "1" : "0" },
+		{ NULL, NULL },
+	};
+
+	const char *Entry;
+	const char *Profile = "ps_5_0";
+	if (Key < SHADER_PERMUTATION_COUNT)
+		Entry = ShaderEntryNames[Key / SHADER_FEATURE_COMBINATIONS];
+	else
+	{
+		Entry = ArchivedShaderNames[Key - SHADER_PERMUTATION_COUNT];
+		Profile = ArchivedShaderProfiles[Key - SHADER_PERMUTATION_COUNT];
+	}
+
+	ID3D10Blob *Errors = NULL;
+	HRESULT Result = D3DCompileFromFile(L"Effects.fx", Key < SHADER_PERMUTATION_COUNT ? Defines : NULL, 0, Entry, Profile,
+		D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, Blob, &Errors);
+	if (Errors)
+	{
+		printf("%s", (const char *)Errors->GetBufferPointer());
+		Errors->Release();
+	}
+	return Result;
+}
+
+bool InitShaderPermutations(const char *ArchivePath)
+{
+	UINT64 SourceHash = HashShaderSource();
+	ArchivedShaderPermutations = 0;
+	CompiledShaderPermutations = 0;
+
+	std::vector<BYTE> Archive;
+	FILE *File;
+	if (fopen_s(&File, ArchivePath, "rb") == 0)
+	{
+		fseek(File, 0, SEEK_END);
+		long Size = ftell(File);
+		fseek(File, 0, SEEK_SET);
+		if (Size > 0)
+		{
+			Archive.resize(Size);
+			if (fread(Archive.data(), 1, Archive.size(), File) != Archive.size())
+				Archive.clear();
+		}
+		fclose(File);
+	}
+
+	const ShaderArchiveHeader *Header = (const ShaderArchiveHeader *)Archive.data();
+	bool ArchiveValid = Archive.size() >= sizeof(ShaderArchiveHeader) && memcmp(Header->Magic, "SHP1", 4) == 0 &&
+		Header->Version == SHADER_ARCHIVE_VERSION && Header->SourceHash == SourceHash &&
+		Archive.size() >= sizeof(ShaderArchiveHeader) + Header->EntryCount * sizeof(ShaderArchiveEntry);
+	if (!Archive.empty() && !ArchiveValid)
+		printf("%s is out of date with Effects.fx, compiling the shader permutations instead\n", ArchivePath);
+
+	if (ArchiveValid)
+	{
+		const ShaderArchiveEntry *Entries = (const ShaderArchiveEntry *)(Header + 1);
+		for (UINT i = 0; i < Header->EntryCount; ++i)
+		{
+			const ShaderArchiveEntry &Entry = Entries[i];
+			if (Entry.Key >= SHADER_ARCHIVE_KEY_COUNT || !IsShaderPermutationNeeded(Entry.Key) ||
+				(size_t)Entry.Offset + Entry.Size > Archive.size())
+				continue;
+			if (Entry.Key >= SHADER_PERMUTATION_COUNT)
+			{
+				ID3D10Blob *&Code = ArchivedShaderCode[Entry.Key - SHADER_PERMUTATION_COUNT];
+				if (!Code && SUCCEEDED(D3DCreateBlob(Entry.Size, &Code)))
+					memcpy(Code->GetBufferPointer(), &Archive[Entry.Offset], Entry.Size);
+				continue;
+			}
+			if (ShaderPermutations[Entry.Key])
+				continue;
+			if (SUCCEEDED(D3D11Device->CreatePixelShader(&Archive[Entry.Offset], Entry.Size, NULL, &ShaderPermutations[Entry.Key])))
+				ArchivedShaderPermutations++;
+		}
+	}
+
+	// Without baked light nothing draws with the probes, so their variants aren't worth compiling
+	bool Baked = GetFileAttributes("Probes.dds") != INVALID_FILE_ATTRIBUTES;
+	for (UINT Key = 0; Key < SHADER_PERMUTATION_COUNT; ++Key)
+	{
+		if (ShaderPermutations[Key] || !IsShaderPermutationNeeded(Key))
+			continue;
+		if (!Baked && (Key % SHADER_FEATURE_COMBINATIONS) & SHADER_FEATURE_BAKED)
+			continue;
+
+		ID3D10Blob *Blob;
+		if (FAILED(CompileShaderPermutation(Key, &Blob)))
+			return false;
+		HR(D3D11Device->CreatePixelShader(Blob->GetBufferPointer(), Blob->GetBufferSize(), NULL, &ShaderPermutations[Key]));
+		Blob->Release();
+		CompiledShaderPermutations++;
+	}
+
+	printf("Shader permutations: %d from %s, %d compiled at startup\n", ArchivedShaderPermutations, ArchivePath, CompiledShaderPermutations);
+	return true;
+}
+
+void ReleaseShaderPermutations()
+{
+	for (UINT Key = 0; Key < SHADER_PERMUTATION_COUNT; ++Key)
+	{
+		if (ShaderPermutations[Key])
+			ShaderPermutations[Key]->Release();
+		ShaderPermutations[Key] = NULL;
+	}
+	for (UINT i = 0; i < ARCHIVED_SHADER_COUNT; ++i)
+	{
+		if (ArchivedShaderCode[i])
+			ArchivedShaderCode[i]->Release();
+		ArchivedShaderCode[i] = NULL;
+	}
+}
+
+HRESULT GetArchivedShaderCode(ArchivedShader Shader, ID3D10Blob **Blob)
+{
+	if (ArchivedShaderCode[Shader])
+	{
+		ArchivedShaderCode[Shader]->AddRef();
+		*Blob = ArchivedShaderCode[Shader];
+		return S_OK;
+	}
+
+	HRESULT Result = CompileShaderPermutation(SHADER_PERMUTATION_COUNT + Shader, Blob);
+	if (SUCCEEDED(Result))
+		printf("%s isn't in the shader archive, compiled it at startup\n", ArchivedShaderNames[Shader]);
+	return Result;
+}
+
+ID3D11PixelShader *GetPixelShaderPermutation(ShaderEntry Entry, UINT Features)
+{
+	// Unlit variants never attenuate, so they are only built without it
+	if (!(Features & SHADER_FEATURE_LIGHTING))
+		Features &= ~SHADER_FEATURE_ATTENUATION;
+	return ShaderPermutations[Entry * SHADER_FEATURE_COMBINATIONS + Features];
+}
+
+// The probes' ambient once there is baked light
+UINT AmbientShaderFeatures()
+{
+	return ProbesLoaded ? SHADER_FEATURE_BAKED : 0;
+}
+
+// What a lit, textured object needs. Attenuation of (1, 0, 0) divides by one, so it can go.
+UINT LitShaderFeatures(const Light &SceneLight)
+{
+	UINT Features = SHADER_FEATURE_LIGHTING | SHADER_FEATURE_TEXTURED | AmbientShaderFeatures();
+	if (SceneLight.att.x != 1.0f || SceneLight.att.y != 0.0f || SceneLight.att.z != 0.0f)
+		Features |= SHADER_FEATURE_ATTENUATION;
+	return Features;
+}
+
+// A cube whose bounding sphere is wholly outside the light's range only ever gets the ambient term, and one wholly past
+// the probes' fade only ever gets the flat ambient
+UINT SelectShaderFeatures(const Light &SceneLight, CXMMATRIX World)
+{
+	float Scale = max(XMVectorGetX(XMVector3Length(World.r[0])), max(XMVectorGetX(XMVector3Length(World.r[1])), XMVectorGetX(XMVector3Length(World.r[2]))));
+	float Radius = Scale * 1.7320508f;
+	float Distance = XMVectorGetX(XMVector3Length(World.r[3] - XMLoadFloat3(&SceneLight.pos)));
+
+	UINT Features = Distance - Radius > SceneLight.range ? SHADER_FEATURE_TEXTURED | AmbientShaderFeatures() : LitShaderFeatures(SceneLight);
+	if (!OverlapsProbeVolume(World.r[3], Radius))
+		Features &= ~SHADER_FEATURE_BAKED;
+	return Features;
+}
+
+// Compiles every needed permutation into an archive InitShaderPermutations loads instead of compiling
+int BuildShaderArchive(const char *Path)
+{
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	std::vector<ShaderArchiveEntry> Entries;
+	std::vector<ID3D10Blob *> Blobs;
+	for (UINT Key = 0; Key < SHADER_ARCHIVE_KEY_COUNT; ++Key)
+	{
+		if (!IsShaderPermutationNeeded(Key))
+			continue;
+
+		ID3D10Blob *Blob;
+		if (FAILED(CompileShaderPermutation(Key, &Blob)))
+		{
+			printf("Couldn't compile shader %u\n", Key);
+			for (size_t i = 0; i < Blobs.size(); ++i)
+				Blobs[i]->Release();
+			return 1;
+		}
+
+		ShaderArchiveEntry Entry = {};
+		Entry.Key = Key;
+		Entry.Size = (UINT)Blob->GetBufferSize();
+
+		ID3D11ShaderReflection *Reflection;
+		if (SUCCEEDED(D3DReflect(Blob->GetBufferPointer(), Blob->GetBufferSize(), __uuidof(ID3D11ShaderReflection), (void **)&Reflection)))
+		{
+			D3D11_SHADER_DESC Desc;
+			Reflection->GetDesc(&Desc);
+			Entry.InstructionCount = Desc.InstructionCount;
+			Reflection->Release();
+		}
+
+		Entries.push_back(Entry);
+		Blobs.push_back(Blob);
+	}
+
+	QueryPerformanceCounter(&End);
+
+	UINT Offset = (UINT)(sizeof(ShaderArchiveHeader) + Entries.size() * sizeof(ShaderArchiveEntry));
+	for (size_t i = 0; i < Entries.size(); ++i)
+	{
+		Entries[i].Offset = Offset;
+		Offset += Entries[i].Size;
+	}
+
+	ShaderArchiveHeader Header = {};
+	memcpy(Header.Magic, "SHP1", 4);
+	Header.Version = SHADER_ARCHIVE_VERSION;
+	Header.SourceHash = HashShaderSource();
+	Header.EntryCount = (UINT)Entries.size();
+
+	FILE *File;
+	bool Written = fopen_s(&File, Path, "wb") == 0;
+	if (Written)
+	{
+		fwrite(&Header, sizeof(Header), 1, File);
+		fwrite(Entries.data(), sizeof(ShaderArchiveEntry), Entries.size(), File);
+		for (size_t i = 0; i < Blobs.size(); ++i)
+			fwrite(Blobs[i]->GetBufferPointer(), 1, Blobs[i]->GetBufferSize(), File);
+		fclose(File);
+	}
+
+	printf("Built %d of %u shaders in %.1f ms into %s (%.1f KB)\n", (int)Entries.size(), SHADER_ARCHIVE_KEY_COUNT,
+		double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart, Path, Offset / 1024.0);
+	for (size_t i = 0; i < Entries.size(); ++i)
+	{
+		if (Entries[i].Key >= SHADER_PERMUTATION_COUNT)
+		{
+			printf("  %2u %-13s %-43s %4u instructions %6u bytes\n", Entries[i].Key, ArchivedShaderNames[Entries[i].Key - SHADER_PERMUTATION_COUNT],
+				ArchivedShaderProfiles[Entries[i].Key - SHADER_PERMUTATION_COUNT], Entries[i].InstructionCount, Entries[i].Size);
+			Blobs[i]->Release();
+			continue;
+		}
+
+		UINT Features = Entries[i].Key % SHADER_FEATURE_COMBINATIONS;
+		printf("  %2u %-13s LIGHTING=%d ATTENUATION=%d TEXTURED=%d BAKED=%d %4u instructions %6u bytes\n", Entries[i].Key,
+			ShaderEntryNames[Entries[i].Key / SHADER_FEATURE_COMBINATIONS], (Features & SHADER_FEATURE_LIGHTING) != 0,
+			(Features & SHADER_FEATURE_ATTENUATION) != 0, (Features & SHADER_FEATURE_TEXTURED) != 0,
+			(Features & SHADER_FEATURE_BAKED) != 0, Entries[i].InstructionCount, Entries[i].Size);
+		Blobs[i]->Release();
+	}
+
+	if (!Written)
+		printf("Couldn't open %s for writing\n", Path);
+	return Written ? 0 : 1;
+}
+
+static inline float ParticleRandom(UINT &Seed)
+{
+	Seed = Seed * 1664525u + 1013904223u;
+	return (Seed >> 8) * (1.0f / 16777216.0f);
+}
+
+void InitParticleSystem(ParticleSystem &System)
+{
+	float **Streams[] = { &System.Pool.PositionX, &System.Pool.PositionY, &System.Pool.PositionZ,
+		&System.Pool.VelocityX, &System.Pool.VelocityY, &System.Pool.VelocityZ, &System.Pool.Age, &System.Pool.Lifetime };
+	for (int i = 0; i < ARRAYSIZE(Streams); ++i)
+		*Streams[i] = (float *)_aligned_malloc(sizeof(float) * MAX_PARTICLES, 32);
+
+	System.Pool.Count = 0;
+	for (int i = 0; i < PARTICLE_CHUNKS; ++i)
+		System.Pool.Dead[i].reserve(PARTICLE_CHUNK);
+
+	System.Emitters.clear();
+	System.Gravity = XMFLOAT3(0.0f, -9.8f, 0.0f);
+	System.Drag = 0.5f;
+	System.StartColor = XMFLOAT4(1.0f, 0.8f, 0.3f, 1.0f);
+	System.EndColor = XMFLOAT4(0.6f, 0.1f, 0.05f, 0.0f);
+	System.Size = 0.05f;
+	System.SimulateMs = 0.0;
+	System.UploadMs = 0.0;
+	System.Spawned = 0;
+	System.Died = 0;
+}
+
+void ReleaseParticleSystem(ParticleSystem &System)
+{
+	_aligned_free(System.Pool.PositionX);
+	_aligned_free(System.Pool.PositionY);
+	_aligned_free(System.Pool.PositionZ);
+	_aligned_free(System.Pool.VelocityX);
+	_aligned_free(System.Pool.VelocityY);
+	_aligned_free(System.Pool.VelocityZ);
+	_aligned_free(System.Pool.Age);
+	_aligned_free(System.Pool.Lifetime);
+	System.Pool.Count = 0;
+}
+
+// Emits enough particles per second to keep Budget of them alive
+void AddParticleEmitter(ParticleSystem &System, XMFLOAT3 Position, int Budget, float Lifetime, float Speed, float Spread)
+{
+	ParticleEmitter Emitter;
+	Emitter.Position = Position;
+	Emitter.Rate = Budget / Lifetime;
+	Emitter.Speed = Speed;
+	Emitter.Spread = Spread;
+	Emitter.Lifetime = Lifetime;
+	Emitter.Accumulator = 0.0f;
+	Emitter.Seed = 0x9e3779b9u * (UINT)(System.Emitters.size() + 1);
+	System.Emitters.push_back(Emitter);
+}
+
+struct ParticleUpdateJob
+{
+	ParticleSystem *System;
+	float DeltaTime;
+};
+
+// Integrates and ages one chunk, and lists the particles that died in it
+static void UpdateParticleChunks(void *Data, int BeginChunk, int EndChunk)
+{
+	ParticleUpdateJob *Job = (ParticleUpdateJob *)Data;
+	ParticlePool &Pool = Job->System->Pool;
+	float DeltaTime = Job->DeltaTime;
+	float Damping = max(1.0f - Job->System->Drag * DeltaTime, 0.0f);
+	XMFLOAT3 Gravity = Job->System->Gravity;
+
+	for (int Chunk = BeginChunk; Chunk < EndChunk; ++Chunk)
+	{
+		std::vector<int> &Dead = Pool.Dead[Chunk];
+		Dead.clear();
+
+		int Begin = Chunk * PARTICLE_CHUNK;
+		int End = min(Begin + PARTICLE_CHUNK, Pool.Count);
+		int i = Begin;
+
+#if defined(__AVX2__)
+		const __m256 Dt = _mm256_set1_ps(DeltaTime);
+		const __m256 Damp = _mm256_set1_ps(Damping);
+		const __m256 GravityX = _mm256_set1_ps(Gravity.x * DeltaTime);
+		const __m256 GravityY = _mm256_set1_ps(Gravity.y * DeltaTime);
+		const __m256 GravityZ = _mm256_set1_ps(Gravity.z * DeltaTime);
+
+		for (; i + 8 <= End; i += 8)
+		{
+			__m256 VelocityX = _mm256_fmadd_ps(_mm256_load_ps(Pool.VelocityX + i), Damp, GravityX);
+			__m256 VelocityY = _mm256_fmadd_ps(_mm256_load_ps(Pool.VelocityY + i), Damp, GravityY);
+			__m256 VelocityZ = _mm256_fmadd_ps(_mm256_load_ps(Pool.VelocityZ + i), Damp, GravityZ);
+			_mm256_store_ps(Pool.VelocityX + i, VelocityX);
+			_mm256_store_ps(Pool.VelocityY + i, VelocityY);
+			_mm256_store_ps(Pool.VelocityZ + i, VelocityZ);
+
+			_mm256_store_ps(Pool.PositionX + i, _mm256_fmadd_ps(VelocityX, Dt, _mm256_load_ps(Pool.PositionX + i)));
+			_mm256_store_ps(Pool.PositionY + i, _mm256_fmadd_ps(VelocityY, Dt, _mm256_load_ps(Pool.PositionY + i)));
+			_mm256_store_ps(Pool.PositionZ + i, _mm256_fmadd_ps(VelocityZ, Dt, _mm256_load_ps(Pool.PositionZ + i)));
+
+			__m256 Age = _mm256_add_ps(_mm256_load_ps(Pool.Age + i), Dt);
+			_mm256_store_ps(Pool.Age + i, Age);
+
+			int DeadMask = _mm256_movemask_ps(_mm256_cmp_ps(Age, _mm256_load_ps(Pool.Lifetime + i), _CMP_GE_OQ));
+			while (DeadMask)
+			{
+				unsigned long Lane;
+				_BitScanForward(&Lane, DeadMask);
+				Dead.push_back(i + (int)Lane);
+				DeadMask &= DeadMask - 1;
+			}
+		}
+#endif
+
+		for (; i < End; ++i)
+		{
+			Pool.VelocityX[i] = Pool.VelocityX[i] * Damping + Gravity.x * DeltaTime;
+			Pool.VelocityY[i] = Pool.VelocityY[i] * Damping + Gravity.y * DeltaTime;
+			Pool.VelocityZ[i] = Pool.VelocityZ[i] * Damping + Gravity.z * DeltaTime;
+			Pool.PositionX[i] += Pool.VelocityX[i] * DeltaTime;
+			Pool.PositionY[i] += Pool.VelocityY[i] * DeltaTime;
+			Pool.PositionZ[i] += Pool.VelocityZ[i] * DeltaTime;
+			Pool.Age[i] += DeltaTime;
+			if (Pool.Age[i] >= Pool.Lifetime[i])
+				Dead.push_back(i);
+		}
+	}
+}
+
+static inline void MoveParticle(ParticlePool &Pool, int To, int From)
+{
+	Pool.PositionX[To] = Pool.PositionX[From];
+	Pool.PositionY[To] = Pool.PositionY[From];
+	Pool.PositionZ[To] = Pool.PositionZ[From];
+	Pool.VelocityX[To] = Pool.VelocityX[From];
+	Pool.VelocityY[To] = Pool.VelocityY[From];
+	Pool.VelocityZ[To] = Pool.VelocityZ[From];
+	Pool.Age[To] = Pool.Age[From];
+	Pool.Lifetime[To] = Pool.Lifetime[From];
+}
+
+static void EmitParticles(ParticleSystem &System, ParticleEmitter &Emitter, float DeltaTime)
+{
+	ParticlePool &Pool = System.Pool;
+
+	Emitter.Accumulator += Emitter.Rate * DeltaTime;
+	int Count = min((int)Emitter.Accumulator, MAX_PARTICLES - Pool.Count);
+	Emitter.Accumulator -= (int)Emitter.Accumulator;
+
+	for (int n = 0; n < Count; ++n)
+	{
+		// Up inside a cone that Spread widens, at 50-100% of Speed
+		float Angle = ParticleRandom(Emitter.Seed) * XM_2PI;
+		float Radius = ParticleRandom(Emitter.Seed) * Emitter.Spread;
+		float Speed = Emitter.Speed * (0.5f + 0.5f * ParticleRandom(Emitter.Seed));
+		float Scale = Speed / sqrtf(1.0f + Radius * Radius);
+
+		int i = Pool.Count++;
+		Pool.PositionX[i] = Emitter.Position.x;
+		Pool.PositionY[i] = Emitter.Position.y;
+		Pool.PositionZ[i] = Emitter.Position.z;
+		Pool.VelocityX[i] = cosf(Angle) * Radius * Scale;
+		Pool.VelocityY[i] = Scale;
+		Pool.VelocityZ[i] = sinf(Angle) * Radius * Scale;
+		Pool.Age[i] = 0.0f;
+		Pool.Lifetime[i] = Emitter.Lifetime * (0.75f + 0.5f * ParticleRandom(Emitter.Seed));
+	}
+	System.Spawned += Count;
+}
+
+void SimulateParticles(ParticleSystem &System, float DeltaTime)
+{
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	ParticlePool &Pool = System.Pool;
+
+	ParticleUpdateJob Job = { &System, DeltaTime };
+	int Chunks = (Pool.Count + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+	ParallelFor(Chunks, 1, UpdateParticleChunks, &Job);
+
+	// Fill every hole with the last particle. Going from the highest dead index down, the last particle is
+	// always alive, because every dead one above the hole has already been removed.
+	System.Died = 0;
+	for (int Chunk = Chunks - 1; Chunk >= 0; --Chunk)
+	{
+		const std::vector<int> &Dead = Pool.Dead[Chunk];
+		for (int d = (int)Dead.size() - 1; d >= 0; --d)
+		{
+			int Last = --Pool.Count;
+			if (Dead[d] != Last)
+				MoveParticle(Pool, Dead[d], Last);
+		}
+		System.Died += (int)Dead.size();
+	}
+
+	System.Spawned = 0;
+	for (size_t i = 0; i < System.Emitters.size(); ++i)
+		EmitParticles(System, System.Emitters[i], DeltaTime);
+
+	QueryPerformanceCounter(&End);
+	System.SimulateMs = double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+}
+
+struct ParticleWriteJob
+{
+	const ParticleSystem *System;
+	ParticleInstance *Out;
+};
+
+// Positions and the color over life, packed to RGBA8
+static void WriteParticleChunk(void *Data, int Begin, int End)
+{
+	ParticleWriteJob *Job = (ParticleWriteJob *)Data;
+	const ParticlePool &Pool = Job->System->Pool;
+	XMFLOAT4 Start = Job->System->StartColor;
+	XMFLOAT4 Delta = XMFLOAT4(Job->System->EndColor.x - Start.x, Job->System->EndColor.y - Start.y,
+		Job->System->EndColor.z - Start.z, Job->System->EndColor.w - Start.w);
+	int i = Begin;
+
+#if defined(__AVX2__)
+	const __m256 Scale = _mm256_set1_ps(255.0f);
+	const __m256 StartR = _mm256_set1_ps(Start.x * 255.0f), DeltaR = _mm256_set1_ps(Delta.x * 255.0f);
+	const __m256 StartG = _mm256_set1_ps(Start.y * 255.0f), DeltaG = _mm256_set1_ps(Delta.y * 255.0f);
+	const __m256 StartB = _mm256_set1_ps(Start.z * 255.0f), DeltaB = _mm256_set1_ps(Delta.z * 255.0f);
+	const __m256 StartA = _mm256_set1_ps(Start.w * 255.0f), DeltaA = _mm256_set1_ps(Delta.w * 255.0f);
+	const __m256 Zero = _mm256_setzero_ps();
+
+	for (; i + 8 <= End; i += 8)
+	{
+		__m256 Life = _mm256_div_ps(_mm256_load_ps(Pool.Age + i), _mm256_load_ps(Pool.Lifetime + i));
+		Life = _mm256_min_ps(_mm256_max_ps(Life, Zero), _mm256_set1_ps(1.0f));
+
+		__m256i R = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_fmadd_ps(DeltaR, Life, StartR), Scale));
+		__m256i G = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_fmadd_ps(DeltaG, Life, StartG), Scale));
+		__m256i B = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_fmadd_ps(DeltaB, Life, StartB), Scale));
+		__m256i A = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_fmadd_ps(DeltaA, Life, StartA), Scale));
+		__m256i Color = _mm256_or_si256(_mm256_or_si256(R, _mm256_slli_epi32(G, 8)),
+			_mm256_or_si256(_mm256_slli_epi32(B, 16), _mm256_slli_epi32(A, 24)));
+
+		alignas(32) UINT Colors[8];
+		_mm256_store_si256((__m256i *)Colors, Color);
+		for (int Lane = 0; Lane < 8; ++Lane)
+		{
+			ParticleInstance &Instance = Job->Out[i + Lane];
+			Instance.Position = XMFLOAT3(Pool.PositionX[i + Lane], Pool.PositionY[i + Lane], Pool.PositionZ[i + Lane]);
+			Instance.Color = Colors[Lane];
+		}
+	}
+#endif
+
+	for (; i < End; ++i)
+	{
+		float Life = min(max(Pool.Age[i] / Pool.Lifetime[i], 0.0f), 1.0f);
+		UINT R = (UINT)((Start.x + Delta.x * Life) * 255.0f + 0.5f);
+		UINT G = (UINT)((Start.y + Delta.y * Life) * 255.0f + 0.5f);
+		UINT B = (UINT)((Start.z + Delta.z * Life) * 255.0f + 0.5f);
+		UINT A = (UINT)((Start.w + Delta.w * Life) * 255.0f + 0.5f);
+
+		Job->Out[i].Position = XMFLOAT3(Pool.PositionX[i], Pool.PositionY[i], Pool.PositionZ[i]);
+		Job->Out[i].Color = R | (G << 8) | (B << 16) | (A << 24);
+	}
+}
+
+// Out has room for System.Pool.Count instances, it is usually a mapped instance buffer
+void WriteParticleInstances(const ParticleSystem &System, ParticleInstance *Out)
+{
+	ParticleWriteJob Job = { &System, Out };
+	ParallelFor(System.Pool.Count, PARTICLE_CHUNK, WriteParticleChunk, &Job);
+}
+
+bool InitParticles()
+{
+	InitParticleSystem(Particles);
+
+	// A fountain over Cube2 that keeps the pool about full
+	AddParticleEmitter(Particles, XMFLOAT3(0.0f, 1.5f, 0.0f), MAX_PARTICLES, 2.0f, 8.0f, 0.5f);
+
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "PARTICLE_VS", "vs_5_0", 0, 0, &ParticleVSBuffer, 0));
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "PARTICLE_PS", "ps_5_0", 0, 0, &ParticlePSBuffer, 0));
+	HR(D3D11Device->CreateVertexShader(ParticleVSBuffer->GetBufferPointer(), ParticleVSBuffer->GetBufferSize(), 0, &ParticleVS));
+	HR(D3D11Device->CreatePixelShader(ParticlePSBuffer->GetBufferPointer(), ParticlePSBuffer->GetBufferSize(), 0, &ParticlePS));
+	HR(D3D11Device->CreateInputLayout(ParticleLayout, ARRAYSIZE(ParticleLayout), ParticleVSBuffer->GetBufferPointer(),
+		ParticleVSBuffer->GetBufferSize(), &ParticleVertexLayout));
+
+	D3D11_BUFFER_DESC InstanceBufferDesc = {};
+	InstanceBufferDesc.ByteWidth = sizeof(ParticleInstance) * MAX_PARTICLES;
+	InstanceBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
+	InstanceBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	InstanceBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	HR(D3D11Device->CreateBuffer(&InstanceBufferDesc, NULL, &ParticleInstanceBuffer));
+
+	D3D11_BUFFER_DESC ConstantBufferDesc = {};
+	ConstantBufferDesc.ByteWidth = sizeof(cbParticle);
+	ConstantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	HR(D3D11Device->CreateBuffer(&ConstantBufferDesc, 0, &cbParticleBuffer));
+
+	D3D11_BLEND_DESC BlendDesc = {};
+	BlendDesc.RenderTarget[0].BlendEnable = true;
+	BlendDesc.RenderTarget[0].SrcBlend = D3D11_BLEND_ONE;
+	BlendDesc.RenderTarget[0].DestBlend = D3D11_BLEND_ONE;
+	BlendDesc.RenderTarget[0].BlendOp = D3D11_BLEND_OP_ADD;
+	BlendDesc.RenderTarget[0].SrcBlendAlpha = D3D11_BLEND_ZERO;
+	BlendDesc.RenderTarget[0].DestBlendAlpha = D3D11_BLEND_ONE;
+	BlendDesc.RenderTarget[0].BlendOpAlpha = D3D11_BLEND_OP_ADD;
+	BlendDesc.RenderTarget[0].RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
+	HR(D3D11Device->CreateBlendState(&BlendDesc, &AdditiveBlendState));
+
+	D3D11_DEPTH_STENCIL_DESC DepthDesc = {};
+	DepthDesc.DepthEnable = true;
+	DepthDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ZERO;
+	DepthDesc.DepthFunc = D3D11_COMPARISON_LESS;
+	HR(D3D11Device->CreateDepthStencilState(&DepthDesc, &DepthTestNoWriteState));
+
+	return true;
+}
+
+void ReleaseParticles()
+{
+	ReleaseParticleSystem(Particles);
+	ParticleInstanceBuffer->Release();
+	cbParticleBuffer->Release();
+	ParticleVS->Release();
+	ParticlePS->Release();
+	ParticleVSBuffer->Release();
+	ParticlePSBuffer->Release();
+	ParticleVertexLayout->Release();
+	AdditiveBlendState->Release();
+	DepthTestNoWriteState->Release();
+}
+
+void ParticlePass()
+{
+	if (!ParticlesEnabled || Particles.Pool.Count == 0)
+		return;
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	ParticleInstance *Mapped = (ParticleInstance *)MapDiscard(ParticleInstanceBuffer);
+	if (!Mapped)
+		return;
+	WriteParticleInstances(Particles, Mapped);
+	Unmap(ParticleInstanceBuffer, Particles.Pool.Count * sizeof(ParticleInstance));
+
+	QueryPerformanceCounter(&End);
+	Particles.UploadMs = double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+	ParticleSimulateMsThisSecond += Particles.SimulateMs;
+	ParticleUploadMsThisSecond += Particles.UploadMs;
+	ParticleFramesThisSecond++;
+
+	// The camera's right and up axes in world space span the quads
+	XMMATRIX InverseView = XMMatrixInverse(NULL, CameraView);
+	cbParticle Constants;
+	Constants.ViewProjection = XMMatrixTranspose(CameraView * CameraProjection);
+	XMStoreFloat4(&Constants.CameraRight, XMVectorSetW(InverseView.r[0], Particles.Size));
+	XMStoreFloat4(&Constants.CameraUp, InverseView.r[1]);
+	UploadSubresource(cbParticleBuffer, &Constants, sizeof(cbParticle));
+
+	ID3D11RenderTargetView *SceneTargetView = FrameGraph.Resources[RGSceneColor].RTV;
+	ID3D11DepthStencilView *DepthStencilView = FrameGraph.Resources[RGDepth].DSV;
+
+	D3D11_VIEWPORT Viewport = {};
+	Viewport.Width = (FLOAT)ScaledWidth;
+	Viewport.Height = (FLOAT)ScaledHeight;
+	Viewport.MinDepth = 0.0f;
+	Viewport.MaxDepth = 1.0f;
+
+	UINT Stride = sizeof(ParticleInstance);
+	UINT Offset = 0;
+
+	Bind()->RSSetViewports(1, &Viewport);
+	Bind()->RSSetState(NoCullMode);
+	Bind()->OMSetRenderTargets(1, &SceneTargetView, DepthStencilView);
+	Bind()->OMSetBlendState(AdditiveBlendState, NULL, 0xffffffff);
+	Bind()->OMSetDepthStencilState(DepthTestNoWriteState, 0);
+	Bind()->IASetInputLayout(ParticleVertexLayout);
+	Bind()->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+	Bind()->IASetVertexBuffers(0, 1, &ParticleInstanceBuffer, &Stride, &Offset);
+	Bind()->VSSetShader(ParticleVS, 0, 0);
+	Bind()->VSSetConstantBuffers(3, 1, &cbParticleBuffer);
+	Bind()->PSSetShader(ParticlePS, 0, 0);
+
+	DrawCall()->DrawInstanced(4, Particles.Pool.Count, 0, 0);
+
+	Stride = sizeof(Vertex);
+	Bind()->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	Bind()->IASetInputLayout(VertexLayout);
+	Bind()->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
+	Bind()->OMSetBlendState(0, 0, 0xffffffff);
+	Bind()->OMSetDepthStencilState(NULL, 0);
+	Bind()->VSSetShader(VertexShader, 0, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+}
+
+// Ages and lifetimes only, enough to count the live particles of the same emitter one particle at a time
+struct ParticleReference
+{
+	std::vector<float> Age;
+	std::vector<float> Lifetime;
+	ParticleEmitter Emitter;
+};
+
+// Same order as SimulateParticles: age, drop the dead, then emit
+static void SimulateParticleReference(ParticleReference &Reference, float DeltaTime)
+{
+	size_t Live = 0;
+	for (size_t i = 0; i < Reference.Age.size(); ++i)
+	{
+		float Age = Reference.Age[i] + DeltaTime;
+		if (Age >= Reference.Lifetime[i])
+			continue;
+		Reference.Age[Live] = Age;
+		Reference.Lifetime[Live] = Reference.Lifetime[i];
+		Live++;
+	}
+	Reference.Age.resize(Live);
+	Reference.Lifetime.resize(Live);
+
+	ParticleEmitter &Emitter = Reference.Emitter;
+	Emitter.Accumulator += Emitter.Rate * DeltaTime;
+	int Count = min((int)Emitter.Accumulator, MAX_PARTICLES - (int)Live);
+	Emitter.Accumulator -= (int)Emitter.Accumulator;
+	for (int n = 0; n < Count; ++n)
+	{
+		// Direction and speed draws are skipped the same way EmitParticles makes them
+		ParticleRandom(Emitter.Seed);
+		ParticleRandom(Emitter.Seed);
+		ParticleRandom(Emitter.Seed);
+		Reference.Age.push_back(0.0f);
+		Reference.Lifetime.push_back(Emitter.Lifetime * (0.75f + 0.5f * ParticleRandom(Emitter.Seed)));
+	}
+}
+
+// Particles past their lifetime still in the pool after compaction
+static int CountDeadParticles(const ParticlePool &Pool)
+{
+	int Dead = 0;
+	for (int i = 0; i < Pool.Count; ++i)
+	{
+		if (Pool.Age[i] >= Pool.Lifetime[i])
+			Dead++;
+	}
+	return Dead;
+}
+
+// Simulates the fountain at 60 Hz until the pool is full, then reports Frames more of simulation and instance writes.
+// Every frame the pool has to stay within MAX_PARTICLES, hold no dead particle and as many live ones as the scalar
+// reference.
+int RunParticleTest(int Frames)
+{
+	InitParticleSystem(Particles);
+	AddParticleEmitter(Particles, XMFLOAT3(0.0f, 1.5f, 0.0f), MAX_PARTICLES, 2.0f, 8.0f, 0.5f);
+
+	ParticleReference Reference;
+	Reference.Age.reserve(MAX_PARTICLES);
+	Reference.Lifetime.reserve(MAX_PARTICLES);
+	Reference.Emitter = Particles.Emitters[0];
+
+	ParticleInstance *Instances = (ParticleInstance *)_aligned_malloc(sizeof(ParticleInstance) * MAX_PARTICLES, 64);
+	const float DeltaTime = 1.0f / 60.0f;
+	// Two and a half lifetimes reaches the steady state
+	const int WarmupFrames = 300;
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+
+	int OverFull = 0, Survivors = 0, Mismatches = 0;
+	double SimulateMs = 0.0, UploadMs = 0.0, WorstMs = 0.0;
+	UINT64 ParticleFrames = 0;
+	for (int i = 0; i < WarmupFrames + Frames; ++i)
+	{
+		SimulateParticles(Particles, DeltaTime);
+		SimulateParticleReference(Reference, DeltaTime);
+
+		if (Particles.Pool.Count > MAX_PARTICLES)
+		{
+			if (OverFull++ == 0)
+				printf("  frame %d: %d particles, more than the %d the pool holds\n", i, Particles.Pool.Count, MAX_PARTICLES);
+		}
+
+		int Dead = CountDeadParticles(Particles.Pool);
+		if (Dead && Survivors++ == 0)
+			printf("  frame %d: %d dead particles survived compaction\n", i, Dead);
+
+		if (Particles.Pool.Count != (int)Reference.Age.size())
+		{
+			if (Mismatches++ == 0)
+				printf("  frame %d: %d particles live, the scalar reference has %d\n", i, Particles.Pool.Count, (int)Reference.Age.size());
+		}
+
+		if (i < WarmupFrames)
+			continue;
+
+		QueryPerformanceCounter(&Start);
+		WriteParticleInstances(Particles, Instances);
+		QueryPerformanceCounter(&End);
+
+		double FrameUploadMs = double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+		SimulateMs += Particles.SimulateMs;
+		UploadMs += FrameUploadMs;
+		WorstMs = max(WorstMs, Particles.SimulateMs + FrameUploadMs);
+		ParticleFrames += Particles.Pool.Count;
+	}
+
+	printf("Particle test (%s, %d threads): %.0f particles on average over %d frames\n",
+#if defined(__AVX2__)
+		"AVX2",
+#else
+		"scalar",
+#endif
+		JobThreadCount(), (double)ParticleFrames / max(Frames, 1), Frames);
+	printf("  %.3f ms simulate + %.3f ms instance write per frame, %.3f ms worst frame, %.1f M particles/sec\n",
+		SimulateMs / max(Frames, 1), UploadMs / max(Frames, 1), WorstMs, ParticleFrames / max((SimulateMs + UploadMs) * 1000.0, 1e-9));
+
+	int Failures = (OverFull > 0) + (Survivors > 0) + (Mismatches > 0);
+	printf("  %d frames over the pool size, %d with dead survivors, %d off the scalar reference\n", OverFull, Survivors, Mismatches);
+	printf("  %d of the checks failed\n", Failures);
+
+	_aligned_free(Instances);
+	ReleaseParticleSystem(Particles);
+	return Failures == 0 ? 0 : 1;
+}
+
+// Largest component dropped and rebuilt from the other three, which then fit in [-1/sqrt2, 1/sqrt2]
+static void EncodeRotation(XMFLOAT4 Rotation, UINT16 Out[3])
+{
+	float Components[4] = { Rotation.x, Rotation.y, Rotation.z, Rotation.w };
+
+	int Largest = 0;
+	for (int c = 1; c < 4; ++c)
+	{
+		if (fabsf(Components[c]) > fabsf(Components[Largest]))
+			Largest = c;
+	}
+
+	// q and -q are the same rotation, keep the dropped component positive
+	float Sign = Components[Largest] < 0.0f ? -1.0f : 1.0f;
+
+	UINT Quantized[3];
+	for (int c = 0, n = 0; c < 4; ++c)
+	{
+		if (c == Largest)
+			continue;
+		float Normalized = Components[c] * Sign * ROTATION_QUANTIZE_SCALE * 0.5f + 0.5f;
+		Quantized[n++] = (UINT)(min(max(Normalized, 0.0f), 1.0f) * 32767.0f + 0.5f);
+	}
+
+	Out[0] = (UINT16)(Quantized[0] | ((Largest & 1) << 15));
+	Out[1] = (UINT16)(Quantized[1] | ((Largest >> 1) << 15));
+	Out[2] = (UINT16)Quantized[2];
+}
+
+static inline XMVECTOR DecodeRotation(const UINT16 In[3])
+{
+	// Where the rebuilt component, which decodes into w, goes back to
+	static const UINT Swizzles[4][4] = { { 3, 0, 1, 2 }, { 0, 3, 1, 2 }, { 0, 1, 3, 2 }, { 0, 1, 2, 3 } };
+	const XMVECTOR Scale = XMVectorReplicate(2.0f / (32767.0f * ROTATION_QUANTIZE_SCALE));
+	const XMVECTOR Bias = XMVectorReplicate(-1.0f / ROTATION_QUANTIZE_SCALE);
+
+	int Largest = (In[0] >> 15) | ((In[1] >> 15) << 1);
+	XMVECTOR Small = XMVectorMultiplyAdd(XMVectorSet((float)(In[0] & 0x7fff), (float)(In[1] & 0x7fff), (float)In[2], 0.0f), Scale, Bias);
+	XMVECTOR W = XMVectorSqrt(XMVectorMax(XMVectorSubtract(XMVectorSplatOne(), XMVector3Dot(Small, Small)), XMVectorZero()));
+	XMVECTOR Rotation = XMVectorSelect(W, Small, g_XMSelect1110);
+
+	const UINT *Swizzle = Swizzles[Largest];
+	return XMVectorSwizzle(Rotation, Swizzle[0], Swizzle[1], Swizzle[2], Swizzle[3]);
+}
+
+bool CompressAnimationClip(const RawAnimationClip &Raw, CompressedAnimationClip &Clip)
+{
+	if (Raw.BoneCount > MAX_BONES || Raw.KeyCount < 2)
+		return false;
+
+	Clip.BoneCount = Raw.BoneCount;
+	Clip.KeyCount = Raw.KeyCount;
+	Clip.SampleRate = Raw.SampleRate;
+	Clip.Duration = Raw.KeyCount / Raw.SampleRate;
+
+	Clip.Rotations.resize(Raw.KeyCount * Raw.BoneCount * 3);
+	for (int i = 0; i < Raw.KeyCount * Raw.BoneCount; ++i)
+		EncodeRotation(Raw.Rotations[i], &Clip.Rotations[i * 3]);
+
+	// A translation track that stays within a millimeter of its first key is stored once
+	Clip.AnimatedTranslationCount = 0;
+	for (int b = 0; b < Raw.BoneCount; ++b)
+	{
+		XMFLOAT3 Low = Raw.Translations[b], High = Raw.Translations[b];
+		for (int k = 1; k < Raw.KeyCount; ++k)
+		{
+			const XMFLOAT3 &T = Raw.Translations[k * Raw.BoneCount + b];
+			Low = XMFLOAT3(min(Low.x, T.x), min(Low.y, T.y), min(Low.z, T.z));
+			High = XMFLOAT3(max(High.x, T.x), max(High.y, T.y), max(High.z, T.z));
+		}
+
+		Clip.TranslationTrack[b] = -1;
+		Clip.ConstantTranslations[b] = Raw.Translations[b];
+		if (High.x - Low.x > 0.001f || High.y - Low.y > 0.001f || High.z - Low.z > 0.001f)
+		{
+			int Track = Clip.AnimatedTranslationCount++;
+			Clip.TranslationTrack[b] = Track;
+			Clip.TranslationMin[Track] = Low;
+			Clip.TranslationExtent[Track] = XMFLOAT3(High.x - Low.x, High.y - Low.y, High.z - Low.z);
+		}
+	}
+
+	// 16 bits per component inside the track's range
+	Clip.Translations.resize(Raw.KeyCount * Clip.AnimatedTranslationCount * 3);
+	for (int k = 0; k < Raw.KeyCount; ++k)
+	{
+		for (int b = 0; b < Raw.BoneCount; ++b)
+		{
+			int Track = Clip.TranslationTrack[b];
+			if (Track < 0)
+				continue;
+
+			const XMFLOAT3 &T = Raw.Translations[k * Raw.BoneCount + b];
+			const XMFLOAT3 &Low = Clip.TranslationMin[Track];
+			const XMFLOAT3 &Extent = Clip.TranslationExtent[Track];
+			UINT16 *Out = &Clip.Translations[(k * Clip.AnimatedTranslationCount + Track) * 3];
+			Out[0] = (UINT16)(Extent.x > 0.0f ? (T.x - Low.x) / Extent.x * 65535.0f + 0.5f : 0.0f);
+			Out[1] = (UINT16)(Extent.y > 0.0f ? (T.y - Low.y) / Extent.y * 65535.0f + 0.5f : 0.0f);
+			Out[2] = (UINT16)(Extent.z > 0.0f ? (T.z - Low.z) / Extent.z * 65535.0f + 0.5f : 0.0f);
+		}
+	}
+	return true;
+}
+
+// Uncompressed, as floats: a rotation and a translation per bone per key
+UINT64 RawAnimationClipBytes(const RawAnimationClip &Raw)
+{
+	return (UINT64)Raw.KeyCount * Raw.BoneCount * (sizeof(XMFLOAT4) + sizeof(XMFLOAT3));
+}
+
+UINT64 CompressedAnimationClipBytes(const CompressedAnimationClip &Clip)
+{
+	return Clip.Rotations.size() * sizeof(UINT16) + Clip.Translations.size() * sizeof(UINT16) +
+		Clip.BoneCount * (sizeof(XMFLOAT3) + sizeof(int)) + Clip.AnimatedTranslationCount * 2 * sizeof(XMFLOAT3);
+}
+
+// Normalized lerp through the shorter arc, close enough to a slerp between neighboring keys or similar poses
+static inline XMVECTOR NlerpRotation(FXMVECTOR Rotation0, FXMVECTOR Rotation1, FXMVECTOR Alpha)
+{
+	XMVECTOR Target = XMVectorSelect(Rotation1, XMVectorNegate(Rotation1), XMVectorLess(XMVector4Dot(Rotation0, Rotation1), XMVectorZero()));
+	return XMQuaternionNormalize(XMVectorLerpV(Rotation0, Target, Alpha));
+}
+
+// Looping, so the last key blends back into the first
+void SampleAnimationClip(const CompressedAnimationClip &Clip, float Time, AnimationPose &Pose)
+{
+	float KeyTime = fmodf(Time, Clip.Duration) * Clip.SampleRate;
+	if (KeyTime < 0.0f)
+		KeyTime += Clip.KeyCount;
+
+	int Key0 = min((int)KeyTime, Clip.KeyCount - 1);
+	int Key1 = Key0 + 1 < Clip.KeyCount ? Key0 + 1 : 0;
+	XMVECTOR Alpha = XMVectorReplicate(KeyTime - Key0);
+
+	const UINT16 *Rotations0 = &Clip.Rotations[Key0 * Clip.BoneCount * 3];
+	const UINT16 *Rotations1 = &Clip.Rotations[Key1 * Clip.BoneCount * 3];
+	for (int b = 0; b < Clip.BoneCount; ++b)
+	{
+		XMVECTOR Rotation0 = DecodeRotation(Rotations0 + b * 3);
+		XMVECTOR Rotation1 = DecodeRotation(Rotations1 + b * 3);
+		Pose.Rotations[b] = NlerpRotation(Rotation0, Rotation1, Alpha);
+	}
+
+	const UINT16 *Translations0 = Clip.Translations.empty() ? NULL : &Clip.Translations[Key0 * Clip.AnimatedTranslationCount * 3];
+	const UINT16 *Translations1 = Clip.Translations.empty() ? NULL : &Clip.Translations[Key1 * Clip.AnimatedTranslationCount * 3];
+	const XMVECTOR Unit = XMVectorReplicate(1.0f / 65535.0f);
+	for (int b = 0; b < Clip.BoneCount; ++b)
+	{
+		int Track = Clip.TranslationTrack[b];
+		if (Track < 0)
+		{
+			Pose.Translations[b] = XMLoadFloat3(&Clip.ConstantTranslations[b]);
+			continue;
+		}
+
+		const UINT16 *T0 = Translations0 + Track * 3;
+		const UINT16 *T1 = Translations1 + Track * 3;
+		XMVECTOR Quantized = XMVectorLerpV(XMVectorSet(T0[0], T0[1], T0[2], 0.0f), XMVectorSet(T1[0], T1[1], T1[2], 0.0f), Alpha);
+		Pose.Translations[b] = XMVectorMultiplyAdd(XMVectorMultiply(Quantized, Unit), XMLoadFloat3(&Clip.TranslationExtent[Track]),
+			XMLoadFloat3(&Clip.TranslationMin[Track]));
+	}
+}
+
+void BlendAnimationPoses(const AnimationPose &Pose0, const AnimationPose &Pose1, float Weight, int BoneCount, AnimationPose &Out)
+{
+	XMVECTOR Alpha = XMVectorReplicate(Weight);
+	for (int b = 0; b < BoneCount; ++b)
+	{
+		Out.Rotations[b] = NlerpRotation(Pose0.Rotations[b], Pose1.Rotations[b], Alpha);
+		Out.Translations[b] = XMVectorLerpV(Pose0.Translations[b], Pose1.Translations[b], Alpha);
+	}
+}
+
+// Parents come before their children, so one pass in order takes every bone to model space
+void ComputeSkinningMatrices(const Skeleton &Bones, const AnimationPose &Pose, CXMMATRIX World, XMFLOAT4X4 *Out)
+{
+	XMMATRIX Model[MAX_BONES];
+	for (int b = 0; b < Bones.BoneCount; ++b)
+	{
+		XMMATRIX Local = XMMatrixRotationQuaternion(Pose.Rotations[b]);
+		Local.r[3] = XMVectorSelect(g_XMIdentityR3, Pose.Translations[b], g_XMSelect1110);
+
+		Model[b] = Bones.Parents[b] < 0 ? Local * World : Local * Model[Bones.Parents[b]];
+		XMStoreFloat4x4(&Out[b], XMMatrixTranspose(XMLoadFloat4x4(&Bones.InverseBind[b]) * Model[b]));
+	}
+}
+
+// A tentacle: a chain of bones 0.5 apart standing up from the root
+void BuildCharacterSkeleton(Skeleton &Bones)
+{
+	Bones.BoneCount = CHARACTER_BONES;
+	for (int b = 0; b < Bones.BoneCount; ++b)
+	{
+		Bones.Parents[b] = b - 1;
+		XMStoreFloat4x4(&Bones.InverseBind[b], XMMatrixTranslation(0.0f, -CHARACTER_BONE_LENGTH * b, 0.0f));
+	}
+}
+
+// Clip 0 sways side to side with a wave running up the chain and bobs the root, clip 1 curls forward
+void BuildCharacterClip(int ClipIndex, const Skeleton &Bones, RawAnimationClip &Raw)
+{
+	Raw.BoneCount = Bones.BoneCount;
+	Raw.KeyCount = 60;
+	Raw.SampleRate = 30.0f;
+	Raw.Rotations.resize(Raw.KeyCount * Raw.BoneCount);
+	Raw.Translations.resize(Raw.KeyCount * Raw.BoneCount);
+
+	for (int k = 0; k < Raw.KeyCount; ++k)
+	{
+		float Phase = XM_2PI * k / Raw.KeyCount;
+		for (int b = 0; b < Raw.BoneCount; ++b)
+		{
+			XMVECTOR Rotation;
+			XMFLOAT3 Translation(0.0f, b > 0 ? CHARACTER_BONE_LENGTH : 0.0f, 0.0f);
+			if (ClipIndex == 0)
+			{
+				Rotation = XMQuaternionRotationRollPitchYaw(0.0f, 0.0f, 0.2f * sinf(Phase + 0.6f * b));
+				if (b == 0)
+					Translation.y = 0.1f * sinf(2.0f * Phase);
+			}
+			else
+			{
+				float Curl = 0.35f * (0.5f + 0.5f * sinf(Phase)) * b / (Raw.BoneCount - 1);
+				Rotation = XMQuaternionRotationRollPitchYaw(Curl, 0.1f * sinf(Phase + b), 0.0f);
+			}
+
+			XMStoreFloat4(&Raw.Rotations[k * Raw.BoneCount + b], Rotation);
+			Raw.Translations[k * Raw.BoneCount + b] = Translation;
+		}
+	}
+}
+
+// A tapered four sided tube over the chain. Vertices near a joint blend between the two bones that meet there.
+void BuildCharacterMesh(std::vector<SkinnedVertex> &Vertices, std::vector<DWORD> &Indices)
+{
+	const int Rings = 25;
+	const float Height = CHARACTER_BONE_LENGTH * CHARACTER_BONES;
+	const float Corners[5][2] = { { -1.0f, -1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f }, { -1.0f, 1.0f }, { -1.0f, -1.0f } };
+	const float Normals[4][2] = { { 0.0f, -1.0f }, { 1.0f, 0.0f }, { 0.0f, 1.0f }, { -1.0f, 0.0f } };
+
+	Vertices.clear();
+	Indices.clear();
+	for (int r = 0; r < Rings; ++r)
+	{
+		float y = Height * r / (Rings - 1);
+		float HalfWidth = 0.3f * (1.0f - 0.6f * y / Height);
+
+		float BonePosition = y / CHARACTER_BONE_LENGTH;
+		int Bone = min((int)BonePosition, CHARACTER_BONES - 1);
+		float Along = BonePosition - Bone;
+		float SelfWeight = Bone > 0 && Along < 0.5f ? 0.5f + Along : 1.0f;
+		BYTE SelfByte = (BYTE)(SelfWeight * 255.0f + 0.5f);
+
+		for (int s = 0; s < 4; ++s)
+		{
+			for (int c = 0; c < 2; ++c)
+			{
+				SkinnedVertex Vertex = {};
+				Vertex.pos = XMFLOAT3(Corners[s + c][0] * HalfWidth, y, Corners[s + c][1] * HalfWidth);
+				Vertex.texCoord = XMFLOAT2((float)c, y / Height);
+				Vertex.normal = XMFLOAT3(Normals[s][0], 0.0f, Normals[s][1]);
+				Vertex.BoneIndices[0] = (BYTE)Bone;
+				Vertex.BoneIndices[1] = (BYTE)max(Bone - 1, 0);
+				Vertex.BoneWeights[0] = SelfByte;
+				Vertex.BoneWeights[1] = (BYTE)(255 - SelfByte);
+				Vertices.push_back(Vertex);
+			}
+
+			if (r + 1 < Rings)
+			{
+				DWORD Base = (DWORD)((r * 4 + s) * 2);
+				DWORD Next = Base + 8;
+				DWORD Quad[6] = { Base, Next, Base + 1, Base + 1, Next, Next + 1 };
+				Indices.insert(Indices.end(), Quad, Quad + 6);
+			}
+		}
+	}
+}
+
+struct CharacterUpdateJob
+{
+	AnimatedCharacter *Characters;
+	float DeltaTime;
+	XMFLOAT4X4 *Skinning;
+};
+
+// Samples both clips, blends them by the character's own weight, then walks the hierarchy. Characters are independent,
+// so the parallelism is across them.
+static void UpdateCharacterChunk(void *Data, int Begin, int End)
+{
+	CharacterUpdateJob *Job = (CharacterUpdateJob *)Data;
+	int BoneCount = CharacterSkeleton.BoneCount;
+
+	AnimationPose Sway, Curl, Pose;
+	for (int i = Begin; i < End; ++i)
+	{
+		AnimatedCharacter &Character = Job->Characters[i];
+		Character.Time += Job->DeltaTime * Character.Speed;
+		float Blend = 0.5f + 0.5f * sinf(0.5f * Character.Time + Character.BlendPhase);
+
+		SampleAnimationClip(CharacterClips[0], Character.Time, Sway);
+		SampleAnimationClip(CharacterClips[1], Character.Time, Curl);
+		BlendAnimationPoses(Sway, Curl, Blend, BoneCount, Pose);
+		ComputeSkinningMatrices(CharacterSkeleton, Pose, XMLoadFloat4x4(&Character.World), Job->Skinning + i * BoneCount);
+	}
+}
+
+// Skinning receives CharacterSkeleton.BoneCount matrices per character, in order
+void UpdateCharacters(AnimatedCharacter *Characters, int Count, float DeltaTime, XMFLOAT4X4 *Skinning)
+{
+	CharacterUpdateJob Job = { Characters, DeltaTime, Skinning };
+	ParallelFor(Count, 16, UpdateCharacterChunk, &Job);
+}
+
+static void PlaceCharacters(std::vector<AnimatedCharacter> &Placed, int Count)
+{
+	Placed.resize(Count);
+	for (int i = 0; i < Count; ++i)
+	{
+		// Rings of 32 around the origin
+		float Angle = XM_2PI * (i % 32) / 32.0f + (i / 32) * 0.1f;
+		float Radius = 10.0f + 3.0f * (i / 32);
+		XMStoreFloat4x4(&Placed[i].World, XMMatrixTranslation(Radius * cosf(Angle), -2.0f, Radius * sinf(Angle)));
+		Placed[i].Time = 0.37f * i;
+		Placed[i].Speed = 0.8f + 0.4f * ((i * 7) % 11) / 10.0f;
+		Placed[i].BlendPhase = 1.3f * i;
+	}
+}
+
+static bool InitCharacterAnimation()
+{
+	BuildCharacterSkeleton(CharacterSkeleton);
+	for (int c = 0; c < CHARACTER_CLIPS; ++c)
+	{
+		RawAnimationClip Raw;
+		BuildCharacterClip(c, CharacterSkeleton, Raw);
+		if (!CompressAnimationClip(Raw, CharacterClips[c]))
+			return false;
+	}
+
+	return true;
+}
+
+bool InitCharacters()
+{
+	if (!InitCharacterAnimation())
+		return false;
+	PlaceCharacters(Characters, SCENE_CHARACTERS);
+
+	std::vector<SkinnedVertex> Vertices;
+	std::vector<DWORD> Indices;
+	BuildCharacterMesh(Vertices, Indices);
+	CharacterIndexCount = (UINT)Indices.size();
+
+	D3D11_BUFFER_DESC BufferDesc = {};
+	BufferDesc.Usage = D3D11_USAGE_DEFAULT;
+	BufferDesc.ByteWidth = (UINT)(sizeof(SkinnedVertex) * Vertices.size());
+	BufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	D3D11_SUBRESOURCE_DATA BufferData = {};
+	BufferData.pSysMem = Vertices.data();
+	HR(D3D11Device->CreateBuffer(&BufferDesc, &BufferData, &SkinnedVertexBuffer));
+
+	BufferDesc.ByteWidth = (UINT)(sizeof(DWORD) * Indices.size());
+	BufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+	BufferData.pSysMem = Indices.data();
+	HR(D3D11Device->CreateBuffer(&BufferDesc, &BufferData, &SkinnedIndexBuffer));
+
+	// Every character's matrices, rewritten every frame and read by index in the vertex shader
+	D3D11_BUFFER_DESC SkinningDesc = {};
+	SkinningDesc.ByteWidth = sizeof(XMFLOAT4X4) * MAX_CHARACTERS * MAX_BONES;
+	SkinningDesc.Usage = D3D11_USAGE_DYNAMIC;
+	SkinningDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	SkinningDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	SkinningDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+	SkinningDesc.StructureByteStride = sizeof(XMFLOAT4X4);
+	HR(D3D11Device->CreateBuffer(&SkinningDesc, NULL, &SkinningBuffer));
+
+	D3D11_SHADER_RESOURCE_VIEW_DESC SkinningViewDesc = {};
+	SkinningViewDesc.Format = DXGI_FORMAT_UNKNOWN;
+	SkinningViewDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+	SkinningViewDesc.Buffer.FirstElement = 0;
+	SkinningViewDesc.Buffer.NumElements = MAX_CHARACTERS * MAX_BONES;
+	HR(D3D11Device->CreateShaderResourceView(SkinningBuffer, &SkinningViewDesc, &SkinningBufferView));
+
+	cbSkinning Skinning = {};
+	Skinning.BonesPerCharacter = CharacterSkeleton.BoneCount;
+	D3D11_BUFFER_DESC ConstantBufferDesc = {};
+	ConstantBufferDesc.ByteWidth = sizeof(cbSkinning);
+	ConstantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	D3D11_SUBRESOURCE_DATA ConstantData = {};
+	ConstantData.pSysMem = &Skinning;
+	HR(D3D11Device->CreateBuffer(&ConstantBufferDesc, &ConstantData, &cbSkinningBuffer));
+
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "SKINNED_VS", "vs_5_0", 0, 0, &SkinnedVSBuffer, 0));
+	HR(D3D11Device->CreateVertexShader(SkinnedVSBuffer->GetBufferPointer(), SkinnedVSBuffer->GetBufferSize(), 0, &SkinnedVS));
+	HR(D3D11Device->CreateInputLayout(SkinnedLayout, ARRAYSIZE(SkinnedLayout), SkinnedVSBuffer->GetBufferPointer(),
+		SkinnedVSBuffer->GetBufferSize(), &SkinnedVertexLayout));
+
+	return true;
+}
+
+void ReleaseCharacters()
+{
+	SkinnedVertexBuffer->Release();
+	SkinnedIndexBuffer->Release();
+	SkinningBuffer->Release();
+	SkinningBufferView->Release();
+	cbSkinningBuffer->Release();
+	SkinnedVS->Release();
+	SkinnedVSBuffer->Release();
+	SkinnedVertexLayout->Release();
+}
+
+void CharacterPass()
+{
+	if (Characters.empty() || !CharacterSkinning)
+		return;
+
+	void *Mapped = MapDiscard(SkinningBuffer);
+	if (!Mapped)
+		return;
+	size_t SkinningBytes = sizeof(XMFLOAT4X4) * Characters.size() * CharacterSkeleton.BoneCount;
+	memcpy(Mapped, CharacterSkinning, SkinningBytes);
+	Unmap(SkinningBuffer, SkinningBytes);
+
+	cbPerView View;
+	View.ViewProjection = XMMatrixTranspose(CameraView * CameraProjection);
+	UploadSubresource(cbPerViewBuffer, &View, sizeof(cbPerView));
+
+	ID3D11RenderTargetView *SceneTargetView = FrameGraph.Resources[RGSceneColor].RTV;
+	ID3D11DepthStencilView *DepthStencilView = FrameGraph.Resources[RGDepth].DSV;
+
+	D3D11_VIEWPORT Viewport = {};
+	Viewport.Width = (FLOAT)ScaledWidth;
+	Viewport.Height = (FLOAT)ScaledHeight;
+	Viewport.MinDepth = 0.0f;
+	Viewport.MaxDepth = 1.0f;
+
+	UINT Stride = sizeof(SkinnedVertex);
+	UINT Offset = 0;
+
+	Bind()->RSSetViewports(1, &Viewport);
+	Bind()->RSSetState(NoCullMode);
+	Bind()->OMSetRenderTargets(1, &SceneTargetView, DepthStencilView);
+	Bind()->OMSetBlendState(0, 0, 0xffffffff);
+	Bind()->IASetInputLayout(SkinnedVertexLayout);
+	Bind()->IASetVertexBuffers(0, 1, &SkinnedVertexBuffer, &Stride, &Offset);
+	Bind()->IASetIndexBuffer(SkinnedIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	Bind()->VSSetShader(SkinnedVS, 0, 0);
+	Bind()->VSSetConstantBuffers(2, 1, &cbPerViewBuffer);
+	Bind()->VSSetConstantBuffers(4, 1, &cbSkinningBuffer);
+	Bind()->VSSetShaderResources(2, 1, &SkinningBufferView);
+	Bind()->PSSetShader(GetPixelShaderPermutation(SHADER_ENTRY_PS, LitShaderFeatures(light)), 0, 0);
+	Bind()->PSSetConstantBuffers(0, 1, &cbPerFrameBuffer);
+	Bind()->PSSetShaderResources(0, 1, &CubeTexture);
+	Bind()->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+
+	DrawCall()->DrawIndexedInstanced(CharacterIndexCount, (UINT)Characters.size(), 0, 0, 0);
+
+	Stride = sizeof(Vertex);
+	Bind()->IASetInputLayout(VertexLayout);
+	Bind()->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
+	Bind()->IASetIndexBuffer(SquareIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	Bind()->VSSetShader(VertexShader, 0, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+}
+
+// SampleAnimationClip on the uncompressed keys, the reference the compressed clip is checked against
+static void SampleRawAnimationClip(const RawAnimationClip &Raw, float Time, AnimationPose &Pose)
+{
+	float Duration = Raw.KeyCount / Raw.SampleRate;
+	float KeyTime = fmodf(Time, Duration) * Raw.SampleRate;
+	if (KeyTime < 0.0f)
+		KeyTime += Raw.KeyCount;
+
+	int Key0 = min((int)KeyTime, Raw.KeyCount - 1);
+	int Key1 = Key0 + 1 < Raw.KeyCount ? Key0 + 1 : 0;
+	XMVECTOR Alpha = XMVectorReplicate(KeyTime - Key0);
+	for (int b = 0; b < Raw.BoneCount; ++b)
+	{
+		Pose.Rotations[b] = NlerpRotation(XMLoadFloat4(&Raw.Rotations[Key0 * Raw.BoneCount + b]),
+			XMLoadFloat4(&Raw.Rotations[Key1 * Raw.BoneCount + b]), Alpha);
+		Pose.Translations[b] = XMVectorLerpV(XMLoadFloat3(&Raw.Translations[Key0 * Raw.BoneCount + b]),
+			XMLoadFloat3(&Raw.Translations[Key1 * Raw.BoneCount + b]), Alpha);
+	}
+}
+
+// Clip sizes and error, then how fast clips decompress on one thread and how many characters the job system updates
+int RunAnimationTest()
+{
+	if (!InitCharacterAnimation())
+		return 1;
+
+	int Failures = 0;
+	static const char *ClipNames[CHARACTER_CLIPS] = { "Sway", "Curl" };
+	for (int c = 0; c < CHARACTER_CLIPS; ++c)
+	{
+		RawAnimationClip Raw;
+		BuildCharacterClip(c, CharacterSkeleton, Raw);
+
+		float WorstDegrees = 0.0f;
+		for (int i = 0; i < Raw.KeyCount * Raw.BoneCount; ++i)
+		{
+			// q and -q are the same rotation. The angle comes from the chord between them, the acos of their dot product
+			// loses errors this small to rounding.
+			XMVECTOR Decoded = DecodeRotation(&CharacterClips[c].Rotations[i * 3]);
+			XMVECTOR Original = XMLoadFloat4(&Raw.Rotations[i]);
+			if (XMVectorGetX(XMVector4Dot(Decoded, Original)) < 0.0f)
+				Decoded = XMVectorNegate(Decoded);
+			float Chord = XMVectorGetX(XMVector4Length(Decoded - Original));
+			WorstDegrees = max(WorstDegrees, XMConvertToDegrees(4.0f * asinf(min(Chord * 0.5f, 1.0f))));
+		}
+
+		UINT64 RawBytes = RawAnimationClipBytes(Raw);
+		UINT64 CompressedBytes = CompressedAnimationClipBytes(CharacterClips[c]);
+		printf("%s: %d bones, %d keys, %.1f KB -> %.1f KB (%.1fx), %d animated translation tracks, %.3f degrees worst rotation error\n",
+			ClipNames[c], Raw.BoneCount, Raw.KeyCount, RawBytes / 1024.0, CompressedBytes / 1024.0, (double)RawBytes / CompressedBytes,
+			CharacterClips[c].AnimatedTranslationCount, WorstDegrees);
+
+		// Skinned between keys too, so the interpolation and the translation tracks are checked along with the rotations
+		float WorstSkinning = 0.0f;
+		for (int i = 0; i < 500; ++i)
+		{
+			AnimationPose Compressed, Reference;
+			SampleAnimationClip(CharacterClips[c], i * 0.0137f, Compressed);
+			SampleRawAnimationClip(Raw, i * 0.0137f, Reference);
+
+			XMFLOAT4X4 CompressedMatrices[MAX_BONES], ReferenceMatrices[MAX_BONES];
+			ComputeSkinningMatrices(CharacterSkeleton, Compressed, XMMatrixIdentity(), CompressedMatrices);
+			ComputeSkinningMatrices(CharacterSkeleton, Reference, XMMatrixIdentity(), ReferenceMatrices);
+			for (int b = 0; b < CharacterSkeleton.BoneCount; ++b)
+			{
+				for (int e = 0; e < 16; ++e)
+					WorstSkinning = max(WorstSkinning, fabsf(CompressedMatrices[b].m[e / 4][e % 4] - ReferenceMatrices[b].m[e / 4][e % 4]));
+			}
+		}
+		printf("  %.5f worst skinning matrix difference from the uncompressed clip\n", WorstSkinning);
+
+		Failures += !(WorstDegrees <= ANIMATION_MAX_ROTATION_ERROR);
+		Failures += (double)RawBytes / CompressedBytes < ANIMATION_MIN_COMPRESSION;
+		Failures += !(WorstSkinning <= ANIMATION_SKINNING_TOLERANCE);
+	}
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+
+	const int Samples = 200000;
+	AnimationPose Pose;
+	QueryPerformanceCounter(&Start);
+	for (int i = 0; i < Samples; ++i)
+		SampleAnimationClip(CharacterClips[0], i * 0.0137f, Pose);
+	QueryPerformanceCounter(&End);
+
+	double Seconds = double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+	double BoneSamples = (double)Samples * CharacterSkeleton.BoneCount;
+	printf("Decompression: %.1f M bone samples/sec on one thread, %.0f MB/s of float poses\n", BoneSamples / Seconds / 1e6,
+		BoneSamples * (sizeof(XMFLOAT4) + 2 * sizeof(XMFLOAT3)) / Seconds / (1024.0 * 1024.0));
+
+	std::vector<AnimatedCharacter> Crowd;
+	PlaceCharacters(Crowd, MAX_CHARACTERS);
+	CharacterSkinning = (XMFLOAT4X4 *)_aligned_malloc(sizeof(XMFLOAT4X4) * MAX_CHARACTERS * MAX_BONES, 16);
+	UpdateCharacters(Crowd.data(), MAX_CHARACTERS, 1.0f / 60.0f, CharacterSkinning);
+
+	const int Frames = 200;
+	QueryPerformanceCounter(&Start);
+	for (int i = 0; i < Frames; ++i)
+		UpdateCharacters(Crowd.data(), MAX_CHARACTERS, 1.0f / 60.0f, CharacterSkinning);
+	QueryPerformanceCounter(&End);
+
+	double FrameMs = double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart / Frames;
+	printf("Characters: %d sampled, blended and skinned in %.3f ms per frame on %d threads, %.1f characters/ms\n",
+		MAX_CHARACTERS, FrameMs, JobThreadCount(), MAX_CHARACTERS / FrameMs);
+	printf("  %d of the checks failed\n", Failures);
+
+	_aligned_free(CharacterSkinning);
+	return Failures == 0 ? 0 : 1;
+}
+
+static inline void CountFrameAllocation()
+{
+	if (TrackFrameAllocations && FrameAllocationsOpen.load(std::memory_order_relaxed))
+		FrameAllocationCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if defined(_DEBUG)
+// Every CRT heap allocation comes through here, operator new included, so the operators below leave the counting to it
+static int __cdecl CountCrtAllocation(int AllocType, void *, size_t, int, long, const unsigned char *, int)
+{
+	if (AllocType != _HOOK_FREE)
+		CountFrameAllocation();
+	return TRUE;
+}
+#define COUNT_NEW_ALLOCATION()
+#else
+#define COUNT_NEW_ALLOCATION() CountFrameAllocation()
+#endif
+
+// Counts allocations for the frame tracking, everything else is the default heap behaviour
+void *operator new(size_t Size)
+{
+	COUNT_NEW_ALLOCATION();
+
+	void *Memory = malloc(Size ? Size : 1);
+	if (!Memory)
+		throw std::bad_alloc();
+	return Memory;
+}
+
+void *operator new[](size_t Size)
+{
+	return operator new(Size);
+}
+
+void *operator new(size_t Size, const std::nothrow_t &) noexcept
+{
+	COUNT_NEW_ALLOCATION();
+	return malloc(Size ? Size : 1);
+}
+
+void *operator new[](size_t Size, const std::nothrow_t &Tag) noexcept
+{
+	return operator new(Size, Tag);
+}
+
+void operator delete(void *Memory) noexcept
+{
+	free(Memory);
+}
+
+void operator delete[](void *Memory) noexcept
+{
+	free(Memory);
+}
+
+#if defined(__cpp_aligned_new)
+void *operator new(size_t Size, std::align_val_t Alignment)
+{
+	COUNT_NEW_ALLOCATION();
+
+	void *Memory = _aligned_malloc(Size ? Size : 1, (size_t)Alignment);
+	if (!Memory)
+		throw std::bad_alloc();
+	return Memory;
+}
+
+void *operator new[](size_t Size, std::align_val_t Alignment)
+{
+	return operator new(Size, Alignment);
+}
+
+void *operator new(size_t Size, std::align_val_t Alignment, const std::nothrow_t &) noexcept
+{
+	COUNT_NEW_ALLOCATION();
+	return _aligned_malloc(Size ? Size : 1, (size_t)Alignment);
+}
+
+void *operator new[](size_t Size, std::align_val_t Alignment, const std::nothrow_t &Tag) noexcept
+{
+	return operator new(Size, Alignment, Tag);
+}
+
+void operator delete(void *Memory, std::align_val_t) noexcept
+{
+	_aligned_free(Memory);
+}
+
+void operator delete[](void *Memory, std::align_val_t) noexcept
+{
+	_aligned_free(Memory);
+}
+#endif
+
+void InitFrameArena(FrameArena &Arena, size_t Capacity)
+{
+	Arena.Memory[0] = (BYTE *)_aligned_malloc(Capacity, 64);
+	Arena.Memory[1] = (BYTE *)_aligned_malloc(Capacity, 64);
+	Arena.Capacity = Capacity;
+	Arena.Used = 0;
+	Arena.Current = 0;
+	Arena.HighWater = 0;
+	Arena.Overflows = 0;
+}
+
+void ReleaseFrameArena(FrameArena &Arena)
+{
+	_aligned_free(Arena.Memory[0]);
+	_aligned_free(Arena.Memory[1]);
+	Arena.Memory[0] = Arena.Memory[1] = NULL;
+}
+
+void BeginFrameArena(FrameArena &Arena)
+{
+	Arena.Current ^= 1;
+	Arena.Used = 0;
+}
+
+void *FrameAlloc(FrameArena &Arena, size_t Bytes, size_t Alignment)
+{
+	size_t Offset = (Arena.Used + Alignment - 1) & ~(Alignment - 1);
+	if (Offset + Bytes > Arena.Capacity)
+	{
+		Arena.Overflows++;
+		return NULL;
+	}
+
+	Arena.Used = Offset + Bytes;
+	Arena.HighWater = max(Arena.HighWater, Arena.Used);
+	return Arena.Memory[Arena.Current] + Offset;
+}
+
+// Called on the main thread, the job workers track themselves from the start
+void BeginFrameAllocations()
+{
+#if defined(_DEBUG)
+	_CrtSetAllocHook(CountCrtAllocation);
+#endif
+	TrackFrameAllocations = true;
+	FrameAllocationCount.store(0, std::memory_order_relaxed);
+	FrameAllocationsOpen.store(true, std::memory_order_release);
+}
+
+UINT64 EndFrameAllocations()
+{
+	FrameAllocationsOpen.store(false, std::memory_order_release);
+	return FrameAllocationCount.load(std::memory_order_relaxed);
+}
+
+// RunFrame on the WARP device in a hidden window, the same frame the message loop runs. Fails if any frame after
+// warm-up allocated.
+int RunAllocationTest(int Frames)
+{
+	if (!InitHeadlessScene())
+		return 1;
+	StartTimer();
+
+	// Warm-up also waits for the scene around the camera to finish loading, for at most 10 seconds
+	double WarmupStart = GetTime();
+	int Warmup = 0;
+	UINT64 Total = 0, Worst = 0;
+	int AllocatingFrames = 0;
+	for (int i = 0; i < Frames; )
+	{
+		UINT64 Allocations = RunFrame(1.0 / 60.0);
+		if (Warmup < FRAME_ALLOCATION_WARMUP || (WorldStreaming && WorldStreamer.PendingBytes > 0 && GetTime() - WarmupStart < 10.0))
+		{
+			Warmup++;
+			continue;
+		}
+
+		Total += Allocations;
+		Worst = max(Worst, Allocations);
+		AllocatingFrames += Allocations > 0;
+		++i;
+	}
+
+	printf("Allocation test (%s): %d frames after %d warm-up frames, %d particles, %d characters, %d streamed draws\n",
+#if defined(_DEBUG)
+		"every CRT heap allocation",
+#else
+		"operator new",
+#endif
+		Frames, Warmup, Particles.Pool.Count, (int)Characters.size(), (int)DrawList.size());
+	printf("  %llu heap allocations in %d frames, %llu in the worst frame, %.1f KB of frame arena at most, %d overflows\n",
+		Total, AllocatingFrames, Worst, Frame.HighWater / 1024.0, Frame.Overflows);
+
+	return Total == 0 ? 0 : 1;
+}
+
+bool InitPerfCounters()
+{
+	QueryPerformanceFrequency(&PerfFrequency);
+	memset(&PerfCounters, 0, sizeof(PerfCounters));
+
+	CounterMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(CounterRing), COUNTER_MAPPING_NAME);
+	if (!CounterMapping)
+		return false;
+
+	// Another instance already publishes under the name
+	if (GetLastError() == ERROR_ALREADY_EXISTS)
+	{
+		CloseHandle(CounterMapping);
+		CounterMapping = NULL;
+		return false;
+	}
+
+	SharedCounters = (CounterRing *)MapViewOfFile(CounterMapping, FILE_MAP_WRITE, 0, 0, sizeof(CounterRing));
+	if (!SharedCounters)
+	{
+		CloseHandle(CounterMapping);
+		CounterMapping = NULL;
+		return false;
+	}
+
+	// A new section is zero filled, so every slot starts out even
+	SharedCounters->Version = COUNTER_VERSION;
+	SharedCounters->SlotCount = COUNTER_RING_SIZE;
+	SharedCounters->ZoneCount = min(COUNTER_ZONE_PASSES + (int)FrameGraph.Passes.size(), MAX_COUNTER_ZONES);
+	SetCounterZoneName(COUNTER_ZONE_INPUT, "Input");
+	SetCounterZoneName(COUNTER_ZONE_UPDATE, "Update");
+	SetCounterZoneName(COUNTER_ZONE_PRESENT, "Present");
+	for (size_t p = 0; p < FrameGraph.Passes.size(); ++p)
+		SetCounterZoneName(COUNTER_ZONE_PASSES + (int)p, FrameGraph.Passes[p].Name);
+
+	MemoryBarrier();
+	SharedCounters->Magic = COUNTER_MAGIC;
+	return true;
+}
+
+void ReleasePerfCounters()
+{
+	if (SharedCounters)
+		UnmapViewOfFile(SharedCounters);
+	if (CounterMapping)
+		CloseHandle(CounterMapping);
+	if (CounterAdapter)
+		CounterAdapter->Release();
+	SharedCounters = NULL;
+	CounterMapping = NULL;
+	CounterAdapter = NULL;
+}
+
+void SetCounterZoneName(int Zone, const char *Name)
+{
+	if (SharedCounters && Zone < MAX_COUNTER_ZONES)
+		strncpy_s(SharedCounters->ZoneNames[Zone], Name, _TRUNCATE);
+}
+
+ID3D11DeviceContext *Bind()
+{
+	PerfCounters.StateBinds++;
+	return D3D11DeviceContext;
+}
+
+ID3D11DeviceContext *Bind(ID3D11DeviceContext *Context, UINT &Binds)
+{
+	Binds++;
+	return Context;
+}
+
+ID3D11DeviceContext *DrawCall()
+{
+	PerfCounters.DrawCalls++;
+	return D3D11DeviceContext;
+}
+
+ID3D11DeviceContext *DrawCall(ID3D11DeviceContext *Context, UINT &Draws)
+{
+	Draws++;
+	return Context;
+}
+
+void UploadSubresource(ID3D11Resource *Resource, const void *Data, UINT64 Bytes)
+{
+	D3D11DeviceContext->UpdateSubresource(Resource, 0, NULL, Data, 0, 0);
+	PerfCounters.UploadBytes += Bytes;
+}
+
+void UploadSubresource(ID3D11DeviceContext *Context, ID3D11Resource *Resource, UINT Subresource, const void *Data, UINT RowPitch,
+	UINT64 Bytes, UINT64 &UploadBytes)
+{
+	Context->UpdateSubresource(Resource, Subresource, NULL, Data, RowPitch, 0);
+	UploadBytes += Bytes;
+}
+
+void *MapDiscard(ID3D11Resource *Resource)
+{
+	return MapDiscard(D3D11DeviceContext, Resource);
+}
+
+void *MapDiscard(ID3D11DeviceContext *Context, ID3D11Resource *Resource)
+{
+	D3D11_MAPPED_SUBRESOURCE Mapped;
+	if (FAILED(Context->Map(Resource, 0, D3D11_MAP_WRITE_DISCARD, 0, &Mapped)))
+		return NULL;
+	return Mapped.pData;
+}
+
+void Unmap(ID3D11Resource *Resource, UINT64 Bytes)
+{
+	D3D11DeviceContext->Unmap(Resource, 0);
+	PerfCounters.UploadBytes += Bytes;
+}
+
+void Unmap(ID3D11DeviceContext *Context, ID3D11Resource *Resource, UINT64 Bytes, UINT64 &UploadBytes)
+{
+	Context->Unmap(Resource, 0);
+	UploadBytes += Bytes;
+}
+
+void CountContextWork(UINT Draws, UINT Binds, UINT64 UploadBytes)
+{
+	PerfCounters.DrawCalls += Draws;
+	PerfCounters.StateBinds += Binds;
+	PerfCounters.UploadBytes += UploadBytes;
+}
+
+float CounterMs(const LARGE_INTEGER &Start, const LARGE_INTEGER &End)
+{
+	return (float)(double(End.QuadPart - Start.QuadPart) * 1000.0 / PerfFrequency.QuadPart);
+}
+
+void BeginFrameCounters()
+{
+	UINT64 Frame = PerfCounters.Frame;
+	UINT64 VideoMemoryBytes = PerfCounters.VideoMemoryBytes;
+	memset(&PerfCounters, 0, sizeof(PerfCounters));
+	PerfCounters.Frame = Frame;
+	PerfCounters.VideoMemoryBytes = VideoMemoryBytes;
+}
+
+void PublishFrameCounters(const LARGE_INTEGER &FrameStart)
+{
+	LARGE_INTEGER FrameEnd;
+	QueryPerformanceCounter(&FrameEnd);
+	PerfCounters.FrameMs = CounterMs(FrameStart, FrameEnd);
+
+	// The video memory query goes to the kernel, twice a second is plenty
+	if (CounterAdapter && PerfCounters.Frame % 30 == 0)
+	{
+		DXGI_QUERY_VIDEO_MEMORY_INFO Info;
+		if (SUCCEEDED(CounterAdapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &Info)))
+			PerfCounters.VideoMemoryBytes = Info.CurrentUsage;
+	}
+	PerfCounters.RenderTargetBytes = FrameGraph.AliasedTransientBytes;
+	PerfCounters.StreamedBytes = WorldStreaming ? WorldStreamer.ResidentBytes : 0;
+	if (TerrainLoaded)
+		PerfCounters.StreamedBytes += (UINT64)Terrain.Stats.PagesResident * TERRAIN_PAGE_TEXELS * TERRAIN_PAGE_TEXELS * sizeof(UINT16);
+
+	if (SharedCounters)
+	{
+		// The interlocked exchanges are full barriers, the counters can't be seen outside the odd window
+		CounterSlot &Slot = SharedCounters->Slots[PerfCounters.Frame % COUNTER_RING_SIZE];
+		LONG64 Sequence = Slot.Sequence;
+		InterlockedExchange64(&Slot.Sequence, Sequence + 1);
+		Slot.Counters = PerfCounters;
+		InterlockedExchange64(&Slot.Sequence, Sequence + 2);
+		InterlockedExchange64(&SharedCounters->Published, (LONG64)PerfCounters.Frame + 1);
+	}
+
+	PerfCounters.Frame++;
+}
+
+// Copies a slot out of the ring, false if it was being written or already holds a later frame
+static bool ReadCounterSlot(const CounterRing *Ring, UINT64 Frame, FrameCounters &Out)
+{
+	const CounterSlot &Slot = Ring->Slots[Frame % Ring->SlotCount];
+
+	LONG64 Before = Slot.Sequence;
+	MemoryBarrier();
+	memcpy(&Out, (const void *)&Slot.Counters, sizeof(FrameCounters));
+	MemoryBarrier();
+	LONG64 After = Slot.Sequence;
+
+	return Before == After && !(Before & 1) && Out.Frame == Frame;
+}
+
+static float CounterPercentile(std::vector<float> &Values, double Percentile)
+{
+	if (Values.empty())
+		return 0.0f;
+	size_t Index = min((size_t)(Percentile * Values.size()), Values.size() - 1);
+	std::nth_element(Values.begin(), Values.begin() + Index, Values.end());
+	return Values[Index];
+}
+
+// Samples the ring of a running sandbox every 50ms and prints a line of percentiles per second, for Seconds or
+// until the sandbox goes away when Seconds is 0
+int RunCounterReader(int Seconds)
+{
+	HANDLE Mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, COUNTER_MAPPING_NAME);
+	if (!Mapping)
+	{
+		printf("No running sandbox publishes counters\n");
+		return 1;
+	}
+
+	const CounterRing *Ring = (const CounterRing *)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, sizeof(CounterRing));
+	if (!Ring || Ring->Magic != COUNTER_MAGIC || Ring->Version != COUNTER_VERSION || Ring->SlotCount != COUNTER_RING_SIZE)
+	{
+		printf("The counters section is from another version\n");
+		if (Ring)
+			UnmapViewOfFile(Ring);
+		CloseHandle(Mapping);
+		return 1;
+	}
+
+	std::vector<FrameCounters> Window;
+	std::vector<float> Values;
+	UINT64 Next = (UINT64)Ring->Published;
+	UINT64 Missed = 0, Torn = 0;
+	int Elapsed = 0, Idle = 0;
+
+	while (Seconds == 0 || Elapsed < Seconds)
+	{
+		for (int Poll = 0; Poll < 20; ++Poll)
+		{
+			Sleep(50);
+
+			// Too far behind, the oldest frames were already overwritten
+			UINT64 Published = (UINT64)Ring->Published;
+			if (Published - Next > Ring->SlotCount)
+			{
+				Missed += Published - Ring->SlotCount - Next;
+				Next = Published - Ring->SlotCount;
+			}
+
+			for (; Next < Published; ++Next)
+			{
+				// A slot caught mid write is tried again, the writer is done with it within microseconds
+				FrameCounters Counters;
+				bool Read = false;
+				for (int Attempt = 0; Attempt < 4 && !Read; ++Attempt)
+					Read = ReadCounterSlot(Ring, Next, Counters);
+				if (Read)
+					Window.push_back(Counters);
+				else
+					Torn++;
+			}
+		}
+		Elapsed++;
+
+		if (Window.empty())
+		{
+			// The sandbox closed, or sits in a modal loop
+			if (Seconds == 0 && ++Idle >= 5)
+				break;
+			continue;
+		}
+		Idle = 0;
+
+		Values.clear();
+		for (size_t i = 0; i < Window.size(); ++i)
+			Values.push_back(Window[i].FrameMs);
+		float P50 = CounterPercentile(Values, 0.5);
+		float P95 = CounterPercentile(Values, 0.95);
+		float P99 = CounterPercentile(Values, 0.99);
+		float Worst = *std::max_element(Values.begin(), Values.end());
+
+		double Draws = 0.0, Binds = 0.0, Upload = 0.0;
+		for (size_t i = 0; i < Window.size(); ++i)
+		{
+			Draws += Window[i].DrawCalls;
+			Binds += Window[i].StateBinds;
+			Upload += (double)Window[i].UploadBytes;
+		}
+		const FrameCounters &Last = Window.back();
+
+		printf("%d frames: %.2f / %.2f / %.2f / %.2f ms p50/p95/p99/max, %.0f draws, %.0f binds, %.1f KB uploaded per frame, "
+			"%.0f MB video memory, %.0f MB render targets, %.1f MB streamed\n",
+			(int)Window.size(), P50, P95, P99, Worst, Draws / Window.size(), Binds / Window.size(), Upload / Window.size() / 1024.0,
+			Last.VideoMemoryBytes / (1024.0 * 1024.0), Last.RenderTargetBytes / (1024.0 * 1024.0), Last.StreamedBytes / (1024.0 * 1024.0));
+
+		for (UINT z = 0; z < Ring->ZoneCount; ++z)
+		{
+			Values.clear();
+			for (size_t i = 0; i < Window.size(); ++i)
+				Values.push_back(Window[i].ZoneMs[z]);
+			printf("  %-*.*s %.3f / %.3f ms p50/p99\n", COUNTER_ZONE_NAME_LENGTH, COUNTER_ZONE_NAME_LENGTH, Ring->ZoneNames[z],
+				CounterPercentile(Values, 0.5), CounterPercentile(Values, 0.99));
+		}
+
+		if (Missed || Torn)
+			printf("  %llu frames missed so far, %llu frames unreadable\n", Missed, Torn);
+		Window.clear();
+	}
+
+	UnmapViewOfFile(Ring);
+	CloseHandle(Mapping);
+	return 0;
+}
+
+D3D11CaptureBackend::D3D11CaptureBackend(ID3D11Device *Device, ID3D11DeviceContext *InContext, ID3D11Texture2D *InSource)
+	: Context(InContext), Source(InSource)
+{
+	D3D11_TEXTURE2D_DESC Desc;
+	Source->GetDesc(&Desc);
+	Width = Desc.Width;
+	Height = Desc.Height;
+
+	Desc.Usage = D3D11_USAGE_STAGING;
+	Desc.BindFlags = 0;
+	Desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+	Desc.MiscFlags = 0;
+	for (int i = 0; i < CAPTURE_RING_SIZE; ++i)
+		HR(Device->CreateTexture2D(&Desc, NULL, &Staging[i]));
+}
+
+D3D11CaptureBackend::~D3D11CaptureBackend()
+{
+	for (int i = 0; i < CAPTURE_RING_SIZE; ++i)
+		Staging[i]->Release();
+}
+
+void D3D11CaptureBackend::Copy(int Slot, UINT64 Frame)
+{
+	Context->CopyResource(Staging[Slot], Source);
+}
+
+bool D3D11CaptureBackend::TryMap(int Slot, UINT64 Frame, const BYTE **Pixels, UINT *RowPitch)
+{
+	// DXGI_ERROR_WAS_STILL_DRAWING until the copy is done
+	D3D11_MAPPED_SUBRESOURCE Mapped;
+	if (FAILED(Context->Map(Staging[Slot], 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &Mapped)))
+		return false;
+
+	*Pixels = (const BYTE *)Mapped.pData;
+	*RowPitch = Mapped.RowPitch;
+	return true;
+}
+
+void D3D11CaptureBackend::Unmap(int Slot)
+{
+	Context->Unmap(Staging[Slot], 0);
+}
+
+NullCaptureBackend::NullCaptureBackend(UINT InWidth, UINT InHeight, int InLatency)
+	: Latency(InLatency)
+{
+	Width = InWidth;
+	Height = InHeight;
+	for (int i = 0; i < CAPTURE_RING_SIZE; ++i)
+	{
+		CopiedFrame[i] = 0;
+		Pixels[i].resize(Width * Height * 4);
+
+		BYTE *Out = Pixels[i].data();
+		for (UINT y = 0; y < Height; ++y)
+		{
+			for (UINT x = 0; x < Width; ++x, Out += 4)
+			{
+				Out[0] = (BYTE)x;
+				Out[1] = (BYTE)y;
+				Out[2] = (BYTE)(x ^ y);
+				Out[3] = 0xff;
+			}
+		}
+	}
+}
+
+// Like CopyResource this only queues the copy, the frame number stamped in the first pixels tells the frames apart
+void NullCaptureBackend::Copy(int Slot, UINT64 Frame)
+{
+	CopiedFrame[Slot] = Frame;
+	memcpy(Pixels[Slot].data(), &Frame, sizeof(Frame));
+}
+
+bool NullCaptureBackend::TryMap(int Slot, UINT64 Frame, const BYTE **Out, UINT *RowPitch)
+{
+	if (Frame - CopiedFrame[Slot] < (UINT64)Latency)
+		return false;
+
+	*Out = Pixels[Slot].data();
+	*RowPitch = Width * 4;
+	return true;
+}
+
+static bool EncodeCapturePNG(IWICImagingFactory *Factory, const wchar_t *Path, const BYTE *Pixels, UINT Width, UINT Height)
+{
+	IWICStream *Stream = NULL;
+	IWICBitmapEncoder *Encoder = NULL;
+	IWICBitmapFrameEncode *Frame = NULL;
+	WICPixelFormatGUID Format = GUID_WICPixelFormat32bppBGRA;
+
+	bool Written = SUCCEEDED(Factory->CreateStream(&Stream)) &&
+		SUCCEEDED(Stream->InitializeFromFilename(Path, GENERIC_WRITE)) &&
+		SUCCEEDED(Factory->CreateEncoder(GUID_ContainerFormatPng, NULL, &Encoder)) &&
+		SUCCEEDED(Encoder->Initialize(Stream, WICBitmapEncoderNoCache)) &&
+		SUCCEEDED(Encoder->CreateNewFrame(&Frame, NULL)) &&
+		SUCCEEDED(Frame->Initialize(NULL)) &&
+		SUCCEEDED(Frame->SetSize(Width, Height)) &&
+		SUCCEEDED(Frame->SetPixelFormat(&Format)) && Format == GUID_WICPixelFormat32bppBGRA &&
+		SUCCEEDED(Frame->WritePixels(Height, Width * 4, Width * Height * 4, (BYTE *)Pixels)) &&
+		SUCCEEDED(Frame->Commit()) &&
+		SUCCEEDED(Encoder->Commit());
+
+	if (Frame)
+		Frame->Release();
+	if (Encoder)
+		Encoder->Release();
+	if (Stream)
+		Stream->Release();
+	return Written;
+}
+
+static void CaptureEncoderThread(FrameCapture *Capture)
+{
+	CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	IWICImagingFactory *Factory = NULL;
+	if (Capture->Format == CAPTURE_FORMAT_PNG)
+		CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&Factory));
+
+	UINT Width = Capture->Backend->Width;
+	UINT Height = Capture->Backend->Height;
+	LARGE_INTEGER Frequency;
+	QueryPerformanceFrequency(&Frequency);
+
+	for (;;)
+	{
+		CaptureJob Job;
+		{
+			std::unique_lock<std::mutex> Guard(Capture->Lock);
+			Capture->Wake.wait(Guard, [Capture] { return Capture->Quit || Capture->JobCount > 0; });
+			// Quit only once everything queued is written
+			if (Capture->JobCount == 0)
+				break;
+
+			Job = Capture->Jobs[Capture->JobHead];
+			Capture->JobHead = (Capture->JobHead + 1) % CAPTURE_BUFFERS;
+			Capture->JobCount--;
+		}
+
+		LARGE_INTEGER Start, End;
+		QueryPerformanceCounter(&Start);
+
+		BYTE *Pixels = Capture->Buffers[Job.Buffer];
+		bool Written;
+		if (Capture->Format == CAPTURE_FORMAT_PNG)
+		{
+			// The Backbuffer's alpha is whatever the passes left in it
+			UINT *Pixel = (UINT *)Pixels;
+			for (UINT i = 0; i < Width * Height; ++i)
+				Pixel[i] |= 0xff000000;
+
+			wchar_t Path[MAX_PATH];
+			swprintf_s(Path, L"%hs_%05llu.png", Capture->Prefix, Job.Frame);
+			Written = Factory && EncodeCapturePNG(Factory, Path, Pixels, Width, Height);
+		}
+		else
+		{
+			DWORD BytesWritten = 0;
+			Written = WriteFile(Capture->RawFile, &Job.Frame, sizeof(Job.Frame), &BytesWritten, NULL) &&
+				WriteFile(Capture->RawFile, Pixels, Width * Height * 4, &BytesWritten, NULL);
+		}
+
+		QueryPerformanceCounter(&End);
+		if (!Written)
+			printf("Failed to write captured frame %llu\n", Job.Frame);
+
+		std::lock_guard<std::mutex> Guard(Capture->Lock);
+		Capture->BufferFree[Job.Buffer] = true;
+		Capture->Stats.Encoded += Written;
+		Capture->Stats.EncodeMs += double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+		Capture->Done.notify_all();
+	}
+
+	if (Factory)
+		Factory->Release();
+	CoUninitialize();
+}
+
+bool InitFrameCapture(FrameCapture &Capture, CaptureBackend *Backend, CaptureFormat Format, const char *Prefix)
+{
+	Capture.Backend = Backend;
+	Capture.Format = Format;
+	strcpy_s(Capture.Prefix, Prefix);
+	Capture.NextSlot = 0;
+	Capture.JobHead = 0;
+	Capture.JobCount = 0;
+	Capture.Quit = false;
+	Capture.RawFile = INVALID_HANDLE_VALUE;
+	memset(&Capture.Stats, 0, sizeof(Capture.Stats));
+
+	if (Format == CAPTURE_FORMAT_RAW)
+	{
+		char Path[MAX_PATH];
+		sprintf_s(Path, "%s.raw", Prefix);
+		Capture.RawFile = CreateFileA(Path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (Capture.RawFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		RawCaptureHeader Header = { { 'C', 'A', 'P', 'R' }, Backend->Width, Backend->Height, DXGI_FORMAT_B8G8R8A8_UNORM };
+		DWORD BytesWritten = 0;
+		WriteFile(Capture.RawFile, &Header, sizeof(Header), &BytesWritten, NULL);
+	}
+
+	for (int i = 0; i < CAPTURE_RING_SIZE; ++i)
+		Capture.Slots[i].Pending = false;
+	for (int i = 0; i < CAPTURE_BUFFERS; ++i)
+	{
+		Capture.Buffers[i] = (BYTE *)_aligned_malloc(Backend->Width * Backend->Height * 4, 64);
+		Capture.BufferFree[i] = true;
+	}
+
+	Capture.Encoder = std::thread(CaptureEncoderThread, &Capture);
+	return true;
+}
+
+void ReleaseFrameCapture(FrameCapture &Capture)
+{
+	for (int i = 0; i < CAPTURE_RING_SIZE; ++i)
+	{
+		// Nothing is mapped between frames, a pending slot only has a copy in flight
+		Capture.Stats.Dropped += Capture.Slots[i].Pending;
+		Capture.Slots[i].Pending = false;
+	}
+
+	if (Capture.Encoder.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Capture.Lock);
+			Capture.Quit = true;
+		}
+		Capture.Wake.notify_one();
+		Capture.Encoder.join();
+	}
+
+	if (Capture.RawFile != INVALID_HANDLE_VALUE)
+		CloseHandle(Capture.RawFile);
+	Capture.RawFile = INVALID_HANDLE_VALUE;
+	for (int i = 0; i < CAPTURE_BUFFERS; ++i)
+	{
+		_aligned_free(Capture.Buffers[i]);
+		Capture.Buffers[i] = NULL;
+	}
+}
+
+void UpdateFrameCapture(FrameCapture &Capture, UINT64 Frame, bool Requested)
+{
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	CaptureBackend *Backend = Capture.Backend;
+	UINT RowBytes = Backend->Width * 4;
+
+	// Oldest first, so frames reach the encoder in order. A copy that isn't done means the later ones aren't either.
+	for (int i = 0; i < CAPTURE_RING_SIZE; ++i)
+	{
+		int s = (Capture.NextSlot + i) % CAPTURE_RING_SIZE;
+		CaptureSlot &Slot = Capture.Slots[s];
+		if (!Slot.Pending)
+			continue;
+
+		const BYTE *Pixels;
+		UINT RowPitch;
+		if (!Backend->TryMap(s, Frame, &Pixels, &RowPitch))
+			break;
+
+		int Buffer = -1;
+		{
+			std::lock_guard<std::mutex> Guard(Capture.Lock);
+			for (int b = 0; b < CAPTURE_BUFFERS && Buffer < 0; ++b)
+			{
+				if (Capture.BufferFree[b])
+					Buffer = b;
+			}
+			if (Buffer >= 0)
+				Capture.BufferFree[Buffer] = false;
+		}
+
+		// The encoder is behind, this frame is lost but the slot is free again
+		if (Buffer < 0)
+		{
+			Backend->Unmap(s);
+			Slot.Pending = false;
+			Capture.Stats.Dropped++;
+			continue;
+		}
+
+		BYTE *Out = Capture.Buffers[Buffer];
+		for (UINT y = 0; y < Backend->Height; ++y)
+			memcpy(Out + y * RowBytes, Pixels + y * RowPitch, RowBytes);
+		Backend->Unmap(s);
+		Slot.Pending = false;
+		Capture.Stats.Captured++;
+
+		{
+			std::lock_guard<std::mutex> Guard(Capture.Lock);
+			CaptureJob &Job = Capture.Jobs[(Capture.JobHead + Capture.JobCount) % CAPTURE_BUFFERS];
+			Job.Buffer = Buffer;
+			Job.Frame = Slot.Frame;
+			Capture.JobCount++;
+		}
+		Capture.Wake.notify_one();
+	}
+
+	if (Requested)
+	{
+		Capture.Stats.Requested++;
+		CaptureSlot &Slot = Capture.Slots[Capture.NextSlot];
+		if (Slot.Pending)
+			Capture.Stats.Dropped++;
+		else
+		{
+			Backend->Copy(Capture.NextSlot, Frame);
+			Slot.Pending = true;
+			Slot.Frame = Frame;
+			Capture.NextSlot = (Capture.NextSlot + 1) % CAPTURE_RING_SIZE;
+		}
+	}
+
+	QueryPerformanceCounter(&End);
+	Capture.Stats.MainThreadMs += double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+}
+
+CaptureStats ResetCaptureStats(FrameCapture &Capture)
+{
+	std::lock_guard<std::mutex> Guard(Capture.Lock);
+	CaptureStats Stats = Capture.Stats;
+	memset(&Capture.Stats, 0, sizeof(Capture.Stats));
+	return Stats;
+}
+
+// Captures every frame of a 60 Hz loop from the null backend into capturetest.raw, or PNGs with "png"
+int RunCaptureTest(int Frames, CaptureFormat Format)
+{
+	NullCaptureBackend Backend(Width, Height, 2);
+	if (!InitFrameCapture(SceneCapture, &Backend, Format, "capturetest"))
+	{
+		printf("Can't create the capture output\n");
+		return 1;
+	}
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	// A few more frames at the end let the last copies come out of the ring
+	for (int i = 0; i < Frames + CAPTURE_RING_SIZE; ++i)
+	{
+		LARGE_INTEGER FrameStart;
+		QueryPerformanceCounter(&FrameStart);
+
+		UpdateFrameCapture(SceneCapture, i, i < Frames);
+
+		// Pace like a vsynced frame loop
+		double Elapsed = 0.0;
+		do
+		{
+			QueryPerformanceCounter(&End);
+			Elapsed = double(End.QuadPart - FrameStart.QuadPart) * 1000.0 / Frequency.QuadPart;
+			if (Elapsed < 15.0)
+				Sleep(1);
+		} while (Elapsed < 1000.0 / 60.0);
+	}
+
+	ReleaseFrameCapture(SceneCapture);
+	QueryPerformanceCounter(&End);
+	CaptureStats Stats = SceneCapture.Stats;
+
+	printf("Capture test (%s, %ux%u, %d frames of GPU latency): %d requested, %d captured, %d dropped, %d written in %.2f s\n",
+		Format == CAPTURE_FORMAT_PNG ? "png" : "raw", Backend.Width, Backend.Height, Backend.Latency, Stats.Requested,
+		Stats.Captured, Stats.Dropped, Stats.Encoded, double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart);
+	printf("  %.3f ms per frame on the main thread, %.3f ms per frame encoding on the worker\n",
+		Stats.MainThreadMs / max(Frames, 1), Stats.EncodeMs / max(Stats.Encoded, 1));
+
+	return Stats.Captured + Stats.Dropped == Stats.Requested && Stats.Encoded == Stats.Captured ? 0 : 1;
+}
+
+static int TerrainPageIndex(const TerrainStreamer &Streamer, int Level, int X, int Z)
+{
+	return Streamer.LevelFirstPage[Level] + Z * Streamer.LevelPagesPerSide[Level] + X;
+}
+
+static float TerrainNodeSize(const TerrainStreamer &Streamer, int Level)
+{
+	return TERRAIN_PAGE_QUADS * Streamer.Header.SampleSpacing * (1 << Level);
+}
+
+static void TerrainLoaderThread(TerrainStreamer *Streamer)
+{
+	const UINT Samples = TERRAIN_PAGE_TEXELS * TERRAIN_PAGE_TEXELS;
+	for (;;)
+	{
+		int PageIndex;
+		{
+			std::unique_lock<std::mutex> Guard(Streamer->Lock);
+			Streamer->Wake.wait(Guard, [Streamer] { return Streamer->Quit || Streamer->RequestCount > 0; });
+			if (Streamer->Quit)
+				return;
+
+			PageIndex = Streamer->Requests[Streamer->RequestHead];
+			Streamer->RequestHead = (Streamer->RequestHead + 1) % (int)Streamer->Requests.size();
+			Streamer->RequestCount--;
+		}
+
+		// Touching the view is what reads the page from disk, so the page faults land here and not on the main thread
+		const TerrainPage &Page = Streamer->Pages[PageIndex];
+		memcpy(Streamer->SlotSamples + Page.Slot * Samples, Streamer->View + Page.Info.Offset, Samples * sizeof(UINT16));
+
+		std::lock_guard<std::mutex> Guard(Streamer->Lock);
+		Streamer->Completed.push_back(PageIndex);
+	}
+}
+
+static void UnmapTerrainFile(TerrainStreamer &Streamer)
+{
+	if (Streamer.View)
+		UnmapViewOfFile(Streamer.View);
+	if (Streamer.Mapping)
+		CloseHandle(Streamer.Mapping);
+	CloseHandle(Streamer.File);
+	Streamer.View = NULL;
+	Streamer.Mapping = NULL;
+}
+
+// Finds a slot for the page, taking the least recently drawn one that wasn't drawn this frame. False when none is free.
+static bool RequestTerrainPage(TerrainStreamer &Streamer, int PageIndex, bool Pinned)
+{
+	int Best = -1;
+	for (int s = 0; s < TERRAIN_PAGE_SLOTS; ++s)
+	{
+		const TerrainSlot &Slot = Streamer.Slots[s];
+		if (Slot.Page < 0)
+		{
+			Best = s;
+			break;
+		}
+		if (Slot.Pinned || Slot.LastUsed >= Streamer.Frame || Streamer.Pages[Slot.Page].State != PAGE_RESIDENT)
+			continue;
+		if (Best < 0 || Slot.LastUsed < Streamer.Slots[Best].LastUsed)
+			Best = s;
+	}
+	if (Best < 0)
+		return false;
+
+	TerrainSlot &Slot = Streamer.Slots[Best];
+	if (Slot.Page >= 0)
+	{
+		Streamer.Pages[Slot.Page].State = PAGE_UNLOADED;
+		Streamer.Pages[Slot.Page].Slot = -1;
+	}
+	Slot.Page = PageIndex;
+	Slot.LastUsed = Streamer.Frame;
+	Slot.Pinned = Pinned;
+
+	TerrainPage &Page = Streamer.Pages[PageIndex];
+	Page.State = PAGE_LOADING;
+	Page.Slot = Best;
+
+	std::lock_guard<std::mutex> Guard(Streamer.Lock);
+	Streamer.Requests[(Streamer.RequestHead + Streamer.RequestCount) % Streamer.Requests.size()] = PageIndex;
+	Streamer.RequestCount++;
+	return true;
+}
+
+bool OpenTerrainStream(TerrainStreamer &Streamer, const char *Path, ID3D11DeviceContext *Context, ID3D11Texture2D *PageArray)
+{
+	Streamer.File = CreateFile(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (Streamer.File == INVALID_HANDLE_VALUE)
+		return false;
+
+	// The whole file is mapped once, only the pages that get read are ever brought into memory
+	LARGE_INTEGER FileSize = {};
+	GetFileSizeEx(Streamer.File, &FileSize);
+	Streamer.FileSize = FileSize.QuadPart;
+	Streamer.Mapping = FileSize.QuadPart > 0 ? CreateFileMapping(Streamer.File, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	Streamer.View = Streamer.Mapping ? (const BYTE *)MapViewOfFile(Streamer.Mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (!Streamer.View)
+	{
+		printf("Could not map %s\n", Path);
+		UnmapTerrainFile(Streamer);
+		return false;
+	}
+
+	const TerrainFileHeader &Header = *(const TerrainFileHeader *)Streamer.View;
+	if (Streamer.FileSize < sizeof(TerrainFileHeader) || memcmp(Header.Magic, TERRAIN_FILE_MAGIC, 4) != 0 ||
+		Header.Version != TERRAIN_FILE_VERSION || Header.Levels < 1 || Header.Levels > TERRAIN_MAX_LODS || Header.RootPages < 1 ||
+		Header.RootPages * Header.RootPages > TERRAIN_PAGE_SLOTS / 4)
+	{
+		printf("%s is not a version %u terrain file\n", Path, TERRAIN_FILE_VERSION);
+		UnmapTerrainFile(Streamer);
+		return false;
+	}
+	Streamer.Header = Header;
+
+	int PageCount = 0;
+	for (int l = 0; l < Header.Levels; ++l)
+	{
+		Streamer.LevelFirstPage[l] = PageCount;
+		Streamer.LevelPagesPerSide[l] = Header.RootPages << (Header.Levels - 1 - l);
+		PageCount += Streamer.LevelPagesPerSide[l] * Streamer.LevelPagesPerSide[l];
+	}
+
+	const UINT64 PageBytes = TERRAIN_PAGE_TEXELS * TERRAIN_PAGE_TEXELS * sizeof(UINT16);
+	bool Truncated = Header.PageCount != (UINT)PageCount || Header.PageTableOffset + PageCount * sizeof(TerrainFilePage) > Streamer.FileSize;
+	const TerrainFilePage *PageTable = (const TerrainFilePage *)(Streamer.View + Header.PageTableOffset);
+	for (int i = 0; i < PageCount && !Truncated; ++i)
+		Truncated = PageTable[i].Offset + PageBytes > Streamer.FileSize;
+	if (Truncated)
+	{
+		printf("%s has a truncated page table\n", Path);
+		UnmapTerrainFile(Streamer);
+		return false;
+	}
+
+	Streamer.Pages.resize(PageCount);
+	for (int i = 0; i < PageCount; ++i)
+	{
+		Streamer.Pages[i].Info = PageTable[i];
+		Streamer.Pages[i].State = PAGE_UNLOADED;
+		Streamer.Pages[i].Slot = -1;
+	}
+
+	// The coarsest level is drawn wherever nothing finer is, however far away
+	for (int l = 0; l < Header.Levels; ++l)
+		Streamer.LodRanges[l] = TERRAIN_DETAIL_RANGE * (1 << l);
+	Streamer.LodRanges[Header.Levels - 1] = FLT_MAX;
+
+	for (int s = 0; s < TERRAIN_PAGE_SLOTS; ++s)
+	{
+		Streamer.Slots[s].Page = -1;
+		Streamer.Slots[s].LastUsed = 0;
+		Streamer.Slots[s].Pinned = false;
+	}
+	Streamer.SlotSamples = new UINT16[TERRAIN_PAGE_SLOTS * TERRAIN_PAGE_TEXELS * TERRAIN_PAGE_TEXELS];
+	Streamer.Context = Context;
+	Streamer.PageArray = PageArray;
+	Streamer.Frame = 0;
+	Streamer.SelectedCount = 0;
+	Streamer.FrustumCulling = true;
+	Streamer.Stats = TerrainStats();
+	Streamer.Quit = false;
+
+	Streamer.Candidates.reserve(MAX_TERRAIN_NODES * 4);
+	Streamer.Finished.reserve(PageCount);
+	Streamer.Uploads.reserve(PageCount);
+	Streamer.Completed.reserve(PageCount);
+	Streamer.Requests.resize(PageCount);
+	Streamer.RequestHead = 0;
+	Streamer.RequestCount = 0;
+
+	int Top = Header.Levels - 1;
+	for (int i = 0; i < Header.RootPages * Header.RootPages; ++i)
+		RequestTerrainPage(Streamer, Streamer.LevelFirstPage[Top] + i, true);
+
+	Streamer.Loader = std::thread(TerrainLoaderThread, &Streamer);
+
+	float Extent = TerrainNodeSize(Streamer, Top) * Header.RootPages;
+	printf("Streaming terrain %s: %.0f x %.0f units, %d levels, %d pages, %.2f MB mapped\n", Path, Extent, Extent, Header.Levels,
+		PageCount, Streamer.FileSize / (1024.0 * 1024.0));
+	return true;
+}
+
+void CloseTerrainStream(TerrainStreamer &Streamer)
+{
+	if (!Streamer.Loader.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> Guard(Streamer.Lock);
+		Streamer.Quit = true;
+	}
+	Streamer.Wake.notify_one();
+	Streamer.Loader.join();
+
+	UnmapTerrainFile(Streamer);
+	delete[] Streamer.SlotSamples;
+	Streamer.SlotSamples = NULL;
+	Streamer.Pages.clear();
+}
+
+static void TerrainNodeBounds(const TerrainStreamer &Streamer, int Level, int X, int Z, XMVECTOR &Min, XMVECTOR &Max)
+{
+	const TerrainFilePage &Info = Streamer.Pages[TerrainPageIndex(Streamer, Level, X, Z)].Info;
+	float Size = TerrainNodeSize(Streamer, Level);
+	float MinX = Streamer.Header.OriginX + X * Size;
+	float MinZ = Streamer.Header.OriginZ + Z * Size;
+	Min = XMVectorSet(MinX, Info.MinHeight, MinZ, 0.0f);
+	Max = XMVectorSet(MinX + Size, Info.MaxHeight, MinZ + Size, 0.0f);
+}
+
+// Squared distance from the point to the closest point of the box
+static float BoxDistanceSquared(FXMVECTOR Point, FXMVECTOR Min, FXMVECTOR Max)
+{
+	return XMVectorGetX(XMVector3LengthSq(XMVectorSubtract(XMVectorClamp(Point, Min, Max), Point)));
+}
+
+// Outside when the corner furthest along a plane's normal is behind it
+static bool BoxInFrustum(const XMVECTOR *Planes, FXMVECTOR Min, FXMVECTOR Max)
+{
+	for (int p = 0; p < 6; ++p)
+	{
+		XMVECTOR Corner = XMVectorSelect(Min, Max, XMVectorGreater(Planes[p], XMVectorZero()));
+		if (XMVectorGetX(XMPlaneDotCoord(Planes[p], Corner)) < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+static void AddTerrainNode(TerrainStreamer &Streamer, int Level, int X, int Z, int Bucket)
+{
+	if (Streamer.SelectedCount >= MAX_TERRAIN_NODES)
+		return;
+
+	float Size = TerrainNodeSize(Streamer, Level);
+	TerrainInstance &Instance = Streamer.Selected[Streamer.SelectedCount];
+	Instance.Node = XMFLOAT4(Streamer.Header.OriginX + X * Size, Streamer.Header.OriginZ + Z * Size, Size, (float)Level);
+	Instance.Slice = Streamer.Pages[TerrainPageIndex(Streamer, Level, X, Z)].Slot;
+	Streamer.SelectedBucket[Streamer.SelectedCount] = (BYTE)Bucket;
+	Streamer.SelectedCount++;
+
+	Streamer.Stats.NodesDrawn++;
+	Streamer.Stats.Triangles += Bucket == TERRAIN_WHOLE_NODE ? TERRAIN_PAGE_QUADS * TERRAIN_PAGE_QUADS * 2 : TERRAIN_PAGE_QUADS * TERRAIN_PAGE_QUADS / 2;
+}
+
+// False when the node is out of its level's range, its parent then draws the area at its own detail
+static bool SelectTerrainNode(TerrainStreamer &Streamer, FXMVECTOR Camera, int Level, int X, int Z)
+{
+	XMVECTOR Min, Max;
+	TerrainNodeBounds(Streamer, Level, X, Z, Min, Max);
+	float DistanceSquared = BoxDistanceSquared(Camera, Min, Max);
+	if (DistanceSquared > Streamer.LodRanges[Level] * Streamer.LodRanges[Level])
+		return false;
+
+	if (Streamer.FrustumCulling && !BoxInFrustum(Streamer.FrustumPlanes, Min, Max))
+	{
+		Streamer.Stats.NodesCulled++;
+		return true;
+	}
+
+	// Only nodes with resident pages are ever visited
+	const TerrainPage &Page = Streamer.Pages[TerrainPageIndex(Streamer, Level, X, Z)];
+	Streamer.Slots[Page.Slot].LastUsed = Streamer.Frame;
+
+	float ChildRange = Level > 0 ? Streamer.LodRanges[Level - 1] : 0.0f;
+	if (Level == 0 || DistanceSquared > ChildRange * ChildRange)
+	{
+		AddTerrainNode(Streamer, Level, X, Z, TERRAIN_WHOLE_NODE);
+		return true;
+	}
+
+	// Every child in range needs its page before the node can split. Until then the node is drawn whole, which can
+	// leave cracks against finer neighbors for the frames it takes the pages to arrive.
+	bool ChildrenResident = true;
+	for (int c = 0; c < 4; ++c)
+	{
+		int ChildX = X * 2 + (c & 1);
+		int ChildZ = Z * 2 + (c >> 1);
+		XMVECTOR ChildMin, ChildMax;
+		TerrainNodeBounds(Streamer, Level - 1, ChildX, ChildZ, ChildMin, ChildMax);
+		float ChildDistanceSquared = BoxDistanceSquared(Camera, ChildMin, ChildMax);
+		int ChildPage = TerrainPageIndex(Streamer, Level - 1, ChildX, ChildZ);
+		if (ChildDistanceSquared > ChildRange * ChildRange || Streamer.Pages[ChildPage].State == PAGE_RESIDENT)
+			continue;
+
+		ChildrenResident = false;
+		if (Streamer.Pages[ChildPage].State == PAGE_UNLOADED)
+			Streamer.Candidates.push_back(std::make_pair(ChildDistanceSquared, ChildPage));
+	}
+
+	if (!ChildrenResident)
+	{
+		AddTerrainNode(Streamer, Level, X, Z, TERRAIN_WHOLE_NODE);
+		Streamer.Stats.NodesCoarser++;
+		return true;
+	}
+
+	for (int c = 0; c < 4; ++c)
+	{
+		if (!SelectTerrainNode(Streamer, Camera, Level - 1, X * 2 + (c & 1), Z * 2 + (c >> 1)))
+			AddTerrainNode(Streamer, Level, X, Z, c);
+	}
+	return true;
+}
+
+static void SelectTerrainNodes(TerrainStreamer &Streamer, FXMVECTOR Camera)
+{
+	Streamer.SelectedCount = 0;
+	Streamer.Candidates.clear();
+	Streamer.Stats.NodesDrawn = 0;
+	Streamer.Stats.NodesCulled = 0;
+	Streamer.Stats.NodesCoarser = 0;
+	Streamer.Stats.Triangles = 0;
+
+	int Top = Streamer.Header.Levels - 1;
+	for (int z = 0; z < Streamer.LevelPagesPerSide[Top]; ++z)
+	{
+		for (int x = 0; x < Streamer.LevelPagesPerSide[Top]; ++x)
+		{
+			if (Streamer.Pages[TerrainPageIndex(Streamer, Top, x, z)].State == PAGE_RESIDENT)
+				SelectTerrainNode(Streamer, Camera, Top, x, z);
+		}
+	}
+}
+
+void UpdateTerrain(TerrainStreamer &Streamer, FXMVECTOR Camera, CXMMATRIX ViewProjection)
+{
+	const UINT Samples = TERRAIN_PAGE_TEXELS * TERRAIN_PAGE_TEXELS;
+	Streamer.Frame++;
+
+	// Pages the loader finished go into the array oldest first, a few a frame so a burst of them doesn't stall one frame
+	Streamer.Finished.clear();
+	{
+		std::lock_guard<std::mutex> Guard(Streamer.Lock);
+		Streamer.Finished.swap(Streamer.Completed);
+	}
+	Streamer.Uploads.insert(Streamer.Uploads.end(), Streamer.Finished.begin(), Streamer.Finished.end());
+
+	int Uploaded = min((int)Streamer.Uploads.size(), TERRAIN_UPLOADS_PER_FRAME);
+	UINT64 UploadBytes = 0;
+	for (int i = 0; i < Uploaded; ++i)
+	{
+		TerrainPage &Page = Streamer.Pages[Streamer.Uploads[i]];
+		if (Streamer.Context)
+		{
+			UploadSubresource(Streamer.Context, Streamer.PageArray, D3D11CalcSubresource(0, Page.Slot, 1),
+				Streamer.SlotSamples + Page.Slot * Samples, TERRAIN_PAGE_TEXELS * sizeof(UINT16), Samples * sizeof(UINT16), UploadBytes);
+		}
+		Page.State = PAGE_RESIDENT;
+		Streamer.Stats.BytesStreamed += Samples * sizeof(UINT16);
+	}
+	Streamer.Uploads.erase(Streamer.Uploads.begin(), Streamer.Uploads.begin() + Uploaded);
+	Streamer.Stats.PagesUploaded = Uploaded;
+	CountContextWork(0, 0, UploadBytes);
+
+	// Frustum planes of a row vector matrix, pointing inwards. Depth goes from 0 to w.
+	XMMATRIX Columns = XMMatrixTranspose(ViewProjection);
+	Streamer.FrustumPlanes[0] = XMPlaneNormalize(XMVectorAdd(Columns.r[3], Columns.r[0]));
+	Streamer.FrustumPlanes[1] = XMPlaneNormalize(XMVectorSubtract(Columns.r[3], Columns.r[0]));
+	Streamer.FrustumPlanes[2] = XMPlaneNormalize(XMVectorAdd(Columns.r[3], Columns.r[1]));
+	Streamer.FrustumPlanes[3] = XMPlaneNormalize(XMVectorSubtract(Columns.r[3], Columns.r[1]));
+	Streamer.FrustumPlanes[4] = XMPlaneNormalize(Columns.r[2]);
+	Streamer.FrustumPlanes[5] = XMPlaneNormalize(XMVectorSubtract(Columns.r[3], Columns.r[2]));
+	XMStoreFloat3(&Streamer.Camera, Camera);
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+	SelectTerrainNodes(Streamer, Camera);
+	QueryPerformanceCounter(&End);
+	Streamer.Stats.SelectMs = double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+
+	// What the selection wanted but didn't have, closest first
+	std::sort(Streamer.Candidates.begin(), Streamer.Candidates.end());
+	bool Requested = false;
+	for (size_t c = 0; c < Streamer.Candidates.size() && c < TERRAIN_UPLOADS_PER_FRAME * 2; ++c)
+	{
+		if (!RequestTerrainPage(Streamer, Streamer.Candidates[c].second, false))
+			break;
+		Requested = true;
+	}
+	if (Requested)
+		Streamer.Wake.notify_one();
+
+	Streamer.Stats.PagesResident = 0;
+	Streamer.Stats.PagesLoading = 0;
+	for (int s = 0; s < TERRAIN_PAGE_SLOTS; ++s)
+	{
+		int Page = Streamer.Slots[s].Page;
+		if (Page < 0)
+			continue;
+		if (Streamer.Pages[Page].State == PAGE_RESIDENT)
+			Streamer.Stats.PagesResident++;
+		else
+			Streamer.Stats.PagesLoading++;
+	}
+}
+
+static float TerrainHash(int X, int Z)
+{
+	UINT Hash = (UINT)X * 73856093u ^ (UINT)Z * 19349663u;
+	Hash = (Hash ^ (Hash >> 13)) * 1274126177u;
+	return (Hash ^ (Hash >> 16)) / 4294967296.0f;
+}
+
+static float TerrainValueNoise(float X, float Z)
+{
+	float CellX = floorf(X);
+	float CellZ = floorf(Z);
+	float FracX = X - CellX;
+	float FracZ = Z - CellZ;
+	FracX = FracX * FracX * (3.0f - 2.0f * FracX);
+	FracZ = FracZ * FracZ * (3.0f - 2.0f * FracZ);
+
+	int IX = (int)CellX;
+	int IZ = (int)CellZ;
+	float Low = TerrainHash(IX, IZ) + (TerrainHash(IX + 1, IZ) - TerrainHash(IX, IZ)) * FracX;
+	float High = TerrainHash(IX, IZ + 1) + (TerrainHash(IX + 1, IZ + 1) - TerrainHash(IX, IZ + 1)) * FracX;
+	return Low + (High - Low) * FracZ;
+}
+
+// Between 0 and 1. Hills of a few hundred units with detail down to a unit, flattened around the origin where the
+// rest of the scene stands.
+static float TestTerrainHeight(float X, float Z)
+{
+	float Sum = 0.0f;
+	float Frequency = 1.0f / 256.0f;
+	float Amplitude = 0.5f;
+	for (int Octave = 0; Octave < 7; ++Octave)
+	{
+		Sum += Amplitude * TerrainValueNoise(X * Frequency, Z * Frequency);
+		Frequency *= 2.0f;
+		Amplitude *= 0.5f;
+	}
+
+	float Flatten = min(max((sqrtf(X * X + Z * Z) - 40.0f) / 160.0f, 0.0f), 1.0f);
+	Flatten = Flatten * Flatten * (3.0f - 2.0f * Flatten);
+	return Sum * Sum * Flatten;
+}
+
+struct TerrainCookJob
+{
+	UINT16 *Heights;
+	int Samples;
+	float Spacing;
+	float Origin;
+};
+
+static void CookTerrainRows(void *Data, int Begin, int End)
+{
+	TerrainCookJob *Job = (TerrainCookJob *)Data;
+	for (int z = Begin; z < End; ++z)
+	{
+		for (int x = 0; x < Job->Samples; ++x)
+		{
+			float Height = TestTerrainHeight(Job->Origin + x * Job->Spacing, Job->Origin + z * Job->Spacing);
+			Job->Heights[z * Job->Samples + x] = (UINT16)(min(max(Height, 0.0f), 1.0f) * 65535.0f + 0.5f);
+		}
+	}
+}
+
+// Writes a square terrain centered on the origin. The finest level is generated, every coarser one takes every
+// other sample of the one below so the vertices of a coarse grid are exactly where the finer grid morphs to.
+bool CookTestTerrain(const char *Path, int RootPages, int Levels, float SampleSpacing, float HeightScale)
+{
+	FILE *File;
+	if (fopen_s(&File, Path, "wb") != 0)
+	{
+		printf("Could not open %s\n", Path);
+		return false;
+	}
+
+	int Quads = RootPages * TERRAIN_PAGE_QUADS << (Levels - 1);
+	int Samples = Quads + 1;
+	std::vector<UINT16> Heights((size_t)Samples * Samples);
+	TerrainCookJob Job = { Heights.data(), Samples, SampleSpacing, -Quads * SampleSpacing * 0.5f };
+	ParallelFor(Samples, 16, CookTerrainRows, &Job);
+
+	TerrainFileHeader Header = {};
+	memcpy(Header.Magic, TERRAIN_FILE_MAGIC, 4);
+	Header.Version = TERRAIN_FILE_VERSION;
+	Header.RootPages = RootPages;
+	Header.Levels = Levels;
+	Header.SampleSpacing = SampleSpacing;
+	Header.HeightScale = HeightScale;
+	// Level with the feet of the characters
+	Header.BaseHeight = -2.0f;
+	Header.OriginX = Job.Origin;
+	Header.OriginZ = Job.Origin;
+	Header.PageTableOffset = sizeof(TerrainFileHeader);
+
+	std::vector<TerrainFilePage> PageTable;
+	std::vector<UINT16> PageSamples;
+	const UINT PageSampleCount = TERRAIN_PAGE_TEXELS * TERRAIN_PAGE_TEXELS;
+	int LevelFirstPage = 0;
+	for (int l = 0; l < Levels; ++l)
+	{
+		int PagesPerSide = RootPages << (Levels - 1 - l);
+		int ChildFirstPage = LevelFirstPage;
+		LevelFirstPage = (int)PageTable.size();
+		for (int z = 0; z < PagesPerSide; ++z)
+		{
+			for (int x = 0; x < PagesPerSide; ++x)
+			{
+				// The border only feeds the normals, the page's bounds are its own samples
+				UINT16 Low = 0xffff, High = 0;
+				int LevelQuads = Quads >> l;
+				for (int j = -TERRAIN_PAGE_BORDER; j < TERRAIN_PAGE_SAMPLES + TERRAIN_PAGE_BORDER; ++j)
+				{
+					for (int i = -TERRAIN_PAGE_BORDER; i < TERRAIN_PAGE_SAMPLES + TERRAIN_PAGE_BORDER; ++i)
+					{
+						size_t SampleX = (size_t)min(max(x * TERRAIN_PAGE_QUADS + i, 0), LevelQuads) << l;
+						size_t SampleZ = (size_t)min(max(z * TERRAIN_PAGE_QUADS + j, 0), LevelQuads) << l;
+						UINT16 Height = Heights[SampleZ * Samples + SampleX];
+						PageSamples.push_back(Height);
+						if (i < 0 || j < 0 || i >= TERRAIN_PAGE_SAMPLES || j >= TERRAIN_PAGE_SAMPLES)
+							continue;
+						Low = min(Low, Height);
+						High = max(High, Height);
+					}
+				}
+
+				// A node bounds everything drawn inside it, so the children's finer samples count too
+				TerrainFilePage Page = {};
+				Page.MinHeight = Header.BaseHeight + Low / 65535.0f * HeightScale;
+				Page.MaxHeight = Header.BaseHeight + High / 65535.0f * HeightScale;
+				for (int c = 0; c < 4 && l > 0; ++c)
+				{
+					const TerrainFilePage &Child = PageTable[ChildFirstPage + (z * 2 + (c >> 1)) * PagesPerSide * 2 + x * 2 + (c & 1)];
+					Page.MinHeight = min(Page.MinHeight, Child.MinHeight);
+					Page.MaxHeight = max(Page.MaxHeight, Child.MaxHeight);
+				}
+				PageTable.push_back(Page);
+			}
+		}
+	}
+
+	Header.PageCount = (UINT)PageTable.size();
+	UINT64 Offset = Header.PageTableOffset + PageTable.size() * sizeof(TerrainFilePage);
+	for (size_t i = 0; i < PageTable.size(); ++i)
+		PageTable[i].Offset = Offset + i * PageSampleCount * sizeof(UINT16);
+
+	fwrite(&Header, sizeof(Header), 1, File);
+	fwrite(PageTable.data(), sizeof(TerrainFilePage), PageTable.size(), File);
+	fwrite(PageSamples.data(), sizeof(UINT16), PageSamples.size(), File);
+	fclose(File);
+
+	UINT64 Bytes = Offset + PageSamples.size() * sizeof(UINT16);
+	printf("Cooked %s: %d x %d samples, %d levels, %d pages, %.2f MB\n", Path, Samples, Samples, Levels, (int)PageTable.size(),
+		Bytes / (1024.0 * 1024.0));
+	return true;
+}
+
+bool InitTerrain()
+{
+	// One grid for every node, (0, 0) to (TERRAIN_PAGE_QUADS, TERRAIN_PAGE_QUADS) in samples
+	std::vector<XMFLOAT2> GridVertices;
+	for (int z = 0; z < TERRAIN_PAGE_SAMPLES; ++z)
+	{
+		for (int x = 0; x < TERRAIN_PAGE_SAMPLES; ++x)
+			GridVertices.push_back(XMFLOAT2((float)x, (float)z));
+	}
+
+	// Quadrant by quadrant, so a node the selection split only partly draws the range of each quadrant it kept
+	const int Half = TERRAIN_PAGE_QUADS / 2;
+	std::vector<DWORD> GridIndices;
+	for (int q = 0; q < 4; ++q)
+	{
+		for (int z = (q >> 1) * Half; z < ((q >> 1) + 1) * Half; ++z)
+		{
+			for (int x = (q & 1) * Half; x < ((q & 1) + 1) * Half; ++x)
+			{
+				DWORD Corner = z * TERRAIN_PAGE_SAMPLES + x;
+				GridIndices.push_back(Corner);
+				GridIndices.push_back(Corner + TERRAIN_PAGE_SAMPLES);
+				GridIndices.push_back(Corner + TERRAIN_PAGE_SAMPLES + 1);
+				GridIndices.push_back(Corner);
+				GridIndices.push_back(Corner + TERRAIN_PAGE_SAMPLES + 1);
+				GridIndices.push_back(Corner + 1);
+			}
+		}
+	}
+
+	D3D11_BUFFER_DESC BufferDesc = {};
+	BufferDesc.Usage = D3D11_USAGE_DEFAULT;
+	BufferDesc.ByteWidth = (UINT)(sizeof(XMFLOAT2) * GridVertices.size());
+	BufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	D3D11_SUBRESOURCE_DATA BufferData = {};
+	BufferData.pSysMem = GridVertices.data();
+	HR(D3D11Device->CreateBuffer(&BufferDesc, &BufferData, &TerrainGridVertexBuffer));
+
+	BufferDesc.ByteWidth = (UINT)(sizeof(DWORD) * GridIndices.size());
+	BufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+	BufferData.pSysMem = GridIndices.data();
+	HR(D3D11Device->CreateBuffer(&BufferDesc, &BufferData, &TerrainGridIndexBuffer));
+
+	D3D11_BUFFER_DESC InstanceBufferDesc = {};
+	InstanceBufferDesc.ByteWidth = sizeof(TerrainInstance) * MAX_TERRAIN_NODES;
+	InstanceBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
+	InstanceBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	InstanceBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	HR(D3D11Device->CreateBuffer(&InstanceBufferDesc, NULL, &TerrainInstanceBuffer));
+
+	D3D11_BUFFER_DESC ConstantBufferDesc = {};
+	ConstantBufferDesc.ByteWidth = sizeof(cbTerrain);
+	ConstantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	HR(D3D11Device->CreateBuffer(&ConstantBufferDesc, 0, &cbTerrainBuffer));
+
+	// A slice per page slot, the streamer fills them in as pages arrive
+	D3D11_TEXTURE2D_DESC PageArrayDesc = {};
+	PageArrayDesc.Width = TERRAIN_PAGE_TEXELS;
+	PageArrayDesc.Height = TERRAIN_PAGE_TEXELS;
+	PageArrayDesc.MipLevels = 1;
+	PageArrayDesc.ArraySize = TERRAIN_PAGE_SLOTS;
+	PageArrayDesc.Format = DXGI_FORMAT_R16_UNORM;
+	PageArrayDesc.SampleDesc.Count = 1;
+	PageArrayDesc.Usage = D3D11_USAGE_DEFAULT;
+	PageArrayDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	HR(D3D11Device->CreateTexture2D(&PageArrayDesc, NULL, &TerrainPageArray));
+	HR(D3D11Device->CreateShaderResourceView(TerrainPageArray, NULL, &TerrainPageArrayView));
+
+	// Clamped, so the edge samples of a page never blend with the other side of it
+	D3D11_SAMPLER_DESC SamplerDesc = {};
+	SamplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+	SamplerDesc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+	SamplerDesc.MaxLOD = D3D11_FLOAT32_MAX;
+	HR(D3D11Device->CreateSamplerState(&SamplerDesc, &TerrainSamplerState));
+
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "TERRAIN_VS", "vs_5_0", 0, 0, &TerrainVSBuffer, 0));
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "TERRAIN_PS", "ps_5_0", 0, 0, &TerrainPSBuffer, 0));
+	HR(D3D11Device->CreateVertexShader(TerrainVSBuffer->GetBufferPointer(), TerrainVSBuffer->GetBufferSize(), 0, &TerrainVS));
+	HR(D3D11Device->CreatePixelShader(TerrainPSBuffer->GetBufferPointer(), TerrainPSBuffer->GetBufferSize(), 0, &TerrainPS));
+	HR(D3D11Device->CreateInputLayout(TerrainLayout, ARRAYSIZE(TerrainLayout), TerrainVSBuffer->GetBufferPointer(),
+		TerrainVSBuffer->GetBufferSize(), &TerrainVertexLayout));
+
+	// Like the scene, the terrain is only there when it was cooked
+	TerrainLoaded = OpenTerrainStream(Terrain, TerrainPath, D3D11DeviceContext, TerrainPageArray);
+	return true;
+}
+
+void ReleaseTerrain()
+{
+	CloseTerrainStream(Terrain);
+	TerrainGridVertexBuffer->Release();
+	TerrainGridIndexBuffer->Release();
+	TerrainInstanceBuffer->Release();
+	cbTerrainBuffer->Release();
+	TerrainPageArray->Release();
+	TerrainPageArrayView->Release();
+	TerrainSamplerState->Release();
+	TerrainVS->Release();
+	TerrainPS->Release();
+	TerrainVSBuffer->Release();
+	TerrainPSBuffer->Release();
+	TerrainVertexLayout->Release();
+}
+
+void TerrainPass()
+{
+	if (!TerrainLoaded || !TerrainEnabled || Terrain.SelectedCount == 0)
+		return;
+
+	// Instances grouped by the index range that draws them, whole nodes last
+	int BucketCounts[TERRAIN_DRAW_BUCKETS] = {};
+	int BucketStarts[TERRAIN_DRAW_BUCKETS];
+	for (int i = 0; i < Terrain.SelectedCount; ++i)
+		BucketCounts[Terrain.SelectedBucket[i]]++;
+	for (int b = 0, Start = 0; b < TERRAIN_DRAW_BUCKETS; Start += BucketCounts[b++])
+		BucketStarts[b] = Start;
+
+	TerrainInstance *Instances = (TerrainInstance *)MapDiscard(TerrainInstanceBuffer);
+	if (!Instances)
+		return;
+	int BucketFill[TERRAIN_DRAW_BUCKETS];
+	memcpy(BucketFill, BucketStarts, sizeof(BucketFill));
+	for (int i = 0; i < Terrain.SelectedCount; ++i)
+		Instances[BucketFill[Terrain.SelectedBucket[i]]++] = Terrain.Selected[i];
+	Unmap(TerrainInstanceBuffer, Terrain.SelectedCount * sizeof(TerrainInstance));
+
+	cbPerView View;
+	View.ViewProjection = XMMatrixTranspose(CameraView * CameraProjection);
+	UploadSubresource(cbPerViewBuffer, &View, sizeof(cbPerView));
+
+	const TerrainFileHeader &Header = Terrain.Header;
+	cbTerrain Constants = {};
+	for (int l = 0; l < Header.Levels - 1; ++l)
+	{
+		float PreviousRange = l > 0 ? Terrain.LodRanges[l - 1] : 0.0f;
+		float MorphStart = PreviousRange + (Terrain.LodRanges[l] - PreviousRange) * TERRAIN_MORPH_START;
+		Constants.MorphConstants[l] = XMFLOAT4(MorphStart, 1.0f / (Terrain.LodRanges[l] - MorphStart), 0.0f, 0.0f);
+	}
+	// The coarsest level has nothing to morph into and stays zero
+	Constants.CameraPositionScale = XMFLOAT4(Terrain.Camera.x, Terrain.Camera.y, Terrain.Camera.z, Header.HeightScale);
+	Constants.TerrainParams = XMFLOAT4(Header.BaseHeight, (float)TERRAIN_PAGE_SAMPLES, 1.0f / TERRAIN_PAGE_TEXELS, (float)TERRAIN_PAGE_BORDER);
+	XMStoreFloat4(&Constants.SunDirection, XMVector3Normalize(XMLoadFloat3(&SUN_DIRECTION)));
+	UploadSubresource(cbTerrainBuffer, &Constants, sizeof(cbTerrain));
+
+	ID3D11RenderTargetView *SceneTargetView = FrameGraph.Resources[RGSceneColor].RTV;
+	ID3D11DepthStencilView *DepthStencilView = FrameGraph.Resources[RGDepth].DSV;
+
+	D3D11_VIEWPORT Viewport = {};
+	Viewport.Width = (FLOAT)ScaledWidth;
+	Viewport.Height = (FLOAT)ScaledHeight;
+	Viewport.MinDepth = 0.0f;
+	Viewport.MaxDepth = 1.0f;
+
+	ID3D11Buffer *Buffers[2] = { TerrainGridVertexBuffer, TerrainInstanceBuffer };
+	UINT Strides[2] = { sizeof(XMFLOAT2), sizeof(TerrainInstance) };
+	UINT Offsets[2] = { 0, 0 };
+
+	Bind()->RSSetViewports(1, &Viewport);
+	Bind()->RSSetState(NoCullMode);
+	Bind()->OMSetRenderTargets(1, &SceneTargetView, DepthStencilView);
+	Bind()->OMSetBlendState(0, 0, 0xffffffff);
+	Bind()->IASetInputLayout(TerrainVertexLayout);
+	Bind()->IASetVertexBuffers(0, 2, Buffers, Strides, Offsets);
+	Bind()->IASetIndexBuffer(TerrainGridIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	Bind()->VSSetShader(TerrainVS, 0, 0);
+	Bind()->VSSetConstantBuffers(2, 1, &cbPerViewBuffer);
+	Bind()->VSSetConstantBuffers(5, 1, &cbTerrainBuffer);
+	Bind()->VSSetShaderResources(3, 1, &TerrainPageArrayView);
+	Bind()->VSSetSamplers(2, 1, &TerrainSamplerState);
+	Bind()->PSSetShader(TerrainPS, 0, 0);
+	Bind()->PSSetConstantBuffers(5, 1, &cbTerrainBuffer);
+
+	const UINT QuadrantIndices = TERRAIN_PAGE_QUADS * TERRAIN_PAGE_QUADS / 4 * 6;
+	for (int b = 0; b < TERRAIN_DRAW_BUCKETS; ++b)
+	{
+		if (BucketCounts[b] == 0)
+			continue;
+		UINT IndexCount = b == TERRAIN_WHOLE_NODE ? QuadrantIndices * 4 : QuadrantIndices;
+		UINT StartIndex = b == TERRAIN_WHOLE_NODE ? 0 : QuadrantIndices * b;
+		DrawCall()->DrawIndexedInstanced(IndexCount, BucketCounts[b], StartIndex, 0, BucketStarts[b]);
+	}
+
+	UINT Stride = sizeof(Vertex);
+	UINT Offset = 0;
+	Bind()->IASetInputLayout(VertexLayout);
+	Bind()->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
+	Bind()->IASetIndexBuffer(SquareIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	Bind()->VSSetShader(VertexShader, 0, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+}
+
+// Height of the finest samples under a point, read straight from the mapped file
+static float TerrainGroundHeight(const TerrainStreamer &Streamer, float X, float Z)
+{
+	const TerrainFileHeader &Header = Streamer.Header;
+	int Quads = Streamer.LevelPagesPerSide[0] * TERRAIN_PAGE_QUADS;
+	int SampleX = min(max((int)((X - Header.OriginX) / Header.SampleSpacing), 0), Quads - 1);
+	int SampleZ = min(max((int)((Z - Header.OriginZ) / Header.SampleSpacing), 0), Quads - 1);
+
+	const TerrainPage &Page = Streamer.Pages[TerrainPageIndex(Streamer, 0, SampleX / TERRAIN_PAGE_QUADS, SampleZ / TERRAIN_PAGE_QUADS)];
+	const UINT16 *Samples = (const UINT16 *)(Streamer.View + Page.Info.Offset);
+	UINT16 Height = Samples[(SampleZ % TERRAIN_PAGE_QUADS + TERRAIN_PAGE_BORDER) * TERRAIN_PAGE_TEXELS + SampleX % TERRAIN_PAGE_QUADS + TERRAIN_PAGE_BORDER];
+	return Header.BaseHeight + Height / 65535.0f * Header.HeightScale;
+}
+
+// Border texels of every page that differ from the samples of the neighbor they were taken from, over every level
+static int CountTerrainBorderMismatches(const TerrainStreamer &Streamer)
+{
+	const int T = TERRAIN_PAGE_TEXELS, B = TERRAIN_PAGE_BORDER;
+	int Mismatches = 0;
+	for (int l = 0; l < Streamer.Header.Levels; ++l)
+	{
+		int PagesPerSide = Streamer.LevelPagesPerSide[l];
+		for (int z = 0; z < PagesPerSide; ++z)
+		{
+			for (int x = 0; x < PagesPerSide; ++x)
+			{
+				const UINT16 *Page = (const UINT16 *)(Streamer.View + Streamer.Pages[TerrainPageIndex(Streamer, l, x, z)].Info.Offset);
+				const UINT16 *Right = x + 1 < PagesPerSide ?
+					(const UINT16 *)(Streamer.View + Streamer.Pages[TerrainPageIndex(Streamer, l, x + 1, z)].Info.Offset) : NULL;
+				const UINT16 *Up = z + 1 < PagesPerSide ?
+					(const UINT16 *)(Streamer.View + Streamer.Pages[TerrainPageIndex(Streamer, l, x, z + 1)].Info.Offset) : NULL;
+
+				// Past the shared edge each page sees the other's first sample in
+				for (int k = 0; k < TERRAIN_PAGE_SAMPLES; ++k)
+				{
+					if (Right)
+					{
+						Mismatches += Page[(k + B) * T + B + TERRAIN_PAGE_SAMPLES] != Right[(k + B) * T + B + 1];
+						Mismatches += Right[(k + B) * T + B - 1] != Page[(k + B) * T + B + TERRAIN_PAGE_QUADS - 1];
+					}
+					if (Up)
+					{
+						Mismatches += Page[(B + TERRAIN_PAGE_SAMPLES) * T + k + B] != Up[(B + 1) * T + k + B];
+						Mismatches += Up[(B - 1) * T + k + B] != Page[(B + TERRAIN_PAGE_QUADS - 1) * T + k + B];
+					}
+				}
+			}
+		}
+	}
+	return Mismatches;
+}
+
+// Flies a spiral out from the origin a few units over the ground at 60 Hz, streaming the pages without a device. Every
+// second the selection is also run without the frustum and has to cover the whole terrain exactly once. Every page's
+// border has to match its neighbors, or the normals would crease along the page edges.
+int RunTerrainTest(int Frames)
+{
+	if (GetFileAttributes(TerrainPath) == INVALID_FILE_ATTRIBUTES && !CookTestTerrain(TerrainPath, 2, 5, 0.5f, 120.0f))
+		return 1;
+	// Cooked by an older version, cook it again
+	if (!OpenTerrainStream(Terrain, TerrainPath, NULL, NULL) &&
+		(!CookTestTerrain(TerrainPath, 2, 5, 0.5f, 120.0f) || !OpenTerrainStream(Terrain, TerrainPath, NULL, NULL)))
+		return 1;
+	int BorderMismatches = CountTerrainBorderMismatches(Terrain);
+
+	CameraProjection = XMMatrixPerspectiveFovLH(0.4f * 3.14f, (float)Width / Height, 1.0f, 1000.0f);
+	CameraUp = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+	int Top = Terrain.Header.Levels - 1;
+	float Extent = TerrainNodeSize(Terrain, Top) * Terrain.Header.RootPages;
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	double SelectMs = 0.0, WorstSelectMs = 0.0;
+	UINT64 Triangles = 0;
+	int Nodes = 0, Coarser = 0, CoverageChecks = 0, CoverageFailures = 0;
+	for (int i = 0; i < Frames; ++i)
+	{
+		LARGE_INTEGER FrameStart;
+		QueryPerformanceCounter(&FrameStart);
+
+		float Time = i / 60.0f;
+		float Angle = 0.4f * Time;
+		float Radius = 20.0f + 25.0f * Time;
+		float X = Radius * cosf(Angle);
+		float Z = Radius * sinf(Angle);
+		CameraPosition = XMVectorSet(X, TerrainGroundHeight(Terrain, X, Z) + 8.0f, Z, 0.0f);
+		CameraTarget = CameraPosition + XMVectorSet(-sinf(Angle), -0.2f, cosf(Angle), 0.0f);
+		CameraView = XMMatrixLookAtLH(CameraPosition, CameraTarget, CameraUp);
+
+		UpdateTerrain(Terrain, CameraPosition, CameraView * CameraProjection);
+		const TerrainStats &Stats = Terrain.Stats;
+		SelectMs += Stats.SelectMs;
+		WorstSelectMs = max(WorstSelectMs, Stats.SelectMs);
+		Triangles += Stats.Triangles;
+		Nodes += Stats.NodesDrawn;
+		Coarser += Stats.NodesCoarser;
+
+		if (i % 60 == 59 && Stats.PagesResident >= Terrain.Header.RootPages * Terrain.Header.RootPages)
+		{
+			Terrain.FrustumCulling = false;
+			SelectTerrainNodes(Terrain, CameraPosition);
+			Terrain.FrustumCulling = true;
+
+			double Area = 0.0;
+			for (int n = 0; n < Terrain.SelectedCount; ++n)
+			{
+				double Size = Terrain.Selected[n].Node.z;
+				Area += Terrain.SelectedBucket[n] == TERRAIN_WHOLE_NODE ? Size * Size : Size * Size * 0.25;
+			}
+			CoverageChecks++;
+			if (fabs(Area - (double)Extent * Extent) > 1e-4 * Extent * Extent)
+			{
+				printf("Frame %d: the selection covers %.1f square units of %.1f\n", i, Area, (double)Extent * Extent);
+				CoverageFailures++;
+			}
+		}
+
+		// Pace like a vsynced frame loop
+		double Elapsed = 0.0;
+		do
+		{
+			QueryPerformanceCounter(&End);
+			Elapsed = double(End.QuadPart - FrameStart.QuadPart) * 1000.0 / Frequency.QuadPart;
+			if (Elapsed < 15.0)
+				Sleep(1);
+		} while (Elapsed < 1000.0 / 60.0);
+	}
+
+	QueryPerformanceCounter(&End);
+	const TerrainStats &Stats = Terrain.Stats;
+	printf("Terrain test: %d frames in %.2f s, %.0f x %.0f units, %d levels\n", Frames,
+		double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart, Extent, Extent, Terrain.Header.Levels);
+	printf("  %.1f nodes and %.2f M triangles per frame, %.1f drawn coarser while their pages streamed\n", (double)Nodes / max(Frames, 1),
+		Triangles / 1e6 / max(Frames, 1), (double)Coarser / max(Frames, 1));
+	printf("  %.3f ms selection per frame, %.3f ms worst\n", SelectMs / max(Frames, 1), WorstSelectMs);
+	printf("  %.2f MB streamed, %d pages resident and %d loading at the end, %d of %d coverage checks failed\n",
+		Stats.BytesStreamed / (1024.0 * 1024.0), Stats.PagesResident, Stats.PagesLoading, CoverageFailures, CoverageChecks);
+	printf("  %d border texels differ from the neighbor page's samples\n", BorderMismatches);
+
+	CloseTerrainStream(Terrain);
+	return CoverageFailures == 0 && CoverageChecks > 0 && BorderMismatches == 0 ? 0 : 1;
+}
+
+// Greedy: a meshlet grows by the triangle next to it that brings in the fewest new vertices, the one nearest its
+// middle on a tie, and is closed once nothing more fits or nothing next to it is left
+void BuildMeshlets(const std::vector<Vertex> &Vertices, const std::vector<DWORD> &Indices, ClusterMesh &Mesh)
+{
+	int VertexCount = (int)Vertices.size();
+	int TriangleCount = (int)Indices.size() / 3;
+
+	Mesh.Vertices = Vertices;
+	Mesh.Meshlets.clear();
+	Mesh.Bounds.clear();
+	Mesh.MeshletVertices.clear();
+	Mesh.MeshletTriangles.clear();
+	Mesh.TriangleCount = TriangleCount;
+	Mesh.LightmapUVs.clear();
+	Mesh.LightmapSize = 0;
+
+	std::vector<XMFLOAT3> Normals(TriangleCount), Centroids(TriangleCount);
+	for (int t = 0; t < TriangleCount; ++t)
+	{
+		XMVECTOR P0 = XMLoadFloat3(&Vertices[Indices[t * 3]].pos);
+		XMVECTOR P1 = XMLoadFloat3(&Vertices[Indices[t * 3 + 1]].pos);
+		XMVECTOR P2 = XMLoadFloat3(&Vertices[Indices[t * 3 + 2]].pos);
+		XMStoreFloat3(&Normals[t], XMVector3Normalize(XMVector3Cross(P1 - P0, P2 - P0)));
+		XMStoreFloat3(&Centroids[t], (P0 + P1 + P2) * (1.0f / 3.0f));
+	}
+
+	// The triangles around every vertex, packed one vertex after another
+	std::vector<int> AdjacencyOffsets(VertexCount + 1, 0), Adjacency(TriangleCount * 3);
+	for (int i = 0; i < TriangleCount * 3; ++i)
+		AdjacencyOffsets[Indices[i] + 1]++;
+	for (int v = 0; v < VertexCount; ++v)
+		AdjacencyOffsets[v + 1] += AdjacencyOffsets[v];
+	std::vector<int> Fill(AdjacencyOffsets.begin(), AdjacencyOffsets.end() - 1);
+	for (int i = 0; i < TriangleCount * 3; ++i)
+		Adjacency[Fill[Indices[i]]++] = i / 3;
+
+	std::vector<bool> Emitted(TriangleCount, false);
+	std::vector<int> LocalIndex(VertexCount, -1);
+	std::vector<UINT> MeshletVertices;
+	std::vector<int> MeshletTriangles;
+	XMVECTOR CentroidSum = XMVectorZero();
+	int Seed = 0;
+
+	while (true)
+	{
+		int Best = -1, BestNew = 4;
+		float BestDistance = FLT_MAX;
+		XMVECTOR Middle = MeshletTriangles.empty() ? XMVectorZero() : CentroidSum / (float)MeshletTriangles.size();
+		bool TrianglesFull = MeshletTriangles.size() == MESHLET_MAX_TRIANGLES;
+
+		for (size_t m = 0; m < MeshletVertices.size() && !TrianglesFull; ++m)
+		{
+			UINT v = MeshletVertices[m];
+			for (int a = AdjacencyOffsets[v]; a < AdjacencyOffsets[v + 1]; ++a)
+			{
+				int t = Adjacency[a];
+				if (Emitted[t])
+					continue;
+
+				int New = (LocalIndex[Indices[t * 3]] < 0) + (LocalIndex[Indices[t * 3 + 1]] < 0) + (LocalIndex[Indices[t * 3 + 2]] < 0);
+				if (MeshletVertices.size() + New > MESHLET_MAX_VERTICES || New > BestNew)
+					continue;
+
+				float Distance = XMVectorGetX(XMVector3LengthSq(XMLoadFloat3(&Centroids[t]) - Middle));
+				if (New < BestNew || Distance < BestDistance)
+				{
+					Best = t;
+					BestNew = New;
+					BestDistance = Distance;
+				}
+			}
+		}
+
+		if (Best < 0)
+		{
+			// Nothing more fits or touches it, close the meshlet and start the next at the first triangle left
+			if (!MeshletTriangles.empty())
+			{
+				Meshlet Closed;
+				Closed.VertexOffset = (UINT)Mesh.MeshletVertices.size();
+				Closed.TriangleOffset = (UINT)(Mesh.MeshletTriangles.size() / 3);
+				Closed.VertexCount = (UINT)MeshletVertices.size();
+				Closed.TriangleCount = (UINT)MeshletTriangles.size();
+				Mesh.Meshlets.push_back(Closed);
+
+				for (size_t i = 0; i < MeshletTriangles.size(); ++i)
+				{
+					for (int c = 0; c < 3; ++c)
+						Mesh.MeshletTriangles.push_back((BYTE)LocalIndex[Indices[MeshletTriangles[i] * 3 + c]]);
+				}
+				for (size_t i = 0; i < MeshletVertices.size(); ++i)
+				{
+					Mesh.MeshletVertices.push_back(MeshletVertices[i]);
+					LocalIndex[MeshletVertices[i]] = -1;
+				}
+				MeshletVertices.clear();
+				MeshletTriangles.clear();
+				CentroidSum = XMVectorZero();
+			}
+
+			while (Seed < TriangleCount && Emitted[Seed])
+				Seed++;
+			if (Seed == TriangleCount)
+				break;
+			Best = Seed;
+		}
+
+		Emitted[Best] = true;
+		MeshletTriangles.push_back(Best);
+		CentroidSum += XMLoadFloat3(&Centroids[Best]);
+		for (int c = 0; c < 3; ++c)
+		{
+			UINT v = Indices[Best * 3 + c];
+			if (LocalIndex[v] < 0)
+			{
+				LocalIndex[v] = (int)MeshletVertices.size();
+				MeshletVertices.push_back(v);
+			}
+		}
+	}
+
+	// A sphere around the meshlet's vertices and a cone around its triangles' normals
+	Mesh.Bounds.resize(Mesh.Meshlets.size());
+	for (size_t m = 0; m < Mesh.Meshlets.size(); ++m)
+	{
+		const Meshlet &Cluster = Mesh.Meshlets[m];
+		MeshletBounds &Bounds = Mesh.Bounds[m];
+
+		XMVECTOR Center = XMVectorZero();
+		for (UINT i = 0; i < Cluster.VertexCount; ++i)
+			Center += XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + i]].pos);
+		Center /= (float)Cluster.VertexCount;
+
+		float Radius = 0.0f;
+		for (UINT i = 0; i < Cluster.VertexCount; ++i)
+		{
+			XMVECTOR Position = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + i]].pos);
+			Radius = max(Radius, XMVectorGetX(XMVector3Length(Position - Center)));
+		}
+		XMStoreFloat3(&Bounds.Center, Center);
+		Bounds.Radius = Radius;
+
+		const BYTE *Corners = &Mesh.MeshletTriangles[Cluster.TriangleOffset * 3];
+		XMVECTOR Axis = XMVectorZero();
+		for (UINT t = 0; t < Cluster.TriangleCount; ++t)
+		{
+			XMVECTOR P0 = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[t * 3]]].pos);
+			XMVECTOR P1 = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[t * 3 + 1]]].pos);
+			XMVECTOR P2 = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[t * 3 + 2]]].pos);
+			Axis += XMVector3Normalize(XMVector3Cross(P1 - P0, P2 - P0));
+		}
+		Axis = XMVector3Normalize(Axis);
+
+		float MinDot = 1.0f;
+		for (UINT t = 0; t < Cluster.TriangleCount; ++t)
+		{
+			XMVECTOR P0 = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[t * 3]]].pos);
+			XMVECTOR P1 = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[t * 3 + 1]]].pos);
+			XMVECTOR P2 = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[t * 3 + 2]]].pos);
+			MinDot = min(MinDot, XMVectorGetX(XMVector3Dot(XMVector3Normalize(XMVector3Cross(P1 - P0, P2 - P0)), Axis)));
+		}
+
+		// Every normal is within acos(MinDot) of the axis, so a view direction within 90 degrees minus that of it sees
+		// every triangle's back. Its cosine is MinDot's sine.
+		XMStoreFloat3(&Bounds.ConeAxis, Axis);
+		Bounds.ConeCutoff = MinDot <= 0.0f ? 1.0f : sqrtf(1.0f - MinDot * MinDot);
+	}
+}
+
+bool WriteClusterMesh(const char *Path, const ClusterMesh &Mesh)
+{
+	FILE *File;
+	if (fopen_s(&File, Path, "wb") != 0)
+	{
+		printf("Could not open %s\n", Path);
+		return false;
+	}
+
+	MeshletFileHeader Header = {};
+	memcpy(Header.Magic, MESHLET_FILE_MAGIC, 4);
+	Header.Version = MESHLET_FILE_VERSION;
+	Header.VertexCount = (UINT)Mesh.Vertices.size();
+	Header.MeshletCount = (UINT)Mesh.Meshlets.size();
+	Header.MeshletVertexCount = (UINT)Mesh.MeshletVertices.size();
+	Header.MeshletTriangleCount = (UINT)Mesh.MeshletTriangles.size() / 3;
+	Header.LightmapSize = Mesh.LightmapUVs.empty() ? 0 : Mesh.LightmapSize;
+
+	fwrite(&Header, sizeof(Header), 1, File);
+	fwrite(Mesh.Vertices.data(), sizeof(Vertex), Mesh.Vertices.size(), File);
+	fwrite(Mesh.Meshlets.data(), sizeof(Meshlet), Mesh.Meshlets.size(), File);
+	fwrite(Mesh.Bounds.data(), sizeof(MeshletBounds), Mesh.Bounds.size(), File);
+	fwrite(Mesh.MeshletVertices.data(), sizeof(UINT), Mesh.MeshletVertices.size(), File);
+	fwrite(Mesh.MeshletTriangles.data(), 1, Mesh.MeshletTriangles.size(), File);
+	if (Header.LightmapSize)
+		fwrite(Mesh.LightmapUVs.data(), sizeof(XMFLOAT2), Mesh.LightmapUVs.size(), File);
+	fclose(File);
+	return true;
+}
+
+bool LoadClusterMesh(const char *Path, ClusterMesh &Mesh)
+{
+	FILE *File;
+	if (fopen_s(&File, Path, "rb") != 0)
+		return false;
+
+	MeshletFileHeader Header;
+	bool Valid = fread(&Header, sizeof(Header), 1, File) == 1 && memcmp(Header.Magic, MESHLET_FILE_MAGIC, 4) == 0 &&
+		Header.Version == MESHLET_FILE_VERSION;
+	if (Valid)
+	{
+		Mesh.Vertices.resize(Header.VertexCount);
+		Mesh.Meshlets.resize(Header.MeshletCount);
+		Mesh.Bounds.resize(Header.MeshletCount);
+		Mesh.MeshletVertices.resize(Header.MeshletVertexCount);
+		Mesh.MeshletTriangles.resize(Header.MeshletTriangleCount * 3);
+		Mesh.TriangleCount = Header.MeshletTriangleCount;
+		Mesh.LightmapUVs.resize(Header.LightmapSize ? Header.MeshletVertexCount : 0);
+		Mesh.LightmapSize = Header.LightmapSize;
+		Valid = fread(Mesh.Vertices.data(), sizeof(Vertex), Mesh.Vertices.size(), File) == Mesh.Vertices.size() &&
+			fread(Mesh.Meshlets.data(), sizeof(Meshlet), Mesh.Meshlets.size(), File) == Mesh.Meshlets.size() &&
+			fread(Mesh.Bounds.data(), sizeof(MeshletBounds), Mesh.Bounds.size(), File) == Mesh.Bounds.size() &&
+			fread(Mesh.MeshletVertices.data(), sizeof(UINT), Mesh.MeshletVertices.size(), File) == Mesh.MeshletVertices.size() &&
+			fread(Mesh.MeshletTriangles.data(), 1, Mesh.MeshletTriangles.size(), File) == Mesh.MeshletTriangles.size() &&
+			fread(Mesh.LightmapUVs.data(), sizeof(XMFLOAT2), Mesh.LightmapUVs.size(), File) == Mesh.LightmapUVs.size();
+	}
+	fclose(File);
+
+	if (!Valid)
+		printf("%s is not a mesh this build can read\n", Path);
+	return Valid;
+}
+
+void PrepareMeshletCulling(ClusterMesh &Mesh)
+{
+	// Padded to whole vectors, the padding is never read as a meshlet
+	int Count = (int)Mesh.Bounds.size();
+	size_t Bytes = ((Count + 7) & ~7) * sizeof(float);
+	float **Streams[8] = { &Mesh.CenterX, &Mesh.CenterY, &Mesh.CenterZ, &Mesh.Radius, &Mesh.ConeX, &Mesh.ConeY, &Mesh.ConeZ, &Mesh.ConeCutoff };
+	for (int s = 0; s < 8; ++s)
+		*Streams[s] = (float *)_aligned_malloc(max(Bytes, (size_t)32), 32);
+
+	for (int i = 0; i < Count; ++i)
+	{
+		const MeshletBounds &Bounds = Mesh.Bounds[i];
+		Mesh.CenterX[i] = Bounds.Center.x;
+		Mesh.CenterY[i] = Bounds.Center.y;
+		Mesh.CenterZ[i] = Bounds.Center.z;
+		Mesh.Radius[i] = Bounds.Radius;
+		Mesh.ConeX[i] = Bounds.ConeAxis.x;
+		Mesh.ConeY[i] = Bounds.ConeAxis.y;
+		Mesh.ConeZ[i] = Bounds.ConeAxis.z;
+		Mesh.ConeCutoff[i] = Bounds.ConeCutoff;
+	}
+
+	Mesh.Visible.resize(Count);
+	Mesh.Chunks.resize((Count + MESHLET_CULL_CHUNK - 1) / MESHLET_CULL_CHUNK);
+}
+
+void ReleaseClusterMesh(ClusterMesh &Mesh)
+{
+	float **Streams[8] = { &Mesh.CenterX, &Mesh.CenterY, &Mesh.CenterZ, &Mesh.Radius, &Mesh.ConeX, &Mesh.ConeY, &Mesh.ConeZ, &Mesh.ConeCutoff };
+	for (int s = 0; s < 8; ++s)
+	{
+		_aligned_free(*Streams[s]);
+		*Streams[s] = NULL;
+	}
+}
+
+struct MeshletCullJob
+{
+	ClusterMesh *Mesh;
+	// Inward frustum planes in the mesh's space, normalized
+	XMFLOAT4 Planes[6];
+	XMFLOAT3 Camera;
+	bool Cull;
+	DWORD *Indices;
+};
+
+static void CullMeshletChunks(void *Data, int BeginChunk, int EndChunk)
+{
+	MeshletCullJob *Job = (MeshletCullJob *)Data;
+	ClusterMesh &Mesh = *Job->Mesh;
+	const XMFLOAT4 *Planes = Job->Planes;
+	const XMFLOAT3 &Camera = Job->Camera;
+	int Count = (int)Mesh.Meshlets.size();
+
+	for (int Chunk = BeginChunk; Chunk < EndChunk; ++Chunk)
+	{
+		MeshletCullChunk &Result = Mesh.Chunks[Chunk];
+		int Begin = Chunk * MESHLET_CULL_CHUNK;
+		int End = min(Begin + MESHLET_CULL_CHUNK, Count);
+		int *Visible = &Mesh.Visible[Begin];
+		int VisibleCount = 0;
+		UINT FrustumCulled = 0, BackfaceCulled = 0, Indices = 0;
+		int i = Begin;
+
+		if (!Job->Cull)
+		{
+			for (; i < End; ++i)
+			{
+				Visible[VisibleCount++] = i;
+				Indices += Mesh.Meshlets[i].TriangleCount * 3;
+			}
+		}
+
+#if defined(__AVX2__)
+		const __m256 CameraX = _mm256_set1_ps(Camera.x);
+		const __m256 CameraY = _mm256_set1_ps(Camera.y);
+		const __m256 CameraZ = _mm256_set1_ps(Camera.z);
+
+		for (; i + 8 <= End; i += 8)
+		{
+			__m256 CenterX = _mm256_load_ps(Mesh.CenterX + i);
+			__m256 CenterY = _mm256_load_ps(Mesh.CenterY + i);
+			__m256 CenterZ = _mm256_load_ps(Mesh.CenterZ + i);
+			__m256 Radius = _mm256_load_ps(Mesh.Radius + i);
+			__m256 NegativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), Radius);
+
+			// Outside once the center is further than the radius behind any plane
+			__m256 Outside = _mm256_setzero_ps();
+			for (int p = 0; p < 6; ++p)
+			{
+				__m256 Distance = _mm256_fmadd_ps(CenterX, _mm256_set1_ps(Planes[p].x), _mm256_set1_ps(Planes[p].w));
+				Distance = _mm256_fmadd_ps(CenterY, _mm256_set1_ps(Planes[p].y), Distance);
+				Distance = _mm256_fmadd_ps(CenterZ, _mm256_set1_ps(Planes[p].z), Distance);
+				Outside = _mm256_or_ps(Outside, _mm256_cmp_ps(Distance, NegativeRadius, _CMP_LT_OQ));
+			}
+
+			__m256 ViewX = _mm256_sub_ps(CenterX, CameraX);
+			__m256 ViewY = _mm256_sub_ps(CenterY, CameraY);
+			__m256 ViewZ = _mm256_sub_ps(CenterZ, CameraZ);
+			__m256 ViewLength = _mm256_sqrt_ps(_mm256_fmadd_ps(ViewX, ViewX, _mm256_fmadd_ps(ViewY, ViewY, _mm256_mul_ps(ViewZ, ViewZ))));
+			__m256 Along = _mm256_fmadd_ps(ViewX, _mm256_load_ps(Mesh.ConeX + i),
+				_mm256_fmadd_ps(ViewY, _mm256_load_ps(Mesh.ConeY + i), _mm256_mul_ps(ViewZ, _mm256_load_ps(Mesh.ConeZ + i))));
+			__m256 Backfacing = _mm256_cmp_ps(Along, _mm256_fmadd_ps(_mm256_load_ps(Mesh.ConeCutoff + i), ViewLength, Radius), _CMP_GT_OQ);
+
+			int OutsideMask = _mm256_movemask_ps(Outside);
+			int BackfacingMask = _mm256_movemask_ps(Backfacing) & ~OutsideMask;
+			int VisibleMask = ~(OutsideMask | BackfacingMask) & 0xff;
+			while (OutsideMask)
+			{
+				unsigned long Lane;
+				_BitScanForward(&Lane, OutsideMask);
+				FrustumCulled += Mesh.Meshlets[i + Lane].TriangleCount;
+				OutsideMask &= OutsideMask - 1;
+			}
+			while (BackfacingMask)
+			{
+				unsigned long Lane;
+				_BitScanForward(&Lane, BackfacingMask);
+				BackfaceCulled += Mesh.Meshlets[i + Lane].TriangleCount;
+				BackfacingMask &= BackfacingMask - 1;
+			}
+			while (VisibleMask)
+			{
+				unsigned long Lane;
+				_BitScanForward(&Lane, VisibleMask);
+				Visible[VisibleCount++] = i + (int)Lane;
+				Indices += Mesh.Meshlets[i + Lane].TriangleCount * 3;
+				VisibleMask &= VisibleMask - 1;
+			}
+		}
+#endif
+
+		for (; i < End; ++i)
+		{
+			bool Outside = false;
+			for (int p = 0; p < 6; ++p)
+			{
+				float Distance = Mesh.CenterX[i] * Planes[p].x + Mesh.CenterY[i] * Planes[p].y + Mesh.CenterZ[i] * Planes[p].z + Planes[p].w;
+				Outside |= Distance < -Mesh.Radius[i];
+			}
+			if (Outside)
+			{
+				FrustumCulled += Mesh.Meshlets[i].TriangleCount;
+				continue;
+			}
+
+			float ViewX = Mesh.CenterX[i] - Camera.x;
+			float ViewY = Mesh.CenterY[i] - Camera.y;
+			float ViewZ = Mesh.CenterZ[i] - Camera.z;
+			float ViewLength = sqrtf(ViewX * ViewX + ViewY * ViewY + ViewZ * ViewZ);
+			float Along = ViewX * Mesh.ConeX[i] + ViewY * Mesh.ConeY[i] + ViewZ * Mesh.ConeZ[i];
+			if (Along > Mesh.ConeCutoff[i] * ViewLength + Mesh.Radius[i])
+			{
+				BackfaceCulled += Mesh.Meshlets[i].TriangleCount;
+				continue;
+			}
+
+			Visible[VisibleCount++] = i;
+			Indices += Mesh.Meshlets[i].TriangleCount * 3;
+		}
+
+		Result.VisibleCount = VisibleCount;
+		Result.IndexCount = Indices;
+		Result.FrustumCulledTriangles = FrustumCulled;
+		Result.BackfaceCulledTriangles = BackfaceCulled;
+	}
+}
+
+// Every chunk writes its visible triangles at the offset the chunks before it left
+static void EmitMeshletChunks(void *Data, int BeginChunk, int EndChunk)
+{
+	MeshletCullJob *Job = (MeshletCullJob *)Data;
+	const ClusterMesh &Mesh = *Job->Mesh;
+
+	for (int Chunk = BeginChunk; Chunk < EndChunk; ++Chunk)
+	{
+		const MeshletCullChunk &Result = Mesh.Chunks[Chunk];
+		const int *Visible = &Mesh.Visible[Chunk * MESHLET_CULL_CHUNK];
+		DWORD *Out = Job->Indices + Result.IndexOffset;
+
+		for (int v = 0; v < Result.VisibleCount; ++v)
+		{
+			const Meshlet &Cluster = Mesh.Meshlets[Visible[v]];
+			const UINT *ClusterVertices = &Mesh.MeshletVertices[Cluster.VertexOffset];
+			const BYTE *Corners = &Mesh.MeshletTriangles[Cluster.TriangleOffset * 3];
+			if (Mesh.LightmapUVs.empty())
+			{
+				for (UINT c = 0; c < Cluster.TriangleCount * 3; ++c)
+					*Out++ = ClusterVertices[Corners[c]];
+			}
+			else
+			{
+				for (UINT c = 0; c < Cluster.TriangleCount * 3; ++c)
+					*Out++ = Cluster.VertexOffset + Corners[c];
+			}
+		}
+	}
+}
+
+UINT CullMeshlets(ClusterMesh &Mesh, CXMMATRIX WorldViewProjection, FXMVECTOR MeshCamera, bool Cull, DWORD *Indices, MeshletCullStats &Stats)
+{
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	MeshletCullJob Job;
+	Job.Mesh = &Mesh;
+	Job.Cull = Cull;
+	Job.Indices = Indices;
+	XMStoreFloat3(&Job.Camera, MeshCamera);
+
+	// Frustum planes of a row vector matrix, pointing inwards. Depth goes from 0 to w.
+	XMMATRIX Columns = XMMatrixTranspose(WorldViewProjection);
+	XMStoreFloat4(&Job.Planes[0], XMPlaneNormalize(XMVectorAdd(Columns.r[3], Columns.r[0])));
+	XMStoreFloat4(&Job.Planes[1], XMPlaneNormalize(XMVectorSubtract(Columns.r[3], Columns.r[0])));
+	XMStoreFloat4(&Job.Planes[2], XMPlaneNormalize(XMVectorAdd(Columns.r[3], Columns.r[1])));
+	XMStoreFloat4(&Job.Planes[3], XMPlaneNormalize(XMVectorSubtract(Columns.r[3], Columns.r[1])));
+	XMStoreFloat4(&Job.Planes[4], XMPlaneNormalize(Columns.r[2]));
+	XMStoreFloat4(&Job.Planes[5], XMPlaneNormalize(XMVectorSubtract(Columns.r[3], Columns.r[2])));
+
+	int ChunkCount = (int)Mesh.Chunks.size();
+	ParallelFor(ChunkCount, 1, CullMeshletChunks, &Job);
+
+	UINT IndexCount = 0;
+	Stats = MeshletCullStats();
+	for (int c = 0; c < ChunkCount; ++c)
+	{
+		MeshletCullChunk &Result = Mesh.Chunks[c];
+		Result.IndexOffset = IndexCount;
+		IndexCount += Result.IndexCount;
+		Stats.VisibleMeshlets += Result.VisibleCount;
+		Stats.FrustumCulledTriangles += Result.FrustumCulledTriangles;
+		Stats.BackfaceCulledTriangles += Result.BackfaceCulledTriangles;
+	}
+
+	if (Indices)
+		ParallelFor(ChunkCount, 1, EmitMeshletChunks, &Job);
+
+	QueryPerformanceCounter(&End);
+	Stats.Meshlets = (int)Mesh.Meshlets.size();
+	Stats.Triangles = Mesh.TriangleCount;
+	Stats.CullMs = double(End.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+	return IndexCount;
+}
+
+// A torus with a ripple over it, fine enough that one draw of it is a few hundred thousand triangles
+void BuildMeshletTestMesh(std::vector<Vertex> &Vertices, std::vector<DWORD> &Indices)
+{
+	const int Rings = 512, Sides = 192;
+	const float MajorRadius = 6.0f, MinorRadius = 2.0f;
+	const float TwoPi = 6.2831853f;
+
+	Vertices.clear();
+	Indices.clear();
+	for (int r = 0; r < Rings; ++r)
+	{
+		for (int s = 0; s < Sides; ++s)
+		{
+			float U = TwoPi * r / Rings, V = TwoPi * s / Sides;
+			float Minor = MinorRadius * (1.0f + 0.08f * sinf(12.0f * U) * sinf(9.0f * V));
+			float Ring = MajorRadius + Minor * cosf(V);
+			Vertices.push_back(Vertex(Ring * cosf(U), Minor * sinf(V), Ring * sinf(U), 8.0f * r / Rings, 2.0f * s / Sides, 0.0f, 0.0f, 0.0f));
+		}
+	}
+
+	for (int r = 0; r < Rings; ++r)
+	{
+		for (int s = 0; s < Sides; ++s)
+		{
+			DWORD Corners[4] = { (DWORD)(r * Sides + s), (DWORD)(((r + 1) % Rings) * Sides + s),
+				(DWORD)(((r + 1) % Rings) * Sides + (s + 1) % Sides), (DWORD)(r * Sides + (s + 1) % Sides) };
+			DWORD Triangles[2][3] = { { Corners[0], Corners[1], Corners[2] }, { Corners[0], Corners[2], Corners[3] } };
+
+			// Wound so the face normal points away from the tube's middle, which the cull mode takes as the front
+			float U = TwoPi * (r + 0.5f) / Rings;
+			XMVECTOR TubeMiddle = XMVectorSet(MajorRadius * cosf(U), 0.0f, MajorRadius * sinf(U), 0.0f);
+			for (int t = 0; t < 2; ++t)
+			{
+				XMVECTOR P0 = XMLoadFloat3(&Vertices[Triangles[t][0]].pos);
+				XMVECTOR P1 = XMLoadFloat3(&Vertices[Triangles[t][1]].pos);
+				XMVECTOR P2 = XMLoadFloat3(&Vertices[Triangles[t][2]].pos);
+				if (XMVectorGetX(XMVector3Dot(XMVector3Cross(P1 - P0, P2 - P0), P0 - TubeMiddle)) < 0.0f)
+					std::swap(Triangles[t][1], Triangles[t][2]);
+				Indices.insert(Indices.end(), Triangles[t], Triangles[t] + 3);
+			}
+		}
+	}
+
+	// Smooth normals, the face normals around every vertex weighted by their area
+	for (size_t i = 0; i < Indices.size(); i += 3)
+	{
+		XMVECTOR P0 = XMLoadFloat3(&Vertices[Indices[i]].pos);
+		XMVECTOR P1 = XMLoadFloat3(&Vertices[Indices[i + 1]].pos);
+		XMVECTOR P2 = XMLoadFloat3(&Vertices[Indices[i + 2]].pos);
+		XMVECTOR Normal = XMVector3Cross(P1 - P0, P2 - P0);
+		for (int c = 0; c < 3; ++c)
+			XMStoreFloat3(&Vertices[Indices[i + c]].normal, XMLoadFloat3(&Vertices[Indices[i + c]].normal) + Normal);
+	}
+	for (size_t i = 0; i < Vertices.size(); ++i)
+		XMStoreFloat3(&Vertices[i].normal, XMVector3Normalize(XMLoadFloat3(&Vertices[i].normal)));
+}
+
+bool CookMeshletMesh(const char *Path)
+{
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	std::vector<Vertex> Vertices;
+	std::vector<DWORD> Indices;
+	BuildMeshletTestMesh(Vertices, Indices);
+
+	ClusterMesh Mesh = {};
+	BuildMeshlets(Vertices, Indices, Mesh);
+	if (!WriteClusterMesh(Path, Mesh))
+		return false;
+
+	QueryPerformanceCounter(&End);
+	printf("Cooked %s: %d vertices, %u triangles in %d meshlets, %.1f triangles and %.1f vertices per meshlet, %.2f s\n", Path,
+		(int)Vertices.size(), Mesh.TriangleCount, (int)Mesh.Meshlets.size(), (double)Mesh.TriangleCount / max((int)Mesh.Meshlets.size(), 1),
+		(double)Mesh.MeshletVertices.size() / max((int)Mesh.Meshlets.size(), 1), double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart);
+	return true;
+}
+
+XMMATRIX ClusterMeshWorld()
+{
+	return XMMatrixRotationX(0.5f) * XMMatrixTranslation(0.0f, 4.0f, 24.0f);
+}
+
+bool InitMeshlets()
+{
+	// Like the scene and the terrain, the mesh is only there when it was cooked
+	MeshletsLoaded = LoadClusterMesh(MeshPath, BigMesh);
+	if (!MeshletsLoaded)
+		return true;
+	PrepareMeshletCulling(BigMesh);
+	BigMeshWorld = ClusterMeshWorld();
+
+	// An unwrapped mesh is drawn from its meshlet vertices, which carry the lightmap UVs in a second stream
+	std::vector<Vertex> MeshletVertices;
+	if (!BigMesh.LightmapUVs.empty())
+	{
+		MeshletVertices.resize(BigMesh.MeshletVertices.size());
+		for (size_t i = 0; i < MeshletVertices.size(); ++i)
+			MeshletVertices[i] = BigMesh.Vertices[BigMesh.MeshletVertices[i]];
+	}
+	const std::vector<Vertex> &DrawnVertices = BigMesh.LightmapUVs.empty() ? BigMesh.Vertices : MeshletVertices;
+
+	D3D11_BUFFER_DESC BufferDesc = {};
+	BufferDesc.Usage = D3D11_USAGE_DEFAULT;
+	BufferDesc.ByteWidth = (UINT)(sizeof(Vertex) * DrawnVertices.size());
+	BufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	D3D11_SUBRESOURCE_DATA BufferData = {};
+	BufferData.pSysMem = DrawnVertices.data();
+	HR(D3D11Device->CreateBuffer(&BufferDesc, &BufferData, &BigMeshVertexBuffer));
+
+	BigMeshLightmapUVBuffer = NULL;
+	if (!BigMesh.LightmapUVs.empty())
+	{
+		BufferDesc.ByteWidth = (UINT)(sizeof(XMFLOAT2) * BigMesh.LightmapUVs.size());
+		BufferData.pSysMem = BigMesh.LightmapUVs.data();
+		HR(D3D11Device->CreateBuffer(&BufferDesc, &BufferData, &BigMeshLightmapUVBuffer));
+	}
+
+	// Big enough for every triangle, which is what a frame with the culling off draws
+	D3D11_BUFFER_DESC IndexBufferDesc = {};
+	IndexBufferDesc.ByteWidth = BigMesh.TriangleCount * 3 * sizeof(DWORD);
+	IndexBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
+	IndexBufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+	IndexBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	HR(D3D11Device->CreateBuffer(&IndexBufferDesc, NULL, &BigMeshIndexBuffer));
+	return true;
+}
+
+void ReleaseMeshlets()
+{
+	if (!MeshletsLoaded)
+		return;
+	ReleaseClusterMesh(BigMesh);
+	BigMeshVertexBuffer->Release();
+	BigMeshIndexBuffer->Release();
+	if (BigMeshLightmapUVBuffer)
+		BigMeshLightmapUVBuffer->Release();
+}
+
+void CullBigMesh()
+{
+	BigMeshIndexCount = 0;
+	DWORD *Indices = (DWORD *)MapDiscard(BigMeshIndexBuffer);
+	if (!Indices)
+		return;
+	// The camera in the mesh's space, where the bounds are
+	XMVECTOR MeshCamera = XMVector3TransformCoord(CameraPosition, XMMatrixInverse(NULL, BigMeshWorld));
+	MeshletCullStats Stats;
+	BigMeshIndexCount = CullMeshlets(BigMesh, BigMeshWorld * CameraView * CameraProjection, MeshCamera, ClusterCulling, Indices, Stats);
+	Unmap(BigMeshIndexBuffer, BigMeshIndexCount * sizeof(DWORD));
+
+	MeshletFramesThisSecond++;
+	MeshletCullMsThisSecond += Stats.CullMs;
+	MeshletTrianglesThisSecond += Stats.Triangles;
+	MeshletFrustumCulledThisSecond += Stats.FrustumCulledTriangles;
+	MeshletBackfaceCulledThisSecond += Stats.BackfaceCulledTriangles;
+}
+
+// Draws what CullBigMesh left of the mesh this frame
+void MeshletPass()
+{
+	if (!MeshletsLoaded || BigMeshIndexCount == 0)
+		return;
+
+	ID3D11RenderTargetView *SceneTargetView = FrameGraph.Resources[RGSceneColor].RTV;
+	ID3D11DepthStencilView *DepthStencilView = FrameGraph.Resources[RGDepth].DSV;
+
+	D3D11_VIEWPORT Viewport = {};
+	Viewport.Width = (FLOAT)ScaledWidth;
+	Viewport.Height = (FLOAT)ScaledHeight;
+	Viewport.MinDepth = 0.0f;
+	Viewport.MaxDepth = 1.0f;
+
+	BuildObjectConstants(BigMeshWorld, CameraView, CameraProjection, cbPerObj);
+	UploadSubresource(cbPerObjectBuffer, &cbPerObj, sizeof(cbPerObject));
+
+	UINT Stride = sizeof(Vertex);
+	UINT Offset = 0;
+	Bind()->RSSetViewports(1, &Viewport);
+	Bind()->RSSetState(CWCullMode);
+	Bind()->OMSetRenderTargets(1, &SceneTargetView, DepthStencilView);
+	Bind()->OMSetBlendState(0, 0, 0xffffffff);
+	if (LightmapLoaded)
+	{
+		// The lightmap UVs come in a second stream, ScenePass bound the lightmap itself
+		ID3D11Buffer *Buffers[2] = { BigMeshVertexBuffer, BigMeshLightmapUVBuffer };
+		UINT Strides[2] = { sizeof(Vertex), sizeof(XMFLOAT2) };
+		UINT Offsets[2] = { 0, 0 };
+		Bind()->IASetInputLayout(LightmappedVertexLayout);
+		Bind()->IASetVertexBuffers(0, 2, Buffers, Strides, Offsets);
+		Bind()->VSSetShader(LightmappedVS, 0, 0);
+		Bind()->PSSetShader(LightmappedPS, 0, 0);
+	}
+	else
+	{
+		Bind()->IASetInputLayout(VertexLayout);
+		Bind()->IASetVertexBuffers(0, 1, &BigMeshVertexBuffer, &Stride, &Offset);
+		Bind()->VSSetShader(VertexShader, 0, 0);
+		Bind()->PSSetShader(GetPixelShaderPermutation(SHADER_ENTRY_PS, LitShaderFeatures(light)), 0, 0);
+	}
+	Bind()->IASetIndexBuffer(BigMeshIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	Bind()->VSSetConstantBuffers(0, 1, &cbPerObjectBuffer);
+	Bind()->PSSetConstantBuffers(0, 1, &cbPerFrameBuffer);
+	Bind()->PSSetShaderResources(0, 1, &CubeTexture);
+	Bind()->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+	DrawCall()->DrawIndexed(BigMeshIndexCount, 0, 0);
+
+	Bind()->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
+	Bind()->IASetIndexBuffer(SquareIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+	Bind()->PSSetShader(PixelShader, 0, 0);
+	if (LightmapLoaded)
+	{
+		Bind()->IASetInputLayout(VertexLayout);
+		Bind()->VSSetShader(VertexShader, 0, 0);
+	}
+}
+
+// Rotated so the smallest index comes first, which keeps the winding, and packed 21 bits an index
+static UINT64 MeshletTriangleKey(const DWORD *Corners)
+{
+	int First = Corners[1] < Corners[0] && Corners[1] < Corners[2] ? 1 : Corners[2] < Corners[0] && Corners[2] < Corners[1] ? 2 : 0;
+	return ((UINT64)Corners[First] << 42) | ((UINT64)Corners[(First + 1) % 3] << 21) | Corners[(First + 2) % 3];
+}
+
+// The brute force reference of the last CullMeshlets: every triangle of a meshlet it rejected has to have all three
+// corners outside one clip plane, or face away from Eye. Returns the triangles that do neither, Rejected is how many
+// were checked and KeptIndices the indices of the meshlets it kept.
+static int CountWronglyCulledTriangles(const ClusterMesh &Mesh, const std::vector<Vertex> &Vertices, CXMMATRIX ViewProjection,
+	FXMVECTOR Eye, UINT64 &Rejected, UINT &KeptIndices)
+{
+	int MeshletCount = (int)Mesh.Meshlets.size();
+	std::vector<bool> Kept(MeshletCount, false);
+	for (size_t c = 0; c < Mesh.Chunks.size(); ++c)
+	{
+		for (int v = 0; v < Mesh.Chunks[c].VisibleCount; ++v)
+			Kept[Mesh.Visible[c * MESHLET_CULL_CHUNK + v]] = true;
+	}
+
+	int Wrong = 0;
+	Rejected = 0;
+	KeptIndices = 0;
+	for (int m = 0; m < MeshletCount; ++m)
+	{
+		const Meshlet &Cluster = Mesh.Meshlets[m];
+		if (Kept[m])
+		{
+			KeptIndices += Cluster.TriangleCount * 3;
+			continue;
+		}
+
+		const BYTE *Corners = &Mesh.MeshletTriangles[Cluster.TriangleOffset * 3];
+		for (UINT t = 0; t < Cluster.TriangleCount; ++t)
+		{
+			XMVECTOR P[3];
+			XMFLOAT4 Clip[3];
+			for (int c = 0; c < 3; ++c)
+			{
+				P[c] = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[t * 3 + c]]].pos);
+				XMStoreFloat4(&Clip[c], XMVector4Transform(XMVectorSetW(P[c], 1.0f), ViewProjection));
+			}
+
+			// Corners within rounding of a plane still count as outside it
+			int Out[6] = {};
+			for (int c = 0; c < 3; ++c)
+			{
+				float Slack = 1e-4f * fabsf(Clip[c].w) + 1e-5f;
+				Out[0] += Clip[c].x < -Clip[c].w + Slack;
+				Out[1] += Clip[c].x > Clip[c].w - Slack;
+				Out[2] += Clip[c].y < -Clip[c].w + Slack;
+				Out[3] += Clip[c].y > Clip[c].w - Slack;
+				Out[4] += Clip[c].z < Slack;
+				Out[5] += Clip[c].z > Clip[c].w - Slack;
+			}
+			bool Outside = false;
+			for (int p = 0; p < 6; ++p)
+				Outside |= Out[p] == 3;
+
+			XMVECTOR Normal = XMVector3Cross(P[1] - P[0], P[2] - P[0]);
+			XMVECTOR View = P[0] - Eye;
+			float Facing = XMVectorGetX(XMVector3Dot(View, Normal));
+			bool Backfacing = Facing > -1e-4f * XMVectorGetX(XMVector3Length(View)) * XMVectorGetX(XMVector3Length(Normal));
+
+			Rejected++;
+			Wrong += !Outside && !Backfacing;
+		}
+	}
+	return Wrong;
+}
+
+// Checks the meshlets cover the mesh and hold their limits and bounds, then culls them from a camera circling the mesh
+// and reports how much of it was thrown away before any triangle reached the device. Every view's rejections are
+// checked triangle by triangle against the brute force reference.
+int RunMeshletTest()
+{
+	std::vector<Vertex> Vertices;
+	std::vector<DWORD> Indices;
+	BuildMeshletTestMesh(Vertices, Indices);
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+	ClusterMesh Mesh = {};
+	BuildMeshlets(Vertices, Indices, Mesh);
+	QueryPerformanceCounter(&End);
+	PrepareMeshletCulling(Mesh);
+
+	int MeshletCount = (int)Mesh.Meshlets.size();
+	printf("Meshlet test: %d triangles in %d meshlets, %.1f triangles and %.1f vertices per meshlet, built in %.2f s\n",
+		Mesh.TriangleCount, MeshletCount, (double)Mesh.TriangleCount / max(MeshletCount, 1),
+		(double)Mesh.MeshletVertices.size() / max(MeshletCount, 1), double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart);
+
+	// Every triangle once, inside the limits, its vertices inside the sphere and its normal inside the cone
+	int Failures = 0;
+	std::vector<int> Seen(Mesh.TriangleCount, 0);
+	std::vector<DWORD> Emitted(Mesh.TriangleCount * 3);
+	MeshletCullStats Stats;
+	UINT IndexCount = CullMeshlets(Mesh, XMMatrixIdentity(), XMVectorZero(), false, Emitted.data(), Stats);
+	if (IndexCount != Mesh.TriangleCount * 3)
+		Failures++;
+
+	std::map<UINT64, int> TriangleIds;
+	for (UINT t = 0; t < Mesh.TriangleCount; ++t)
+		TriangleIds[MeshletTriangleKey(&Indices[t * 3])] = t;
+	for (UINT i = 0; i + 2 < IndexCount; i += 3)
+	{
+		std::map<UINT64, int>::iterator Found = TriangleIds.find(MeshletTriangleKey(&Emitted[i]));
+		if (Found == TriangleIds.end())
+			Failures++;
+		else
+			Seen[Found->second]++;
+	}
+	for (UINT t = 0; t < Mesh.TriangleCount; ++t)
+		Failures += Seen[t] != 1;
+
+	for (int m = 0; m < MeshletCount; ++m)
+	{
+		const Meshlet &Cluster = Mesh.Meshlets[m];
+		const MeshletBounds &Bounds = Mesh.Bounds[m];
+		if (Cluster.VertexCount > MESHLET_MAX_VERTICES || Cluster.TriangleCount > MESHLET_MAX_TRIANGLES)
+			Failures++;
+
+		XMVECTOR Center = XMLoadFloat3(&Bounds.Center);
+		XMVECTOR Axis = XMLoadFloat3(&Bounds.ConeAxis);
+		float MinDot = sqrtf(max(1.0f - Bounds.ConeCutoff * Bounds.ConeCutoff, 0.0f));
+		const BYTE *Corners = &Mesh.MeshletTriangles[Cluster.TriangleOffset * 3];
+		for (UINT t = 0; t < Cluster.TriangleCount; ++t)
+		{
+			XMVECTOR P[3];
+			for (int c = 0; c < 3; ++c)
+			{
+				P[c] = XMLoadFloat3(&Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[t * 3 + c]]].pos);
+				if (XMVectorGetX(XMVector3Length(P[c] - Center)) > Bounds.Radius * 1.0001f + 1e-5f)
+					Failures++;
+			}
+			XMVECTOR Normal = XMVector3Normalize(XMVector3Cross(P[1] - P[0], P[2] - P[0]));
+			if (Bounds.ConeCutoff < 1.0f && XMVectorGetX(XMVector3Dot(Normal, Axis)) < MinDot - 1e-4f)
+				Failures++;
+		}
+	}
+
+	// Around the mesh at a few heights and distances, every other view from the hole looking along the ring
+	const int Views = 64;
+	const int Repeats = 20;
+	std::vector<DWORD> Compacted(Mesh.TriangleCount * 3);
+	XMMATRIX Projection = XMMatrixPerspectiveFovLH(0.4f * 3.14f, (float)Width / Height, 0.5f, 1000.0f);
+	XMVECTOR Up = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+	UINT64 Triangles = 0, FrustumCulled = 0, BackfaceCulled = 0, Checked = 0;
+	double CullMs = 0.0, WorstCullMs = 0.0;
+	int VisibleMeshlets = 0, WronglyCulled = 0, CountMismatches = 0;
+	for (int v = 0; v < Views; ++v)
+	{
+		float Angle = 6.2831853f * v / Views;
+		float Distance = v & 1 ? 2.0f : 14.0f + 6.0f * (v % 3);
+		float Height = 1.0f + 4.0f * ((v >> 1) % 3);
+		XMVECTOR Eye = XMVectorSet(Distance * cosf(Angle), Height, Distance * sinf(Angle), 0.0f);
+		XMVECTOR Target = v & 1 ? Eye + XMVectorSet(-sinf(Angle), -0.1f, cosf(Angle), 0.0f) : XMVectorZero();
+		XMMATRIX ViewProjection = XMMatrixLookAtLH(Eye, Target, Up) * Projection;
+
+		UINT ViewIndexCount = 0;
+		for (int r = 0; r < Repeats; ++r)
+		{
+			ViewIndexCount = CullMeshlets(Mesh, ViewProjection, Eye, true, Compacted.data(), Stats);
+			CullMs += Stats.CullMs;
+			WorstCullMs = max(WorstCullMs, Stats.CullMs);
+		}
+
+		UINT64 Rejected;
+		UINT KeptIndices;
+		int Wrong = CountWronglyCulledTriangles(Mesh, Vertices, ViewProjection, Eye, Rejected, KeptIndices);
+		if (Wrong > 0)
+			printf("  view %d: %d culled triangles are inside the frustum and facing the camera\n", v, Wrong);
+		WronglyCulled += Wrong;
+		Checked += Rejected;
+		CountMismatches += KeptIndices != ViewIndexCount || Rejected != Stats.FrustumCulledTriangles + Stats.BackfaceCulledTriangles;
+		Triangles += Stats.Triangles;
+		FrustumCulled += Stats.FrustumCulledTriangles;
+		BackfaceCulled += Stats.BackfaceCulledTriangles;
+		VisibleMeshlets += Stats.VisibleMeshlets;
+	}
+
+	printf("  %d views on %d job threads: %.1f%% of the triangles rejected, %.1f%% outside the frustum and %.1f%% facing away\n",
+		Views, JobThreadCount(), 100.0 * (FrustumCulled + BackfaceCulled) / Triangles, 100.0 * FrustumCulled / Triangles,
+		100.0 * BackfaceCulled / Triangles);
+	printf("  %.1f of %d meshlets drawn per view, %.3f ms culling and compaction per view, %.3f ms worst\n",
+		(double)VisibleMeshlets / Views, MeshletCount, CullMs / (Views * Repeats), WorstCullMs);
+
+	// A reference that never sees a rejection proves nothing
+	Failures += WronglyCulled > 0;
+	Failures += CountMismatches > 0;
+	Failures += Checked == 0;
+	printf("  %llu culled triangles checked against the reference, %d wrongly culled, %d views miscounted\n", Checked,
+		WronglyCulled, CountMismatches);
+	printf("  %d of the checks failed\n", Failures);
+
+	ReleaseClusterMesh(Mesh);
+	return Failures == 0 ? 0 : 1;
+}
+
+// A meshlet's chart: its vertices projected on the plane across its average normal, at the same density as every other
+struct LightmapChart
+{
+	XMFLOAT3 AxisU;
+	XMFLOAT3 AxisV;
+	float MinU;
+	float MinV;
+	float ExtentU;
+	float ExtentV;
+	int X;
+	int Y;
+};
+
+bool UnwrapLightmap(ClusterMesh &Mesh, int Size)
+{
+	int MeshletCount = (int)Mesh.Meshlets.size();
+	std::vector<LightmapChart> Charts(MeshletCount);
+	double ProjectedArea = 0.0;
+	for (int m = 0; m < MeshletCount; ++m)
+	{
+		const Meshlet &Cluster = Mesh.Meshlets[m];
+		const UINT *ClusterVertices = &Mesh.MeshletVertices[Cluster.VertexOffset];
+		const BYTE *Corners = &Mesh.MeshletTriangles[Cluster.TriangleOffset * 3];
+
+		// Area weighted. The meshlets' normal cones are narrow, so the projection folds a triangle over another
+		// only where a meshlet wraps around a sharp edge.
+		XMVECTOR Normal = XMVectorZero();
+		for (UINT t = 0; t < Cluster.TriangleCount; ++t)
+		{
+			XMVECTOR P0 = XMLoadFloat3(&Mesh.Vertices[ClusterVertices[Corners[t * 3]]].pos);
+			XMVECTOR P1 = XMLoadFloat3(&Mesh.Vertices[ClusterVertices[Corners[t * 3 + 1]]].pos);
+			XMVECTOR P2 = XMLoadFloat3(&Mesh.Vertices[ClusterVertices[Corners[t * 3 + 2]]].pos);
+			Normal += XMVector3Cross(P1 - P0, P2 - P0);
+		}
+		if (XMVectorGetX(XMVector3LengthSq(Normal)) <= 0.0f)
+			Normal = XMLoadFloat3(&Mesh.Bounds[m].ConeAxis);
+		Normal = XMVector3Normalize(Normal);
+
+		XMVECTOR Helper = fabsf(XMVectorGetX(Normal)) < 0.9f ? XMVectorSet(1.0f, 0.0f, 0.0f, 0.0f) : XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+		XMVECTOR AxisU = XMVector3Normalize(XMVector3Cross(Helper, Normal));
+		XMVECTOR AxisV = XMVector3Cross(Normal, AxisU);
+
+		float MinU = FLT_MAX, MinV = FLT_MAX, MaxU = -FLT_MAX, MaxV = -FLT_MAX;
+		for (UINT v = 0; v < Cluster.VertexCount; ++v)
+		{
+			XMVECTOR Position = XMLoadFloat3(&Mesh.Vertices[ClusterVertices[v]].pos);
+			float U = XMVectorGetX(XMVector3Dot(Position, AxisU)), V = XMVectorGetX(XMVector3Dot(Position, AxisV));
+			MinU = min(MinU, U);
+			MinV = min(MinV, V);
+			MaxU = max(MaxU, U);
+			MaxV = max(MaxV, V);
+		}
+
+		LightmapChart &Chart = Charts[m];
+		XMStoreFloat3(&Chart.AxisU, AxisU);
+		XMStoreFloat3(&Chart.AxisV, AxisV);
+		Chart.MinU = MinU;
+		Chart.MinV = MinV;
+		Chart.ExtentU = MaxU - MinU;
+		Chart.ExtentV = MaxV - MinV;
+		ProjectedArea += (double)Chart.ExtentU * Chart.ExtentV;
+	}
+	if (MeshletCount == 0 || ProjectedArea <= 0.0)
+		return false;
+
+	// Rows of charts, tallest first. Starts at the density that would fill the whole map and backs off until they fit.
+	std::vector<int> Order(MeshletCount);
+	for (int m = 0; m < MeshletCount; ++m)
+		Order[m] = m;
+	std::sort(Order.begin(), Order.end(), [&Charts](int A, int B) { return Charts[A].ExtentV > Charts[B].ExtentV || (Charts[A].ExtentV == Charts[B].ExtentV && A < B); });
+
+	float TexelsPerUnit = (float)sqrt((double)Size * Size / ProjectedArea);
+	for (;;)
+	{
+		int X = 0, Y = 0, RowHeight = 0;
+		bool Fits = true;
+		for (int i = 0; i < MeshletCount && Fits; ++i)
+		{
+			LightmapChart &Chart = Charts[Order[i]];
+			// A texel more than the extent, so the half texel the charts start in never runs them over
+			int ChartWidth = (int)ceilf(Chart.ExtentU * TexelsPerUnit) + 1 + 2 * LIGHTMAP_CHART_PADDING;
+			int ChartHeight = (int)ceilf(Chart.ExtentV * TexelsPerUnit) + 1 + 2 * LIGHTMAP_CHART_PADDING;
+			if (X + ChartWidth > Size)
+			{
+				X = 0;
+				Y += RowHeight;
+				RowHeight = 0;
+			}
+			Fits = ChartWidth <= Size && Y + ChartHeight <= Size;
+			Chart.X = X;
+			Chart.Y = Y;
+			X += ChartWidth;
+			RowHeight = max(RowHeight, ChartHeight);
+		}
+		if (Fits)
+			break;
+
+		TexelsPerUnit *= 0.97f;
+		if (TexelsPerUnit * TexelsPerUnit * ProjectedArea < 1.0)
+			return false;
+	}
+
+	Mesh.LightmapUVs.resize(Mesh.MeshletVertices.size());
+	Mesh.LightmapSize = Size;
+	for (int m = 0; m < MeshletCount; ++m)
+	{
+		const Meshlet &Cluster = Mesh.Meshlets[m];
+		const LightmapChart &Chart = Charts[m];
+		XMVECTOR AxisU = XMLoadFloat3(&Chart.AxisU), AxisV = XMLoadFloat3(&Chart.AxisV);
+		float OffsetX = Chart.X + LIGHTMAP_CHART_PADDING + 0.5f, OffsetY = Chart.Y + LIGHTMAP_CHART_PADDING + 0.5f;
+		for (UINT v = 0; v < Cluster.VertexCount; ++v)
+		{
+			XMVECTOR Position = XMLoadFloat3(&Mesh.Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + v]].pos);
+			float U = XMVectorGetX(XMVector3Dot(Position, AxisU)) - Chart.MinU, V = XMVectorGetX(XMVector3Dot(Position, AxisV)) - Chart.MinV;
+			Mesh.LightmapUVs[Cluster.VertexOffset + v] = XMFLOAT2((OffsetX + U * TexelsPerUnit) / Size, (OffsetY + V * TexelsPerUnit) / Size);
+		}
+	}
+	return true;
+}
+
+void ComputeProbeVolume(const ClusterMesh &Mesh, CXMMATRIX World, ProbeVolume &Volume)
+{
+	XMVECTOR Min = XMVectorReplicate(FLT_MAX), Max = XMVectorReplicate(-FLT_MAX);
+	for (size_t i = 0; i < Mesh.Vertices.size(); ++i)
+	{
+		XMVECTOR Position = XMVector3TransformCoord(XMLoadFloat3(&Mesh.Vertices[i].pos), World);
+		Min = XMVectorMin(Min, Position);
+		Max = XMVectorMax(Max, Position);
+	}
+	Min -= XMVectorReplicate(PROBE_MARGIN);
+	Max += XMVectorReplicate(PROBE_MARGIN);
+
+	XMFLOAT3 Extent;
+	XMStoreFloat3(&Volume.Origin, Min);
+	XMStoreFloat3(&Extent, Max - Min);
+	Volume.Spacing = PROBE_SPACING;
+	Volume.CountX = (int)ceilf(Extent.x / PROBE_SPACING) + 1;
+	Volume.CountY = (int)ceilf(Extent.y / PROBE_SPACING) + 1;
+	Volume.CountZ = (int)ceilf(Extent.z / PROBE_SPACING) + 1;
+}
+
+// Reads every cube of a cooked scene whose bounding sphere reaches into the box
+static void ReadBakeSceneCubes(const char *Path, FXMVECTOR BoxMin, FXMVECTOR BoxMax, std::vector<XMFLOAT4X4> &Cubes)
+{
+	FILE *File;
+	if (!Path || fopen_s(&File, Path, "rb") != 0)
+		return;
+
+	SceneFileHeader Header;
+	if (fread(&Header, sizeof(Header), 1, File) == 1 && memcmp(Header.Magic, SCENE_FILE_MAGIC, 4) == 0 && Header.Version == SCENE_FILE_VERSION)
+	{
+		std::vector<SceneFileCell> CellTable(Header.GridX * Header.GridZ);
+		_fseeki64(File, Header.CellTableOffset, SEEK_SET);
+		if (fread(CellTable.data(), sizeof(SceneFileCell), CellTable.size(), File) != CellTable.size())
+			CellTable.clear();
+
+		std::vector<SceneFileEntity> Entities;
+		for (size_t c = 0; c < CellTable.size(); ++c)
+		{
+			// Entities stay inside their cell, give or take their size
+			float CellX = Header.OriginX + (c % Header.GridX) * Header.CellSize;
+			float CellZ = Header.OriginZ + (c / Header.GridX) * Header.CellSize;
+			if (CellX > XMVectorGetX(BoxMax) + Header.CellSize || CellX + Header.CellSize < XMVectorGetX(BoxMin) - Header.CellSize ||
+				CellZ > XMVectorGetZ(BoxMax) + Header.CellSize || CellZ + Header.CellSize < XMVectorGetZ(BoxMin) - Header.CellSize)
+				continue;
+
+			Entities.resize(CellTable[c].EntityCount);
+			_fseeki64(File, CellTable[c].Offset, SEEK_SET);
+			if (fread(Entities.data(), sizeof(SceneFileEntity), Entities.size(), File) != Entities.size())
+				continue;
+			for (size_t e = 0; e < Entities.size(); ++e)
+			{
+				XMVECTOR Center = XMLoadFloat4x4(&Entities[e].World).r[3];
+				XMVECTOR Closest = XMVectorClamp(Center, BoxMin, BoxMax);
+				if (Entities[e].Mesh == SCENE_MESH_CUBE &&
+					XMVectorGetX(XMVector3LengthSq(Center - Closest)) <= Entities[e].BoundingRadius * Entities[e].BoundingRadius)
+					Cubes.push_back(Entities[e].World);
+			}
+		}
+	}
+	fclose(File);
+}
+
+// A binary BVH node while building, before four levels of it collapse into a BvhNode
+struct BvhBuildNode
+{
+	float Bounds[6];
+	int Children[2];
+	int First;
+	int Count;
+};
+
+struct BvhBuilder
+{
+	// Of every triangle: its box, min then max, and the middle of it
+	std::vector<float> TriangleBounds;
+	std::vector<float> Centroids;
+	std::vector<int> Order;
+	std::vector<BvhBuildNode> Nodes;
+};
+
+const int BVH_BINS = 16;
+
+static float BoxHalfArea(const float *Bounds)
+{
+	float X = Bounds[3] - Bounds[0], Y = Bounds[4] - Bounds[1], Z = Bounds[5] - Bounds[2];
+	return X * Y + Y * Z + Z * X;
+}
+
+static void GrowBox(float *Bounds, const float *Other)
+{
+	for (int c = 0; c < 3; ++c)
+	{
+		Bounds[c] = min(Bounds[c], Other[c]);
+		Bounds[c + 3] = max(Bounds[c + 3], Other[c + 3]);
+	}
+}
+
+static void EmptyBox(float *Bounds)
+{
+	Bounds[0] = Bounds[1] = Bounds[2] = FLT_MAX;
+	Bounds[3] = Bounds[4] = Bounds[5] = -FLT_MAX;
+}
+
+// Splits where the surface area heuristic says to, over BVH_BINS bins on every axis
+static int BuildBinaryBvh(BvhBuilder &Builder, int First, int Count)
+{
+	int NodeIndex = (int)Builder.Nodes.size();
+	Builder.Nodes.push_back(BvhBuildNode());
+	BvhBuildNode Node;
+	EmptyBox(Node.Bounds);
+	float CentroidBounds[6];
+	EmptyBox(CentroidBounds);
+	for (int i = First; i < First + Count; ++i)
+	{
+		int Triangle = Builder.Order[i];
+		const float *Centroid = &Builder.Centroids[Triangle * 3];
+		float Point[6] = { Centroid[0], Centroid[1], Centroid[2], Centroid[0], Centroid[1], Centroid[2] };
+		GrowBox(Node.Bounds, &Builder.TriangleBounds[Triangle * 6]);
+		GrowBox(CentroidBounds, Point);
+	}
+	Node.Children[0] = Node.Children[1] = -1;
+	Node.First = First;
+	Node.Count = Count;
+	if (Count <= BVH_LEAF_TRIANGLES)
+	{
+		Builder.Nodes[NodeIndex] = Node;
+		return NodeIndex;
+	}
+
+	int BestAxis = -1, BestSplit = 0;
+	float BestCost = FLT_MAX;
+	for (int Axis = 0; Axis < 3; ++Axis)
+	{
+		float Low = CentroidBounds[Axis], Extent = CentroidBounds[Axis + 3] - Low;
+		if (Extent <= 0.0f)
+			continue;
+
+		int BinCounts[BVH_BINS] = {};
+		float BinBounds[BVH_BINS][6];
+		for (int b = 0; b < BVH_BINS; ++b)
+			EmptyBox(BinBounds[b]);
+		for (int i = First; i < First + Count; ++i)
+		{
+			int Triangle = Builder.Order[i];
+			int Bin = min((int)((Builder.Centroids[Triangle * 3 + Axis] - Low) * BVH_BINS / Extent), BVH_BINS - 1);
+			BinCounts[Bin]++;
+			GrowBox(BinBounds[Bin], &Builder.TriangleBounds[Triangle * 6]);
+		}
+
+		// What lies left of every split, then sweep back from the right and cost both sides
+		float LeftAreas[BVH_BINS];
+		int LeftCounts[BVH_BINS];
+		float Accumulated[6];
+		EmptyBox(Accumulated);
+		for (int b = 0, Sum = 0; b < BVH_BINS - 1; ++b)
+		{
+			GrowBox(Accumulated, BinBounds[b]);
+			Sum += BinCounts[b];
+			LeftAreas[b] = Sum ? BoxHalfArea(Accumulated) : 0.0f;
+			LeftCounts[b] = Sum;
+		}
+		EmptyBox(Accumulated);
+		for (int b = BVH_BINS - 1, Sum = 0; b > 0; --b)
+		{
+			GrowBox(Accumulated, BinBounds[b]);
+			Sum += BinCounts[b];
+			if (Sum == 0 || LeftCounts[b - 1] == 0)
+				continue;
+			float Cost = LeftAreas[b - 1] * LeftCounts[b - 1] + BoxHalfArea(Accumulated) * Sum;
+			if (Cost < BestCost)
+			{
+				BestCost = Cost;
+				BestAxis = Axis;
+				BestSplit = b;
+			}
+		}
+	}
+
+	int Middle = First + Count / 2;
+	if (BestAxis >= 0)
+	{
+		float Low = CentroidBounds[BestAxis], Extent = CentroidBounds[BestAxis + 3] - Low;
+		const float *Centroids = Builder.Centroids.data();
+		Middle = (int)(std::partition(Builder.Order.begin() + First, Builder.Order.begin() + First + Count, [=](int Triangle)
+			{ return min((int)((Centroids[Triangle * 3 + BestAxis] - Low) * BVH_BINS / Extent), BVH_BINS - 1) < BestSplit; }) - Builder.Order.begin());
+	}
+	// Every centroid in one spot, any split is as good as another
+	if (Middle == First || Middle == First + Count)
+		Middle = First + Count / 2;
+
+	Node.Children[0] = BuildBinaryBvh(Builder, First, Middle - First);
+	Node.Children[1] = BuildBinaryBvh(Builder, Middle, First + Count - Middle);
+	Builder.Nodes[NodeIndex] = Node;
+	return NodeIndex;
+}
+
+static int AddBvhPacket(const BvhBuilder &Builder, BakeScene &Scene, const BvhBuildNode &Leaf)
+{
+	BvhPacket Packet = {};
+	for (int Lane = 0; Lane < 4; ++Lane)
+	{
+		Packet.Triangles[Lane] = -1;
+		if (Lane >= Leaf.Count)
+			continue;
+
+		int Triangle = Builder.Order[Leaf.First + Lane];
+		const XMFLOAT3 *Corners = &Scene.Positions[Triangle * 3];
+		Packet.Triangles[Lane] = Triangle;
+		for (int c = 0; c < 3; ++c)
+		{
+			Packet.Corner[c][Lane] = (&Corners[0].x)[c];
+			Packet.Edge1[c][Lane] = (&Corners[1].x)[c] - (&Corners[0].x)[c];
+			Packet.Edge2[c][Lane] = (&Corners[2].x)[c] - (&Corners[0].x)[c];
+		}
+	}
+	Scene.Packets.push_back(Packet);
+	return (int)Scene.Packets.size() - 1;
+}
+
+// Takes the binary children of a node apart, biggest first, until there are four of them. Depth is the node's level,
+// from 1 at the root.
+static int CollapseBvh(const BvhBuilder &Builder, BakeScene &Scene, int Binary, int Depth)
+{
+	Scene.BvhDepth = max(Scene.BvhDepth, Depth);
+	int NodeIndex = (int)Scene.Nodes.size();
+	Scene.Nodes.push_back(BvhNode());
+
+	int Children[4] = { Builder.Nodes[Binary].Children[0], Builder.Nodes[Binary].Children[1] };
+	int ChildCount = 2;
+	if (Children[0] < 0)
+	{
+		// A leaf for a root
+		Children[0] = Binary;
+		ChildCount = 1;
+	}
+	while (ChildCount < 4)
+	{
+		int Opened = -1;
+		float OpenedArea = -1.0f;
+		for (int c = 0; c < ChildCount; ++c)
+		{
+			const BvhBuildNode &Child = Builder.Nodes[Children[c]];
+			if (Child.Children[0] >= 0 && BoxHalfArea(Child.Bounds) > OpenedArea)
+			{
+				Opened = c;
+				OpenedArea = BoxHalfArea(Child.Bounds);
+			}
+		}
+		if (Opened < 0)
+			break;
+		const BvhBuildNode &Child = Builder.Nodes[Children[Opened]];
+		Children[ChildCount++] = Child.Children[1];
+		Children[Opened] = Child.Children[0];
+	}
+
+	BvhNode Node;
+	for (int c = 0; c < 4; ++c)
+	{
+		const float Inverted[6] = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		const float *Bounds = c < ChildCount ? Builder.Nodes[Children[c]].Bounds : Inverted;
+		for (int b = 0; b < 6; ++b)
+			Node.Bounds[b][c] = Bounds[b];
+
+		Node.Children[c] = 0;
+		if (c < ChildCount)
+		{
+			const BvhBuildNode &Child = Builder.Nodes[Children[c]];
+			Node.Children[c] = Child.Children[0] < 0 ? ~AddBvhPacket(Builder, Scene, Child) : CollapseBvh(Builder, Scene, Children[c], Depth + 1);
+		}
+	}
+	Scene.Nodes[NodeIndex] = Node;
+	return NodeIndex;
+}
+
+static bool BuildBvh(BakeScene &Scene)
+{
+	int TriangleCount = (int)Scene.Positions.size() / 3;
+	Scene.Nodes.clear();
+	Scene.Packets.clear();
+	Scene.BvhDepth = 0;
+	if (TriangleCount == 0)
+		return true;
+
+	BvhBuilder Builder;
+	Builder.TriangleBounds.resize(TriangleCount * 6);
+	Builder.Centroids.resize(TriangleCount * 3);
+	Builder.Order.resize(TriangleCount);
+	for (int t = 0; t < TriangleCount; ++t)
+	{
+		float *Bounds = &Builder.TriangleBounds[t * 6];
+		EmptyBox(Bounds);
+		for (int c = 0; c < 3; ++c)
+		{
+			const XMFLOAT3 &Corner = Scene.Positions[t * 3 + c];
+			float Point[6] = { Corner.x, Corner.y, Corner.z, Corner.x, Corner.y, Corner.z };
+			GrowBox(Bounds, Point);
+		}
+		for (int c = 0; c < 3; ++c)
+			Builder.Centroids[t * 3 + c] = (Bounds[c] + Bounds[c + 3]) * 0.5f;
+		Builder.Order[t] = t;
+	}
+
+	Builder.Nodes.reserve(TriangleCount * 2 / BVH_LEAF_TRIANGLES + 1);
+	BuildBinaryBvh(Builder, 0, TriangleCount);
+	CollapseBvh(Builder, Scene, 0, 1);
+
+	if (3 * Scene.BvhDepth + 1 > BVH_STACK_SIZE)
+	{
+		printf("The bake scene's BVH is %d levels deep, tracing it needs a stack of %d but there are %d\n", Scene.BvhDepth,
+			3 * Scene.BvhDepth + 1, BVH_STACK_SIZE);
+		return false;
+	}
+	return true;
+}
+
+bool BuildBakeScene(const ClusterMesh &Mesh, CXMMATRIX World, const ProbeVolume &Volume, const char *ScenePath, BakeScene &Scene)
+{
+	Scene.Positions.clear();
+	for (size_t m = 0; m < Mesh.Meshlets.size(); ++m)
+	{
+		const Meshlet &Cluster = Mesh.Meshlets[m];
+		const BYTE *Corners = &Mesh.MeshletTriangles[Cluster.TriangleOffset * 3];
+		for (UINT c = 0; c < Cluster.TriangleCount * 3; ++c)
+		{
+			XMFLOAT3 Position;
+			XMStoreFloat3(&Position, XMVector3TransformCoord(XMLoadFloat3(&Mesh.Vertices[Mesh.MeshletVertices[Cluster.VertexOffset + Corners[c]]].pos), World));
+			Scene.Positions.push_back(Position);
+		}
+	}
+	Scene.MeshTriangles = (int)Scene.Positions.size() / 3;
+
+	// The two cubes in front of the camera move, only the streamed ones are still enough to bake
+	XMVECTOR VolumeMin = XMLoadFloat3(&Volume.Origin);
+	XMVECTOR VolumeMax = VolumeMin + XMVectorSet((float)(Volume.CountX - 1), (float)(Volume.CountY - 1), (float)(Volume.CountZ - 1), 0.0f) * Volume.Spacing;
+	std::vector<XMFLOAT4X4> Cubes;
+	ReadBakeSceneCubes(ScenePath, VolumeMin - XMVectorReplicate(BAKE_SCENE_MARGIN), VolumeMax + XMVectorReplicate(BAKE_SCENE_MARGIN), Cubes);
+	Scene.CubeCount = (int)Cubes.size();
+
+	Vertex CubeVertices[CUBE_VERTEX_COUNT];
+	DWORD CubeIndices[CUBE_INDEX_COUNT];
+	BuildCubeGeometry(CubeVertices, CubeIndices, 0);
+	for (size_t i = 0; i < Cubes.size(); ++i)
+	{
+		XMMATRIX CubeWorld = XMLoadFloat4x4(&Cubes[i]);
+		for (int c = 0; c < CUBE_INDEX_COUNT; ++c)
+		{
+			XMFLOAT3 Position;
+			XMStoreFloat3(&Position, XMVector3TransformCoord(XMLoadFloat3(&CubeVertices[CubeIndices[c]].pos), CubeWorld));
+			Scene.Positions.push_back(Position);
+		}
+	}
+
+	int TriangleCount = (int)Scene.Positions.size() / 3;
+	Scene.Normals.resize(TriangleCount);
+	for (int t = 0; t < TriangleCount; ++t)
+	{
+		XMVECTOR P0 = XMLoadFloat3(&Scene.Positions[t * 3]);
+		XMVECTOR P1 = XMLoadFloat3(&Scene.Positions[t * 3 + 1]);
+		XMVECTOR P2 = XMLoadFloat3(&Scene.Positions[t * 3 + 2]);
+		XMVECTOR Normal = XMVector3Cross(P1 - P0, P2 - P0);
+		XMStoreFloat3(&Scene.Normals[t], XMVectorGetX(XMVector3LengthSq(Normal)) > 0.0f ? XMVector3Normalize(Normal) : XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	}
+	XMStoreFloat3(&Scene.SunDirection, XMVector3Normalize(XMLoadFloat3(&SUN_DIRECTION)));
+
+	return BuildBvh(Scene);
+}
+
+// Nearest first, down the children the ray's box test lets through. Triangles are tested from both sides.
+bool TraceBakeRay(const BakeScene &Scene, const XMFLOAT3 &Origin, const XMFLOAT3 &Direction, float MaxDistance, bool AnyHit, BakeHit &Hit)
+{
+	Hit.Triangle = -1;
+	Hit.Distance = MaxDistance;
+	if (Scene.Nodes.empty())
+		return false;
+
+	// A zero component would turn the slabs into infinities and NaNs
+	float Inverse[3];
+	const float *Components = &Direction.x;
+	for (int c = 0; c < 3; ++c)
+		Inverse[c] = fabsf(Components[c]) > 1e-12f ? 1.0f / Components[c] : (Components[c] < 0.0f ? -1e12f : 1e12f);
+
+	const __m128 OriginX = _mm_set1_ps(Origin.x), OriginY = _mm_set1_ps(Origin.y), OriginZ = _mm_set1_ps(Origin.z);
+	const __m128 DirectionX = _mm_set1_ps(Direction.x), DirectionY = _mm_set1_ps(Direction.y), DirectionZ = _mm_set1_ps(Direction.z);
+	const __m128 InverseX = _mm_set1_ps(Inverse[0]), InverseY = _mm_set1_ps(Inverse[1]), InverseZ = _mm_set1_ps(Inverse[2]);
+	const __m128 Zero = _mm_setzero_ps(), One = _mm_set1_ps(1.0f);
+	const __m128 SignMask = _mm_set1_ps(-0.0f);
+
+	// The slab of every axis the ray enters first
+	int NearX = Direction.x < 0.0f ? 3 : 0, NearY = Direction.y < 0.0f ? 4 : 1, NearZ = Direction.z < 0.0f ? 5 : 2;
+	int FarX = NearX < 3 ? NearX + 3 : NearX - 3, FarY = NearY < 3 ? NearY + 3 : NearY - 3, FarZ = NearZ < 3 ? NearZ + 3 : NearZ - 3;
+
+	int StackChildren[BVH_STACK_SIZE];
+	float StackDistances[BVH_STACK_SIZE];
+	int StackSize = 1;
+	StackChildren[0] = 0;
+	StackDistances[0] = 0.0f;
+	while (StackSize > 0)
+	{
+		--StackSize;
+		if (StackDistances[StackSize] > Hit.Distance)
+			continue;
+		int Child = StackChildren[StackSize];
+		__m128 Closest = _mm_set1_ps(Hit.Distance);
+
+		if (Child < 0)
+		{
+			// Moller-Trumbore on four triangles at once
+			const BvhPacket &Packet = Scene.Packets[~Child];
+			__m128 Edge1X = _mm_loadu_ps(Packet.Edge1[0]), Edge1Y = _mm_loadu_ps(Packet.Edge1[1]), Edge1Z = _mm_loadu_ps(Packet.Edge1[2]);
+			__m128 Edge2X = _mm_loadu_ps(Packet.Edge2[0]), Edge2Y = _mm_loadu_ps(Packet.Edge2[1]), Edge2Z = _mm_loadu_ps(Packet.Edge2[2]);
+
+			__m128 PX = _mm_sub_ps(_mm_mul_ps(DirectionY, Edge2Z), _mm_mul_ps(DirectionZ, Edge2Y));
+			__m128 PY = _mm_sub_ps(_mm_mul_ps(DirectionZ, Edge2X), _mm_mul_ps(DirectionX, Edge2Z));
+			__m128 PZ = _mm_sub_ps(_mm_mul_ps(DirectionX, Edge2Y), _mm_mul_ps(DirectionY, Edge2X));
+			__m128 Determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Edge1X, PX), _mm_mul_ps(Edge1Y, PY)), _mm_mul_ps(Edge1Z, PZ));
+			__m128 InverseDeterminant = _mm_div_ps(One, Determinant);
+
+			__m128 TX = _mm_sub_ps(OriginX, _mm_loadu_ps(Packet.Corner[0]));
+			__m128 TY = _mm_sub_ps(OriginY, _mm_loadu_ps(Packet.Corner[1]));
+			__m128 TZ = _mm_sub_ps(OriginZ, _mm_loadu_ps(Packet.Corner[2]));
+			__m128 U = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(TX, PX), _mm_mul_ps(TY, PY)), _mm_mul_ps(TZ, PZ)), InverseDeterminant);
+
+			__m128 QX = _mm_sub_ps(_mm_mul_ps(TY, Edge1Z), _mm_mul_ps(TZ, Edge1Y));
+			__m128 QY = _mm_sub_ps(_mm_mul_ps(TZ, Edge1X), _mm_mul_ps(TX, Edge1Z));
+			__m128 QZ = _mm_sub_ps(_mm_mul_ps(TX, Edge1Y), _mm_mul_ps(TY, Edge1X));
+			__m128 V = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(DirectionX, QX), _mm_mul_ps(DirectionY, QY)), _mm_mul_ps(DirectionZ, QZ)), InverseDeterminant);
+			__m128 Distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Edge2X, QX), _mm_mul_ps(Edge2Y, QY)), _mm_mul_ps(Edge2Z, QZ)), InverseDeterminant);
+
+			// Unused lanes have no area, so no determinant either
+			__m128 Inside = _mm_and_ps(_mm_cmpgt_ps(_mm_andnot_ps(SignMask, Determinant), _mm_set1_ps(1e-12f)), _mm_cmpge_ps(U, Zero));
+			Inside = _mm_and_ps(Inside, _mm_and_ps(_mm_cmpge_ps(V, Zero), _mm_cmple_ps(_mm_add_ps(U, V), One)));
+			Inside = _mm_and_ps(Inside, _mm_and_ps(_mm_cmpgt_ps(Distance, Zero), _mm_cmplt_ps(Distance, Closest)));
+
+			float Distances[4];
+			_mm_storeu_ps(Distances, Distance);
+			unsigned long Lane;
+			for (int Bits = _mm_movemask_ps(Inside); Bits; Bits &= Bits - 1)
+			{
+				_BitScanForward(&Lane, Bits);
+				if (Distances[Lane] < Hit.Distance)
+				{
+					Hit.Distance = Distances[Lane];
+					Hit.Triangle = Packet.Triangles[Lane];
+				}
+			}
+			if (AnyHit && Hit.Triangle >= 0)
+				return true;
+			continue;
+		}
+
+		const BvhNode &Node = Scene.Nodes[Child];
+		__m128 EnterX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(Node.Bounds[NearX]), OriginX), InverseX);
+		__m128 EnterY = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(Node.Bounds[NearY]), OriginY), InverseY);
+		__m128 EnterZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(Node.Bounds[NearZ]), OriginZ), InverseZ);
+		__m128 LeaveX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(Node.Bounds[FarX]), OriginX), InverseX);
+		__m128 LeaveY = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(Node.Bounds[FarY]), OriginY), InverseY);
+		__m128 LeaveZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(Node.Bounds[FarZ]), OriginZ), InverseZ);
+		__m128 Enter = _mm_max_ps(_mm_max_ps(EnterX, EnterY), _mm_max_ps(EnterZ, Zero));
+		__m128 Leave = _mm_min_ps(_mm_min_ps(LeaveX, LeaveY), _mm_min_ps(LeaveZ, Closest));
+
+		float Entries[4];
+		_mm_storeu_ps(Entries, Enter);
+		int Hits[4], HitCount = 0;
+		unsigned long Lane;
+		for (int Bits = _mm_movemask_ps(_mm_cmple_ps(Enter, Leave)); Bits; Bits &= Bits - 1)
+		{
+			_BitScanForward(&Lane, Bits);
+			// Sorted far to near, so the nearest is popped first
+			int i = HitCount++;
+			for (; i > 0 && Entries[Hits[i - 1]] < Entries[Lane]; --i)
+				Hits[i] = Hits[i - 1];
+			Hits[i] = (int)Lane;
+		}
+		// Never full, BuildBakeScene checked the depth
+		for (int i = 0; i < HitCount && StackSize < BVH_STACK_SIZE; ++i)
+		{
+			StackChildren[StackSize] = Node.Children[Hits[i]];
+			StackDistances[StackSize] = Entries[Hits[i]];
+			StackSize++;
+		}
+	}
+	return Hit.Triangle >= 0;
+}
+
+// Wang's hash, so neighboring texels and probes start their random numbers far apart
+static inline UINT BakeSeed(UINT Index)
+{
+	Index = (Index ^ 61u) ^ (Index >> 16);
+	Index *= 9u;
+	Index ^= Index >> 4;
+	Index *= 0x27d4eb2du;
+	Index ^= Index >> 15;
+	return Index | 1u;
+}
+
+static inline float BakeRandom(UINT &Seed)
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 17;
+	Seed ^= Seed << 5;
+	return (Seed >> 8) * (1.0f / 16777216.0f);
+}
+
+// Cosine weighted around the normal, so the mean of what the rays bring back is the irradiance over pi
+static inline XMVECTOR CosineBakeDirection(FXMVECTOR Normal, UINT &Seed)
+{
+	float X = XMVectorGetX(Normal), Y = XMVectorGetY(Normal), Z = XMVectorGetZ(Normal);
+	float Sign = Z < 0.0f ? -1.0f : 1.0f;
+	float A = -1.0f / (Sign + Z), B = X * Y * A;
+	XMVECTOR Tangent = XMVectorSet(1.0f + Sign * X * X * A, Sign * B, -Sign * X, 0.0f);
+	XMVECTOR Bitangent = XMVectorSet(B, Sign + Y * Y * A, -Y, 0.0f);
+
+	float Radius = sqrtf(BakeRandom(Seed)), Angle = 6.2831853f * BakeRandom(Seed);
+	return Tangent * (Radius * cosf(Angle)) + Bitangent * (Radius * sinf(Angle)) + Normal * sqrtf(max(1.0f - Radius * Radius, 0.0f));
+}
+
+// Counts the ray for the report
+static inline bool TraceCountedBakeRay(const BakeScene &Scene, FXMVECTOR Origin, FXMVECTOR Direction, float MaxDistance, bool AnyHit, BakeHit &Hit, UINT64 &Rays)
+{
+	XMFLOAT3 RayOrigin, RayDirection;
+	XMStoreFloat3(&RayOrigin, Origin);
+	XMStoreFloat3(&RayDirection, Direction);
+	Rays++;
+	return TraceBakeRay(Scene, RayOrigin, RayDirection, MaxDistance, AnyHit, Hit);
+}
+
+// The light coming back along a ray: the sun and the sky off every surface the path bounces off, BAKE_BOUNCES of them.
+// BackFace tells whether the first thing the ray met was the inside of something.
+static XMVECTOR TraceBakeRadiance(const BakeScene &Scene, FXMVECTOR RayOrigin, FXMVECTOR RayDirection, UINT &Seed, UINT64 &Rays, bool &BackFace)
+{
+	XMVECTOR Sun = XMLoadFloat3(&Scene.SunDirection);
+	XMVECTOR SunColor = XMLoadFloat3(&SUN_COLOR);
+	XMVECTOR Radiance = XMVectorZero();
+	XMVECTOR Origin = RayOrigin, Direction = RayDirection;
+	float Throughput = 1.0f;
+	BackFace = false;
+
+	BakeHit Hit;
+	for (int Bounce = 0; Bounce < BAKE_BOUNCES; ++Bounce)
+	{
+		if (!TraceCountedBakeRay(Scene, Origin, Direction, FLT_MAX, false, Hit, Rays))
+		{
+			Radiance += XMLoadFloat3(&SKY_COLOR) * Throughput;
+			break;
+		}
+
+		XMVECTOR Normal = XMLoadFloat3(&Scene.Normals[Hit.Triangle]);
+		if (XMVectorGetX(XMVector3Dot(Normal, Direction)) > 0.0f)
+		{
+			BackFace |= Bounce == 0;
+			Normal = -Normal;
+		}
+		Throughput *= BAKE_ALBEDO;
+		Origin = Origin + Direction * Hit.Distance + Normal * BAKE_RAY_OFFSET;
+
+		float SunCosine = XMVectorGetX(XMVector3Dot(Normal, Sun));
+		if (SunCosine > 0.0f && !TraceCountedBakeRay(Scene, Origin, Sun, FLT_MAX, true, Hit, Rays))
+			Radiance += SunColor * (Throughput * SunCosine);
+		Direction = CosineBakeDirection(Normal, Seed);
+	}
+	return Radiance;
+}
+
+void RasterizeLightmap(const ClusterMesh &Mesh, CXMMATRIX World, std::vector<LightmapTexel> &Texels)
+{
+	int Size = (int)Mesh.LightmapSize;
+	Texels.clear();
+	if (Mesh.LightmapUVs.empty())
+		return;
+
+	// Where triangles of a chart share a texel, the first one keeps it
+	std::vector<BYTE> Covered(Size * Size, 0);
+	for (size_t m = 0; m < Mesh.Meshlets.size(); ++m)
+	{
+		const Meshlet &Cluster = Mesh.Meshlets[m];
+		const BYTE *Corners = &Mesh.MeshletTriangles[Cluster.TriangleOffset * 3];
+		for (UINT t = 0; t < Cluster.TriangleCount; ++t)
+		{
+			XMVECTOR Positions[3], Normals[3];
+			float X[3], Y[3];
+			for (int c = 0; c < 3; ++c)
+			{
+				UINT MeshletVertex = Cluster.VertexOffset + Corners[t * 3 + c];
+				const Vertex &Corner = Mesh.Vertices[Mesh.MeshletVertices[MeshletVertex]];
+				Positions[c] = XMVector3TransformCoord(XMLoadFloat3(&Corner.pos), World);
+				Normals[c] = XMVector3TransformNormal(XMLoadFloat3(&Corner.normal), World);
+				// Texel centers land on whole numbers
+				X[c] = Mesh.LightmapUVs[MeshletVertex].x * Size - 0.5f;
+				Y[c] = Mesh.LightmapUVs[MeshletVertex].y * Size - 0.5f;
+			}
+
+			float Area = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+			if (fabsf(Area) < 1e-12f)
+				continue;
+			XMVECTOR FaceNormal = XMVector3Normalize(XMVector3Cross(Positions[1] - Positions[0], Positions[2] - Positions[0]));
+
+			int MinX = max((int)ceilf(min(X[0], min(X[1], X[2]))), 0), MaxX = min((int)floorf(max(X[0], max(X[1], X[2]))), Size - 1);
+			int MinY = max((int)ceilf(min(Y[0], min(Y[1], Y[2]))), 0), MaxY = min((int)floorf(max(Y[0], max(Y[1], Y[2]))), Size - 1);
+			for (int PixelY = MinY; PixelY <= MaxY; ++PixelY)
+			{
+				for (int PixelX = MinX; PixelX <= MaxX; ++PixelX)
+				{
+					float W1 = ((PixelX - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (PixelY - Y[0])) / Area;
+					float W2 = ((X[1] - X[0]) * (PixelY - Y[0]) - (PixelX - X[0]) * (Y[1] - Y[0])) / Area;
+					float W0 = 1.0f - W1 - W2;
+					if (W0 < -1e-5f || W1 < -1e-5f || W2 < -1e-5f || Covered[PixelY * Size + PixelX])
+						continue;
+					Covered[PixelY * Size + PixelX] = 1;
+
+					LightmapTexel Texel;
+					Texel.X = PixelX;
+					Texel.Y = PixelY;
+					XMStoreFloat3(&Texel.Position, Positions[0] * W0 + Positions[1] * W1 + Positions[2] * W2);
+					XMStoreFloat3(&Texel.Normal, XMVector3Normalize(Normals[0] * W0 + Normals[1] * W1 + Normals[2] * W2));
+					XMStoreFloat3(&Texel.FaceNormal, FaceNormal);
+					Texels.push_back(Texel);
+				}
+			}
+		}
+	}
+}
+
+struct LightmapBakeJob
+{
+	const BakeScene *Scene;
+	const std::vector<LightmapTexel> *Texels;
+	XMFLOAT4 *Lightmap;
+	int Size;
+	int Samples;
+	// Handed out a block at a time to however many threads joined in
+	std::atomic<int> NextBlock;
+	std::atomic<UINT64> Rays;
+};
+
+const int LIGHTMAP_BAKE_BLOCK = 64;
 
-	cbPerFrameBuffer->Release();
+static void BakeLightmapBlocks(void *Data, int Begin, int End)
+{
+	LightmapBakeJob &Job = *(LightmapBakeJob *)Data;
+	const BakeScene &Scene = *Job.Scene;
+	XMVECTOR Sun = XMLoadFloat3(&Scene.SunDirection);
+	XMVECTOR SunColor = XMLoadFloat3(&SUN_COLOR);
+	int TexelCount = (int)Job.Texels->size();
+	UINT64 Rays = 0;
+	BakeHit Hit;
+	bool BackFace;
+
+	for (;;)
+	{
+		int Block = Job.NextBlock.fetch_add(1);
+		if (Block * LIGHTMAP_BAKE_BLOCK >= TexelCount)
+			break;
 
-	DIKeyboard->Unacquire();
-	DIMouse->Unacquire();
-	DirectInput->Release();
+		for (int i = Block * LIGHTMAP_BAKE_BLOCK; i < min((Block + 1) * LIGHTMAP_BAKE_BLOCK, TexelCount); ++i)
+		{
+			const LightmapTexel &Texel = (*Job.Texels)[i];
+			XMVECTOR Normal = XMLoadFloat3(&Texel.Normal);
+			XMVECTOR Origin = XMLoadFloat3(&Texel.Position) + XMLoadFloat3(&Texel.FaceNormal) * BAKE_RAY_OFFSET;
+			UINT Seed = BakeSeed(i);
+
+			XMVECTOR Light = XMVectorZero();
+			float SunCosine = XMVectorGetX(XMVector3Dot(Normal, Sun));
+			if (SunCosine > 0.0f && !TraceCountedBakeRay(Scene, Origin, Sun, FLT_MAX, true, Hit, Rays))
+				Light = SunColor * SunCosine;
+
+			XMVECTOR Indirect = XMVectorZero();
+			for (int s = 0; s < Job.Samples; ++s)
+				Indirect += TraceBakeRadiance(Scene, Origin, CosineBakeDirection(Normal, Seed), Seed, Rays, BackFace);
+			Light += Indirect * (1.0f / Job.Samples);
+			XMStoreFloat4(&Job.Lightmap[Texel.Y * Job.Size + Texel.X], XMVectorSetW(Light, 1.0f));
+		}
+	}
+	Job.Rays += Rays;
 }
 
-bool InitScene()
+BakeStats BakeLightmap(const BakeScene &Scene, const std::vector<LightmapTexel> &Texels, int Size, int Samples, int Threads,
+	std::vector<XMFLOAT4> &Lightmap)
 {
-	InitD2DScreenTexture();
+	// Alpha marks the texels the unwrap covers, the rest wait for DilateLightmap
+	Lightmap.assign(Size * Size, XMFLOAT4(0.0f, 0.0f, 0.0f, 0.0f));
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	LightmapBakeJob Job;
+	Job.Scene = &Scene;
+	Job.Texels = &Texels;
+	Job.Lightmap = Lightmap.data();
+	Job.Size = Size;
+	Job.Samples = Samples;
+	Job.NextBlock = 0;
+	Job.Rays = 0;
+	ParallelFor(max(Threads, 1), 1, BakeLightmapBlocks, &Job);
+
+	QueryPerformanceCounter(&End);
+	BakeStats Stats;
+	Stats.Rays = Job.Rays;
+	Stats.Seconds = double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+	Stats.BuriedProbes = 0;
+	return Stats;
+}
 
-	// Compile Shaders From File
-	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "VS", "vs_5_0", 0, 0, &VSBuffer, 0));
-	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "PS", "ps_5_0", 0, 0, &PSBuffer, 0));
-	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, "D2D_PS", "ps_5_0", 0, 0, &D2D_PS_Buffer, 0));
+// Grows every chart into its padding, so the filter at a chart's edge blends with the chart's own light
+void DilateLightmap(std::vector<XMFLOAT4> &Lightmap, int Size)
+{
+	std::vector<XMFLOAT4> Source;
+	for (int Pass = 0; Pass < LIGHTMAP_CHART_PADDING; ++Pass)
+	{
+		Source = Lightmap;
+		for (int Y = 0; Y < Size; ++Y)
+		{
+			for (int X = 0; X < Size; ++X)
+			{
+				if (Source[Y * Size + X].w > 0.0f)
+					continue;
+
+				XMVECTOR Sum = XMVectorZero();
+				for (int NeighborY = max(Y - 1, 0); NeighborY <= min(Y + 1, Size - 1); ++NeighborY)
+				{
+					for (int NeighborX = max(X - 1, 0); NeighborX <= min(X + 1, Size - 1); ++NeighborX)
+					{
+						const XMFLOAT4 &Neighbor = Source[NeighborY * Size + NeighborX];
+						if (Neighbor.w > 0.0f)
+							Sum += XMVectorSet(Neighbor.x, Neighbor.y, Neighbor.z, 1.0f);
+					}
+				}
+				if (XMVectorGetW(Sum) > 0.0f)
+					XMStoreFloat4(&Lightmap[Y * Size + X], XMVectorSetW(Sum / XMVectorGetW(Sum), 1.0f));
+			}
+		}
+	}
+}
 
-	// Create the Shader object
-	HR(D3D11Device->CreateVertexShader(VSBuffer->GetBufferPointer(), VSBuffer->GetBufferSize(), 0, &VertexShader));
-	HR(D3D11Device->CreatePixelShader(PSBuffer->GetBufferPointer(), PSBuffer->GetBufferSize(), 0, &PixelShader));
-	HR(D3D11Device->CreatePixelShader(D2D_PS_Buffer->GetBufferPointer(), D2D_PS_Buffer->GetBufferSize(), 0, &D2D_PS));
+// The real L2 SH basis, in the order ProbeIrradiance reads it
+static inline void EvaluateShBasis(FXMVECTOR Direction, float Basis[SH_COEFFICIENTS])
+{
+	float X = XMVectorGetX(Direction), Y = XMVectorGetY(Direction), Z = XMVectorGetZ(Direction);
+	Basis[0] = 0.282095f;
+	Basis[1] = 0.488603f * Y;
+	Basis[2] = 0.488603f * Z;
+	Basis[3] = 0.488603f * X;
+	Basis[4] = 1.092548f * X * Y;
+	Basis[5] = 1.092548f * Y * Z;
+	Basis[6] = 0.315392f * (3.0f * Z * Z - 1.0f);
+	Basis[7] = 1.092548f * X * Z;
+	Basis[8] = 0.546274f * (X * X - Y * Y);
+}
 
-	// Now that the shaders are compiled and created, need to set them as our Pipelines current shader.
-	D3D11DeviceContext->VSSetShader(VertexShader, 0, 0);
-	D3D11DeviceContext->PSSetShader(PixelShader, 0, 0);
+struct ProbeBakeJob
+{
+	const BakeScene *Scene;
+	const ProbeVolume *Volume;
+	XMFLOAT3 *Coefficients;
+	BYTE *Buried;
+	int Samples;
+	std::atomic<int> NextProbe;
+	std::atomic<UINT64> Rays;
+};
 
-	light.pos = XMFLOAT3(0.0f, 0.0f, 0.0f);
-	light.range = 100.0f;
-	light.att = XMFLOAT3(0.0f, 0.2, 0.0f);
-	light.ambient = XMFLOAT4(0.3f, 0.3f, 0.3f, 1.0f);
-	light.diffuse = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
+static void BakeProbeSet(void *Data, int Begin, int End)
+{
+	ProbeBakeJob &Job = *(ProbeBakeJob *)Data;
+	const BakeScene &Scene = *Job.Scene;
+	const ProbeVolume &Volume = *Job.Volume;
+	int ProbeCount = Volume.CountX * Volume.CountY * Volume.CountZ;
+	XMVECTOR Sun = XMLoadFloat3(&Scene.SunDirection);
+	XMVECTOR SunColor = XMLoadFloat3(&SUN_COLOR);
+	// The clamped cosine's bands over pi, which turns radiance into what the albedo is multiplied by
+	const float BandWeights[SH_COEFFICIENTS] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+	UINT64 Rays = 0;
+	BakeHit Hit;
+
+	for (;;)
+	{
+		int Probe = Job.NextProbe.fetch_add(1);
+		if (Probe >= ProbeCount)
+			break;
+
+		int X = Probe % Volume.CountX, Y = (Probe / Volume.CountX) % Volume.CountY, Z = Probe / (Volume.CountX * Volume.CountY);
+		XMVECTOR Position = XMLoadFloat3(&Volume.Origin) + XMVectorSet((float)X, (float)Y, (float)Z, 0.0f) * Volume.Spacing;
+		UINT Seed = BakeSeed(0x80000000u + Probe);
+
+		XMVECTOR Sums[SH_COEFFICIENTS];
+		float Basis[SH_COEFFICIENTS];
+		for (int i = 0; i < SH_COEFFICIENTS; ++i)
+			Sums[i] = XMVectorZero();
+		int BackFaces = 0;
+		for (int s = 0; s < Job.Samples; ++s)
+		{
+			// Uniform over the sphere
+			float CosTheta = 1.0f - 2.0f * BakeRandom(Seed), Angle = 6.2831853f * BakeRandom(Seed);
+			float SinTheta = sqrtf(max(1.0f - CosTheta * CosTheta, 0.0f));
+			XMVECTOR Direction = XMVectorSet(SinTheta * cosf(Angle), SinTheta * sinf(Angle), CosTheta, 0.0f);
+
+			bool BackFace;
+			XMVECTOR Radiance = TraceBakeRadiance(Scene, Position, Direction, Seed, Rays, BackFace);
+			BackFaces += BackFace;
+			EvaluateShBasis(Direction, Basis);
+			for (int i = 0; i < SH_COEFFICIENTS; ++i)
+				Sums[i] += Radiance * Basis[i];
+		}
 
-	// Where the points meet
-	Vertex Vertices[] =
+		// The sun is a direction rather than an area, it projects straight onto the basis
+		bool SunVisible = !TraceCountedBakeRay(Scene, Position, Sun, FLT_MAX, true, Hit, Rays);
+		EvaluateShBasis(Sun, Basis);
+		for (int i = 0; i < SH_COEFFICIENTS; ++i)
+		{
+			XMVECTOR Coefficient = Sums[i] * (4.0f * 3.1415927f / Job.Samples * BandWeights[i]);
+			if (SunVisible)
+				Coefficient += SunColor * (3.1415927f * BandWeights[i] * Basis[i]);
+			XMStoreFloat3(&Job.Coefficients[Probe * SH_COEFFICIENTS + i], Coefficient);
+		}
+		Job.Buried[Probe] = BackFaces > Job.Samples * PROBE_BURIED_FRACTION;
+	}
+	Job.Rays += Rays;
+}
+
+BakeStats BakeProbes(const BakeScene &Scene, const ProbeVolume &Volume, int Samples, int Threads, std::vector<XMFLOAT3> &Coefficients)
+{
+	int ProbeCount = Volume.CountX * Volume.CountY * Volume.CountZ;
+	Coefficients.assign(ProbeCount * SH_COEFFICIENTS, XMFLOAT3(0.0f, 0.0f, 0.0f));
+	std::vector<BYTE> Buried(ProbeCount, 0);
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+
+	ProbeBakeJob Job;
+	Job.Scene = &Scene;
+	Job.Volume = &Volume;
+	Job.Coefficients = Coefficients.data();
+	Job.Buried = Buried.data();
+	Job.Samples = Samples;
+	Job.NextProbe = 0;
+	Job.Rays = 0;
+	ParallelFor(max(Threads, 1), 1, BakeProbeSet, &Job);
+
+	BakeStats Stats;
+	Stats.Rays = Job.Rays;
+	Stats.BuriedProbes = 0;
+	for (int p = 0; p < ProbeCount; ++p)
+		Stats.BuriedProbes += Buried[p];
+
+	// A buried probe would light whatever is near it from inside the geometry. It takes the average of its neighbors
+	// that aren't, a ring at a time, until no more can be reached.
+	const int Steps[6][3] = { { -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 } };
+	std::vector<BYTE> Filled;
+	for (bool Changed = true; Changed;)
 	{
-		// Front Face
-		Vertex(-1.0f, -1.0f, -1.0f, 0.0f, 1.0f,-1.0f, -1.0f, -1.0f),
-		Vertex(-1.0f,  1.0f, -1.0f, 0.0f, 0.0f,-1.0f,  1.0f, -1.0f),
-		Vertex(1.0f,  1.0f, -1.0f, 1.0f, 0.0f, 1.0f,  1.0f, -1.0f),
-		Vertex(1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f, -1.0f, -1.0f),
+		Changed = false;
+		Filled = Buried;
+		for (int p = 0; p < ProbeCount; ++p)
+		{
+			if (!Buried[p])
+				continue;
+
+			int X = p % Volume.CountX, Y = (p / Volume.CountX) % Volume.CountY, Z = p / (Volume.CountX * Volume.CountY);
+			XMVECTOR Sums[SH_COEFFICIENTS];
+			for (int i = 0; i < SH_COEFFICIENTS; ++i)
+				Sums[i] = XMVectorZero();
+			int Valid = 0;
+			for (int s = 0; s < 6; ++s)
+			{
+				int NeighborX = X + Steps[s][0], NeighborY = Y + Steps[s][1], NeighborZ = Z + Steps[s][2];
+				if (NeighborX < 0 || NeighborY < 0 || NeighborZ < 0 || NeighborX >= Volume.CountX || NeighborY >= Volume.CountY || NeighborZ >= Volume.CountZ)
+					continue;
+				int Neighbor = (NeighborZ * Volume.CountY + NeighborY) * Volume.CountX + NeighborX;
+				if (Buried[Neighbor])
+					continue;
+				for (int i = 0; i < SH_COEFFICIENTS; ++i)
+					Sums[i] += XMLoadFloat3(&Coefficients[Neighbor * SH_COEFFICIENTS + i]);
+				Valid++;
+			}
+			if (Valid == 0)
+				continue;
 
-		// Back Face
-		Vertex(-1.0f, -1.0f, 1.0f, 1.0f, 1.0f,-1.0f, -1.0f, 1.0f),
-		Vertex(1.0f, -1.0f, 1.0f, 0.0f, 1.0f, 1.0f, -1.0f, 1.0f),
-		Vertex(1.0f,  1.0f, 1.0f, 0.0f, 0.0f, 1.0f,  1.0f, 1.0f),
-		Vertex(-1.0f,  1.0f, 1.0f, 1.0f, 0.0f,-1.0f,  1.0f, 1.0f),
+			for (int i = 0; i < SH_COEFFICIENTS; ++i)
+				XMStoreFloat3(&Coefficients[p * SH_COEFFICIENTS + i], Sums[i] / (float)Valid);
+			Filled[p] = 0;
+			Changed = true;
+		}
+		Buried.swap(Filled);
+	}
 
-		// Top Face
-		Vertex(-1.0f, 1.0f, -1.0f, 0.0f, 1.0f,-1.0f, 1.0f, -1.0f),
-		Vertex(-1.0f, 1.0f,  1.0f, 0.0f, 0.0f,-1.0f, 1.0f,  1.0f),
-		Vertex(1.0f, 1.0f,  1.0f, 1.0f, 0.0f, 1.0f, 1.0f,  1.0f),
-		Vertex(1.0f, 1.0f, -1.0f, 1.0f, 1.0f, 1.0f, 1.0f, -1.0f),
+	QueryPerformanceCounter(&End);
+	Stats.Seconds = double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+	return Stats;
+}
 
-		// Bottom Face
-		Vertex(-1.0f, -1.0f, -1.0f, 1.0f, 1.0f,-1.0f, -1.0f, -1.0f),
-		Vertex(1.0f, -1.0f, -1.0f, 0.0f, 1.0f, 1.0f, -1.0f, -1.0f),
-		Vertex(1.0f, -1.0f,  1.0f, 0.0f, 0.0f, 1.0f, -1.0f,  1.0f),
-		Vertex(-1.0f, -1.0f,  1.0f, 1.0f, 0.0f,-1.0f, -1.0f,  1.0f),
+bool WriteLightmap(const char *Path, const std::vector<XMFLOAT4> &Lightmap, int Size)
+{
+	CookedTexture Texture;
+	Texture.Codec = TEXTURE_CODEC_RGBA16F;
+	Texture.Format = DXGI_FORMAT_R16G16B16A16_FLOAT;
+	Texture.Width = Size;
+	Texture.Height = Size;
+	Texture.Depth = 1;
+	Texture.MipCount = 1;
+	Texture.Data.resize(Lightmap.size() * 4 * sizeof(HALF));
+	XMConvertFloatToHalfStream((HALF *)Texture.Data.data(), sizeof(HALF), &Lightmap[0].x, sizeof(float), Lightmap.size() * 4);
+	return WriteDDSFile(Path, Texture);
+}
 
-		// Left Face
-		Vertex(-1.0f, -1.0f,  1.0f, 0.0f, 1.0f,-1.0f, -1.0f,  1.0f),
-		Vertex(-1.0f,  1.0f,  1.0f, 0.0f, 0.0f,-1.0f,  1.0f,  1.0f),
-		Vertex(-1.0f,  1.0f, -1.0f, 1.0f, 0.0f,-1.0f,  1.0f, -1.0f),
-		Vertex(-1.0f, -1.0f, -1.0f, 1.0f, 1.0f,-1.0f, -1.0f, -1.0f),
+// A slice per coefficient per z, coefficient after coefficient, which is how ProbeIrradiance reads them
+bool WriteProbeVolume(const char *Path, const ProbeVolume &Volume, const std::vector<XMFLOAT3> &Coefficients)
+{
+	int ProbeCount = Volume.CountX * Volume.CountY * Volume.CountZ;
+	std::vector<XMFLOAT4> Texels(ProbeCount * SH_COEFFICIENTS);
+	for (int p = 0; p < ProbeCount; ++p)
+	{
+		int Slice = p / (Volume.CountX * Volume.CountY), InSlice = p % (Volume.CountX * Volume.CountY);
+		for (int i = 0; i < SH_COEFFICIENTS; ++i)
+		{
+			const XMFLOAT3 &Coefficient = Coefficients[p * SH_COEFFICIENTS + i];
+			Texels[(i * Volume.CountZ + Slice) * Volume.CountX * Volume.CountY + InSlice] = XMFLOAT4(Coefficient.x, Coefficient.y, Coefficient.z, 1.0f);
+		}
+	}
 
-		// Right Face
-		Vertex(1.0f, -1.0f, -1.0f, 0.0f, 1.0f, 1.0f, -1.0f, -1.0f),
-		Vertex(1.0f,  1.0f, -1.0f, 0.0f, 0.0f, 1.0f,  1.0f, -1.0f),
-		Vertex(1.0f,  1.0f,  1.0f, 1.0f, 0.0f, 1.0f,  1.0f,  1.0f),
-		Vertex(1.0f, -1.0f,  1.0f, 1.0f, 1.0f, 1.0f, -1.0f,  1.0f),
-	};
+	CookedTexture Texture;
+	Texture.Codec = TEXTURE_CODEC_RGBA16F;
+	Texture.Format = DXGI_FORMAT_R16G16B16A16_FLOAT;
+	Texture.Width = Volume.CountX;
+	Texture.Height = Volume.CountY;
+	Texture.Depth = Volume.CountZ * SH_COEFFICIENTS;
+	Texture.MipCount = 1;
+	Texture.Data.resize(Texels.size() * 4 * sizeof(HALF));
+	XMConvertFloatToHalfStream((HALF *)Texture.Data.data(), sizeof(HALF), &Texels[0].x, sizeof(float), Texels.size() * 4);
+	return WriteDDSFile(Path, Texture);
+}
 
-	// Allows to use part of another triangle to use on another
-	DWORD Indices[] =
+// Unwraps the mesh, writes it back with its lightmap UVs, then bakes the lightmap and the probes around it
+int RunLightBake(int Samples)
+{
+	ClusterMesh Mesh = {};
+	if (!LoadClusterMesh(MeshPath, Mesh))
 	{
-		// Front Face
-		0,  1,  2,
-		0,  2,  3,
+		std::vector<Vertex> Vertices;
+		std::vector<DWORD> Indices;
+		BuildMeshletTestMesh(Vertices, Indices);
+		BuildMeshlets(Vertices, Indices, Mesh);
+	}
+	if (!UnwrapLightmap(Mesh, LIGHTMAP_SIZE))
+	{
+		printf("Couldn't fit the charts of %d meshlets into a %dx%d lightmap\n", (int)Mesh.Meshlets.size(), LIGHTMAP_SIZE, LIGHTMAP_SIZE);
+		return 1;
+	}
+	if (!WriteClusterMesh(MeshPath, Mesh))
+		return 1;
+
+	LARGE_INTEGER Frequency, Start, End;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Start);
+	XMMATRIX World = ClusterMeshWorld();
+	ProbeVolume Volume;
+	ComputeProbeVolume(Mesh, World, Volume);
+	BakeScene Scene;
+	if (!BuildBakeScene(Mesh, World, Volume, ScenePath, Scene))
+		return 1;
+	QueryPerformanceCounter(&End);
+	printf("Bake scene: %d mesh triangles and %d cubes from %s, %d BVH nodes %d levels deep over %d leaves, built in %.2f s\n",
+		Scene.MeshTriangles, Scene.CubeCount, ScenePath, (int)Scene.Nodes.size(), Scene.BvhDepth, (int)Scene.Packets.size(),
+		double(End.QuadPart - Start.QuadPart) / Frequency.QuadPart);
+
+	std::vector<LightmapTexel> Texels;
+	RasterizeLightmap(Mesh, World, Texels);
+	std::vector<XMFLOAT4> Lightmap;
+	BakeStats LightmapStats = BakeLightmap(Scene, Texels, LIGHTMAP_SIZE, Samples, JobThreadCount(), Lightmap);
+	DilateLightmap(Lightmap, LIGHTMAP_SIZE);
+	printf("Lightmap: %d texels (%.1f%% of %dx%d), %d paths each, %.1f M rays in %.2f s, %.1f M rays/s on %d threads\n",
+		(int)Texels.size(), 100.0 * Texels.size() / (LIGHTMAP_SIZE * LIGHTMAP_SIZE), LIGHTMAP_SIZE, LIGHTMAP_SIZE, Samples,
+		LightmapStats.Rays / 1e6, LightmapStats.Seconds, LightmapStats.Rays / 1e6 / max(LightmapStats.Seconds, 1e-9), JobThreadCount());
+
+	std::vector<XMFLOAT3> Coefficients;
+	BakeStats ProbeStats = BakeProbes(Scene, Volume, PROBE_SAMPLES, JobThreadCount(), Coefficients);
+	printf("Probes: %dx%dx%d every %.1f units, %d buried, %.1f M rays in %.2f s, %.1f M rays/s\n", Volume.CountX, Volume.CountY,
+		Volume.CountZ, Volume.Spacing, ProbeStats.BuriedProbes, ProbeStats.Rays / 1e6, ProbeStats.Seconds,
+		ProbeStats.Rays / 1e6 / max(ProbeStats.Seconds, 1e-9));
+
+	bool Written = WriteLightmap("Lightmap.dds", Lightmap, LIGHTMAP_SIZE) && WriteProbeVolume("Probes.dds", Volume, Coefficients);
+	ReleaseClusterMesh(Mesh);
+	return Written ? 0 : 1;
+}
 
-		// Back Face
-		4,  5,  6,
-		4,  6,  7,
+// Every triangle, for the BVH to be checked against
+static bool TraceBakeRayBruteForce(const BakeScene &Scene, const XMFLOAT3 &Origin, const XMFLOAT3 &Direction, BakeHit &Hit)
+{
+	Hit.Triangle = -1;
+	Hit.Distance = FLT_MAX;
+	XMVECTOR RayOrigin = XMLoadFloat3(&Origin), RayDirection = XMLoadFloat3(&Direction);
+	for (int t = 0; t < (int)Scene.Positions.size() / 3; ++t)
+	{
+		XMVECTOR P0 = XMLoadFloat3(&Scene.Positions[t * 3]);
+		XMVECTOR Edge1 = XMLoadFloat3(&Scene.Positions[t * 3 + 1]) - P0, Edge2 = XMLoadFloat3(&Scene.Positions[t * 3 + 2]) - P0;
+		XMVECTOR P = XMVector3Cross(RayDirection, Edge2);
+		float Determinant = XMVectorGetX(XMVector3Dot(Edge1, P));
+		if (fabsf(Determinant) <= 1e-12f)
+			continue;
+		XMVECTOR T = RayOrigin - P0, Q = XMVector3Cross(T, Edge1);
+		float U = XMVectorGetX(XMVector3Dot(T, P)) / Determinant, V = XMVectorGetX(XMVector3Dot(RayDirection, Q)) / Determinant;
+		float Distance = XMVectorGetX(XMVector3Dot(Edge2, Q)) / Determinant;
+		if (U >= 0.0f && V >= 0.0f && U + V <= 1.0f && Distance > 0.0f && Distance < Hit.Distance)
+		{
+			Hit.Distance = Distance;
+			Hit.Triangle = t;
+		}
+	}
+	return Hit.Triangle >= 0;
+}
 
-		// Top Face
-		8,  9, 10,
-		8, 10, 11,
+// Checks the unwrap and the BVH, then bakes a small lightmap on 1, 2, 4 ... threads to show how the bake scales and
+// that every thread count bakes the same thing
+int RunBakeTest()
+{
+	const int Size = 512;
+	const int Samples = 8;
+	std::vector<Vertex> Vertices;
+	std::vector<DWORD> Indices;
+	BuildMeshletTestMesh(Vertices, Indices);
+	ClusterMesh Mesh = {};
+	BuildMeshlets(Vertices, Indices, Mesh);
+
+	int Failures = 0;
+	if (!UnwrapLightmap(Mesh, Size))
+	{
+		printf("Bake test: couldn't unwrap the mesh into %dx%d\n", Size, Size);
+		return 1;
+	}
 
-		// Bottom Face
-		12, 13, 14,
-		12, 14, 15,
+	// Every chart inside the map, and the texels a bilinear lookup in one reaches are no other chart's
+	std::vector<int> Owners(Size * Size, -1);
+	for (int m = 0; m < (int)Mesh.Meshlets.size(); ++m)
+	{
+		const Meshlet &Cluster = Mesh.Meshlets[m];
+		float MinX = FLT_MAX, MinY = FLT_MAX, MaxX = -FLT_MAX, MaxY = -FLT_MAX;
+		for (UINT v = 0; v < Cluster.VertexCount; ++v)
+		{
+			const XMFLOAT2 &UV = Mesh.LightmapUVs[Cluster.VertexOffset + v];
+			MinX = min(MinX, UV.x * Size - 0.5f);
+			MinY = min(MinY, UV.y * Size - 0.5f);
+			MaxX = max(MaxX, UV.x * Size - 0.5f);
+			MaxY = max(MaxY, UV.y * Size - 0.5f);
+		}
+		if (MinX < 0.0f || MinY < 0.0f || MaxX + 1.0f >= Size || MaxY + 1.0f >= Size)
+		{
+			Failures++;
+			continue;
+		}
+		for (int Y = (int)floorf(MinY); Y <= (int)floorf(MaxY) + 1; ++Y)
+		{
+			for (int X = (int)floorf(MinX); X <= (int)floorf(MaxX) + 1; ++X)
+			{
+				Failures += Owners[Y * Size + X] >= 0 && Owners[Y * Size + X] != m;
+				Owners[Y * Size + X] = m;
+			}
+		}
+	}
+
+	XMMATRIX World = ClusterMeshWorld();
+	ProbeVolume Volume;
+	ComputeProbeVolume(Mesh, World, Volume);
+	BakeScene Scene;
+	Failures += !BuildBakeScene(Mesh, World, Volume, NULL, Scene);
+
+	// From all over the probe volume, the BVH finds the same nearest hit as testing every triangle
+	UINT Seed = 1;
+	int BvhFailures = 0;
+	for (int r = 0; r < 200; ++r)
+	{
+		XMFLOAT3 Origin(Volume.Origin.x + BakeRandom(Seed) * (Volume.CountX - 1) * Volume.Spacing,
+			Volume.Origin.y + BakeRandom(Seed) * (Volume.CountY - 1) * Volume.Spacing,
+			Volume.Origin.z + BakeRandom(Seed) * (Volume.CountZ - 1) * Volume.Spacing);
+		XMFLOAT3 Direction;
+		XMStoreFloat3(&Direction, XMVector3Normalize(XMVectorSet(BakeRandom(Seed) - 0.5f, BakeRandom(Seed) - 0.5f, BakeRandom(Seed) - 0.5f, 0.0f)));
+
+		BakeHit Hit, AnyHit, Reference;
+		bool Found = TraceBakeRay(Scene, Origin, Direction, FLT_MAX, false, Hit);
+		bool AnyFound = TraceBakeRay(Scene, Origin, Direction, FLT_MAX, true, AnyHit);
+		bool ReferenceFound = TraceBakeRayBruteForce(Scene, Origin, Direction, Reference);
+		BvhFailures += Found != ReferenceFound || AnyFound != ReferenceFound ||
+			(Found && fabsf(Hit.Distance - Reference.Distance) > 1e-4f * max(Reference.Distance, 1.0f));
+	}
+	Failures += BvhFailures;
+
+	std::vector<LightmapTexel> Texels;
+	RasterizeLightmap(Mesh, World, Texels);
+	printf("Bake test: %d meshlet charts in %dx%d, %d texels covered, %d triangles in %d BVH nodes %d levels deep, %d of 200 rays "
+		"off the reference\n", (int)Mesh.Meshlets.size(), Size, Size, (int)Texels.size(), Scene.MeshTriangles, (int)Scene.Nodes.size(),
+		Scene.BvhDepth, BvhFailures);
+
+	std::vector<XMFLOAT4> Reference, Lightmap;
+	double SingleThreadSeconds = 0.0;
+	for (int Threads = 1;; Threads = min(Threads * 2, JobThreadCount()))
+	{
+		BakeStats Stats = BakeLightmap(Scene, Texels, Size, Samples, Threads, Threads == 1 ? Reference : Lightmap);
+		if (Threads == 1)
+			SingleThreadSeconds = Stats.Seconds;
+		else
+			Failures += memcmp(Reference.data(), Lightmap.data(), Reference.size() * sizeof(XMFLOAT4)) != 0;
+		printf("  %2d threads: %.1f M rays in %.2f s, %.1f M rays/s, %.2fx\n", Threads, Stats.Rays / 1e6, Stats.Seconds,
+			Stats.Rays / 1e6 / max(Stats.Seconds, 1e-9), SingleThreadSeconds / max(Stats.Seconds, 1e-9));
+		if (Threads >= JobThreadCount())
+			break;
+	}
+
+	for (size_t i = 0; i < Reference.size(); ++i)
+		Failures += !(Reference[i].x >= 0.0f && Reference[i].x < 100.0f) || !(Reference[i].y >= 0.0f && Reference[i].y < 100.0f) ||
+			!(Reference[i].z >= 0.0f && Reference[i].z < 100.0f);
+
+	std::vector<XMFLOAT3> Coefficients;
+	BakeStats ProbeStats = BakeProbes(Scene, Volume, 64, JobThreadCount(), Coefficients);
+	for (size_t i = 0; i < Coefficients.size(); ++i)
+		Failures += !_finite(Coefficients[i].x) || !_finite(Coefficients[i].y) || !_finite(Coefficients[i].z) ||
+			(i % SH_COEFFICIENTS == 0 && (Coefficients[i].x < 0.0f || Coefficients[i].y < 0.0f || Coefficients[i].z < 0.0f));
+	printf("  %d probes, %d buried, %.1f M rays/s\n", (int)Coefficients.size() / SH_COEFFICIENTS, ProbeStats.BuriedProbes,
+		ProbeStats.Rays / 1e6 / max(ProbeStats.Seconds, 1e-9));
+	printf("  %d of the checks failed\n", Failures);
+
+	ReleaseClusterMesh(Mesh);
+	return Failures == 0 ? 0 : 1;
+}
+
+bool InitBakedLight()
+{
+	LightmapLoaded = false;
+	ProbesLoaded = false;
+
+	D3D11_BUFFER_DESC BufferDesc = {};
+	BufferDesc.Usage = D3D11_USAGE_DEFAULT;
+	BufferDesc.ByteWidth = sizeof(cbBakedLight);
+	BufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	HR(D3D11Device->CreateBuffer(&BufferDesc, NULL, &cbBakedLightBuffer));
+
+	// Clamped, so the probes at the edge of the volume don't blend with the far side of it
+	D3D11_SAMPLER_DESC SamplerDesc = {};
+	SamplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+	SamplerDesc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+	SamplerDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+	SamplerDesc.MaxLOD = D3D11_FLOAT32_MAX;
+	HR(D3D11Device->CreateSamplerState(&SamplerDesc, &BakedSamplerState));
+
+	// The probe volume goes with the mesh it was baked around, like the lightmap goes with its UVs
+	LightmapView = NULL;
+	ProbeVolumeView = NULL;
+	if (!MeshletsLoaded)
+		return true;
+
+	ProbeVolume &Volume = BakedProbeVolume;
+	ComputeProbeVolume(BigMesh, BigMeshWorld, Volume);
+	ID3D11Resource *Probes = NULL;
+	if (SUCCEEDED(CreateDDSTextureFromFile(D3D11Device, L"Probes.dds", &Probes, &ProbeVolumeView)))
+	{
+		ID3D11Texture3D *Texture;
+		D3D11_TEXTURE3D_DESC Desc = {};
+		if (SUCCEEDED(Probes->QueryInterface(__uuidof(ID3D11Texture3D), (void **)&Texture)))
+		{
+			Texture->GetDesc(&Desc);
+			Texture->Release();
+		}
+		Probes->Release();
+
+		ProbesLoaded = Desc.Width == (UINT)Volume.CountX && Desc.Height == (UINT)Volume.CountY && Desc.Depth == (UINT)(Volume.CountZ * SH_COEFFICIENTS);
+		if (!ProbesLoaded)
+		{
+			printf("Probes.dds was baked around another mesh, run -bakelight again\n");
+			ProbeVolumeView->Release();
+			ProbeVolumeView = NULL;
+		}
+	}
+
+	cbBakedLight Constants;
+	Constants.ProbeOrigin = XMFLOAT4(Volume.Origin.x, Volume.Origin.y, Volume.Origin.z, 1.0f / Volume.Spacing);
+	Constants.ProbeCounts = XMFLOAT4((float)Volume.CountX, (float)Volume.CountY, (float)Volume.CountZ, 1.0f / PROBE_FADE_DISTANCE);
+	D3D11DeviceContext->UpdateSubresource(cbBakedLightBuffer, 0, NULL, &Constants, 0, 0);
+
+	if (BigMesh.LightmapUVs.empty() || FAILED(CreateDDSTextureFromFile(D3D11Device, L"Lightmap.dds", NULL, &LightmapView)))
+		return true;
+	LightmapLoaded = true;
+
+	HR(GetArchivedShaderCode(ARCHIVED_SHADER_LIGHTMAPPED_VS, &LightmappedVSBuffer));
+	HR(GetArchivedShaderCode(ARCHIVED_SHADER_LIGHTMAPPED_PS, &LightmappedPSBuffer));
+	HR(D3D11Device->CreateVertexShader(LightmappedVSBuffer->GetBufferPointer(), LightmappedVSBuffer->GetBufferSize(), 0, &LightmappedVS));
+	HR(D3D11Device->CreatePixelShader(LightmappedPSBuffer->GetBufferPointer(), LightmappedPSBuffer->GetBufferSize(), 0, &LightmappedPS));
+	HR(D3D11Device->CreateInputLayout(LightmappedLayout, ARRAYSIZE(LightmappedLayout), LightmappedVSBuffer->GetBufferPointer(),
+		LightmappedVSBuffer->GetBufferSize(), &LightmappedVertexLayout));
+	return true;
+}
+
+bool OverlapsProbeVolume(FXMVECTOR Center, float Radius)
+{
+	if (!ProbesLoaded)
+		return false;
+
+	const ProbeVolume &Volume = BakedProbeVolume;
+	XMVECTOR Min = XMLoadFloat3(&Volume.Origin);
+	XMVECTOR Max = Min + XMVectorSet((float)(Volume.CountX - 1), (float)(Volume.CountY - 1), (float)(Volume.CountZ - 1), 0.0f) * Volume.Spacing;
+	XMVECTOR Outside = XMVectorMax(XMVectorMax(Min - Center, Center - Max), XMVectorZero());
+	return XMVectorGetX(XMVector3Length(Outside)) - Radius < PROBE_FADE_DISTANCE;
+}
+
+void ReleaseBakedLight()
+{
+	cbBakedLightBuffer->Release();
+	BakedSamplerState->Release();
+	if (ProbesLoaded)
+		ProbeVolumeView->Release();
+	if (!LightmapLoaded)
+		return;
+	LightmapView->Release();
+	LightmappedVS->Release();
+	LightmappedPS->Release();
+	LightmappedVSBuffer->Release();
+	LightmappedPSBuffer->Release();
+	LightmappedVertexLayout->Release();
+}
+
+void BindBakedLight()
+{
+	if (!ProbesLoaded && !LightmapLoaded)
+		return;
+
+	ID3D11ShaderResourceView *Views[2] = { LightmapView, ProbeVolumeView };
+	Bind()->PSSetConstantBuffers(6, 1, &cbBakedLightBuffer);
+	Bind()->PSSetShaderResources(4, 2, Views);
+	Bind()->PSSetSamplers(3, 1, &BakedSamplerState);
+}
+
+// Every loop takes the first task whose dependencies are done until there is none left to start. The tasks were added
+// after what they depend on, so the first one not started yet always can once the running ones are done.
+static void RunStartupTasks(void *Data, int Begin, int End)
+{
+	StartupGraph &Graph = *(StartupGraph *)Data;
+	std::unique_lock<std::mutex> Guard(Graph.Lock);
+	for (;;)
+	{
+		int Next = -1;
+		bool Blocked = false;
+		for (int i = 0; i < Graph.TaskCount && Next < 0; ++i)
+		{
+			const StartupTask &Task = Graph.Tasks[i];
+			if (Task.Started)
+				continue;
+
+			bool Ready = true;
+			for (int d = 0; d < Task.DependencyCount; ++d)
+				Ready = Ready && Graph.Tasks[Task.Dependencies[d]].Done;
+			if (Ready)
+				Next = i;
+			else
+				Blocked = true;
+		}
+
+		if (Graph.FailedTask >= 0 || (Next < 0 && !Blocked))
+			return;
+		if (Next < 0)
+		{
+			Graph.Ready.wait(Guard);
+			continue;
+		}
+
+		StartupTask &Task = Graph.Tasks[Next];
+		Task.Started = true;
+		Task.Thread = Begin;
+		Guard.unlock();
+
+		QueryPerformanceCounter(&Task.Start);
+		bool Succeeded = Task.Function(Task.Data);
+		QueryPerformanceCounter(&Task.End);
+
+		Guard.lock();
+		Task.Done = true;
+		if (!Succeeded && Graph.FailedTask < 0)
+			Graph.FailedTask = Next;
+		Graph.Ready.notify_all();
+	}
+}
+
+void ResetStartupGraph(StartupGraph &Graph)
+{
+	Graph.TaskCount = 0;
+	Graph.FailedTask = -1;
+	Graph.Threads = 0;
+	Graph.Begin.QuadPart = 0;
+	Graph.End.QuadPart = 0;
+}
+
+int AddStartupTask(StartupGraph &Graph, const char *Name, StartupFunction Function, void *Data)
+{
+	if (Graph.TaskCount == STARTUP_MAX_TASKS)
+		return -1;
+
+	StartupTask &Task = Graph.Tasks[Graph.TaskCount];
+	Task = StartupTask();
+	Task.Name = Name;
+	Task.Function = Function;
+	Task.Data = Data;
+	Task.Thread = -1;
+	return Graph.TaskCount++;
+}
+
+void AddStartupDependency(StartupGraph &Graph, int Task, int DependsOn)
+{
+	if (Task < 0 || DependsOn < 0 || DependsOn >= Task)
+		return;
+
+	StartupTask &Dependent = Graph.Tasks[Task];
+	if (Dependent.DependencyCount < STARTUP_MAX_DEPENDENCIES)
+		Dependent.Dependencies[Dependent.DependencyCount++] = DependsOn;
+}
+
+void RecordStartupStep(StartupGraph &Graph, const char *Name, LARGE_INTEGER Start, LARGE_INTEGER End)
+{
+	int Step = AddStartupTask(Graph, Name, NULL, NULL);
+	if (Step < 0)
+		return;
+
+	StartupTask &Task = Graph.Tasks[Step];
+	Task.Started = true;
+	Task.Done = true;
+	Task.Start = Start;
+	Task.End = End;
+}
+
+bool RunStartupGraph(StartupGraph &Graph, int Threads)
+{
+	Graph.Threads = max(min(Threads, JobThreadCount()), 1);
+
+	QueryPerformanceCounter(&Graph.Begin);
+	ParallelFor(Graph.Threads, 1, RunStartupTasks, &Graph);
+	QueryPerformanceCounter(&Graph.End);
+
+	return Graph.FailedTask < 0;
+}
+
+void PrintStartupTimeline(FILE *Stream, const StartupGraph &Graph, LARGE_INTEGER Origin, LARGE_INTEGER End, const char *Title)
+{
+	float Total = max(CounterMs(Origin, End), 0.001f);
+	float Work = 0.0f;
+	int Order[STARTUP_MAX_TASKS];
+	int Count = 0;
+	for (int i = 0; i < Graph.TaskCount; ++i)
+	{
+		const StartupTask &Task = Graph.Tasks[i];
+		if (!Task.Done)
+			continue;
+		if (Task.Thread >= 0)
+			Work += CounterMs(Task.Start, Task.End);
+		Order[Count++] = i;
+	}
+	std::sort(Order, Order + Count, [&Graph](int a, int b) { return Graph.Tasks[a].Start.QuadPart < Graph.Tasks[b].Start.QuadPart; });
+
+	fprintf(Stream, "Startup: %.1f ms %s, the graph ran %.1f ms of tasks in %.1f ms on %d thread(s)\n", Total, Title, Work,
+		CounterMs(Graph.Begin, Graph.End), Graph.Threads);
+	for (int i = 0; i < Count; ++i)
+	{
+		const StartupTask &Task = Graph.Tasks[Order[i]];
+		float Start = CounterMs(Origin, Task.Start);
+		float Finish = CounterMs(Origin, Task.End);
+
+		char Bar[STARTUP_TIMELINE_WIDTH + 1];
+		int First = min((int)(Start / Total * STARTUP_TIMELINE_WIDTH), STARTUP_TIMELINE_WIDTH - 1);
+		int Last = min(max((int)(Finish / Total * STARTUP_TIMELINE_WIDTH), First), STARTUP_TIMELINE_WIDTH - 1);
+		for (int c = 0; c < STARTUP_TIMELINE_WIDTH; ++c)
+			Bar[c] = c >= First && c <= Last ? '#' : ' ';
+		Bar[STARTUP_TIMELINE_WIDTH] = 0;
+
+		char Thread[16];
+		if (Task.Thread < 0)
+			strcpy_s(Thread, "main");
+		else
+			sprintf_s(Thread, "thread %d", Task.Thread);
+		fprintf(Stream, "  %-20s %8.1f %8.1f ms  %-9s |%s|\n", Task.Name, Start, Finish, Thread, Bar);
+	}
+}
+
+void ReportStartup(LARGE_INTEGER End, const char *Title)
+{
+	PrintStartupTimeline(stdout, Startup, StartupBegin, End, Title);
+
+	FILE *Log;
+	if (fopen_s(&Log, STARTUP_LOG_PATH, "w") != 0)
+		return;
+	PrintStartupTimeline(Log, Startup, StartupBegin, End, Title);
+	fclose(Log);
+}
+
+static StartupShaderCompile SceneShaderCompiles[] =
+{
+	{ "Compile VS", "VS", "vs_5_0", &VSBuffer },
+	{ "Compile PS", "PS", "ps_5_0", &PSBuffer },
+	{ "Compile D2D_PS", "D2D_PS", "ps_5_0", &D2D_PS_Buffer },
+};
+
+static bool StartupCompileShader(void *Data)
+{
+	const StartupShaderCompile &Compile = *(const StartupShaderCompile *)Data;
+	*Compile.Blob = NULL;
+	HR(D3DCompileFromFile(L"Effects.fx", 0, 0, Compile.Entry, Compile.Target, 0, 0, Compile.Blob, 0));
+	return *Compile.Blob != NULL;
+}
+
+// WIC wants COM on the thread that decodes
+static bool DecodeStartupImage(const wchar_t *Path, CookImage &Image)
+{
+	HRESULT Com = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	bool Decoded = DecodeImageFile(Path, Image);
+	if (SUCCEEDED(Com))
+		CoUninitialize();
+	return Decoded;
+}
+
+// The block compressed one from -cooktextures when it is there, read as is. Otherwise test.png, decoded.
+static bool StartupLoadCubeTexture(void *Data)
+{
+	SceneStartup &State = *(SceneStartup *)Data;
+
+	FILE *File;
+	if (fopen_s(&File, "test.dds", "rb") == 0)
+	{
+		fseek(File, 0, SEEK_END);
+		long Size = ftell(File);
+		fseek(File, 0, SEEK_SET);
+		if (Size > 0)
+		{
+			State.CubeTextureDDS.resize(Size);
+			if (fread(State.CubeTextureDDS.data(), 1, State.CubeTextureDDS.size(), File) != State.CubeTextureDDS.size())
+				State.CubeTextureDDS.clear();
+		}
+		fclose(File);
+		if (!State.CubeTextureDDS.empty())
+			return true;
+	}
+
+	return DecodeStartupImage(L"test.png", State.CubeTextureImage);
+}
+
+static bool StartupTextFactories(void *Data)
+{
+	SceneStartup &State = *(SceneStartup *)Data;
+	return InitTextFactories(&State.D2DFactory);
+}
+
+static bool StartupDevice(void *Data)
+{
+	return CreateD3DDevice(*(SceneStartup *)Data);
+}
+
+static bool StartupTextTarget(void *Data)
+{
+	SceneStartup &State = *(SceneStartup *)Data;
+	bool Created = InitD2D_D3D11_DWrite(State.Adapter, State.D2DFactory);
+	State.D2DFactory->Release();
+	State.D2DFactory = NULL;
+	State.Adapter->Release();
+	State.Adapter = NULL;
+
+	if (Created)
+		InitD2DScreenTexture();
+	return Created;
+}
+
+static bool StartupSceneShaders(void *Data)
+{
+	// Create the Shader object
+	HR(D3D11Device->CreateVertexShader(VSBuffer->GetBufferPointer(), VSBuffer->GetBufferSize(), 0, &VertexShader));
+	HR(D3D11Device->CreatePixelShader(PSBuffer->GetBufferPointer(), PSBuffer->GetBufferSize(), 0, &PixelShader));
+	HR(D3D11Device->CreatePixelShader(D2D_PS_Buffer->GetBufferPointer(), D2D_PS_Buffer->GetBufferSize(), 0, &D2D_PS));
+
+	// Create the Input Layout
+	HR(D3D11Device->CreateInputLayout(Layout, NumLayoutElements, VSBuffer->GetBufferPointer(), VSBuffer->GetBufferSize(), &VertexLayout));
 
-		// Left Face
-		16, 17, 18,
-		16, 18, 19,
+	return true;
+}
 
-		// Right Face
-		20, 21, 22,
-		20, 22, 23
-	};
+static bool StartupSceneBuffers(void *Data)
+{
+	Vertex Vertices[CUBE_VERTEX_COUNT];
+	DWORD Indices[CUBE_INDEX_COUNT];
+	BuildCubeGeometry(Vertices, Indices, 0);
 
 	// Describe our Index Buffer
 	D3D11_BUFFER_DESC IndexBufferDesc = {};
-	IndexBufferDesc.ByteWidth = sizeof(DWORD) * 12 * 3;
+	IndexBufferDesc.ByteWidth = sizeof(DWORD) * CUBE_INDEX_COUNT;
 	IndexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
 	IndexBufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
 
@@ -719,12 +12490,9 @@ bool InitScene()
 	IndexBufferData.pSysMem = Indices;
 	HR(D3D11Device->CreateBuffer(&IndexBufferDesc, &IndexBufferData, &SquareIndexBuffer));
 
-	// Bind the Index Buffer in the IA (first stage)
-	D3D11DeviceContext->IASetIndexBuffer(SquareIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
-
 	// Describe our Vertex Buffer
 	D3D11_BUFFER_DESC VertexBufferDesc = {};
-	VertexBufferDesc.ByteWidth = sizeof(Vertex) * 24;
+	VertexBufferDesc.ByteWidth = sizeof(Vertex) * CUBE_VERTEX_COUNT;
 	VertexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
 	VertexBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
 
@@ -734,33 +12502,6 @@ bool InitScene()
 	VertexBufferData.pSysMem = Vertices;
 	HR(D3D11Device->CreateBuffer(&VertexBufferDesc, &VertexBufferData, &SquareVertexBuffer));
 
-	// Now we need to bind our Vertex Buffer to the IA (first stage)
-	UINT Stride = sizeof(Vertex);
-	UINT Offset = 0;
-	D3D11DeviceContext->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
-
-	// Create the Input Layout
-	HR(D3D11Device->CreateInputLayout(Layout, NumLayoutElements, VSBuffer->GetBufferPointer(), VSBuffer->GetBufferSize(), &VertexLayout));
-	// Bind the Layout to the IA as the Active Layout.
-	D3D11DeviceContext->IASetInputLayout(VertexLayout);
-
-	// Set the Primitive Topology of the IA
-	// Create a triangle; Every 3 vertices will make a triangle. 
-	D3D11DeviceContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-
-	// Create and set our viewport.
-	// Tells the RS stage what to draw.
-	// Creates a square in pixels which the rasterizer uses to find where to display our geometry on the client area of our window.
-	D3D11_VIEWPORT Viewport = {};
-	Viewport.TopLeftX = 0;
-	Viewport.TopLeftY = 0;
-	Viewport.Width = Width;
-	Viewport.Height = Height;
-	Viewport.MinDepth = 0.0f; // Closest value in Depth
-	Viewport.MaxDepth = 1.0f; // Furthest value in Depth
-
-	D3D11DeviceContext->RSSetViewports(1, &Viewport);
-
 	// Create Constant Buffer
 	D3D11_BUFFER_DESC ConstantBufferDesc = {};
 	ConstantBufferDesc.ByteWidth = sizeof(cbPerObject);
@@ -772,26 +12513,12 @@ bool InitScene()
 	ConstantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
 	HR(D3D11Device->CreateBuffer(&ConstantBufferDesc, 0, &cbPerFrameBuffer));
 
-	// Setup Camera
-	CameraPosition = XMVectorSet(0.0f, 3.0f, -8.0f, 0.0f);
-	CameraTarget = XMVectorSet(0.0f, 0.0f, 0.0f, 0.0f);
-	CameraUp = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
-
-	// Create the Viewspace
-	CameraView = XMMatrixLookAtLH(CameraPosition, CameraTarget, CameraUp);
-	
-	// Create projection space
-	CameraProjection = XMMatrixPerspectiveFovLH((0.4f * 3.14f), (float)Width / Height, 1.0f, 1000.0f);
-
 	// Setup the Rasterizer for Wireframe
 	D3D11_RASTERIZER_DESC RasterizerDesc = {};
 	RasterizerDesc.FillMode = D3D11_FILL_SOLID;
 	RasterizerDesc.CullMode = D3D11_CULL_NONE;
 	HR(D3D11Device->CreateRasterizerState(&RasterizerDesc, &NoCullMode));
 
-	// Load Texture File
-	HR(CreateWICTextureFromFile(D3D11Device, L"test.png", NULL, &CubeTexture));
-
 	// Describe Sample State (How the shader will render the texture)
 	D3D11_SAMPLER_DESC SamplerDesc = {};
 	SamplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
@@ -830,264 +12557,309 @@ bool InitScene()
 	CMDesc.FrontCounterClockwise = false;
 	HR(D3D11Device->CreateRasterizerState(&CMDesc, &CWCullMode));
 
-
 	return true;
 }
 
-void UpdateScene(double time)
+// One mip like the WIC loader made without a context to generate the rest on
+static bool StartupCubeTexture(void *Data)
 {
-	Rot += 1.0f * time;
-	if (Rot > 6.28f) // 2pi
-		Rot = 0.0f;
-
-	Cube1World = XMMatrixIdentity();
-
-	XMVECTOR RotYAxis = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
-	XMVECTOR RotZAxis = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f);
-	XMVECTOR RotXAxis = XMVectorSet(1.0f, 0.0f, 0.0f, 0.0f);
-
-	Rotation = XMMatrixRotationAxis(RotYAxis, Rot);
-	RotationX = XMMatrixRotationAxis(RotXAxis, RotX);
-	RotationZ = XMMatrixRotationAxis(RotZAxis, RotZ);
-	Translation = XMMatrixTranslation(0.0f, 0.0f, 4.0f);
+	SceneStartup &State = *(SceneStartup *)Data;
+	bool Created = !State.CubeTextureDDS.empty() &&
+		SUCCEEDED(CreateDDSTextureFromMemory(D3D11Device, State.CubeTextureDDS.data(), State.CubeTextureDDS.size(), NULL, &CubeTexture));
 
-	Cube1World = Translation * Rotation * RotationX * RotationZ;
-
-	XMVECTOR LightVector = XMVectorZero();
-	LightVector = XMVector3TransformCoord(LightVector, Cube1World);
-	light.pos.x = XMVectorGetX(LightVector);
-	light.pos.y = XMVectorGetY(LightVector);
-	light.pos.z = XMVectorGetZ(LightVector);
+	// A test.dds the loader won't take falls back to test.png
+	if (!Created && (!State.CubeTextureImage.Pixels.empty() || DecodeStartupImage(L"test.png", State.CubeTextureImage)))
+	{
+		const CookImage &Image = State.CubeTextureImage;
+		D3D11_TEXTURE2D_DESC TextureDesc = {};
+		TextureDesc.Width = Image.Width;
+		TextureDesc.Height = Image.Height;
+		TextureDesc.MipLevels = 1;
+		TextureDesc.ArraySize = 1;
+		// Like the _SRGB format the cooker writes into test.dds
+		TextureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+		TextureDesc.SampleDesc.Count = 1;
+		TextureDesc.Usage = D3D11_USAGE_DEFAULT;
+		TextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+		D3D11_SUBRESOURCE_DATA TextureData = {};
+		TextureData.pSysMem = Image.Pixels.data();
+		TextureData.SysMemPitch = Image.Width * 4;
+
+		ID3D11Texture2D *Texture;
+		if (SUCCEEDED(D3D11Device->CreateTexture2D(&TextureDesc, &TextureData, &Texture)))
+		{
+			Created = SUCCEEDED(D3D11Device->CreateShaderResourceView(Texture, NULL, &CubeTexture));
+			Texture->Release();
+		}
+	}
 
-	Cube2World = XMMatrixIdentity();
-	Rotation = XMMatrixRotationAxis(RotYAxis, -Rot);
-	Scale = XMMatrixScaling(ScaleX, ScaleY, 1.3f);
-	Cube2World = Rotation * Scale;
+	State.CubeTextureDDS.clear();
+	State.CubeTextureDDS.shrink_to_fit();
+	State.CubeTextureImage.Pixels.clear();
+	State.CubeTextureImage.Pixels.shrink_to_fit();
+	return Created;
 }
 
-void DrawScene()
+static bool StartupUpscale(void *Data)
 {
-	// Clear backbuffer
-	FLOAT bgColor[4] = { Red, Green, Blue, 0.0f };
-	D3D11DeviceContext->ClearRenderTargetView(RenderTargetView, bgColor);
-	D3D11DeviceContext->ClearDepthStencilView(DepthStencilView, D3D11_CLEAR_DEPTH | D3D11_CLEAR_STENCIL, 1.0f, 0);
-
-	constBufferPerFrame.light = light;
-	D3D11DeviceContext->UpdateSubresource(cbPerFrameBuffer, 0, NULL, &constBufferPerFrame, 0, 0);
-	D3D11DeviceContext->PSSetConstantBuffers(0, 1, &cbPerFrameBuffer);
-
-	D3D11DeviceContext->VSSetShader(VertexShader, 0, 0);
-	D3D11DeviceContext->PSSetShader(PixelShader, 0, 0);
-
-	D3D11DeviceContext->OMSetRenderTargets(1, &RenderTargetView, DepthStencilView);
-	D3D11DeviceContext->OMSetBlendState(0, 0, 0xffffffff);
-
-	D3D11DeviceContext->IASetIndexBuffer(SquareIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
-	UINT Stride = sizeof(Vertex);
-	UINT Offset = 0;
-	D3D11DeviceContext->IASetVertexBuffers(0, 1, &SquareVertexBuffer, &Stride, &Offset);
-
-
-	WVP = Cube1World * CameraView * CameraProjection;
-	cbPerObj.World = XMMatrixTranspose(Cube1World);
-	cbPerObj.WVP = XMMatrixTranspose(WVP);
-	D3D11DeviceContext->UpdateSubresource(cbPerObjectBuffer, 0, NULL, &cbPerObj, 0, 0);
-	D3D11DeviceContext->VSSetConstantBuffers(0, 1, &cbPerObjectBuffer);
-	D3D11DeviceContext->PSSetShaderResources(0, 1, &CubeTexture);
-	D3D11DeviceContext->PSSetSamplers(0, 1, &CubeTextureSamplerState);
-
-	D3D11DeviceContext->RSSetState(CWCullMode);
-	D3D11DeviceContext->DrawIndexed(36, 0, 0);
-
-	WVP = Cube2World * CameraView * CameraProjection;
-	cbPerObj.World = XMMatrixTranspose(Cube2World);
-	cbPerObj.WVP = XMMatrixTranspose(WVP);
-	D3D11DeviceContext->UpdateSubresource(cbPerObjectBuffer, 0, NULL, &cbPerObj, 0, 0);
-	D3D11DeviceContext->VSSetConstantBuffers(0, 1, &cbPerObjectBuffer);
-	D3D11DeviceContext->PSSetShaderResources(0, 1, &CubeTexture);
-	D3D11DeviceContext->PSSetSamplers(0, 1, &CubeTextureSamplerState);
-
-	D3D11DeviceContext->RSSetState(CWCullMode);
-	D3D11DeviceContext->DrawIndexed(36, 0, 0);
-
-	RenderText(L"FPS: ", FPS);
+	return InitDynamicResolution();
+}
 
-	// Swap the front buffer with the backbuffer
-	SwapChain->Present(0, 0);
+static bool StartupShaderPermutations(void *Data)
+{
+	return InitShaderPermutations("Shaders.bin");
 }
 
-bool InitD2D_D3D11_DWrite(IDXGIAdapter1 *Adapter)
+// What only reads files and doesn't need the device
+static void AddLoadingTasks(StartupGraph &Graph, SceneStartup &State, int *Compiles, int &TextureFile, int &TextFactories)
 {
-	D3D10CreateDevice1(Adapter, D3D10_DRIVER_TYPE_HARDWARE, NULL, D3D10_CREATE_DEVICE_DEBUG | D3D10_CREATE_DEVICE_BGRA_SUPPORT,
-		D3D10_FEATURE_LEVEL_10_1, D3D10_1_SDK_VERSION, &D3D101Device);
+	for (int i = 0; i < (int)ARRAYSIZE(SceneShaderCompiles); ++i)
+		Compiles[i] = AddStartupTask(Graph, SceneShaderCompiles[i].Name, StartupCompileShader, &SceneShaderCompiles[i]);
+	TextureFile = AddStartupTask(Graph, "Load test texture", StartupLoadCubeTexture, &State);
+	TextFactories = AddStartupTask(Graph, "Text factories", StartupTextFactories, &State);
+}
 
-	D3D11_TEXTURE2D_DESC SharedTextureDesc = {};
-	SharedTextureDesc.Width = Width;
-	SharedTextureDesc.Height = Height;
-	SharedTextureDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-	SharedTextureDesc.MipLevels = 1;
-	SharedTextureDesc.ArraySize = 1;
-	SharedTextureDesc.SampleDesc.Count = 1;
-	SharedTextureDesc.Usage = D3D11_USAGE_DEFAULT;
-	SharedTextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
-	SharedTextureDesc.MiscFlags = D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX;
-	HR(D3D11Device->CreateTexture2D(&SharedTextureDesc, NULL, &SharedTexture1));
-	HR(SharedTexture1->QueryInterface(__uuidof(IDXGIKeyedMutex), (void **)&KeyedMutex1));
+// Ahead of the rest when a thread frees up: the device, as nearly everything waits on it, and then the shader
+// permutations, which compile longest when Shaders.bin is out of date
+void BuildSceneStartup(StartupGraph &Graph, SceneStartup &State)
+{
+	int Device = AddStartupTask(Graph, "Device", StartupDevice, &State);
 
-	IDXGIResource *SharedResource10;
-	HANDLE SharedHandle10;
+	int Compiles[ARRAYSIZE(SceneShaderCompiles)];
+	int TextureFile, TextFactories;
+	AddLoadingTasks(Graph, State, Compiles, TextureFile, TextFactories);
 
-	HR(SharedTexture1->QueryInterface(__uuidof(IDXGIResource), (void **)&SharedResource10));
-	HR(SharedResource10->GetSharedHandle(&SharedHandle10));
-	SharedResource10->Release();
+	int Permutations = AddStartupTask(Graph, "Shader permutations", StartupShaderPermutations, NULL);
+	AddStartupDependency(Graph, Permutations, Device);
 
-	IDXGISurface1 *SharedSurface10;
-	HR(D3D101Device->OpenSharedResource(SharedHandle10, __uuidof(IDXGISurface1), (void **)(&SharedSurface10)));
-	HR(SharedSurface10->QueryInterface(__uuidof(IDXGIKeyedMutex), (void **)&KeyedMutex0));
+	int Upscale = AddStartupTask(Graph, "Upscale pass", StartupUpscale, NULL);
+	AddStartupDependency(Graph, Upscale, Device);
 
-	ID2D1Factory *D2DFactory;
-	HR(D2D1CreateFactory(D2D1_FACTORY_TYPE_SINGLE_THREADED, __uuidof(ID2D1Factory), (void **)&D2DFactory));
+	int TextTarget = AddStartupTask(Graph, "Text target", StartupTextTarget, &State);
+	AddStartupDependency(Graph, TextTarget, Device);
+	AddStartupDependency(Graph, TextTarget, TextFactories);
 
-	D2D1_RENDER_TARGET_PROPERTIES RenderTargetProperties = {};
-	RenderTargetProperties.type = D2D1_RENDER_TARGET_TYPE_HARDWARE;
-	RenderTargetProperties.pixelFormat = D2D1::PixelFormat(DXGI_FORMAT_UNKNOWN, D2D1_ALPHA_MODE_PREMULTIPLIED);
+	int Shaders = AddStartupTask(Graph, "Scene shaders", StartupSceneShaders, NULL);
+	AddStartupDependency(Graph, Shaders, Device);
+	for (int i = 0; i < (int)ARRAYSIZE(Compiles); ++i)
+		AddStartupDependency(Graph, Shaders, Compiles[i]);
 
-	HR(D2DFactory->CreateDxgiSurfaceRenderTarget(SharedSurface10, &RenderTargetProperties, &D2DRenderTarget));
-	SharedSurface10->Release();
-	D2DFactory->Release();
+	int Buffers = AddStartupTask(Graph, "Scene buffers", StartupSceneBuffers, NULL);
+	AddStartupDependency(Graph, Buffers, Device);
 
-	HR(D2DRenderTarget->CreateSolidColorBrush(D2D1::ColorF(1.0f, 1.0f, 0.0f, 1.0f), &Brush));
-	HR(DWriteCreateFactory(DWRITE_FACTORY_TYPE_SHARED, __uuidof(IDWriteFactory), reinterpret_cast<IUnknown **>(&DWriteFactory)));
+	int Texture = AddStartupTask(Graph, "Cube texture", StartupCubeTexture, &State);
+	AddStartupDependency(Graph, Texture, Device);
+	AddStartupDependency(Graph, Texture, TextureFile);
+}
 
-	HR(DWriteFactory->CreateTextFormat(L"Script",
-		NULL,
-		DWRITE_FONT_WEIGHT_REGULAR,
-		DWRITE_FONT_STYLE_NORMAL,
-		DWRITE_FONT_STRETCH_NORMAL,
-		24.0f,
-		L"en-us",
-		&TextFormat));
+// Stand ins for startup tasks that only take time, and maybe fail, so the test knows what order they must run in
+struct SyntheticStartupTask
+{
+	const char *Name;
+	DWORD Milliseconds;
+	bool Fails;
+	// -1 for none
+	int Dependencies[2];
+};
 
-	HR(TextFormat->SetTextAlignment(DWRITE_TEXT_ALIGNMENT_LEADING));
-	HR(TextFormat->SetParagraphAlignment(DWRITE_PARAGRAPH_ALIGNMENT_NEAR));
+// A chain beside a task that doesn't depend on it, and a task joining both
+static const SyntheticStartupTask SyntheticChainTasks[] =
+{
+	{ "Chain 1", 10, false, { -1, -1 } },
+	{ "Chain 2", 10, false, { 0, -1 } },
+	{ "Chain 3", 10, false, { 1, -1 } },
+	{ "Beside the chain", 25, false, { -1, -1 } },
+	{ "Join", 5, false, { 2, 3 } },
+};
 
-	D3D101Device->IASetPrimitiveTopology(D3D10_PRIMITIVE_TOPOLOGY_POINTLIST);
+// The slow task is still running when the other one fails, and whatever depends on either must not start
+static const SyntheticStartupTask SyntheticFailureTasks[] =
+{
+	{ "Slow", 40, false, { -1, -1 } },
+	{ "Fails", 10, true, { -1, -1 } },
+	{ "After the failure", 5, false, { 1, -1 } },
+	{ "After the slow one", 5, false, { 0, -1 } },
+};
 
-	return true;
+static bool StartupSyntheticTask(void *Data)
+{
+	const SyntheticStartupTask &Task = *(const SyntheticStartupTask *)Data;
+	Sleep(Task.Milliseconds);
+	return !Task.Fails;
 }
 
-void InitD2DScreenTexture()
+static void AddSyntheticTasks(StartupGraph &Graph, const SyntheticStartupTask *Tasks, int Count)
 {
-	//Create the vertex buffer
-	Vertex v[] =
+	for (int i = 0; i < Count; ++i)
 	{
-		// Front Face
-		Vertex(-1.0f, -1.0f, -1.0f, 0.0f, 1.0f,-1.0f, -1.0f, -1.0f),
-		Vertex(-1.0f,  1.0f, -1.0f, 0.0f, 0.0f,-1.0f,  1.0f, -1.0f),
-		Vertex(1.0f,  1.0f, -1.0f, 1.0f, 0.0f, 1.0f,  1.0f, -1.0f),
-		Vertex(1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f, -1.0f, -1.0f),
-	};
-
-	DWORD indices[] = {
-		// Front Face
-		0,  1,  2,
-		0,  2,  3,
-	};
-
-	D3D11_BUFFER_DESC IndexBufferDesc = {};
-	IndexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
-	IndexBufferDesc.ByteWidth = sizeof(DWORD) * 2 * 3;
-	IndexBufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-
-	D3D11_SUBRESOURCE_DATA IndexInitData;
-	IndexInitData.pSysMem = indices;
-	D3D11Device->CreateBuffer(&IndexBufferDesc, &IndexInitData, &D2DIndexBuffer);
-
-	D3D11_BUFFER_DESC VertexBufferDesc = {};
-	VertexBufferDesc.Usage = D3D11_USAGE_DEFAULT;
-	VertexBufferDesc.ByteWidth = sizeof(Vertex) * 4;
-	VertexBufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-
-	D3D11_SUBRESOURCE_DATA VertexInitData;
-	VertexInitData.pSysMem = v;
-	D3D11Device->CreateBuffer(&VertexBufferDesc, &VertexInitData, &D2DVertBuffer);
-
-	D3D11Device->CreateShaderResourceView(SharedTexture1, NULL, &D2DTexture);
+		int Task = AddStartupTask(Graph, Tasks[i].Name, StartupSyntheticTask, (void *)&Tasks[i]);
+		for (int d = 0; d < ARRAYSIZE(Tasks[i].Dependencies); ++d)
+			AddStartupDependency(Graph, Task, Tasks[i].Dependencies[d]);
+	}
 }
 
-void RenderText(std::wstring text, int inInt)
+// Tasks that started before what they depend on was done
+static int CountStartupOrderViolations(const StartupGraph &Graph)
 {
-	KeyedMutex1->ReleaseSync(0);
-	KeyedMutex0->AcquireSync(0, 5);
-	D2DRenderTarget->BeginDraw();
-
-	D2DRenderTarget->Clear(D2D1::ColorF(0.0f, 0.0f, 0.0f, 0.0f));
-
-	std::wostringstream PrintString;
-	PrintString << text << inInt;
-	PrintText = PrintString.str();
-
-	D2D1_COLOR_F FontColor = D2D1::ColorF(1.0f, 1.0f, 1.0f, 1.0f);
-	Brush->SetColor(FontColor);
-
-	D2D1_RECT_F LayoutRect = D2D1::RectF(0, 0, Width, Height);
-
-	D2DRenderTarget->DrawText(PrintText.c_str(), wcslen(PrintText.c_str()), TextFormat, LayoutRect, Brush);
-
-	D2DRenderTarget->EndDraw();
-
-	KeyedMutex0->ReleaseSync(1);
-	KeyedMutex1->AcquireSync(1, 5);
-
-	D3D11DeviceContext->OMSetBlendState(TransparentBlendState, NULL, 0xffffffff);
-
-	D3D11DeviceContext->IASetIndexBuffer(D2DIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
-	UINT Stride = sizeof(Vertex);
-	UINT Offset = 0;
-	D3D11DeviceContext->IASetVertexBuffers(0, 1, &D2DVertBuffer, &Stride, &Offset);
-
-	WVP = XMMatrixIdentity();
-	cbPerObj.World = XMMatrixTranspose(WVP);
-	cbPerObj.WVP = XMMatrixTranspose(WVP);
-	D3D11DeviceContext->UpdateSubresource(cbPerObjectBuffer, 0, 0, &cbPerObj, 0, 0);
-	D3D11DeviceContext->VSSetConstantBuffers(0, 1, &cbPerObjectBuffer);
+	int Violations = 0;
+	for (int i = 0; i < Graph.TaskCount; ++i)
+	{
+		const StartupTask &Task = Graph.Tasks[i];
+		if (!Task.Started)
+			continue;
+		for (int d = 0; d < Task.DependencyCount; ++d)
+		{
+			const StartupTask &Dependency = Graph.Tasks[Task.Dependencies[d]];
+			Violations += !Dependency.Done || Dependency.End.QuadPart > Task.Start.QuadPart;
+		}
+	}
+	return Violations;
+}
 
-	D3D11DeviceContext->PSSetShaderResources(0, 1, &D2DTexture);
-	D3D11DeviceContext->PSSetSamplers(0, 1, &CubeTextureSamplerState);
+// The scene graph as InitHeadlessScene ran it: everything done in order, and nothing that only reads files held up by
+// the device
+static int CheckSceneStartup(const StartupGraph &Graph)
+{
+	int Failures = 0;
+	int Device = -1;
+	for (int i = 0; i < Graph.TaskCount; ++i)
+	{
+		Failures += !Graph.Tasks[i].Done;
+		if (Graph.Tasks[i].Function == StartupDevice)
+			Device = i;
+	}
+	Failures += CountStartupOrderViolations(Graph);
+	if (Device < 0)
+	{
+		printf("Startup test: the scene graph has no device task\n");
+		return Failures + 1;
+	}
+	Failures += Graph.Tasks[Device].DependencyCount != 0;
 
-	D3D11DeviceContext->RSSetState(CWCullMode);
-	D3D11DeviceContext->DrawIndexed(6, 0, 0);
+	for (int i = 0; i < Graph.TaskCount; ++i)
+	{
+		const StartupTask &Task = Graph.Tasks[i];
+		if (Task.Function != StartupCompileShader && Task.Function != StartupLoadCubeTexture &&
+			Task.Function != StartupTextFactories)
+			continue;
+		for (int d = 0; d < Task.DependencyCount; ++d)
+		{
+			if (Task.Dependencies[d] == Device)
+			{
+				printf("Startup test: %s doesn't use the device but waits on %s\n", Task.Name, Graph.Tasks[Device].Name);
+				Failures++;
+			}
+		}
+	}
+	return Failures;
 }
 
-void StartTimer()
+static int CheckSyntheticStartup(int Threads)
 {
-	LARGE_INTEGER FrequencyCount;
-	QueryPerformanceFrequency(&FrequencyCount);
+	int Failures = 0;
+
+	StartupGraph Chain;
+	ResetStartupGraph(Chain);
+	AddSyntheticTasks(Chain, SyntheticChainTasks, ARRAYSIZE(SyntheticChainTasks));
+	Failures += !RunStartupGraph(Chain, Threads);
+	for (int i = 0; i < Chain.TaskCount; ++i)
+		Failures += !Chain.Tasks[i].Done;
+	Failures += CountStartupOrderViolations(Chain);
+	// A single loop takes the first ready task, here always the next one added
+	if (Chain.Threads == 1)
+	{
+		for (int i = 1; i < Chain.TaskCount; ++i)
+			Failures += Chain.Tasks[i].Start.QuadPart < Chain.Tasks[i - 1].End.QuadPart;
+	}
 
-	CountsPerSecond = double(FrequencyCount.QuadPart);
+	StartupGraph Failure;
+	ResetStartupGraph(Failure);
+	AddSyntheticTasks(Failure, SyntheticFailureTasks, ARRAYSIZE(SyntheticFailureTasks));
+	if (RunStartupGraph(Failure, Threads) || Failure.FailedTask != 1)
+	{
+		printf("Startup test: the graph didn't report %s failing\n", SyntheticFailureTasks[1].Name);
+		return Failures + 1;
+	}
+	Failures += CountStartupOrderViolations(Failure);
+	// What ran when the failure came finishes, nothing starts after it
+	Failures += !Failure.Tasks[0].Done;
+	for (int i = 0; i < Failure.TaskCount; ++i)
+	{
+		const StartupTask &Task = Failure.Tasks[i];
+		if (Task.Started && Task.Start.QuadPart > Failure.Tasks[Failure.FailedTask].End.QuadPart)
+		{
+			printf("Startup test: %s started after %s failed\n", Task.Name, Failure.Tasks[Failure.FailedTask].Name);
+			Failures++;
+		}
+	}
+	Failures += Failure.Tasks[2].Started || Failure.Tasks[3].Started;
 
-	QueryPerformanceFrequency(&FrequencyCount);
-	CounterStart = FrequencyCount.QuadPart;
+	printf("Startup test: synthetic graphs on %d thread(s), %.1f ms for the chain, %.1f ms until the failure stopped it\n",
+		Chain.Threads, CounterMs(Chain.Begin, Chain.End), CounterMs(Failure.Begin, Failure.End));
+	return Failures;
 }
 
-double GetTime()
+int RunStartupTest()
 {
-	LARGE_INTEGER _CurrentTime;
-	QueryPerformanceCounter(&_CurrentTime);
-	return double(_CurrentTime.QuadPart - CounterStart) / CountsPerSecond;
-}
+	int Failures = 0;
+	float Milliseconds[2] = {};
+	int Threads[2] = { 1, JobThreadCount() };
+	for (int Run = 0; Run < 2; ++Run)
+	{
+		StartupGraph Graph;
+		SceneStartup State = {};
+		ResetStartupGraph(Graph);
 
-double GetFrameTime()
-{
-	LARGE_INTEGER _CurrentTime;
-	__int64 _TickCount;
-	QueryPerformanceCounter(&_CurrentTime);
+		int Compiles[ARRAYSIZE(SceneShaderCompiles)];
+		int TextureFile, TextFactories;
+		AddLoadingTasks(Graph, State, Compiles, TextureFile, TextFactories);
 
-	_TickCount = _CurrentTime.QuadPart - FrameTimeOld;
-	FrameTimeOld = _CurrentTime.QuadPart;
+		if (!RunStartupGraph(Graph, Threads[Run]))
+		{
+			printf("Startup test: %s failed\n", Graph.Tasks[Graph.FailedTask].Name);
+			Failures++;
+		}
+		Milliseconds[Run] = CounterMs(Graph.Begin, Graph.End);
+		PrintStartupTimeline(stdout, Graph, Graph.Begin, Graph.End, "loading what doesn't need the device");
 
-	if (_TickCount < 0.0f)
-		_TickCount = 0.0f;
+		// Everything ran, and nothing before what it depends on
+		for (int i = 0; i < Graph.TaskCount; ++i)
+			Failures += !Graph.Tasks[i].Done;
+		Failures += CountStartupOrderViolations(Graph);
+		Failures += State.CubeTextureDDS.empty() && State.CubeTextureImage.Pixels.empty();
+		Failures += !TextFormat;
 
-	return float(_TickCount) / CountsPerSecond;
-}
\ No newline at end of file
+		for (int i = 0; i < (int)ARRAYSIZE(SceneShaderCompiles); ++i)
+		{
+			ID3D10Blob *&Blob = *SceneShaderCompiles[i].Blob;
+			Failures += !Blob;
+			if (Blob)
+				Blob->Release();
+			Blob = NULL;
+		}
+		if (State.D2DFactory)
+			State.D2DFactory->Release();
+		if (TextFormat)
+			TextFormat->Release();
+		if (DWriteFactory)
+			DWriteFactory->Release();
+		TextFormat = NULL;
+		DWriteFactory = NULL;
+
+		Failures += CheckSyntheticStartup(Threads[Run]);
+	}
+
+	if (InitHeadlessScene())
+	{
+		PrintStartupTimeline(stdout, Startup, Startup.Begin, Startup.End, "the scene graph on the WARP adapter");
+		Failures += CheckSceneStartup(Startup);
+	}
+	else
+		Failures++;
+
+	printf("  %.1f ms on 1 thread, %.1f ms on %d threads, %.2fx\n", Milliseconds[0], Milliseconds[1], Threads[1],
+		Milliseconds[0] / max(Milliseconds[1], 0.001f));
+	printf("  %d of the checks failed\n", Failures);
+	return Failures == 0 ? 0 : 1;
+}